@@ -3,8 +3,9 @@
 set -euo pipefail
 #set -x
 
-CFLAGS="-std=c99 -Wall -Wextra -Werror -pedantic -Wmissing-prototypes -Wstrict-prototypes -I $PWD/inc/ -I $PWD/src/"
+CFLAGS="-std=c99 -pthread -Wall -Wextra -Werror -pedantic -Wmissing-prototypes -Wstrict-prototypes -I $PWD/inc/ -I $PWD/src/"
 TEST_CFLAGS="$CFLAGS -g $(pkg-config --cflags --libs check)"
+BENCH_CFLAGS="$CFLAGS -O2 -DNDEBUG"
 : ${CC:="clang"}
 BUILD_DIR="build"
 
@@ -18,19 +19,99 @@ build() {
 tests() {
 	mkdir -p "$BUILD_DIR"
 
+	# Buffer tests.
+	$CC $TEST_CFLAGS ./tests/ls_buffer_test.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/buffer_test"
+	valgrind --quiet --leak-check=full --errors-for-leak-kinds=definite $_
+
+	# Number tests.
+	$CC $TEST_CFLAGS ./tests/ls_number_test.c ./src/ls_number.c -o "$BUILD_DIR/number_test"
+	valgrind --quiet --leak-check=full --errors-for-leak-kinds=definite $_
+
 	# VM tests.
-	$CC $TEST_CFLAGS ./tests/ls_vm_test.c ./src/ls_vm.c ./src/ls_value.c -o "$BUILD_DIR/vm_test"
+	$CC $TEST_CFLAGS ./tests/ls_vm_test.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/vm_test"
+	valgrind --quiet --leak-check=full --errors-for-leak-kinds=definite $_
+
+	# Compiler tests.
+	$CC $TEST_CFLAGS ./tests/ls_compiler_test.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/compiler_test"
+	valgrind --quiet --leak-check=full --errors-for-leak-kinds=definite $_
+
+	# Image tests.
+	$CC $TEST_CFLAGS ./tests/ls_image_test.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/image_test"
+	valgrind --quiet --leak-check=full --errors-for-leak-kinds=definite $_
+
+	# Snapshot tests.
+	$CC $TEST_CFLAGS ./tests/ls_snapshot_test.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/snapshot_test"
+	valgrind --quiet --leak-check=full --errors-for-leak-kinds=definite $_
+
+	# Program tests.
+	$CC $TEST_CFLAGS ./tests/ls_program_test.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/program_test"
+	valgrind --quiet --leak-check=full --errors-for-leak-kinds=definite $_
+
+	# Pool tests.
+	$CC $TEST_CFLAGS ./tests/ls_pool_test.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/pool_test"
+	valgrind --quiet --leak-check=full --errors-for-leak-kinds=definite $_
+
+	# Channel tests.
+	$CC $TEST_CFLAGS ./tests/ls_channel_test.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/channel_test"
+	valgrind --quiet --leak-check=full --errors-for-leak-kinds=definite $_
+
+	# Fiber tests.
+	$CC $TEST_CFLAGS ./tests/ls_fiber_test.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/fiber_test"
+	valgrind --quiet --leak-check=full --errors-for-leak-kinds=definite $_
+
+	# Loop tests.
+	$CC $TEST_CFLAGS -I ./cmd/lightscript ./tests/ls_loop_test.c ./cmd/lightscript/loop.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/loop_test"
+	valgrind --quiet --leak-check=full --errors-for-leak-kinds=definite $_
+
+	# Slot tests.
+	$CC $TEST_CFLAGS ./tests/ls_slot_test.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/slot_test"
 	valgrind --quiet --leak-check=full --errors-for-leak-kinds=definite $_
 
 	# String tests.
-	$CC $TEST_CFLAGS ./tests/ls_value_string_test.c ./src/ls_vm.c ./src/ls_value.c -o "$BUILD_DIR/value_string_test"
+	$CC $TEST_CFLAGS ./tests/ls_value_string_test.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/value_string_test"
 	valgrind --quiet --leak-check=full --errors-for-leak-kinds=definite $_
 
 	# Array tests.
-	$CC $TEST_CFLAGS ./tests/ls_value_array_test.c ./src/ls_vm.c ./src/ls_value.c -o "$BUILD_DIR/value_string_test"
+	$CC $TEST_CFLAGS ./tests/ls_value_array_test.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/value_array_test"
+	valgrind --quiet --leak-check=full --errors-for-leak-kinds=definite $_
+
+	# Map tests.
+	$CC $TEST_CFLAGS ./tests/ls_value_map_test.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/value_map_test"
 	valgrind --quiet --leak-check=full --errors-for-leak-kinds=definite $_
 }
 
+bench() {
+	mkdir -p "$BUILD_DIR"
+
+	# Buffer benchmarks.
+	$CC $BENCH_CFLAGS ./tests/ls_buffer_bench.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/buffer_bench"
+	$_
+
+	# Compiler benchmarks.
+	$CC $BENCH_CFLAGS ./tests/ls_compiler_bench.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/compiler_bench"
+	$_
+
+	# Pool benchmarks.
+	$CC $BENCH_CFLAGS ./tests/ls_pool_bench.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/pool_bench"
+	$_
+
+	# Channel benchmarks.
+	$CC $BENCH_CFLAGS ./tests/ls_channel_bench.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/channel_bench"
+	$_
+
+	# Fiber benchmarks.
+	$CC $BENCH_CFLAGS ./tests/ls_fiber_bench.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/fiber_bench"
+	$_
+
+	# Slot benchmarks.
+	$CC $BENCH_CFLAGS ./tests/ls_slot_bench.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/slot_bench"
+	$_
+
+	# Array benchmarks.
+	$CC $BENCH_CFLAGS ./tests/ls_value_array_bench.c ./src/ls_vm.c ./src/ls_channel.c ./src/ls_compiler.c ./src/ls_image.c ./src/ls_pool.c ./src/ls_program.c ./src/ls_snapshot.c ./src/ls_value.c ./src/ls_number.c ./src/ls_buffer.c ./src/ls_utf8.c -lm -o "$BUILD_DIR/value_array_bench"
+	$_
+}
+
 clean() {
 	rm -rf "$BUILD_DIR"
 }
@@ -47,6 +128,9 @@ main() {
 			"tests"|"test")
 				tests
 				;;
+			"bench")
+				bench
+				;;
 			*)
 				echo "Unknown command $1" >&2
 				exit 1;
@@ -0,0 +1,576 @@
+// Must be defined before any header is included to expose the POSIX
+// functions.
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "loop.h"
+
+// The number of events read from epoll at once.
+#define MAX_EVENTS 256
+
+// The most bytes read at once.
+#define MAX_READ_SIZE 65536
+
+// The longest sleep, about 31 years, so that deadlines fit in microseconds.
+#define MAX_SLEEP_MS 1e12
+
+// A fiber sleeping until [deadline], in microseconds of the monotonic clock.
+typedef struct {
+  uint64_t deadline;
+
+  // Orders the timers with the same deadline by creation.
+  uint64_t sequence;
+
+  LsFiber *fiber;
+} Timer;
+
+// The fibers waiting for a file descriptor.
+typedef struct {
+  // The fiber waiting to read at most [read_size] bytes, or NULL.
+  LsFiber *reader;
+  size_t read_size;
+
+  // The fiber waiting to write the [write_length] bytes at [write_data], of
+  // which [written] already are, or NULL.
+  LsFiber *writer;
+  char *write_data;
+  size_t write_length;
+  size_t written;
+
+  // The events the file descriptor is registered for with epoll.
+  uint32_t events;
+} Waiters;
+
+struct loop {
+  LsVM *vm;
+  int epoll_fd;
+
+  // The fibers ready to run, in order, from [ready_head] to [ready_length].
+  LsFiber **ready;
+  size_t ready_head;
+  size_t ready_length;
+  size_t ready_capacity;
+
+  // The sleeping fibers, as a binary heap ordered by deadline.
+  Timer *timers;
+  size_t num_timers;
+  size_t timers_capacity;
+  uint64_t next_sequence;
+
+  // The waiters of each file descriptor, indexed by it.
+  Waiters *fds;
+  size_t fds_capacity;
+
+  // The number of fibers waiting for a file descriptor.
+  size_t num_waiting;
+
+  // Whether the fiber last resumed waits, rather than yielded.
+  bool waits;
+
+  // Whether a fiber failed.
+  bool failed;
+
+  // Where data is read into.
+  char *buffer;
+};
+
+// Returns the time of the monotonic clock, in microseconds.
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void push_ready(Loop *loop, LsFiber *fiber) {
+  if (loop->ready_length == loop->ready_capacity) {
+    // Make room at the end by dropping the fibers that already ran, or grow.
+    size_t count = loop->ready_length - loop->ready_head;
+    if (loop->ready_head > 0) {
+      memmove(loop->ready, loop->ready + loop->ready_head,
+              count * sizeof(LsFiber *));
+    } else {
+      loop->ready_capacity = loop->ready_capacity * 2 + 16;
+      loop->ready =
+          realloc(loop->ready, loop->ready_capacity * sizeof(LsFiber *));
+    }
+    loop->ready_head = 0;
+    loop->ready_length = count;
+  }
+
+  loop->ready[loop->ready_length++] = fiber;
+}
+
+// Returns true if [a] is due before [b].
+static bool timer_before(const Timer *a, const Timer *b) {
+  return a->deadline != b->deadline ? a->deadline < b->deadline
+                                    : a->sequence < b->sequence;
+}
+
+static void push_timer(Loop *loop, uint64_t deadline, LsFiber *fiber) {
+  if (loop->num_timers == loop->timers_capacity) {
+    loop->timers_capacity = loop->timers_capacity * 2 + 16;
+    loop->timers =
+        realloc(loop->timers, loop->timers_capacity * sizeof(Timer));
+  }
+
+  Timer timer = {deadline, loop->next_sequence++, fiber};
+  size_t i = loop->num_timers++;
+  while (i > 0 && timer_before(&timer, &loop->timers[(i - 1) / 2])) {
+    loop->timers[i] = loop->timers[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  loop->timers[i] = timer;
+}
+
+// Removes the timer due first from [loop], and returns it.
+static Timer pop_timer(Loop *loop) {
+  Timer *timers = loop->timers;
+  Timer first = timers[0];
+  Timer last = timers[--loop->num_timers];
+  size_t i = 0;
+  for (;;) {
+    size_t child = 2 * i + 1;
+    if (child >= loop->num_timers)
+      break;
+    if (child + 1 < loop->num_timers &&
+        timer_before(&timers[child + 1], &timers[child]))
+      child++;
+    if (!timer_before(&timers[child], &last))
+      break;
+    timers[i] = timers[child];
+    i = child;
+  }
+  if (loop->num_timers > 0)
+    timers[i] = last;
+
+  return first;
+}
+
+// Returns the waiters of [fd], which has none at first.
+static Waiters *waiters_of(Loop *loop, int fd) {
+  size_t index = (size_t)fd;
+  if (index >= loop->fds_capacity) {
+    size_t capacity = loop->fds_capacity * 2;
+    if (capacity <= index)
+      capacity = index + 16;
+    loop->fds = realloc(loop->fds, capacity * sizeof(Waiters));
+    memset(loop->fds + loop->fds_capacity, 0,
+           (capacity - loop->fds_capacity) * sizeof(Waiters));
+    loop->fds_capacity = capacity;
+  }
+
+  return &loop->fds[index];
+}
+
+// Makes [fd] non-blocking, so that reading or writing it once epoll reports
+// it ready can't block if another process took the data or the room first.
+// Returns false if it can't be.
+static bool set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  return flags != -1 &&
+         ((flags & O_NONBLOCK) || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1);
+}
+
+// Registers [fd] with epoll for the events its waiters wait for, and makes it
+// non-blocking when it is added. Returns false if it can't be.
+static bool update_events(Loop *loop, int fd) {
+  Waiters *waiters = &loop->fds[fd];
+  uint32_t events = (waiters->reader != NULL ? EPOLLIN : 0) |
+                    (waiters->writer != NULL ? EPOLLOUT : 0);
+  if (events == waiters->events)
+    return true;
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = events;
+  event.data.fd = fd;
+  int op = waiters->events == 0 ? EPOLL_CTL_ADD
+           : events == 0        ? EPOLL_CTL_DEL
+                                : EPOLL_CTL_MOD;
+  int status = op == EPOLL_CTL_ADD && !set_nonblocking(fd)
+                   ? -1
+                   : epoll_ctl(loop->epoll_fd, op, fd, &event);
+
+  // Closing a file descriptor removes it from epoll.
+  if (status == -1 && errno == ENOENT && op == EPOLL_CTL_MOD)
+    status = set_nonblocking(fd)
+                 ? epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event)
+                 : -1;
+  if (status == -1 && op != EPOLL_CTL_DEL)
+    return false;
+
+  waiters->events = events;
+  return true;
+}
+
+// Records the [result] of resuming [fiber]. Fibers that yielded rather than
+// waiting run again after the ones ready.
+static void resumed(Loop *loop, LsFiber *fiber, LsInterpretResult result) {
+  if (result == LS_RESULT_RUNTIME_ERROR)
+    loop->failed = true;
+  else if (result == LS_RESULT_SUSPENDED && !loop->waits)
+    push_ready(loop, fiber);
+}
+
+static void resume_null(Loop *loop, LsFiber *fiber) {
+  loop->waits = false;
+  resumed(loop, fiber, ls_resume_null(loop->vm, fiber));
+}
+
+static void resume_double(Loop *loop, LsFiber *fiber, double value) {
+  loop->waits = false;
+  resumed(loop, fiber, ls_resume_double(loop->vm, fiber, value));
+}
+
+static void resume_string(Loop *loop, LsFiber *fiber, const char *text,
+                          size_t length) {
+  loop->waits = false;
+  resumed(loop, fiber, ls_resume_string(loop->vm, fiber, text, length));
+}
+
+// Suspends the fiber calling the foreign function being called by the VM of
+// [loop]. Makes the call fail and returns NULL if it can't be.
+static LsFiber *suspend_caller(Loop *loop) {
+  LsFiber *fiber = ls_suspend_fiber(loop->vm);
+  if (fiber == NULL) {
+    ls_abort_fiber(loop->vm, "Only fibers run by the loop can wait.");
+    return NULL;
+  }
+
+  loop->waits = true;
+  return fiber;
+}
+
+// Stores in [fd] the file descriptor in slot 1 of [vm]. Makes the call fail
+// and returns false if it isn't one. Sets [ready] if it is always ready, like
+// regular files which epoll doesn't take.
+static bool get_fd(LsVM *vm, int *fd, bool *ready) {
+  double value = ls_get_slot_type(vm, 1) == LS_TYPE_NUMBER
+                     ? ls_get_slot_double(vm, 1)
+                     : -1;
+  struct stat st;
+  if (value < 0 || value > INT_MAX || value != (int)value ||
+      fstat((int)value, &st) == -1) {
+    ls_abort_fiber(vm, "Expected a file descriptor.");
+    return false;
+  }
+
+  *fd = (int)value;
+  *ready = S_ISREG(st.st_mode) || S_ISDIR(st.st_mode);
+  return true;
+}
+
+// sleep(ms)
+static void loop_sleep(LsVM *vm) {
+  Loop *loop = ls_get_user_data(vm);
+  if (ls_get_slot_type(vm, 1) != LS_TYPE_NUMBER) {
+    ls_abort_fiber(vm, "Duration must be a number.");
+    return;
+  }
+
+  // The clock and fractions of microseconds are rounded up, with one more
+  // tick, so that fibers never wake up before [ms] passed.
+  double ms = ls_get_slot_double(vm, 1);
+  uint64_t us = 0;
+  if (ms > MAX_SLEEP_MS)
+    ms = MAX_SLEEP_MS;
+  if (ms > 0) {
+    us = (uint64_t)(ms * 1000);
+    if ((double)us < ms * 1000)
+      us++;
+  }
+
+  LsFiber *fiber = suspend_caller(loop);
+  if (fiber != NULL)
+    push_timer(loop, now_us() + us + 1, fiber);
+}
+
+// Reads at most [size] bytes from [fd] into the buffer of [loop]. Returns the
+// number of bytes read, or -1 if it fails, or if nothing can be read yet from
+// a non-blocking [fd] with errno set to EAGAIN or EWOULDBLOCK.
+static ssize_t read_fd(Loop *loop, int fd, size_t size) {
+  ssize_t length;
+  do {
+    length = read(fd, loop->buffer, size);
+  } while (length == -1 && errno == EINTR);
+
+  return length;
+}
+
+// read(fd, size)
+static void loop_read(LsVM *vm) {
+  Loop *loop = ls_get_user_data(vm);
+  int fd;
+  bool ready;
+  if (!get_fd(vm, &fd, &ready))
+    return;
+  if (ls_get_slot_type(vm, 2) != LS_TYPE_NUMBER) {
+    ls_abort_fiber(vm, "Size must be a number.");
+    return;
+  }
+
+  double size = ls_get_slot_double(vm, 2);
+  size_t read_size = size < 1              ? 1
+                     : size > MAX_READ_SIZE ? MAX_READ_SIZE
+                                            : (size_t)size;
+  if (ready) {
+    ssize_t length = read_fd(loop, fd, read_size);
+    if (length == -1) {
+      ls_set_slot_null(vm, 0);
+    } else {
+      ls_set_slot_string(vm, 0, loop->buffer, (size_t)length);
+    }
+    return;
+  }
+
+  Waiters *waiters = waiters_of(loop, fd);
+  if (waiters->reader != NULL) {
+    ls_abort_fiber(vm, "Another fiber reads this file descriptor.");
+    return;
+  }
+
+  LsFiber *fiber = suspend_caller(loop);
+  if (fiber == NULL)
+    return;
+
+  // A fiber resumed with null fails.
+  waiters->reader = fiber;
+  waiters->read_size = read_size;
+  loop->num_waiting++;
+  if (!update_events(loop, fd)) {
+    waiters->reader = NULL;
+    loop->num_waiting--;
+    push_ready(loop, fiber);
+  }
+}
+
+// Writes what is left to write to [fd] for its writer, at most PIPE_BUF bytes
+// at a time, which fit once it is writable. Stops early if [fd] is full
+// again. Returns false if it fails.
+static bool write_fd(Loop *loop, int fd, bool all) {
+  Waiters *waiters = &loop->fds[fd];
+  do {
+    size_t left = waiters->write_length - waiters->written;
+    ssize_t written = write(fd, waiters->write_data + waiters->written,
+                            left < PIPE_BUF ? left : PIPE_BUF);
+    if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return true;
+    if (written == -1 && errno != EINTR)
+      return false;
+    if (written > 0)
+      waiters->written += (size_t)written;
+  } while (all && waiters->written < waiters->write_length);
+
+  return true;
+}
+
+// write(fd, text)
+static void loop_write(LsVM *vm) {
+  Loop *loop = ls_get_user_data(vm);
+  int fd;
+  bool ready;
+  if (!get_fd(vm, &fd, &ready))
+    return;
+  if (ls_get_slot_type(vm, 2) != LS_TYPE_STRING) {
+    ls_abort_fiber(vm, "Expected a string to write.");
+    return;
+  }
+
+  size_t length;
+  const char *text = ls_get_slot_string(vm, 2, &length);
+  Waiters *waiters = waiters_of(loop, fd);
+  if (waiters->writer != NULL) {
+    ls_abort_fiber(vm, "Another fiber writes this file descriptor.");
+    return;
+  }
+
+  // The text is only valid during the call, so it is copied while waiting.
+  waiters->write_data = (char *)text;
+  waiters->write_length = length;
+  waiters->written = 0;
+  if (ready || length == 0) {
+    if (write_fd(loop, fd, true)) {
+      ls_set_slot_double(vm, 0, (double)waiters->written);
+    } else {
+      ls_set_slot_null(vm, 0);
+    }
+    waiters->write_data = NULL;
+    return;
+  }
+
+  LsFiber *fiber = suspend_caller(loop);
+  if (fiber == NULL) {
+    waiters->write_data = NULL;
+    return;
+  }
+
+  waiters->write_data = malloc(length);
+  memcpy(waiters->write_data, text, length);
+  waiters->writer = fiber;
+  loop->num_waiting++;
+  if (!update_events(loop, fd)) {
+    free(waiters->write_data);
+    waiters->write_data = NULL;
+    waiters->writer = NULL;
+    loop->num_waiting--;
+    push_ready(loop, fiber);
+  }
+}
+
+// spawn(fn)
+static void loop_spawn(LsVM *vm) {
+  Loop *loop = ls_get_user_data(vm);
+  LsFiber *fiber = ls_spawn_fiber_in_slot(vm, 1);
+  if (fiber == NULL) {
+    ls_abort_fiber(vm, "Expected a function taking at most one argument.");
+    return;
+  }
+
+  push_ready(loop, fiber);
+  ls_set_slot_null(vm, 0);
+}
+
+Loop *new_loop(LsConfiguration *config) {
+  Loop *loop = calloc(1, sizeof(Loop));
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll_fd == -1) {
+    free(loop);
+    return NULL;
+  }
+
+  LsConfiguration loop_config = *config;
+  loop_config.user_data = loop;
+  loop->vm = ls_new_vm(&loop_config);
+  loop->buffer = malloc(MAX_READ_SIZE);
+  ls_define_foreign(loop->vm, LOOP_MODULE, "sleep", 1, loop_sleep);
+  ls_define_foreign(loop->vm, LOOP_MODULE, "read", 2, loop_read);
+  ls_define_foreign(loop->vm, LOOP_MODULE, "write", 2, loop_write);
+  ls_define_foreign(loop->vm, LOOP_MODULE, "spawn", 1, loop_spawn);
+
+  // Writing to a closed pipe or socket fails rather than killing the process.
+  signal(SIGPIPE, SIG_IGN);
+  return loop;
+}
+
+void free_loop(Loop *loop) {
+  for (size_t i = 0; i < loop->fds_capacity; i++)
+    free(loop->fds[i].write_data);
+
+  ls_free_vm(loop->vm);
+  close(loop->epoll_fd);
+  free(loop->ready);
+  free(loop->timers);
+  free(loop->fds);
+  free(loop->buffer);
+  free(loop);
+}
+
+LsVM *loop_vm(Loop *loop) { return loop->vm; }
+
+// Resumes the reader of [fd], which is readable, with what it reads.
+static void complete_read(Loop *loop, int fd) {
+  Waiters *waiters = &loop->fds[fd];
+  LsFiber *fiber = waiters->reader;
+  ssize_t length = read_fd(loop, fd, waiters->read_size);
+
+  // Another process may have read the data first.
+  if (length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+
+  waiters->reader = NULL;
+  loop->num_waiting--;
+  update_events(loop, fd);
+
+  if (length == -1) {
+    resume_null(loop, fiber);
+  } else {
+    resume_string(loop, fiber, loop->buffer, (size_t)length);
+  }
+}
+
+// Writes to [fd], which is writable, for its writer, and resumes it once all
+// is written, or if it fails.
+static void continue_write(Loop *loop, int fd) {
+  bool written = write_fd(loop, fd, false);
+  Waiters *waiters = &loop->fds[fd];
+  if (written && waiters->written < waiters->write_length)
+    return;
+
+  LsFiber *fiber = waiters->writer;
+  free(waiters->write_data);
+  waiters->write_data = NULL;
+  waiters->writer = NULL;
+  loop->num_waiting--;
+  update_events(loop, fd);
+
+  if (written) {
+    resume_double(loop, fiber, (double)waiters->written);
+  } else {
+    resume_null(loop, fiber);
+  }
+}
+
+LsInterpretResult run_loop(Loop *loop) {
+  struct epoll_event events[MAX_EVENTS];
+  loop->failed = false;
+  while (loop->ready_length > loop->ready_head || loop->num_timers > 0 ||
+         loop->num_waiting > 0) {
+    // Only the fibers ready so far run, so that those they make ready wait
+    // for the others to get their events.
+    size_t ready = loop->ready_length - loop->ready_head;
+    for (size_t i = 0; i < ready; i++)
+      resume_null(loop, loop->ready[loop->ready_head++]);
+    if (loop->ready_head == loop->ready_length)
+      loop->ready_head = loop->ready_length = 0;
+
+    int timeout = -1;
+    if (loop->ready_length > 0) {
+      timeout = 0;
+    } else if (loop->num_timers > 0) {
+      // epoll waits in milliseconds, which are rounded up so that timers
+      // don't wake up before their deadline.
+      uint64_t now = now_us();
+      uint64_t deadline = loop->timers[0].deadline;
+      uint64_t ms = deadline <= now ? 0 : (deadline - now + 999) / 1000;
+      timeout = ms > INT_MAX ? INT_MAX : (int)ms;
+    } else if (loop->num_waiting == 0) {
+      break;
+    }
+
+    int count = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+    if (count == -1 && errno != EINTR) {
+      loop->failed = true;
+      break;
+    }
+
+    // Hang ups and errors wake up both, which then fail or read the end of
+    // the file.
+    for (int i = 0; i < count; i++) {
+      int fd = events[i].data.fd;
+      uint32_t flags = events[i].events;
+      if ((flags & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+          loop->fds[fd].reader != NULL)
+        complete_read(loop, fd);
+      if ((flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) &&
+          loop->fds[fd].writer != NULL)
+        continue_write(loop, fd);
+    }
+
+    uint64_t now = now_us();
+    while (loop->num_timers > 0 && loop->timers[0].deadline <= now)
+      resume_null(loop, pop_timer(loop).fiber);
+  }
+
+  return loop->failed ? LS_RESULT_RUNTIME_ERROR : LS_RESULT_SUCCESS;
+}
@@ -0,0 +1,42 @@
+#ifndef LOOP_H_INCLUDE
+#define LOOP_H_INCLUDE
+
+#include "lightscript.h"
+
+// The module the functions of loops are defined in, and scripts run in.
+#define LOOP_MODULE "main"
+
+// An event loop running the fibers of a VM on a single thread while they wait
+// for timers, or for file descriptors to be readable or writable, with epoll.
+//
+// Scripts use it through the functions it defines in LOOP_MODULE:
+//
+// - sleep(ms) returns null after [ms] milliseconds.
+// - read(fd, size) returns a string of at most [size] bytes read from [fd],
+//   an empty one at the end of the file, or null if it fails.
+// - write(fd, text) writes the whole string [text] to [fd], and returns the
+//   number of bytes written, or null if it fails.
+// - spawn(fn) runs [fn] in a new fiber, once the running one waits.
+//
+// The fiber calling them waits for the result while the others run. Fibers
+// resumed by other fibers can't wait, so these fail in them. Regular files
+// are always ready, so they are read and written right away.
+typedef struct loop Loop;
+
+// Creates a loop, with a VM configured with [config] running its fibers.
+// [config] can't have user data, which the loop takes. Returns NULL if epoll
+// can't be used.
+Loop *new_loop(LsConfiguration *config);
+
+// Frees [loop] and its VM. The fibers still waiting are dropped.
+void free_loop(Loop *loop);
+
+// Returns the VM of [loop].
+LsVM *loop_vm(Loop *loop);
+
+// Runs the fibers of [loop] until none is left waiting. Returns
+// LS_RESULT_RUNTIME_ERROR if any of them failed since it was called, and
+// LS_RESULT_SUCCESS otherwise.
+LsInterpretResult run_loop(Loop *loop);
+
+#endif
@@ -1,8 +1,260 @@
+// Must be defined before any header is included to expose the POSIX
+// functions.
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lightscript.h"
+#include "loop.h"
+
+// The exit codes of scripts that fail, from sysexits.h.
+#define EXIT_USAGE 64
+#define EXIT_COMPILE_ERROR 65
+#define EXIT_RUNTIME_ERROR 70
+#define EXIT_IO_ERROR 74
+
+static void on_error(LsVM *vm, LsErrorType type, const char *module, int line,
+                     const char *message) {
+  (void)vm;
+
+  switch (type) {
+  case LS_ERROR_COMPILE:
+    fprintf(stderr, "[%s line %d] %s\n", module, line, message);
+    break;
+  case LS_ERROR_RUNTIME:
+    fprintf(stderr, "%s\n", message);
+    break;
+  case LS_ERROR_STACK_TRACE:
+    fprintf(stderr, "[%s line %d] in %s\n", module, line, message);
+    break;
+  }
+}
+
+// Reads all of the file descriptor [fd] into a buffer, whose length is
+// stored in [length].
+static char *read_all(int fd, size_t *length) {
+  size_t capacity = 4096;
+  char *buffer = malloc(capacity);
+  *length = 0;
+  for (;;) {
+    if (*length == capacity) {
+      capacity *= 2;
+      buffer = realloc(buffer, capacity);
+    }
+
+    ssize_t read_length = read(fd, buffer + *length, capacity - *length);
+    if (read_length <= 0)
+      return buffer;
+    *length += (size_t)read_length;
+  }
+}
+
+// A file mapped in memory.
+typedef struct {
+  void *data;
+  size_t length;
+} MappedFile;
+
+// Maps the file at [path] read-only in [file]. Returns false and prints an
+// error if it can't be.
+static bool map_file(const char *path, MappedFile *file) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror(path);
+    if (fd != -1)
+      close(fd);
+    return false;
+  }
+
+  // Empty files can't be mapped.
+  file->length = (size_t)st.st_size;
+  file->data = NULL;
+  if (file->length > 0)
+    file->data = mmap(NULL, file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file->data == MAP_FAILED) {
+    perror(path);
+    return false;
+  }
+
+  return true;
+}
+
+static void unmap_file(MappedFile *file) {
+  if (file->data != NULL)
+    munmap(file->data, file->length);
+}
+
+// Writes [image] to the file descriptor [data] points to.
+static void write_image(void *data, const char *image, size_t length) {
+  int fd = *(int *)data;
+  while (length > 0) {
+    ssize_t written = write(fd, image, length);
+    if (written <= 0)
+      return;
+    image += written;
+    length -= (size_t)written;
+  }
+}
+
+// Compiles the script at [path] to an image written to [image_path].
+static int compile_file(LsVM *vm, const char *path, const char *image_path) {
+  MappedFile file;
+  if (!map_file(path, &file))
+    return EXIT_IO_ERROR;
+
+  int fd = open(image_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    perror(image_path);
+    unmap_file(&file);
+    return EXIT_IO_ERROR;
+  }
+
+  LsInterpretResult result = ls_compile_image(
+      vm, file.length > 0 ? file.data : "", file.length, write_image, &fd);
+  close(fd);
+  unmap_file(&file);
+  return result == LS_RESULT_SUCCESS ? 0 : EXIT_COMPILE_ERROR;
+}
+
+// Runs the script or the image at [path], which is mapped in memory and run
+// in place. Images are only unmapped once the VM is freed. Scripts run in the
+// module of the loop, so they can use its functions.
+static LsInterpretResult run_file(LsVM *vm, const char *path,
+                                  MappedFile *file) {
+  if (!map_file(path, file))
+    return -1;
+
+  const char *data = file->length > 0 ? file->data : "";
+  if (ls_is_image(data, file->length))
+    return ls_interpret_image(vm, data, file->length);
+
+  return ls_interpret_length_in_module(vm, LOOP_MODULE, data, file->length);
+}
+
+// Returns the exit code of a script run with [result].
+static int exit_code(LsInterpretResult result) {
+  switch ((int)result) {
+  case LS_RESULT_SUCCESS:
+    return 0;
+  case LS_RESULT_COMPILE_ERROR:
+    return EXIT_COMPILE_ERROR;
+  case LS_RESULT_RUNTIME_ERROR:
+    return EXIT_RUNTIME_ERROR;
+  default:
+    return EXIT_IO_ERROR;
+  }
+}
+
+// Runs the [count] scripts at [paths] on a pool of [workers] threads. Returns
+// the exit code of the first script that fails, or 0.
+static int run_batch(LsConfiguration *config, int workers, char **paths,
+                     int count) {
+  LsPool *pool = ls_new_pool(config, workers);
+  if (pool == NULL) {
+    fprintf(stderr, "Could not start %d workers.\n", workers);
+    return EXIT_IO_ERROR;
+  }
+
+  LsJob **jobs = malloc(sizeof(LsJob *) * (size_t)count);
+  int *statuses = malloc(sizeof(int) * (size_t)count);
+  for (int i = 0; i < count; i++) {
+    jobs[i] = NULL;
+    statuses[i] = 0;
+
+    MappedFile file;
+    if (!map_file(paths[i], &file)) {
+      statuses[i] = EXIT_IO_ERROR;
+      continue;
+    }
+
+    LsProgram *program = ls_new_program(
+        config, file.length > 0 ? file.data : "", file.length);
+    unmap_file(&file);
+    if (program == NULL) {
+      statuses[i] = EXIT_COMPILE_ERROR;
+      continue;
+    }
+
+    jobs[i] = ls_pool_submit(pool, program);
+    ls_release_program(program);
+  }
+
+  int status = 0;
+  for (int i = 0; i < count; i++) {
+    if (jobs[i] != NULL)
+      statuses[i] = exit_code(ls_pool_await(pool, jobs[i]));
+    if (status == 0)
+      status = statuses[i];
+  }
+
+  ls_free_pool(pool);
+  free(jobs);
+  free(statuses);
+  return status;
+}
+
+int main(int argc, char **argv) {
+  bool compile = argc == 4 && strcmp(argv[1], "--compile") == 0;
+  bool batch = argc >= 3 && strcmp(argv[1], "--workers") == 0;
+  int workers = batch ? atoi(argv[2]) : 0;
+  if ((argc > 2 && !compile && !batch) || (batch && workers <= 0)) {
+    fprintf(stderr,
+            "Usage: %s [script]\n"
+            "       %s --compile script image\n"
+            "       %s --workers N script...\n",
+            argv[0], argv[0], argv[0]);
+    return EXIT_USAGE;
+  }
+
+  LsConfiguration config = {0};
+  config.on_error = on_error;
+  config.lazy_compile = !compile;
+
+  // Scripts run in batches are compiled upfront, so their functions can be
+  // shared by the workers.
+  if (batch)
+    return run_batch(&config, workers, argv + 3, argc - 3);
+
+  if (compile) {
+    LsVM *vm = ls_new_vm(&config);
+    int status = compile_file(vm, argv[2], argv[3]);
+    ls_free_vm(vm);
+    return status;
+  }
 
-int main(void) {
+  Loop *loop = new_loop(&config);
+  if (loop == NULL) {
+    perror("epoll");
+    return EXIT_IO_ERROR;
+  }
+  LsVM *vm = loop_vm(loop);
 
-  printf("Hello world!\n");
+  // Without a script, it is read from the standard input.
+  MappedFile file = {NULL, 0};
+  LsInterpretResult result;
+  if (argc == 2) {
+    result = run_file(vm, argv[1], &file);
+  } else {
+    size_t length;
+    char *source = read_all(STDIN_FILENO, &length);
+    result = ls_interpret_length_in_module(vm, LOOP_MODULE, source, length);
+    free(source);
+  }
 
-  return 0;
+  // The script is done once the fibers it started are, and the main one if it
+  // waits.
+  if (result == LS_RESULT_SUCCESS || result == LS_RESULT_SUSPENDED)
+    result = run_loop(loop);
+  free_loop(loop);
+  unmap_file(&file);
+  return exit_code(result);
 }
@@ -1,6 +1,7 @@
 #ifndef LIGHTSCRIPT_H_INCLUDE
 #define LIGHTSCRIPT_H_INCLUDE
 
+#include <stdbool.h>
 #include <stddef.h>
 
 // The LightScript semantic version number components.
@@ -22,6 +23,29 @@
 // lives here.
 typedef struct ls_vm LsVM;
 
+// A compiled module, which VMs on any thread can run at once. See
+// ls_new_program().
+typedef struct ls_program LsProgram;
+
+// A set of threads running programs, each with a VM of its own. See
+// ls_new_pool().
+typedef struct ls_pool LsPool;
+
+// A run of a program submitted to a pool.
+typedef struct ls_job LsJob;
+
+// A queue of values sent from one VM to another, possibly on another thread.
+// See ls_new_channel().
+typedef struct ls_channel LsChannel;
+
+// A fiber suspended by a foreign function until the host resumes it. See
+// ls_suspend_fiber().
+typedef struct ls_obj_fiber LsFiber;
+
+// A function of a script resolved once for the host to call it many times.
+// See ls_make_call_handle().
+typedef struct ls_call_handle LsCallHandle;
+
 // A generic allocation function that handles all explicit memory management
 // used by LightScript. It's used like so:
 //
@@ -68,6 +92,50 @@ typedef enum {
 typedef void (*LsErrorFn)(LsVM *vm, LsErrorType type, const char *module,
                           int line, const char *message);
 
+// Reads the next chunk of a source code of unknown length, up to [size] bytes,
+// into [buffer]. [data] is passed through from the caller of the function
+// compiling the source. Returns the number of bytes read, or 0 at the end of
+// the source.
+typedef size_t (*LsReadFn)(void *data, char *buffer, size_t size);
+
+// A function called with the [length] bytes of a compiled [image] and the
+// [data] passed along with it, to store them. [image] is freed once it
+// returns.
+typedef void (*LsImageFn)(void *data, const char *image, size_t length);
+
+// A function implemented by the host, called by scripts. It reads its
+// arguments from slots 1 and up, and stores its result in slot 0. See
+// ls_define_foreign().
+typedef void (*LsForeignFn)(LsVM *vm);
+
+// The types of the values in slots.
+typedef enum {
+  LS_TYPE_NULL,
+  LS_TYPE_BOOL,
+  LS_TYPE_NUMBER,
+  LS_TYPE_STRING,
+
+  // An array of bytes.
+  LS_TYPE_BYTES,
+
+  // The other values, which the host can't read.
+  LS_TYPE_UNKNOWN
+} LsType;
+
+// The outcome of running a piece of code.
+typedef enum {
+  LS_RESULT_SUCCESS,
+  LS_RESULT_COMPILE_ERROR,
+  LS_RESULT_RUNTIME_ERROR,
+
+  // A fiber yielded, waits for the host, or was preempted, and can be
+  // resumed. See ls_resume_fiber() and ls_get_preempted_fiber().
+  LS_RESULT_SUSPENDED,
+
+  // A job of a pool was canceled before it ran. See ls_pool_cancel().
+  LS_RESULT_CANCELED
+} LsInterpretResult;
+
 typedef struct {
   // The callback LightScript will use to allocate, reallocate, and deallocate
   // memory.
@@ -122,8 +190,34 @@ typedef struct {
   // If zero, defaults to 50.
   int heap_growth_percent;
 
-  // User-defined data associated with the VM.
+  // If true, the bodies of functions are only checked for errors when their
+  // module is compiled, and compiled when the functions are first called. The
+  // time and memory spent compiling then depend on the code that runs rather
+  // than on the size of the source, at the cost of keeping a copy of the
+  // source of modules.
+  //
+  // Defaults to false.
+  bool lazy_compile;
+
+  // The number of threads ls_interpret_modules() compiles modules on,
+  // including the calling one. The [reallocate] callback is then called from
+  // all of them, so it must be thread safe.
+  //
+  // If zero, defaults to 4.
+  int compile_threads;
+
+  // User-defined data associated with the VM. See ls_get_user_data().
   void *user_data;
+
+  // The number of loop iterations and calls code run by the host makes before
+  // it is preempted: suspended where it is, like a fiber that yields, so that
+  // the host can run something else and resume it later. See
+  // ls_get_preempted_fiber(). Fibers resumed by other fibers are only
+  // preempted once they give control back to the fiber the host resumed.
+  //
+  // Counting stops while no code runs, and starts over each time the host
+  // runs code or resumes a fiber. If zero, code runs until it returns.
+  size_t budget;
 } LsConfiguration;
 
 // Creates a new LightScript virtual machine using the given [configuration].
@@ -132,11 +226,327 @@ typedef struct {
 // configuration.
 LsVM *ls_new_vm(LsConfiguration *config);
 
+// Returns the user data [vm] was configured with.
+void *ls_get_user_data(LsVM *vm);
+
 // Disposes of all resources is use by [vm], which was previously created by a
-// call to [ls_new_vm].
+// call to [ls_new_vm], including every object its code created.
 void ls_free_vm(LsVM *vm);
 
 // Immediately run the garbage collector to free unused memory.
 void ls_collect_garbage(LsVM *vm);
 
+// Compiles and runs [source], a string of LightScript source code, in a new
+// module.
+LsInterpretResult ls_interpret(LsVM *vm, const char *source);
+
+// Compiles and runs [source] in the module named [module], which is created
+// the first time. Its variables stay defined from one call to the next, so
+// later code can use the ones earlier code declared.
+LsInterpretResult ls_interpret_in_module(LsVM *vm, const char *module,
+                                         const char *source);
+
+// Compiles and runs the [length] bytes of source code at [source] in a new
+// module. Unlike with ls_interpret(), the source doesn't need to be null
+// terminated, so it can be a memory mapped file for example.
+LsInterpretResult ls_interpret_length(LsVM *vm, const char *source,
+                                      size_t length);
+
+// Compiles and runs the [length] bytes of source code at [source] in the
+// module named [module], like ls_interpret_in_module().
+LsInterpretResult ls_interpret_length_in_module(LsVM *vm, const char *module,
+                                                const char *source,
+                                                size_t length);
+
+// Compiles and runs the source code returned by successive calls to [read]
+// with [data], until it returns 0, in a new module.
+LsInterpretResult ls_interpret_reader(LsVM *vm, LsReadFn read, void *data);
+
+// Compiles the [length] bytes of source code at [source] to an image, and
+// calls [save] with it and [data]. Images run with ls_interpret_image()
+// without being compiled again. Returns LS_RESULT_COMPILE_ERROR if [source]
+// has a compile error, and LS_RESULT_SUCCESS otherwise.
+LsInterpretResult ls_compile_image(LsVM *vm, const char *source, size_t length,
+                                   LsImageFn save, void *data);
+
+// Returns true if the [length] bytes at [data] start like an image.
+bool ls_is_image(const char *data, size_t length);
+
+// Runs the [length] bytes [image] written by ls_compile_image() in a new
+// module. Returns LS_RESULT_COMPILE_ERROR if it isn't a valid image of this
+// version of LightScript, or wasn't written on a machine of the same byte
+// order.
+//
+// The image isn't copied: its code runs in place and its strings are only
+// created once used. It must be aligned to 8 bytes, like a memory mapped
+// file, and stay unchanged until [vm] is freed.
+LsInterpretResult ls_interpret_image(LsVM *vm, const char *image,
+                                     size_t length);
+
+// Compiles the [count] modules whose source code is in [sources], with the
+// lengths in [lengths], in parallel, then runs them one after the other in
+// order. Nothing runs if any of them has a compile error. Otherwise, stops at
+// the first runtime error.
+LsInterpretResult ls_interpret_modules(LsVM *vm, const char *const *sources,
+                                       const size_t *lengths, size_t count);
+
+// Saves the whole heap of [vm] to an image: its modules with their variables,
+// and the functions, closures and other objects they hold. Calls [save] with
+// it and [data]. Functions compiled lazily are compiled first.
+//
+// Returns false if [vm] is running code, if it has fibers or foreign
+// functions, or if a function has a compile error.
+bool ls_save_image(LsVM *vm, LsImageFn save, void *data);
+
+// Creates a VM configured with [config], like ls_new_vm(), whose heap is
+// restored from the [length] bytes [image] written by ls_save_image(). No code
+// runs: ls_interpret_in_module() continues where the saved VM was. [image] is
+// copied, so it can be freed once this returns.
+//
+// Returns NULL if it isn't a valid heap image of this version of LightScript,
+// or wasn't written on a machine of the same byte order.
+LsVM *ls_new_vm_from_image(LsConfiguration *config, const char *image,
+                           size_t length);
+
+// Creates a VM configured like [parent], which starts with a copy of its
+// state, like a VM restored from an image of it. Only what scripts can change
+// is copied: the module variables, arrays, maps and closures. Strings and the
+// code of functions are shared with [parent], which must outlive the clone
+// and mustn't run code while it is being cloned.
+//
+// Returns NULL if [parent] is running code, if it has fibers, or if a
+// function has a compile error.
+LsVM *ls_clone_vm(LsVM *parent);
+
+// Compiles the [length] bytes of source code at [source] to a program, with
+// a VM configured with [config]. Returns NULL if there is a compile error,
+// which is reported through the on_error callback of [config].
+//
+// A program is compiled once and never changes, so any number of VMs can run
+// it at once, on any thread, without locking. They share its code, constants
+// and strings: only the variables of the module and the objects created while
+// running are private to each of them.
+//
+// The caller holds a reference to the returned program.
+LsProgram *ls_new_program(LsConfiguration *config, const char *source,
+                          size_t length);
+
+// Takes a reference to [program]. Safe to call from any thread.
+void ls_retain_program(LsProgram *program);
+
+// Drops a reference to [program], and frees it when none is left. Safe to
+// call from any thread.
+void ls_release_program(LsProgram *program);
+
+// Runs [program] in a new module of [vm]. [vm] holds a reference to
+// [program] until it is freed.
+LsInterpretResult ls_run_program(LsVM *vm, LsProgram *program);
+
+// Creates a pool of [workers] threads, each running the jobs submitted to the
+// pool with a VM configured with [config]. The callbacks of [config] are then
+// called from all of them, so they must be thread safe. Returns NULL if the
+// threads can't be started.
+//
+// Jobs are queued on the workers in turn, and workers without jobs steal them
+// from the queues of the others. The objects a job creates are freed once it
+// is done.
+//
+// Jobs that run out of the budget of [config] are preempted and queued again
+// behind the others, so that long ones don't hold a worker. Each of them then
+// keeps a VM of its own until it is done.
+//
+// If [workers] is zero, defaults to 4.
+LsPool *ls_new_pool(LsConfiguration *config, int workers);
+
+// Stops the threads of [pool] and frees it. Every job submitted to it must be
+// awaited before.
+void ls_free_pool(LsPool *pool);
+
+// Queues a run of [program] in a new module of one of the VMs of [pool]. The
+// job holds a reference to [program] until it is awaited. Safe to call from
+// any thread.
+LsJob *ls_pool_submit(LsPool *pool, LsProgram *program);
+
+// Cancels [job] unless it started running. Returns true if it won't run.
+// Canceled jobs must still be awaited. Safe to call from any thread.
+bool ls_pool_cancel(LsPool *pool, LsJob *job);
+
+// Waits for [job] to be done, and returns its result, or LS_RESULT_CANCELED if
+// it was canceled. [job] is freed, so it must be awaited exactly once.
+LsInterpretResult ls_pool_await(LsPool *pool, LsJob *job);
+
+// Creates a channel holding up to [capacity] values in transit between VMs
+// using the reallocate callback of [config]. VMs with another one can't send
+// nor receive values with it.
+//
+// If [capacity] is zero, defaults to 64.
+LsChannel *ls_new_channel(LsConfiguration *config, size_t capacity);
+
+// Frees [channel] and the values still in it. No thread may be sending nor
+// receiving with it.
+void ls_free_channel(LsChannel *channel);
+
+// Stops [channel] from taking more values, and wakes up the threads waiting
+// on it. The values already sent can still be received. Safe to call from any
+// thread.
+void ls_close_channel(LsChannel *channel);
+
+// Moves the value of the variable [variable] of the module named [module] of
+// [vm] to [channel], waiting for room if it is full. Safe to call from any
+// thread.
+//
+// The objects the value references are moved too: strings, arrays and maps
+// are cloned, preserving the objects they share, while the elements of arrays
+// of bytes or numbers are handed over without being copied, leaving the
+// arrays of [vm] empty. Returns false if [channel] is closed, if there is no
+// such variable, or if the value references functions.
+bool ls_channel_send(LsChannel *channel, LsVM *vm, const char *module,
+                     const char *variable);
+
+// Takes the oldest value of [channel], waiting for one if it is empty, and
+// stores it in the variable [variable] of the module named [module] of [vm],
+// which is declared if needed. Returns false once [channel] is closed and
+// empty. Safe to call from any thread.
+bool ls_channel_receive(LsChannel *channel, LsVM *vm, const char *module,
+                        const char *variable);
+
+// Stores in the variable [fiber] of the module named [module] of [vm], which
+// is declared if needed, a new fiber running the function in its variable
+// [fn]. Returns false if there is no such function, or if it takes more than
+// one argument.
+//
+// A fiber runs its function on a stack of its own, and can be suspended in
+// the middle of it with `yield value`. Scripts resume it by calling it, with
+// at most one argument: the call returns the value it yields, or returns once
+// done, and the argument is the value of the yield it was suspended at, or
+// the argument of its function when it starts.
+bool ls_spawn_fiber(LsVM *vm, const char *module, const char *fn,
+                    const char *fiber);
+
+// Runs the fiber in the variable [fiber] of the module named [module] of [vm]
+// until it yields or returns, resuming it with null. Returns
+// LS_RESULT_SUSPENDED if it yielded, and LS_RESULT_RUNTIME_ERROR if there is
+// no such fiber, or it is running or done.
+LsInterpretResult ls_resume_fiber(LsVM *vm, const char *module,
+                                  const char *fiber);
+
+// Stores in the variable [name] of the module named [module] of [vm], which is
+// declared if needed, a function taking [arity] arguments that calls [fn].
+// Returns false if the module has too many variables.
+bool ls_define_foreign(LsVM *vm, const char *module, const char *name,
+                       int arity, LsForeignFn fn);
+
+// Slots pass values between the host and scripts. A foreign function being
+// called has its own: the function in slot 0, then its arguments. Otherwise,
+// the host has a set of its own, for ls_call(). Slots only hold null,
+// booleans and numbers as they are, so moving those never allocates.
+
+// Returns the number of slots of the foreign function being called, which
+// starts one more than the number of arguments it takes, or of the host.
+int ls_get_slot_count(LsVM *vm);
+
+// Makes sure there are at least [num_slots] slots, adding null ones if needed.
+// The slots of the host are kept from one call to the next, so this only
+// allocates the first time.
+void ls_ensure_slots(LsVM *vm, int num_slots);
+
+// Returns the type of the value in [slot].
+LsType ls_get_slot_type(LsVM *vm, int slot);
+
+// Returns the boolean in [slot], which must hold one.
+bool ls_get_slot_bool(LsVM *vm, int slot);
+
+// Returns the number in [slot], which must hold one.
+double ls_get_slot_double(LsVM *vm, int slot);
+
+// Returns the characters of the string in [slot], which must hold one, and
+// stores its length in [length]. They are borrowed from the VM rather than
+// copied, and not null terminated: they are only valid until the foreign
+// function returns, or until the host runs code again.
+const char *ls_get_slot_string(LsVM *vm, int slot, size_t *length);
+
+// Returns the bytes of the array of bytes in [slot], which must hold one, and
+// stores its length in [length]. They are borrowed like the characters of
+// strings.
+const char *ls_get_slot_bytes(LsVM *vm, int slot, size_t *length);
+
+void ls_set_slot_null(LsVM *vm, int slot);
+void ls_set_slot_bool(LsVM *vm, int slot, bool value);
+void ls_set_slot_double(LsVM *vm, int slot, double value);
+
+// Stores a new string with a copy of the [length] bytes at [text] in [slot].
+void ls_set_slot_string(LsVM *vm, int slot, const char *text, size_t length);
+
+// Stores a new array with a copy of the [length] bytes at [bytes] in [slot].
+void ls_set_slot_bytes(LsVM *vm, int slot, const char *bytes, size_t length);
+
+// Stores the value of the variable [name] of the module named [module] in
+// [slot]. Returns false if there is no such variable.
+bool ls_get_variable(LsVM *vm, const char *module, const char *name,
+                     int slot);
+
+// Calls the function in slot 0 with the [num_args] arguments in the slots
+// after it, and stores the value it returns in slot 0.
+//
+// Returns LS_RESULT_RUNTIME_ERROR if slot 0 doesn't hold a function taking
+// [num_args] arguments, or if it fails. Returns LS_RESULT_SUSPENDED, without
+// the value, if it waits for the host or is preempted, like ls_interpret().
+LsInterpretResult ls_call(LsVM *vm, int num_args);
+
+// Resolves the function [name] of the module named [module], which takes
+// [arity] arguments, into a handle to call it with. Lazy functions are
+// compiled right away. Returns NULL if there is no such variable, or if it
+// isn't a function taking [arity] arguments.
+//
+// Calls through the handle then skip the lookup of the variable, and the
+// checks of the function, and allocate nothing. It holds the function it was
+// made with, even if the variable changes later.
+LsCallHandle *ls_make_call_handle(LsVM *vm, const char *module,
+                                  const char *name, int arity);
+
+// Calls the function of [handle] with the arguments in slots 1 and after, and
+// stores the value it returns in slot 0, like ls_call().
+LsInterpretResult ls_call_handle(LsVM *vm, LsCallHandle *handle);
+
+// Frees [handle], made for [vm].
+void ls_release_call_handle(LsVM *vm, LsCallHandle *handle);
+
+// Makes the foreign function being called fail with a runtime error once it
+// returns. [message] must live until then.
+void ls_abort_fiber(LsVM *vm, const char *message);
+
+// Replaces the function in [slot] by a new fiber running it, like
+// ls_spawn_fiber(), and returns it. Returns NULL if it isn't a function
+// taking at most one argument.
+LsFiber *ls_spawn_fiber_in_slot(LsVM *vm, int slot);
+
+// Suspends the fiber calling the foreign function being called, once it
+// returns, and returns it as the token to resume it with. The host then
+// completes the call on its own time: resuming the fiber with a value gives
+// it as the result of the call. The code run by the host returns
+// LS_RESULT_SUSPENDED meanwhile.
+//
+// Returns NULL if the fiber can't be suspended: when it is resumed by another
+// fiber rather than by the host, or when the host called the code calling
+// the foreign function while running another one.
+LsFiber *ls_suspend_fiber(LsVM *vm);
+
+// Resumes [fiber] until it yields, is suspended, or returns, with null, a
+// number, or a new string with a copy of the [length] bytes at [text]. A new
+// fiber gets the value as the argument of its function. Returns
+// LS_RESULT_SUSPENDED if it yielded or is suspended again, and
+// LS_RESULT_RUNTIME_ERROR if it can't be resumed.
+LsInterpretResult ls_resume_null(LsVM *vm, LsFiber *fiber);
+LsInterpretResult ls_resume_double(LsVM *vm, LsFiber *fiber, double value);
+LsInterpretResult ls_resume_string(LsVM *vm, LsFiber *fiber, const char *text,
+                                   size_t length);
+
+// Returns the fiber preempted by the last call of the host running code, if
+// it returned LS_RESULT_SUSPENDED because the code ran out of budget, or NULL.
+// It can be the main fiber, which ls_interpret() and the like run code on.
+//
+// Resuming it with ls_resume_null() continues where it was, with a new
+// budget. Calls made by the host in the meantime run on top of it.
+LsFiber *ls_get_preempted_fiber(LsVM *vm);
+
 #endif
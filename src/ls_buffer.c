@@ -1,3 +1,3 @@
 #include "ls_buffer.h"
 
-DEFINE_BUFFER(Byte, byte, char *)
+DEFINE_BUFFER(Byte, byte, uint8_t)
@@ -2,23 +2,58 @@
 #define LS_BUFFER_H_INCLUDE
 
 #include <stdint.h>
+#include <string.h>
 
 #include "ls_alloc.h"
 
+// The smallest capacity a buffer grows to when it runs out of room, so that
+// appending a few elements one by one to an empty buffer doesn't reallocate
+// each time.
+#define BUFFER_MIN_CAPACITY 8
+
 // We need buffers of a few different types. To avoid lots of casting between
 // void * and back, we'll use the preprocessor as a poor man's generics and let
 // it generate a few type-specific ones.
+//
+// Buffers only reallocate when their capacity changes. Running out of room
+// doubles the capacity, so appending is amortized constant time, while
+// reserve() and shrink_to_fit() allocate exact capacities.
+//
+// Writing a single element is the hot path of most buffers, so it is inlined
+// and only calls out of line to grow.
 #define DECLARE_BUFFER(Name, name, type)                                       \
   typedef struct {                                                             \
     size_t length;                                                             \
     size_t capacity;                                                           \
     type *data;                                                                \
   } Name##Buffer;                                                              \
+  void ls_##name##_buffer_grow(LsVM *vm, Name##Buffer *buffer,                 \
+                               size_t min_capacity);                           \
+                                                                               \
+  static inline void ls_##name##_buffer_write(LsVM *vm, Name##Buffer *buffer,  \
+                                              type data) {                     \
+    if (buffer->length == buffer->capacity)                                    \
+      ls_##name##_buffer_grow(vm, buffer, buffer->length + 1);                 \
+    buffer->data[buffer->length++] = data;                                     \
+  }                                                                            \
+                                                                               \
+  static inline void ls_##name##_buffer_append_n(                              \
+      LsVM *vm, Name##Buffer *buffer, const type *data, size_t count) {        \
+    if (count == 0)                                                            \
+      return;                                                                  \
+    if (buffer->capacity - buffer->length < count)                             \
+      ls_##name##_buffer_grow(vm, buffer, buffer->length + count);             \
+    memcpy(buffer->data + buffer->length, data, count * sizeof(type));         \
+    buffer->length += count;                                                   \
+  }                                                                            \
+                                                                               \
   void ls_##name##_buffer_init(Name##Buffer *buffer);                          \
   void ls_##name##_buffer_clear(LsVM *vm, Name##Buffer *buffer);               \
+  void ls_##name##_buffer_reserve(LsVM *vm, Name##Buffer *buffer,              \
+                                  size_t capacity);                            \
+  void ls_##name##_buffer_shrink_to_fit(LsVM *vm, Name##Buffer *buffer);       \
   void ls_##name##_buffer_fill(LsVM *vm, Name##Buffer *buffer, type data,      \
-                               size_t count);                                  \
-  void ls_##name##_buffer_write(LsVM *vm, Name##Buffer *buffer, type data)
+                               size_t count)
 
 // This should be used once for each type instantiation, somewhere in a .c file.
 #define DEFINE_BUFFER(Name, name, type)                                        \
@@ -29,27 +64,58 @@
   }                                                                            \
                                                                                \
   void ls_##name##_buffer_clear(LsVM *vm, Name##Buffer *buffer) {              \
-    ls_reallocate(vm, buffer->data, 0, 0);                                     \
+    ls_reallocate(vm, buffer->data, buffer->capacity * sizeof(type), 0);       \
     ls_##name##_buffer_init(buffer);                                           \
   }                                                                            \
                                                                                \
-  void ls_##name##_buffer_fill(LsVM *vm, Name##Buffer *buffer, type data,      \
-                               size_t length) {                                \
-    size_t capacity = buffer->capacity;                                        \
-    while (buffer->capacity < buffer->length + length) {                       \
-      buffer->capacity = (buffer->capacity == 0 ? 1 : buffer->capacity) * 2;   \
-    }                                                                          \
-    buffer->data =                                                             \
-        (type *)ls_reallocate(vm, buffer->data, capacity * sizeof(type),       \
-                              buffer->capacity * sizeof(type));                \
+  void ls_##name##_buffer_reserve(LsVM *vm, Name##Buffer *buffer,              \
+                                  size_t capacity) {                           \
+    if (capacity <= buffer->capacity)                                          \
+      return;                                                                  \
                                                                                \
-    for (size_t i = 0; i < length; i++) {                                      \
-      buffer->data[buffer->length++] = data;                                   \
+    buffer->data = (type *)ls_reallocate(vm, buffer->data,                     \
+                                         buffer->capacity * sizeof(type),      \
+                                         capacity * sizeof(type));             \
+    /* TODO: handle oom. */                                                    \
+    buffer->capacity = capacity;                                               \
+  }                                                                            \
+                                                                               \
+  void ls_##name##_buffer_grow(LsVM *vm, Name##Buffer *buffer,                 \
+                               size_t min_capacity) {                          \
+    size_t capacity = buffer->capacity * 2;                                    \
+    if (capacity < BUFFER_MIN_CAPACITY)                                        \
+      capacity = BUFFER_MIN_CAPACITY;                                          \
+    if (capacity < min_capacity)                                               \
+      capacity = min_capacity;                                                 \
+    ls_##name##_buffer_reserve(vm, buffer, capacity);                          \
+  }                                                                            \
+                                                                               \
+  void ls_##name##_buffer_shrink_to_fit(LsVM *vm, Name##Buffer *buffer) {      \
+    if (buffer->length == buffer->capacity)                                    \
+      return;                                                                  \
+                                                                               \
+    if (buffer->length == 0) {                                                 \
+      ls_##name##_buffer_clear(vm, buffer);                                    \
+      return;                                                                  \
     }                                                                          \
+                                                                               \
+    buffer->data = (type *)ls_reallocate(vm, buffer->data,                     \
+                                         buffer->capacity * sizeof(type),      \
+                                         buffer->length * sizeof(type));       \
+    buffer->capacity = buffer->length;                                         \
   }                                                                            \
                                                                                \
-  void ls_##name##_buffer_write(LsVM *vm, Name##Buffer *buffer, type data) {   \
-    ls_##name##_buffer_fill(vm, buffer, data, 1);                              \
+  void ls_##name##_buffer_fill(LsVM *vm, Name##Buffer *buffer, type data,      \
+                               size_t count) {                                 \
+    if (count == 0)                                                            \
+      return;                                                                  \
+    if (buffer->capacity - buffer->length < count)                             \
+      ls_##name##_buffer_grow(vm, buffer, buffer->length + count);             \
+                                                                               \
+    type *out = buffer->data + buffer->length;                                 \
+    for (size_t i = 0; i < count; i++)                                         \
+      out[i] = data;                                                           \
+    buffer->length += count;                                                   \
   }
 
 DECLARE_BUFFER(Byte, byte, uint8_t);
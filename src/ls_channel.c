@@ -0,0 +1,356 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ls_alloc.h"
+#include "ls_channel.h"
+#include "ls_value.h"
+
+// The state of ls_pack_message().
+typedef struct {
+  LsVM *vm;
+
+  // Maps the address of each object of the value, as a number, to its copy,
+  // or to LS_NULL until it is created.
+  LsObjMap copies;
+
+  // The objects of the value, in the order they were found.
+  ValueBuffer objects;
+
+  // The number of bytes of the elements handed over by typed arrays.
+  size_t moved;
+} Packer;
+
+// Returns the key of [obj] in the map of copies of the packer. Objects aren't
+// used as keys since maps compare strings by content.
+static LsValue address_of(LsObj *obj) {
+  return ls_num2val((double)(uintptr_t)obj);
+}
+
+// Returns the copy of [value] in the message being packed.
+static LsValue copy_of(Packer *packer, LsValue value) {
+  if (!ls_is_obj(value))
+    return value;
+
+  return ls_map_get(&packer->copies, address_of(ls_val2obj(value)));
+}
+
+#define COPY_OF(packer, obj) ((void *)ls_val2obj(copy_of(packer, ls_obj2val(obj))))
+
+// Adds the objects reachable from [value] to those of [packer]. Returns false
+// if one of them can't be sent.
+static bool collect_objects(Packer *packer, LsValue value) {
+  LsVM *vm = packer->vm;
+  ValueBuffer pending;
+  ls_value_buffer_init(&pending);
+  ls_value_buffer_write(vm, &pending, value);
+
+  bool sendable = true;
+  while (pending.length > 0 && sendable) {
+    value = pending.data[--pending.length];
+    if (!ls_is_obj(value) ||
+        ls_map_get(&packer->copies, address_of(ls_val2obj(value))) !=
+            LS_UNDEFINED)
+      continue;
+
+    LsObj *obj = ls_val2obj(value);
+    ls_map_set(vm, &packer->copies, address_of(obj), LS_NULL);
+    ls_value_buffer_write(vm, &packer->objects, value);
+
+    switch (obj->type) {
+    case LS_OBJ_STRING:
+      break;
+
+    case LS_OBJ_ARRAY: {
+      LsObjArray *arr = (LsObjArray *)obj;
+      if (arr->kind == LS_ARRAY_VALUE)
+        ls_value_buffer_append_n(vm, &pending, arr->elements.values.data,
+                                 arr->elements.values.length);
+      break;
+    }
+
+    case LS_OBJ_MAP: {
+      size_t iterator = 0;
+      LsValue key, entry;
+      while (ls_map_next((LsObjMap *)obj, &iterator, &key, &entry)) {
+        ls_value_buffer_write(vm, &pending, key);
+        ls_value_buffer_write(vm, &pending, entry);
+      }
+      break;
+    }
+
+    // Code stays in the VM it was compiled by, and so do the fibers running
+    // it.
+    case LS_OBJ_MODULE:
+    case LS_OBJ_FN:
+    case LS_OBJ_CLOSURE:
+    case LS_OBJ_UPVALUE:
+    case LS_OBJ_FIBER:
+    case LS_OBJ_FOREIGN:
+    case LS_OBJ_TYPE_COUNT:
+      sendable = false;
+      break;
+    }
+  }
+
+  ls_value_buffer_clear(vm, &pending);
+  return sendable;
+}
+
+// Creates the copy of [obj], without the values referencing other objects.
+// Typed arrays hand their elements over to their copy, and are left empty.
+static void create_copy(Packer *packer, LsObj *obj) {
+  LsVM *vm = packer->vm;
+  LsObj *copy = NULL;
+
+  switch (obj->type) {
+  case LS_OBJ_STRING: {
+    LsObjString *str = (LsObjString *)obj;
+    copy = ls_val2obj(ls_new_string_length(vm, str->value, str->length));
+    break;
+  }
+
+  case LS_OBJ_ARRAY: {
+    LsObjArray *arr = (LsObjArray *)obj;
+    LsObjArray *arr_copy = NULL;
+    switch (arr->kind) {
+    case LS_ARRAY_BYTE:
+      arr_copy = (LsObjArray *)ls_val2obj(ls_new_byte_array(vm, NULL, 0));
+      arr_copy->elements.bytes = arr->elements.bytes;
+      packer->moved += arr->elements.bytes.capacity * sizeof(uint8_t);
+      ls_byte_buffer_init(&arr->elements.bytes);
+      break;
+    case LS_ARRAY_INT32:
+      arr_copy = (LsObjArray *)ls_val2obj(ls_new_int32_array(vm, NULL, 0));
+      arr_copy->elements.ints = arr->elements.ints;
+      packer->moved += arr->elements.ints.capacity * sizeof(int32_t);
+      ls_int_buffer_init(&arr->elements.ints);
+      break;
+    case LS_ARRAY_DOUBLE:
+      arr_copy = (LsObjArray *)ls_val2obj(ls_new_double_array(vm, NULL, 0));
+      arr_copy->elements.doubles = arr->elements.doubles;
+      packer->moved += arr->elements.doubles.capacity * sizeof(double);
+      ls_double_buffer_init(&arr->elements.doubles);
+      break;
+    case LS_ARRAY_VALUE:
+      arr_copy = (LsObjArray *)ls_val2obj(
+          ls_new_array(vm, arr->elements.values.length));
+      break;
+    }
+    copy = &arr_copy->obj;
+    break;
+  }
+
+  case LS_OBJ_MAP:
+    copy = ls_val2obj(ls_new_map(vm));
+    break;
+
+  case LS_OBJ_MODULE:
+  case LS_OBJ_FN:
+  case LS_OBJ_CLOSURE:
+  case LS_OBJ_UPVALUE:
+  case LS_OBJ_FIBER:
+  case LS_OBJ_FOREIGN:
+  case LS_OBJ_TYPE_COUNT:
+    return;
+  }
+
+  ls_map_set(vm, &packer->copies, address_of(obj), ls_obj2val(copy));
+}
+
+// Stores in the copy of [obj] the copies of the values it references.
+static void link_copy(Packer *packer, LsObj *obj) {
+  LsVM *vm = packer->vm;
+
+  switch (obj->type) {
+  case LS_OBJ_ARRAY: {
+    LsObjArray *arr = (LsObjArray *)obj;
+    if (arr->kind != LS_ARRAY_VALUE)
+      break;
+
+    LsObjArray *arr_copy = COPY_OF(packer, obj);
+    for (size_t i = 0; i < arr->elements.values.length; i++)
+      arr_copy->elements.values.data[i] =
+          copy_of(packer, arr->elements.values.data[i]);
+    break;
+  }
+
+  case LS_OBJ_MAP: {
+    LsObjMap *map_copy = COPY_OF(packer, obj);
+    size_t iterator = 0;
+    LsValue key, value;
+    while (ls_map_next((LsObjMap *)obj, &iterator, &key, &value))
+      ls_map_set(vm, map_copy, copy_of(packer, key), copy_of(packer, value));
+    break;
+  }
+
+  case LS_OBJ_STRING:
+  case LS_OBJ_MODULE:
+  case LS_OBJ_FN:
+  case LS_OBJ_CLOSURE:
+  case LS_OBJ_UPVALUE:
+  case LS_OBJ_FIBER:
+  case LS_OBJ_FOREIGN:
+  case LS_OBJ_TYPE_COUNT:
+    break;
+  }
+}
+
+bool ls_pack_message(LsVM *vm, LsValue value, Message *message) {
+  message->value = value;
+  message->first_obj = NULL;
+  message->last_obj = NULL;
+  message->bytes = 0;
+  if (!ls_is_obj(value))
+    return true;
+
+  // Counted before the packer allocates anything, so that only what the
+  // message keeps is.
+  size_t bytes_before = vm->bytes_allocated;
+  Packer packer;
+  packer.vm = vm;
+  packer.moved = 0;
+  ls_init_map(&packer.copies);
+  ls_value_buffer_init(&packer.objects);
+  if (!collect_objects(&packer, value)) {
+    ls_map_clear(vm, &packer.copies);
+    ls_value_buffer_clear(vm, &packer.objects);
+    return false;
+  }
+
+  // The copies are allocated by [vm] like any object, so they are the ones
+  // its list of objects gains until it is back to [first_obj].
+  LsObj *first_obj = vm->first_obj;
+  for (size_t i = 0; i < packer.objects.length; i++)
+    create_copy(&packer, ls_val2obj(packer.objects.data[i]));
+  for (size_t i = 0; i < packer.objects.length; i++)
+    link_copy(&packer, ls_val2obj(packer.objects.data[i]));
+  message->value = copy_of(&packer, value);
+
+  ls_map_clear(vm, &packer.copies);
+  ls_value_buffer_clear(vm, &packer.objects);
+
+  message->first_obj = vm->first_obj;
+  message->last_obj = vm->first_obj;
+  while (message->last_obj->next != first_obj)
+    message->last_obj = message->last_obj->next;
+  message->last_obj->next = NULL;
+  vm->first_obj = first_obj;
+
+  message->bytes = vm->bytes_allocated - bytes_before + packer.moved;
+  vm->bytes_allocated -= message->bytes;
+  return true;
+}
+
+LsValue ls_unpack_message(LsVM *vm, Message *message) {
+  if (message->first_obj != NULL) {
+    message->last_obj->next = vm->first_obj;
+    vm->first_obj = message->first_obj;
+    vm->bytes_allocated += message->bytes;
+  }
+
+  return message->value;
+}
+
+LsChannel *ls_new_channel(LsConfiguration *config, size_t capacity) {
+  if (capacity == 0)
+    capacity = DEFAULT_CHANNEL_CAPACITY;
+
+  // The VM resolves the default configuration.
+  LsVM *vm = ls_new_vm(config);
+  LsChannel *channel = ls_reallocate(vm, NULL, 0, sizeof(LsChannel));
+  // TODO: handle oom.
+  channel->vm = vm;
+  channel->messages = ls_allocate_array(vm, Message, capacity);
+  channel->head = 0;
+  channel->count = 0;
+  channel->capacity = capacity;
+  channel->closed = false;
+  pthread_mutex_init(&channel->lock, NULL);
+  pthread_cond_init(&channel->not_empty, NULL);
+  pthread_cond_init(&channel->not_full, NULL);
+
+  return channel;
+}
+
+void ls_free_channel(LsChannel *channel) {
+  // The objects of the messages left are freed with the VM.
+  LsVM *vm = channel->vm;
+  for (size_t i = 0; i < channel->count; i++) {
+    ls_unpack_message(
+        vm, &channel->messages[(channel->head + i) % channel->capacity]);
+  }
+
+  pthread_mutex_destroy(&channel->lock);
+  pthread_cond_destroy(&channel->not_empty);
+  pthread_cond_destroy(&channel->not_full);
+  ls_reallocate(vm, channel->messages, channel->capacity * sizeof(Message), 0);
+  ls_reallocate(vm, channel, sizeof(LsChannel), 0);
+  ls_free_vm(vm);
+}
+
+void ls_close_channel(LsChannel *channel) {
+  pthread_mutex_lock(&channel->lock);
+  channel->closed = true;
+  pthread_cond_broadcast(&channel->not_empty);
+  pthread_cond_broadcast(&channel->not_full);
+  pthread_mutex_unlock(&channel->lock);
+}
+
+bool ls_channel_send(LsChannel *channel, LsVM *vm, const char *module,
+                     const char *variable) {
+  if (vm->config.reallocate != channel->vm->config.reallocate)
+    return false;
+
+  LsValue *slot = ls_find_variable(vm, module, variable, false);
+  if (slot == NULL)
+    return false;
+
+  pthread_mutex_lock(&channel->lock);
+  while (channel->count == channel->capacity && !channel->closed)
+    pthread_cond_wait(&channel->not_full, &channel->lock);
+
+  // The value is packed once there is room for it, so that nothing is taken
+  // from [vm] unless it is sent.
+  bool sent = !channel->closed;
+  if (sent) {
+    size_t tail = (channel->head + channel->count) % channel->capacity;
+    sent = ls_pack_message(vm, *slot, &channel->messages[tail]);
+  }
+  if (sent) {
+    channel->count++;
+    pthread_cond_signal(&channel->not_empty);
+  }
+
+  pthread_mutex_unlock(&channel->lock);
+  return sent;
+}
+
+bool ls_channel_receive(LsChannel *channel, LsVM *vm, const char *module,
+                        const char *variable) {
+  if (vm->config.reallocate != channel->vm->config.reallocate)
+    return false;
+
+  LsValue *slot = ls_find_variable(vm, module, variable, true);
+  if (slot == NULL)
+    return false;
+
+  pthread_mutex_lock(&channel->lock);
+  while (channel->count == 0 && !channel->closed)
+    pthread_cond_wait(&channel->not_empty, &channel->lock);
+
+  bool received = channel->count > 0;
+  Message message;
+  if (received) {
+    message = channel->messages[channel->head];
+    channel->head = (channel->head + 1) % channel->capacity;
+    channel->count--;
+    pthread_cond_signal(&channel->not_full);
+  }
+
+  pthread_mutex_unlock(&channel->lock);
+  if (received)
+    *slot = ls_unpack_message(vm, &message);
+  return received;
+}
@@ -0,0 +1,68 @@
+#ifndef LS_CHANNEL_H_INCLUDE
+#define LS_CHANNEL_H_INCLUDE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ls_vm.h"
+
+// The number of messages a channel holds when no capacity is given.
+#define DEFAULT_CHANNEL_CAPACITY 64
+
+// A value in transit between two VMs.
+//
+// Its objects were created by the sending VM, then unlinked from its objects
+// so that they belong to no VM until the receiving one links them to its
+// own. Their memory moves along with them, which is why both VMs must use the
+// same reallocate callback.
+typedef struct {
+  LsValue value;
+
+  // The objects of the message, linked through their [next] field.
+  LsObj *first_obj;
+  LsObj *last_obj;
+
+  // The number of bytes allocated for them.
+  size_t bytes;
+} Message;
+
+// A bounded queue of messages, sent and received by VMs on any thread.
+struct ls_channel {
+  // The VM the channel is allocated with, which frees the messages still in
+  // the channel when it is freed.
+  LsVM *vm;
+
+  // The messages in the channel, in a ring buffer of [capacity] messages.
+  Message *messages;
+  size_t head;
+  size_t count;
+  size_t capacity;
+
+  // Set once no more messages can be sent.
+  bool closed;
+
+  pthread_mutex_t lock;
+
+  // Signaled when a message is sent, and broadcast when the channel is
+  // closed.
+  pthread_cond_t not_empty;
+
+  // Signaled when a message is received, and broadcast when the channel is
+  // closed.
+  pthread_cond_t not_full;
+};
+
+// Moves the graph of objects reachable from [value] out of [vm] to
+// [message]. Returns false if it holds objects that can't be sent, i.e.
+// functions and modules.
+//
+// Strings, value arrays and maps are cloned, preserving sharing and cycles.
+// Typed arrays are transferred instead: the message takes their elements
+// without copying them, and the arrays of [vm] are left empty.
+bool ls_pack_message(LsVM *vm, LsValue value, Message *message);
+
+// Links the objects of [message] to those of [vm], and returns its value.
+LsValue ls_unpack_message(LsVM *vm, Message *message);
+
+#endif
@@ -1,9 +1,10 @@
 #include <assert.h>
-#include <ctype.h>
-#include <errno.h>
+#include <float.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,10 +12,16 @@
 #include "lightscript.h"
 #include "ls_buffer.h"
 #include "ls_compiler.h"
+#include "ls_number.h"
 #include "ls_options.h"
 #include "ls_utf8.h"
+#include "ls_utils.h"
 #include "ls_value.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 // The buffer size used to format a compile error message, excluding the header
 // with the module name and error location. Using a hardcoded buffer for this
 // is kind of hairy, but fortunately we can control what the longest possible
@@ -22,6 +29,15 @@
 // available in standard C++98.
 #define ERROR_MESSAGE_SIZE (80 + MAX_VARIABLE_NAME + 15)
 
+// The smallest number of bytes of source code a LsReadFn is asked to read at
+// once.
+#define READ_CHUNK_SIZE 4096
+
+// The number of threads ls_compile_modules() compiles modules on when the
+// compile_threads option is zero, and the most it uses.
+#define DEFAULT_COMPILE_THREADS 4
+#define MAX_COMPILE_THREADS 64
+
 typedef enum {
   TOKEN_LEFT_PAREN,
   TOKEN_RIGHT_PAREN,
@@ -39,6 +55,7 @@ typedef enum {
   TOKEN_COLON,
   TOKEN_COMMA,
   TOKEN_DOT,
+  TOKEN_DOTDOT,
   TOKEN_ELLIPSIS,
   TOKEN_HASH,
   TOKEN_LINE,
@@ -65,12 +82,14 @@ typedef enum {
   TOKEN_BREAK,
   TOKEN_CONTINUE,
   TOKEN_ELSE,
+  TOKEN_FN,
   TOKEN_FOR,
   TOKEN_IF,
   TOKEN_RETURN,
   TOKEN_WHILE,
   TOKEN_LET,
   TOKEN_CONST,
+  TOKEN_YIELD,
 
   TOKEN_NULL,
   TOKEN_TRUE,
@@ -97,10 +116,25 @@ typedef struct {
   // The 1-based line where the token appears.
   ptrdiff_t line;
 
-  // The parsed value if the token is a literal.
+  // The parsed value if the token is a number literal or a string literal
+  // with escape sequences. Other string literals are LS_UNDEFINED and, like
+  // identifiers, only become strings when token_string() is called.
   LsValue value;
 } Token;
 
+// What the compiler knows about a module variable it declared.
+typedef struct {
+  // If the variable was declared with `const`.
+  bool is_const;
+
+  // The value of a `const` variable whose initializer is a constant, which
+  // is loaded in place of the variable. Otherwise LS_UNDEFINED.
+  LsValue constant;
+} ModuleVariable;
+
+DECLARE_BUFFER(ModuleVariable, module_variable, ModuleVariable);
+DEFINE_BUFFER(ModuleVariable, module_variable, ModuleVariable)
+
 // Parser define a lexer and parser in a single type.
 typedef struct {
   LsVM *vm;
@@ -108,6 +142,14 @@ typedef struct {
   // The source code being parsed.
   const char *source;
 
+  // The end of [source], which doesn't need to be followed by a null
+  // terminator. The lexer never reads past it.
+  const char *source_end;
+
+  // The copy of [source] the functions compiled lazily are compiled from, or
+  // NULL if they aren't.
+  LsObjString *source_copy;
+
   // The current character being lexed in [source].
   const char *current_char;
 
@@ -126,6 +168,17 @@ typedef struct {
   // The most recently consumed/advanced token.
   Token previous;
 
+  // Scratch space for decoding string literals with escape sequences. It is
+  // reused by every literal so lexing doesn't allocate once it has grown.
+  ByteBuffer string;
+
+  // The module being compiled.
+  LsObjModule *module;
+
+  // The variables of [module] declared so far, by symbol. The ones declared
+  // before this source was parsed aren't known to be constants.
+  ModuleVariableBuffer module_variables;
+
   bool has_error;
   bool print_errors;
 } Parser;
@@ -136,16 +189,205 @@ typedef struct {
   TokenType token_type;
 } Keyword;
 
-// The table of reserved words and their associated token types.
-static Keyword keywords[] = {
-    {"break", 5, TOKEN_BREAK}, {"continue", 8, TOKEN_CONTINUE},
-    {"else", 4, TOKEN_ELSE},   {"false", 5, TOKEN_FALSE},
-    {"for", 3, TOKEN_FOR},     {"if", 2, TOKEN_IF},
-    {"null", 4, TOKEN_NULL},   {"return", 6, TOKEN_RETURN},
-    {"true", 4, TOKEN_TRUE},   {"while", 5, TOKEN_WHILE},
-    {NULL, 0, TOKEN_EOF} // Sentinel to mark the end of the array.
+// The length of the longest keyword. Longer identifiers are never looked up.
+#define MAX_KEYWORD_LENGTH 8
+
+// A perfect hash of the reserved words: each of them lands in its own slot of
+// [keywords], so recognizing one takes a single comparison. It must be
+// updated along with the table.
+#define KEYWORD_HASH(first, length) (((uint8_t)(first) + 4 * (length)) & 31)
+
+// The table of reserved words and their associated token types, indexed by
+// KEYWORD_HASH(). Unused slots have a NULL identifier.
+static const Keyword keywords[32] = {
+    {NULL, 0, TOKEN_EOF},             // 0
+    {NULL, 0, TOKEN_EOF},             // 1
+    {NULL, 0, TOKEN_EOF},             // 2
+    {"continue", 8, TOKEN_CONTINUE},  // 3
+    {"true", 4, TOKEN_TRUE},          // 4
+    {NULL, 0, TOKEN_EOF},             // 5
+    {NULL, 0, TOKEN_EOF},             // 6
+    {NULL, 0, TOKEN_EOF},             // 7
+    {NULL, 0, TOKEN_EOF},             // 8
+    {NULL, 0, TOKEN_EOF},             // 9
+    {"return", 6, TOKEN_RETURN},      // 10
+    {"while", 5, TOKEN_WHILE},        // 11
+    {NULL, 0, TOKEN_EOF},             // 12
+    {"yield", 5, TOKEN_YIELD},        // 13
+    {"fn", 2, TOKEN_FN},              // 14
+    {NULL, 0, TOKEN_EOF},             // 15
+    {NULL, 0, TOKEN_EOF},             // 16
+    {"if", 2, TOKEN_IF},              // 17
+    {"for", 3, TOKEN_FOR},            // 18
+    {NULL, 0, TOKEN_EOF},             // 19
+    {NULL, 0, TOKEN_EOF},             // 20
+    {"else", 4, TOKEN_ELSE},          // 21
+    {"break", 5, TOKEN_BREAK},        // 22
+    {"const", 5, TOKEN_CONST},        // 23
+    {"let", 3, TOKEN_LET},            // 24
+    {NULL, 0, TOKEN_EOF},             // 25
+    {"false", 5, TOKEN_FALSE},        // 26
+    {NULL, 0, TOKEN_EOF},             // 27
+    {NULL, 0, TOKEN_EOF},             // 28
+    {NULL, 0, TOKEN_EOF},             // 29
+    {"null", 4, TOKEN_NULL},          // 30
+    {NULL, 0, TOKEN_EOF},             // 31
+};
+
+// Character classes, as bit flags. Looking them up in a table is cheaper than
+// the <ctype.h> functions and doesn't depend on the locale.
+#define CHAR_DIGIT 0x01
+#define CHAR_ALPHA 0x02
+#define CHAR_SPACE 0x04
+
+#define D CHAR_DIGIT
+#define A CHAR_ALPHA
+#define S CHAR_SPACE
+
+// The classes of each byte. Bytes above 0x7f have none.
+static const uint8_t char_classes[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, S, 0, 0, 0, S, 0, 0, // 0x00
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x10
+    S, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x20
+    D, D, D, D, D, D, D, D, D, D, 0, 0, 0, 0, 0, 0, // 0x30
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, // 0x40
+    A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, 0, // 0x50
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, // 0x60
+    A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, 0, // 0x70
 };
 
+#undef D
+#undef A
+#undef S
+
+// Returns true if [c] belongs to one of the [classes].
+static inline bool char_is(char c, uint8_t classes) {
+  return (char_classes[(uint8_t)c] & classes) != 0;
+}
+
+static inline bool char_is_digit(char c) { return char_is(c, CHAR_DIGIT); }
+
+// The number of source bytes the scanners test at once.
+#if defined(__SSE2__)
+#define SCAN_WIDTH 16
+#else
+#define SCAN_WIDTH 8
+#endif
+
+// A bit mask with one bit per byte of a scanned chunk. With SSE2 bit N stands
+// for byte N, in the portable version bit 8 * N + 7 does.
+typedef uint64_t ScanMask;
+
+#if defined(__SSE2__)
+
+typedef __m128i ScanChunk;
+
+// The mask of a chunk whose bytes all match.
+#define SCAN_ALL ((ScanMask)0xffff)
+
+static inline ScanChunk scan_load(const char *p) {
+  return _mm_loadu_si128((const __m128i *)p);
+}
+
+// Returns the bytes of [chunk] equal to [c].
+static inline ScanMask scan_eq(ScanChunk chunk, char c) {
+  return (ScanMask)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)));
+}
+
+#else
+
+// Without SSE2, the chunk is packed in an integer and matched with bitwise
+// tricks ("SIMD within a register").
+typedef uint64_t ScanChunk;
+
+#define SCAN_LSBS ((uint64_t)0x0101010101010101)
+#define SCAN_MSBS ((uint64_t)0x8080808080808080)
+#define SCAN_ALL SCAN_MSBS
+
+static inline ScanChunk scan_load(const char *p) {
+  // Assemble the word byte by byte so byte N is always in byte N, whatever
+  // the host's endianness. Compilers turn this into a single load.
+  ScanChunk chunk = 0;
+  for (int i = 0; i < SCAN_WIDTH; i++)
+    chunk |= (uint64_t)(uint8_t)p[i] << (8 * i);
+  return chunk;
+}
+
+static inline ScanMask scan_eq(ScanChunk chunk, char c) {
+  // Zero the matching bytes, then detect zero bytes exactly: adding 0x7f to
+  // the low bits of a byte only leaves its high bit clear if it was zero.
+  uint64_t x = chunk ^ (SCAN_LSBS * (uint8_t)c);
+  uint64_t low = (x & ~SCAN_MSBS) + ~SCAN_MSBS;
+  return ~(low | x) & SCAN_MSBS;
+}
+
+#endif
+
+// Returns the index in its chunk of the first byte in [mask].
+static inline size_t scan_first(ScanMask mask) {
+#if defined(__SSE2__)
+  return (size_t)ls_ctz64(mask);
+#else
+  return (size_t)ls_ctz64(mask) / 8;
+#endif
+}
+
+// Returns the first byte from [p] that is [a], [b] or [c], or [end] if there
+// is none. Adds the number of newlines skipped over to [lines], counting them
+// a chunk at a time instead of checking every byte.
+static const char *scan_until(const char *p, const char *end, char a, char b,
+                              char c, ptrdiff_t *lines) {
+  while (end - p >= SCAN_WIDTH) {
+    ScanChunk chunk = scan_load(p);
+    ScanMask newlines = scan_eq(chunk, '\n');
+    ScanMask stops = scan_eq(chunk, a) | scan_eq(chunk, b) | scan_eq(chunk, c);
+
+    if (stops != 0) {
+      // Only count the newlines before the stop: those are the bits below
+      // its own.
+      ScanMask before = stops & (~stops + 1);
+      *lines += ls_popcount64(newlines & (before - 1));
+      return p + scan_first(stops);
+    }
+
+    *lines += ls_popcount64(newlines);
+    p += SCAN_WIDTH;
+  }
+
+  for (; p < end; p++) {
+    if (*p == a || *p == b || *p == c)
+      return p;
+    if (*p == '\n')
+      (*lines)++;
+  }
+
+  return end;
+}
+
+// Returns the first byte from [p] that isn't whitespace, or [end] if there is
+// none. Newlines aren't whitespace, they are tokens.
+static const char *scan_spaces(const char *p, const char *end) {
+  // Most runs are a single space, which was already consumed.
+  if (p == end || !char_is(*p, CHAR_SPACE))
+    return p;
+
+  while (end - p >= SCAN_WIDTH) {
+    ScanChunk chunk = scan_load(p);
+    ScanMask spaces =
+        scan_eq(chunk, ' ') | scan_eq(chunk, '\t') | scan_eq(chunk, '\r');
+
+    if (spaces != SCAN_ALL)
+      return p + scan_first(~spaces & SCAN_ALL);
+
+    p += SCAN_WIDTH;
+  }
+
+  while (p < end && char_is(*p, CHAR_SPACE))
+    p++;
+
+  return p;
+}
+
 static void print_error(Parser *parser, int line, const char *label,
                         const char *format, va_list args) {
   parser->has_error = true;
@@ -175,18 +417,32 @@ static void lex_error(Parser *parser, const char *format, ...) {
   va_end(args);
 }
 
-// Returns the current character the parser is sitting on.
-static char peek_char(Parser *parser) { return *parser->current_char; }
+// Returns true if the parser has reached the end of the source.
+static bool is_at_end(Parser *parser) {
+  return parser->current_char >= parser->source_end;
+}
+
+// Returns the current character the parser is sitting on, or '\0' at the end
+// of the source.
+static char peek_char(Parser *parser) {
+  return is_at_end(parser) ? '\0' : *parser->current_char;
+}
 
-// Returns the character following current character.
+// Returns the character following current character, or '\0' past the end of
+// the source.
 static char peek_next_char(Parser *parser) {
-  return *parser->current_char != '\0' ? *(parser->current_char + 1) : '\0';
+  return parser->source_end - parser->current_char > 1
+             ? *(parser->current_char + 1)
+             : '\0';
 }
 
-// Advances the parser forward one character.
+// Advances the parser forward one character, unless it is at the end of the
+// source.
 static char next_char(Parser *parser) {
-  char c = peek_char(parser);
-  parser->current_char++;
+  if (is_at_end(parser))
+    return '\0';
+
+  char c = *parser->current_char++;
   if (c == '\n')
     parser->current_line++;
   return c;
@@ -196,7 +452,12 @@ static char next_char(Parser *parser) {
 static void skip_block_comment(Parser *parser) {
   int nesting = 1;
   while (nesting > 0) {
-    if (peek_char(parser) == '\0') {
+    // Only slashes and stars can change the nesting.
+    parser->current_char =
+        scan_until(parser->current_char, parser->source_end, '/', '*', '*',
+                   &parser->current_line);
+
+    if (is_at_end(parser)) {
       lex_error(parser, "Unterminated block comment.");
       return;
     }
@@ -222,9 +483,9 @@ static void skip_block_comment(Parser *parser) {
 
 // Skips the rest of a line comment.
 static void skip_line_comment(Parser *parser) {
-  while (peek_char(parser) != '\n' && peek_char(parser) != '\0') {
-    next_char(parser);
-  }
+  const char *end = memchr(parser->current_char, '\n',
+                           parser->source_end - parser->current_char);
+  parser->current_char = end != NULL ? end : parser->source_end;
 }
 
 // If current character is [c], consumes it and returns `true`, otherwise
@@ -256,81 +517,71 @@ static inline void prepare_2char_token(Parser *parser, char next, TokenType two,
 }
 
 static void lex_ident_or_keyword(Parser *parser) {
-  ByteBuffer string;
-  ls_byte_buffer_init(&string);
-  ls_byte_buffer_write(parser->vm, &string, peek_char(parser));
-
-  while (isalnum(peek_next_char(parser))) {
-    char c = next_char(parser);
-    ls_byte_buffer_write(parser->vm, &string, c);
-  }
+  while (char_is(peek_char(parser), CHAR_ALPHA | CHAR_DIGIT))
+    parser->current_char++;
 
   TokenType ttype = TOKEN_IDENT;
 
   // Update the type if it's a keyword.
   size_t length = parser->current_char - parser->token_start;
-  for (int i = 0; keywords[i].identifier != NULL; i++) {
-    if (length == keywords[i].length &&
-        memcmp(parser->token_start, keywords[i].identifier, length) == 0) {
-      ttype = keywords[i].token_type;
-      break;
-    }
+  if (length <= MAX_KEYWORD_LENGTH) {
+    const Keyword *keyword =
+        &keywords[KEYWORD_HASH(*parser->token_start, length)];
+    if (length == keyword->length &&
+        memcmp(parser->token_start, keyword->identifier, length) == 0)
+      ttype = keyword->token_type;
   }
 
-  parser->next.value =
-      ls_new_string_length(parser->vm, (char *)string.data, string.length);
-
-  ls_byte_buffer_clear(parser->vm, &string);
   prepare_token(parser, ttype);
 }
 
 // Reads the next character, which should be a hex digit (0-9, a-f, or A-F) and
 // returns its numeric value. If the character isn't a hex digit, returns -1.
 static int8_t lex_hex_digit(Parser *parser) {
-  char c = next_char(parser);
-  if (c >= '0' && c <= '9')
-    return c - '0';
-  if (c >= 'a' && c <= 'f')
-    return c - 'a' + 10;
-  if (c >= 'A' && c <= 'F')
-    return c - 'A' + 10;
-
-  // Don't consume it if it isn't expected. Keeps us from reading past the end
-  // of an unterminated string.
-  parser->current_char--;
-  return -1;
+  char c = peek_char(parser);
+  int8_t digit;
+  if (c >= '0' && c <= '9') {
+    digit = c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    digit = c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    digit = c - 'A' + 10;
+  } else {
+    // Don't consume it if it isn't expected. Keeps us from reading past the
+    // end of an unterminated string.
+    return -1;
+  }
+
+  next_char(parser);
+  return digit;
 }
 
 // Lexes the numeric value of the current token.
-static void prepare_number_token(Parser *parser, bool isHex) {
-  errno = 0;
+static void prepare_number_token(Parser *parser) {
+  double value = 0;
 
-  if (isHex) {
-    parser->next.value =
-        ls_num2val((double)strtoll(parser->token_start, NULL, 16));
-  } else {
-    parser->next.value = ls_num2val(strtod(parser->token_start, NULL));
-  }
+  // The scanner already reported malformed literals, so they are left as 0.
+  ls_parse_number(parser->token_start,
+                  parser->current_char - parser->token_start, &value);
 
-  if (errno == ERANGE) {
+  if (value > DBL_MAX) {
     lex_error(parser, "Number literal was too large (%d).", sizeof(long int));
-    parser->next.value = ls_num2val(0);
+    value = 0;
   }
 
-  // We don't check that the entire token is consumed after calling strtoll()
-  // or strtod() because we've already scanned it ourselves and know it's valid.
+  parser->next.value = ls_num2val(value);
   prepare_token(parser, TOKEN_NUMBER);
 }
 
 static void lex_number(Parser *parser) {
-  while (isdigit(peek_char(parser)))
+  while (char_is_digit(peek_char(parser)))
     next_char(parser);
 
   // See if it has a floating point. Make sure there is a digit after the "."
   // so we don't get confused by method calls on number literals.
-  if (peek_char(parser) == '.' && isdigit(peek_next_char(parser))) {
+  if (peek_char(parser) == '.' && char_is_digit(peek_next_char(parser))) {
     next_char(parser);
-    while (isdigit(peek_char(parser)))
+    while (char_is_digit(peek_char(parser)))
       next_char(parser);
   }
 
@@ -341,15 +592,15 @@ static void lex_number(Parser *parser) {
       match_char(parser, '-');
     }
 
-    if (!isdigit(peek_char(parser))) {
+    if (!char_is_digit(peek_char(parser))) {
       lex_error(parser, "Unterminated scientific notation.");
     }
 
-    while (isdigit(peek_char(parser)))
+    while (char_is_digit(peek_char(parser)))
       next_char(parser);
   }
 
-  prepare_number_token(parser, false);
+  prepare_number_token(parser);
 }
 
 // Finishes lexing a hexadecimal number literal.
@@ -358,10 +609,12 @@ static void lex_hex_number(Parser *parser) {
   next_char(parser);
 
   // Iterate over all the valid hexadecimal digits found.
+  if (lex_hex_digit(parser) == -1)
+    lex_error(parser, "Expect hex digit after '0x'.");
   while (lex_hex_digit(parser) != -1)
     continue;
 
-  prepare_number_token(parser, true);
+  prepare_number_token(parser);
 }
 
 // Reads [digits] hex digits in a string literal and returns their number value.
@@ -369,12 +622,9 @@ static uint8_t lex_hex_escape(Parser *parser, size_t digits,
                               const char *description) {
   int value = 0;
   for (size_t i = 0; i < digits; i++) {
-    if (peek_char(parser) == '"' || peek_char(parser) == '\0') {
+    // Leave the end of the string to the caller.
+    if (peek_char(parser) == '"' || is_at_end(parser)) {
       lex_error(parser, "Incomplete %s escape sequence.", description);
-
-      // Don't consume it if it isn't expected. Keeps us from reading past the
-      // end of an unterminated string.
-      parser->current_char--;
       break;
     }
 
@@ -395,100 +645,114 @@ static void lex_unicode_escape(Parser *parser, ByteBuffer *string,
                                size_t length) {
   int value = lex_hex_escape(parser, length, "Unicode");
 
-  // Grow the buffer enough for the encoded result.
+  // Encode the result on the stack and append it in one go.
   size_t bytes_len = ls_utf8_encode_bytes_len(value);
   if (bytes_len != 0) {
-    ls_byte_buffer_fill(parser->vm, string, 0, bytes_len);
-    ls_utf8_encode(value, string->data + string->length - bytes_len);
+    uint8_t bytes[4];
+    ls_utf8_encode(value, bytes);
+    ls_byte_buffer_append_n(parser->vm, string, bytes, bytes_len);
   }
 }
 
 static void lex_string(Parser *parser) {
-  ByteBuffer string;
-  TokenType type = TOKEN_STRING;
-  ls_byte_buffer_init(&string);
+  ByteBuffer *string = &parser->string;
+  string->length = 0;
 
   for (;;) {
+    // Skip runs of plain characters at once instead of byte by byte.
+    const char *run = parser->current_char;
+    parser->current_char =
+        scan_until(run, parser->source_end, '"', '\\', '\r',
+                   &parser->current_line);
+
+    // Most literals have no escape sequences, so their contents can be read
+    // straight from the source when the compiler needs them.
+    if (peek_char(parser) == '"' && run == parser->token_start + 1) {
+      parser->current_char++;
+      parser->next.value = LS_UNDEFINED;
+      prepare_token(parser, TOKEN_STRING);
+      return;
+    }
+
+    ls_byte_buffer_append_n(parser->vm, string, (const uint8_t *)run,
+                            parser->current_char - run);
+
+    if (is_at_end(parser)) {
+      lex_error(parser, "Unterminated string.");
+      break;
+    }
+
     char c = next_char(parser);
     if (c == '"')
       break;
     if (c == '\r')
       continue;
 
-    if (c == '\0') {
-      lex_error(parser, "Unterminated string.");
-
-      // Don't consume it if it isn't expected. Keeps us from reading past the
-      // end of an unterminated string.
-      parser->current_char--;
-      break;
-    }
-
     if (c == '\\') {
-      switch (next_char(parser)) {
+      // The string is unterminated.
+      if (is_at_end(parser))
+        continue;
+
+      char escape = next_char(parser);
+      switch (escape) {
       case '"':
-        ls_byte_buffer_write(parser->vm, &string, '"');
+        ls_byte_buffer_write(parser->vm, string, '"');
         break;
       case '\\':
-        ls_byte_buffer_write(parser->vm, &string, '\\');
+        ls_byte_buffer_write(parser->vm, string, '\\');
         break;
       case '%':
-        ls_byte_buffer_write(parser->vm, &string, '%');
+        ls_byte_buffer_write(parser->vm, string, '%');
         break;
       case '0':
-        ls_byte_buffer_write(parser->vm, &string, '\0');
+        ls_byte_buffer_write(parser->vm, string, '\0');
         break;
       case 'a':
-        ls_byte_buffer_write(parser->vm, &string, '\a');
+        ls_byte_buffer_write(parser->vm, string, '\a');
         break;
       case 'b':
-        ls_byte_buffer_write(parser->vm, &string, '\b');
+        ls_byte_buffer_write(parser->vm, string, '\b');
         break;
       case 'e':
-        ls_byte_buffer_write(parser->vm, &string, '\33');
+        ls_byte_buffer_write(parser->vm, string, '\33');
         break;
       case 'f':
-        ls_byte_buffer_write(parser->vm, &string, '\f');
+        ls_byte_buffer_write(parser->vm, string, '\f');
         break;
       case 'n':
-        ls_byte_buffer_write(parser->vm, &string, '\n');
+        ls_byte_buffer_write(parser->vm, string, '\n');
         break;
       case 'r':
-        ls_byte_buffer_write(parser->vm, &string, '\r');
+        ls_byte_buffer_write(parser->vm, string, '\r');
         break;
       case 't':
-        ls_byte_buffer_write(parser->vm, &string, '\t');
+        ls_byte_buffer_write(parser->vm, string, '\t');
         break;
       case 'u':
-        lex_unicode_escape(parser, &string, 4);
+        lex_unicode_escape(parser, string, 4);
         break;
       case 'U':
-        lex_unicode_escape(parser, &string, 8);
+        lex_unicode_escape(parser, string, 8);
         break;
       case 'v':
-        ls_byte_buffer_write(parser->vm, &string, '\v');
+        ls_byte_buffer_write(parser->vm, string, '\v');
         break;
       case 'x':
-        ls_byte_buffer_write(parser->vm, &string,
+        ls_byte_buffer_write(parser->vm, string,
                              (uint8_t)lex_hex_escape(parser, 2, "byte"));
         break;
 
       default:
-        lex_error(parser, "Invalid escape character '%c'.",
-                  *(parser->current_char - 1));
+        lex_error(parser, "Invalid escape character '%c'.", escape);
         break;
       }
-    } else {
-      ls_byte_buffer_write(parser->vm, &string, c);
     }
   }
 
   parser->next.value =
-      ls_new_string_length(parser->vm, (char *)string.data, string.length);
-
-  ls_byte_buffer_clear(parser->vm, &string);
+      ls_intern_string(parser->vm, (char *)string->data, string->length);
 
-  prepare_token(parser, type);
+  prepare_token(parser, TOKEN_STRING);
 }
 
 // Lex the next token and store it in [parser.next].
@@ -504,7 +768,7 @@ static void next_token(Parser *parser) {
   if (parser->current.type == TOKEN_EOF)
     return;
 
-  while (peek_char(parser) != '\0') {
+  while (!is_at_end(parser)) {
     parser->token_start = parser->current_char;
 
     char c = next_char(parser);
@@ -628,10 +892,8 @@ static void next_token(Parser *parser) {
     case '\r':
     case '\t':
       // Skip forward until we run out of whitespace.
-      while (peek_char(parser) == ' ' || peek_char(parser) == '\r' ||
-             peek_char(parser) == '\t') {
-        next_char(parser);
-      }
+      parser->current_char =
+          scan_spaces(parser->current_char, parser->source_end);
       break;
 
     case '"': {
@@ -645,13 +907,13 @@ static void next_token(Parser *parser) {
         return;
       }
 
-      prepare_number_token(parser, false);
+      lex_number(parser);
       return;
 
     default:
-      if (isalpha(c)) {
+      if (char_is(c, CHAR_ALPHA)) {
         lex_ident_or_keyword(parser);
-      } else if (isdigit(c)) {
+      } else if (char_is_digit(c)) {
         lex_number(parser);
       } else {
         if (c >= 32 && c <= 126) {
@@ -675,6 +937,60 @@ static void next_token(Parser *parser) {
   prepare_token(parser, TOKEN_EOF);
 }
 
+// Returns the interned string of the identifier, keyword or string literal
+// [token]. Tokens only reference the source, so this is where their strings
+// are first allocated.
+static LsValue token_string(Parser *parser, const Token *token) {
+  if (token->type != TOKEN_STRING)
+    return ls_intern_string(parser->vm, token->start, token->length);
+
+  // Literals with escape sequences were decoded by the lexer.
+  if (token->value != LS_UNDEFINED)
+    return token->value;
+
+  // Strip the surrounding quotes.
+  return ls_intern_string(parser->vm, token->start + 1, token->length - 2);
+}
+
+// Initializes [parser] to parse the [length] bytes of [source], the source code
+// of [module], from [offset] which is on [line].
+static void init_parser(Parser *parser, LsVM *vm, LsObjModule *module,
+                        const char *source, size_t length, size_t offset,
+                        int line) {
+  parser->vm = vm;
+  parser->source = source;
+  parser->source_end = source + length;
+  parser->source_copy = NULL;
+  parser->current_char = source + offset;
+  parser->token_start = source + offset;
+  parser->current_line = line;
+  parser->has_error = false;
+  parser->print_errors = true;
+  ls_byte_buffer_init(&parser->string);
+  parser->module = module;
+  ls_module_variable_buffer_init(&parser->module_variables);
+  ModuleVariable unknown = {false, LS_UNDEFINED};
+  ls_module_variable_buffer_fill(vm, &parser->module_variables, unknown,
+                                 module->variables.length);
+
+  // Zero-init the current token. This will get copied to previous when
+  // next_token() is called below.
+  parser->next.type = TOKEN_ERROR;
+  parser->next.start = source + offset;
+  parser->next.length = 0;
+  parser->next.line = 0;
+  parser->next.value = LS_UNDEFINED;
+
+  // Read the first two tokens.
+  next_token(parser);
+  next_token(parser);
+}
+
+static void free_parser(Parser *parser) {
+  ls_byte_buffer_clear(parser->vm, &parser->string);
+  ls_module_variable_buffer_clear(parser->vm, &parser->module_variables);
+}
+
 typedef struct {
   // The name of the local variable. This points directly into the original
   // source code string.
@@ -688,8 +1004,24 @@ typedef struct {
   // top level code. One is the scope within that, etc.
   int depth;
 
-  // If this local variable is being used as an upvalue.
-  bool is_upvalue;
+  // The number of functions capturing this local variable as an upvalue.
+  int captures;
+
+  // If the value of this local variable is used other than by calling it. A
+  // function stored in a local that doesn't escape is only ever called by
+  // the function that declares the local, while the local is in scope.
+  bool escapes;
+
+  // The offset of the CODE_CLOSURE instruction that initialized this local
+  // variable, or -1 if it wasn't initialized by one.
+  int closure;
+
+  // If this local variable was declared with `const`.
+  bool is_const;
+
+  // The value of a `const` variable whose initializer is a constant, which
+  // is loaded in place of the variable. Otherwise LS_UNDEFINED.
+  LsValue constant;
 } Local;
 
 typedef struct {
@@ -698,9 +1030,44 @@ typedef struct {
   bool is_local;
 
   // The index of the local or upvalue being captured in the enclosing function.
-  size_t index;
+  int index;
+
+  // The name of the variable being captured. This points directly into the
+  // original source code string.
+  const char *name;
+  int length;
 } CompilerUpvalue;
 
+// Bookkeeping information for the current loop being compiled.
+typedef struct loop {
+  // Index of the instruction that the loop should jump back to.
+  size_t start;
+
+  // Index of the argument for the CODE_JUMP_IF instruction used to exit the
+  // loop, or -1 if the loop only exits with a break. Stored so we can patch
+  // it once we know where the loop ends.
+  int exit_jump;
+
+  // Index of the first instruction of the body of the loop.
+  size_t body;
+
+  // Depth of the scope(s) that need to be exited if a break is hit inside the
+  // loop.
+  int scope_depth;
+
+  // The loop enclosing this one, or NULL if this is the outermost loop.
+  struct loop *enclosing;
+} Loop;
+
+// A position in the code of the function being compiled. Code emitted after
+// it can be discarded, which is how constant folding replaces the code of
+// operands by their result and how dead branches are dropped.
+typedef struct {
+  size_t code;
+  size_t constants;
+  int num_slots;
+} CodeMark;
+
 struct ls_compiler {
   Parser *parser;
 
@@ -715,10 +1082,71 @@ struct ls_compiler {
   size_t locals_count;
 
   // The upvalues that this function has captured from outer scopes. The count
-  // of them is stored in [numUpvalues].
+  // of them is stored in the [num_upvalues] of [fn].
   CompilerUpvalue upvalues[MAX_UPVALUES];
+
+  // The current level of block scope nesting, where zero is no nesting. A -1
+  // here means top-level code is being compiled and there is no block scope
+  // in effect at all. Any variables declared will be module-level.
+  int scope_depth;
+
+  // The current number of slots (locals and temporaries) in use.
+  //
+  // We use this and max_slots to track the maximum number of additional slots
+  // a function may need while executing. When the function is called, the
+  // stack will be grown to this size.
+  int num_slots;
+
+  // The current innermost loop being compiled, or NULL if not in a loop.
+  Loop *loop;
+
+  // The function being compiled.
+  LsObjFn *fn;
+
+  // Maps the constants of [fn] to their index, so each is stored once.
+  LsObjMap constants;
+
+  // Where the left operand of the infix operator being compiled begins.
+  CodeMark operand;
+
+  // If the function is only checked for errors, to be compiled lazily: no
+  // code is emitted.
+  bool preparse;
+
+  // If a function nested in this one captured one of its upvalues.
+  bool upvalues_captured;
 };
 
+// Describes where a parse error happened and reports it.
+static void error(LsCompiler *compiler, const char *format, ...) {
+  Token *token = &compiler->parser->previous;
+
+  // If the parse error was caused by an error token, the lexer has already
+  // reported it.
+  if (token->type == TOKEN_ERROR)
+    return;
+
+  va_list args;
+  va_start(args, format);
+  if (token->type == TOKEN_LINE) {
+    print_error(compiler->parser, (int)token->line, "Error at newline", format,
+                args);
+  } else if (token->type == TOKEN_EOF) {
+    print_error(compiler->parser, (int)token->line, "Error at end of file",
+                format, args);
+  } else {
+    // Make sure we don't exceed the buffer with a very long token.
+    char label[10 + MAX_VARIABLE_NAME + 4 + 1];
+    if (token->length <= MAX_VARIABLE_NAME) {
+      sprintf(label, "Error at '%.*s'", (int)token->length, token->start);
+    } else {
+      sprintf(label, "Error at '%.*s...'", MAX_VARIABLE_NAME, token->start);
+    }
+    print_error(compiler->parser, (int)token->line, label, format, args);
+  }
+  va_end(args);
+}
+
 // Returns the type of the current token.
 static TokenType peek_token(LsCompiler *compiler) {
   return compiler->parser->current.type;
@@ -739,6 +1167,1979 @@ static bool match_token(LsCompiler *compiler, TokenType expected) {
   return true;
 }
 
-LsObj *ls_compile(LsVM *vm, const char *source) {
-  // Foo.
+// Consumes the current token. Emits an error if its type is not [expected].
+static void consume(LsCompiler *compiler, TokenType expected,
+                    const char *message) {
+  next_token(compiler->parser);
+  if (compiler->parser->previous.type != expected) {
+    error(compiler, "%s", message);
+
+    // If the next token is the one we want, assume the current one is just a
+    // spurious error and discard it to minimize the number of cascaded errors.
+    if (compiler->parser->current.type == expected)
+      next_token(compiler->parser);
+  }
+}
+
+// Matches one or more newlines. Returns true if at least one was found.
+static bool match_line(LsCompiler *compiler) {
+  if (!match_token(compiler, TOKEN_LINE))
+    return false;
+
+  while (match_token(compiler, TOKEN_LINE))
+    continue;
+  return true;
+}
+
+// Discards any newlines starting at the current token.
+static void ignore_newlines(LsCompiler *compiler) { match_line(compiler); }
+
+// Consumes the current token. Emits an error if it is not a newline. Then
+// discards any duplicate newlines following it.
+static void consume_line(LsCompiler *compiler, const char *message) {
+  consume(compiler, TOKEN_LINE, message);
+  ignore_newlines(compiler);
+}
+
+// The stack effect of each instruction, see ls_opcodes.h.
+static const int stack_effects[] = {
+#define OPCODE(_, effect) effect,
+#include "ls_opcodes.h"
+};
+
+// Emits one byte of bytecode. Returns its index.
+static size_t emit_byte(LsCompiler *compiler, int byte) {
+  if (compiler->preparse)
+    return 0;
+
+  LsVM *vm = compiler->parser->vm;
+  ls_byte_buffer_write(vm, &compiler->fn->code, (uint8_t)byte);
+
+  // Assume the instruction is associated with the most recently consumed
+  // token.
+  ls_int_buffer_write(vm, &compiler->fn->lines,
+                      (int32_t)compiler->parser->previous.line);
+
+  return compiler->fn->code.length - 1;
+}
+
+// Emits one bytecode instruction.
+static void emit_op(LsCompiler *compiler, LsCode instruction) {
+  emit_byte(compiler, instruction);
+
+  // Keep track of the stack's high water mark.
+  compiler->num_slots += stack_effects[instruction];
+  if (compiler->num_slots > compiler->fn->max_slots) {
+    compiler->fn->max_slots = compiler->num_slots;
+    if (compiler->num_slots == MAX_SLOTS + 1)
+      error(compiler, "Expression uses more than %d stack slots.", MAX_SLOTS);
+  }
+}
+
+// Emits one 16-bit argument, which will be written big endian.
+static void emit_short(LsCompiler *compiler, int arg) {
+  emit_byte(compiler, (arg >> 8) & 0xff);
+  emit_byte(compiler, arg & 0xff);
+}
+
+// Emits one bytecode instruction followed by a 8-bit argument.
+static void emit_byte_arg(LsCompiler *compiler, LsCode instruction, int arg) {
+  emit_op(compiler, instruction);
+  emit_byte(compiler, arg);
+}
+
+// Emits one bytecode instruction followed by a 16-bit argument, which will be
+// written big endian.
+static void emit_short_arg(LsCompiler *compiler, LsCode instruction, int arg) {
+  emit_op(compiler, instruction);
+  emit_short(compiler, arg);
+}
+
+// Emits [instruction] followed by a placeholder for a jump offset. The
+// placeholder can be patched by calling patch_jump(). Returns the index of
+// the placeholder.
+static size_t emit_jump(LsCompiler *compiler, LsCode instruction) {
+  emit_op(compiler, instruction);
+  emit_byte(compiler, 0xff);
+  return emit_byte(compiler, 0xff) - 1;
+}
+
+// Replaces the placeholder argument for a previous CODE_JUMP or CODE_JUMP_IF
+// instruction with an offset that jumps to the current end of bytecode.
+static void patch_jump(LsCompiler *compiler, size_t offset) {
+  if (compiler->preparse)
+    return;
+
+  // -2 to adjust for the bytecode for the jump offset itself.
+  size_t jump = compiler->fn->code.length - offset - 2;
+  if (jump >= MAX_JUMP)
+    error(compiler, "Too much code to jump over.");
+
+  compiler->fn->code.data[offset] = (jump >> 8) & 0xff;
+  compiler->fn->code.data[offset + 1] = jump & 0xff;
+}
+
+// Adds [constant] to the constant pool and returns its index.
+static int add_constant(LsCompiler *compiler, LsValue constant) {
+  if (compiler->parser->has_error || compiler->preparse)
+    return -1;
+
+  LsVM *vm = compiler->parser->vm;
+  LsValue index = ls_map_get(&compiler->constants, constant);
+  if (index != LS_UNDEFINED)
+    return (int)ls_val2num(index);
+
+  LsObjFn *fn = compiler->fn;
+  if (fn->constants.length == MAX_CONSTANTS) {
+    error(compiler, "A function may only contain %d unique constants.",
+          MAX_CONSTANTS);
+    return -1;
+  }
+
+  ls_value_buffer_write(vm, &fn->constants, constant);
+  ls_map_set(vm, &compiler->constants, constant,
+             ls_num2val((double)(fn->constants.length - 1)));
+  return (int)fn->constants.length - 1;
+}
+
+// Emits the instruction that loads [value], which must be null, a bool, a
+// number or a string.
+static void emit_constant(LsCompiler *compiler, LsValue value) {
+  if (value == LS_NULL) {
+    emit_op(compiler, CODE_NULL);
+  } else if (value == LS_FALSE) {
+    emit_op(compiler, CODE_FALSE);
+  } else if (value == LS_TRUE) {
+    emit_op(compiler, CODE_TRUE);
+  } else {
+    emit_short_arg(compiler, CODE_CONSTANT, add_constant(compiler, value));
+  }
+}
+
+// Returns the current position in the code of the function being compiled.
+static CodeMark code_mark(LsCompiler *compiler) {
+  CodeMark mark;
+  mark.code = compiler->fn->code.length;
+  mark.constants = compiler->fn->constants.length;
+  mark.num_slots = compiler->num_slots;
+  return mark;
+}
+
+// Discards the code emitted since [mark], along with the constants that only
+// it used.
+static void discard_code(LsCompiler *compiler, CodeMark mark) {
+  LsObjFn *fn = compiler->fn;
+  fn->code.length = mark.code;
+  fn->lines.length = mark.code;
+
+  // Constants are stored once, so those added since [mark] aren't used by
+  // the code before it.
+  while (fn->constants.length > mark.constants) {
+    LsValue constant = fn->constants.data[--fn->constants.length];
+    ls_map_remove(compiler->parser->vm, &compiler->constants, constant);
+  }
+
+  compiler->num_slots = mark.num_slots;
+}
+
+// If the instruction at [offset] in the code loads a constant, stores the
+// constant in [value] and returns the size of the instruction. Otherwise,
+// returns 0.
+static size_t constant_at(LsCompiler *compiler, size_t offset, LsValue *value) {
+  // After an error, the constant indexes can't be trusted.
+  if (compiler->parser->has_error || offset >= compiler->fn->code.length)
+    return 0;
+
+  const uint8_t *code = compiler->fn->code.data + offset;
+  switch ((LsCode)code[0]) {
+  case CODE_NULL:
+    *value = LS_NULL;
+    return 1;
+  case CODE_FALSE:
+    *value = LS_FALSE;
+    return 1;
+  case CODE_TRUE:
+    *value = LS_TRUE;
+    return 1;
+  case CODE_CONSTANT:
+    *value = compiler->fn->constants.data[(code[1] << 8) | code[2]];
+    return 3;
+  default:
+    return 0;
+  }
+}
+
+// If all the code emitted since [mark] loads a single constant, stores it in
+// [value] and returns true.
+static bool constant_since(LsCompiler *compiler, CodeMark mark,
+                           LsValue *value) {
+  size_t size = constant_at(compiler, mark.code, value);
+  return size != 0 && mark.code + size == compiler->fn->code.length;
+}
+
+// Returns the number of bytes of arguments of the instruction at [ip].
+static int argument_bytes(const uint8_t *ip) {
+  switch ((LsCode)*ip) {
+  case CODE_LOAD_LOCAL:
+  case CODE_STORE_LOCAL:
+  case CODE_LOAD_UPVALUE:
+  case CODE_STORE_UPVALUE:
+  case CODE_LOAD_PARENT_LOCAL:
+  case CODE_STORE_PARENT_LOCAL:
+    return 1;
+
+  case CODE_CONSTANT:
+  case CODE_CLOSURE:
+  case CODE_LOAD_MODULE_VAR:
+  case CODE_STORE_MODULE_VAR:
+  case CODE_JUMP:
+  case CODE_LOOP:
+  case CODE_JUMP_IF:
+  case CODE_AND:
+  case CODE_OR:
+  // CODE_END only appears in the middle of code as a break placeholder,
+  // which has the argument of a jump.
+  case CODE_END:
+    return 2;
+
+  default:
+    return 0;
+  }
+}
+
+// Returns the instruction of the unary or binary operator [token].
+static LsCode operator_instruction(TokenType token, bool unary) {
+  switch (token) {
+  case TOKEN_MINUS:
+    return unary ? CODE_NEGATE : CODE_SUB;
+  case TOKEN_BANG:
+    return CODE_NOT;
+  case TOKEN_TILDE:
+    return CODE_BNOT;
+  case TOKEN_PLUS:
+    return CODE_ADD;
+  case TOKEN_STAR:
+    return CODE_MUL;
+  case TOKEN_SLASH:
+    return CODE_DIV;
+  case TOKEN_PERCENT:
+    return CODE_MOD;
+  case TOKEN_CARET:
+    return CODE_POW;
+  case TOKEN_AMP:
+    return CODE_BAND;
+  case TOKEN_PIPE:
+    return CODE_BOR;
+  case TOKEN_LTLT:
+    return CODE_SHL;
+  case TOKEN_GTGT:
+    return CODE_SHR;
+  case TOKEN_EQEQ:
+    return CODE_EQ;
+  case TOKEN_BANGEQ:
+    return CODE_NEQ;
+  case TOKEN_LT:
+    return CODE_LT;
+  case TOKEN_LTEQ:
+    return CODE_LE;
+  case TOKEN_GT:
+    return CODE_GT;
+  case TOKEN_GTEQ:
+    return CODE_GE;
+  default:
+    UNREACHABLE();
+    return CODE_END;
+  }
+}
+
+// Computes the unary operator [instruction] on the constant [operand]. Only
+// primitive values are folded, so that metatables keep their say on every
+// other value. Returns false if it can't be folded, and the instruction runs
+// (and maybe fails) at runtime.
+static bool fold_unary(LsCode instruction, LsValue operand, LsValue *result) {
+  if (instruction == CODE_NOT) {
+    *result = ls_is_falsy(operand) ? LS_TRUE : LS_FALSE;
+    return true;
+  }
+
+  if (!ls_is_num(operand))
+    return false;
+
+  double a = ls_val2num(operand);
+  *result = ls_num2val(instruction == CODE_NEGATE ? -a : ls_num_bnot(a));
+  return true;
+}
+
+// Computes the binary operator [instruction] on the constants [left] and
+// [right], like fold_unary().
+static bool fold_binary(LsCompiler *compiler, LsCode instruction, LsValue left,
+                        LsValue right, LsValue *result) {
+  // Numbers compare by value, like at runtime.
+  bool equal = ls_is_num(left) && ls_is_num(right)
+                   ? ls_val2num(left) == ls_val2num(right)
+                   : ls_val_eq(left, right);
+  switch (instruction) {
+  case CODE_EQ:
+    *result = equal ? LS_TRUE : LS_FALSE;
+    return true;
+  case CODE_NEQ:
+    *result = equal ? LS_FALSE : LS_TRUE;
+    return true;
+  default:
+    break;
+  }
+
+  if (instruction == CODE_ADD && ls_is_str(left) && ls_is_str(right)) {
+    LsVM *vm = compiler->parser->vm;
+    LsObjString *a = (LsObjString *)ls_val2obj(left);
+    LsObjString *b = (LsObjString *)ls_val2obj(right);
+
+    // Build the result in the scratch buffer of the lexer, which is free
+    // once a literal is lexed, and intern it like the literals.
+    ByteBuffer *string = &compiler->parser->string;
+    string->length = 0;
+    ls_byte_buffer_append_n(vm, string, (uint8_t *)a->value, a->length);
+    ls_byte_buffer_append_n(vm, string, (uint8_t *)b->value, b->length);
+    *result = ls_intern_string(vm, (char *)string->data, string->length);
+    return true;
+  }
+
+  if (!ls_is_num(left) || !ls_is_num(right))
+    return false;
+
+  double a = ls_val2num(left);
+  double b = ls_val2num(right);
+  switch (instruction) {
+  case CODE_ADD:
+    *result = ls_num2val(a + b);
+    break;
+  case CODE_SUB:
+    *result = ls_num2val(a - b);
+    break;
+  case CODE_MUL:
+    *result = ls_num2val(a * b);
+    break;
+  case CODE_DIV:
+    *result = ls_num2val(a / b);
+    break;
+  case CODE_MOD:
+    *result = ls_num2val(ls_num_mod(a, b));
+    break;
+  case CODE_POW:
+    *result = ls_num2val(ls_num_pow(a, b));
+    break;
+  case CODE_BAND:
+    *result = ls_num2val(ls_num_band(a, b));
+    break;
+  case CODE_BOR:
+    *result = ls_num2val(ls_num_bor(a, b));
+    break;
+  case CODE_SHL:
+    *result = ls_num2val(ls_num_shl(a, b));
+    break;
+  case CODE_SHR:
+    *result = ls_num2val(ls_num_shr(a, b));
+    break;
+  case CODE_LT:
+    *result = a < b ? LS_TRUE : LS_FALSE;
+    break;
+  case CODE_LE:
+    *result = a <= b ? LS_TRUE : LS_FALSE;
+    break;
+  case CODE_GT:
+    *result = a > b ? LS_TRUE : LS_FALSE;
+    break;
+  case CODE_GE:
+    *result = a >= b ? LS_TRUE : LS_FALSE;
+    break;
+  default:
+    return false;
+  }
+
+  return true;
+}
+
+// Create a new local variable with [name]. Assumes the current scope is local
+// and the name is unique.
+static int add_local(LsCompiler *compiler, const char *name, int length,
+                     bool is_const, LsValue constant) {
+  Local *local = &compiler->locals[compiler->locals_count];
+  local->name = name;
+  local->length = length;
+  local->depth = compiler->scope_depth;
+  local->captures = 0;
+  local->escapes = false;
+  local->closure = -1;
+  local->is_const = is_const;
+  local->constant = constant;
+  return (int)compiler->locals_count++;
+}
+
+// Declares a variable in the current scope whose name is [token]. If
+// [is_const], it can't be assigned and if [constant] isn't LS_UNDEFINED, it
+// is always that value.
+//
+// If it's a top-level module variable, returns its symbol, otherwise the
+// slot of the local.
+static int declare_variable(LsCompiler *compiler, const Token *token,
+                            bool is_const, LsValue constant) {
+  Parser *parser = compiler->parser;
+  if (token->length > MAX_VARIABLE_NAME) {
+    error(compiler, "Variable name cannot be longer than %d characters.",
+          MAX_VARIABLE_NAME);
+  }
+
+  // Top-level module scope.
+  if (compiler->scope_depth == -1) {
+    LsObjModule *module = parser->module;
+    LsValue name = token_string(parser, token);
+    if (ls_map_get(module->variable_names, name) != LS_UNDEFINED) {
+      error(compiler, "Module variable is already defined.");
+      return -1;
+    }
+
+    if (module->variables.length == MAX_MODULE_VARS) {
+      error(compiler, "Too many module variables defined.");
+      return -1;
+    }
+
+    ModuleVariable variable = {is_const, constant};
+    ls_module_variable_buffer_write(parser->vm, &parser->module_variables,
+                                    variable);
+    ls_value_buffer_write(parser->vm, &module->variables, LS_NULL);
+    ls_map_set(parser->vm, module->variable_names, name,
+               ls_num2val((double)(module->variables.length - 1)));
+    return (int)module->variables.length - 1;
+  }
+
+  // See if there is already a variable with this name declared in the current
+  // scope. (Outer scopes are OK: those get shadowed.)
+  for (int i = (int)compiler->locals_count - 1; i >= 0; i--) {
+    Local *local = &compiler->locals[i];
+
+    // Once we escape this scope and hit an outer one, we can stop.
+    if (local->depth < compiler->scope_depth)
+      break;
+
+    if (local->length == token->length &&
+        memcmp(local->name, token->start, token->length) == 0) {
+      error(compiler, "Variable is already declared in this scope.");
+      return i;
+    }
+  }
+
+  if (compiler->locals_count == MAX_LOCALS) {
+    error(compiler, "Cannot declare more than %d variables in one scope.",
+          MAX_LOCALS);
+    return -1;
+  }
+
+  return add_local(compiler, token->start, (int)token->length, is_const,
+                   constant);
+}
+
+// Stores a variable with the previously defined symbol in the current scope.
+static void define_variable(LsCompiler *compiler, int symbol) {
+  // Store the variable. If it's a local, the result of the initializer is
+  // in the correct slot on the stack already so we're done.
+  if (compiler->scope_depth >= 0)
+    return;
+
+  // It's a module-level variable, so store the value in the module slot and
+  // then discard the temporary for the initializer.
+  emit_short_arg(compiler, CODE_STORE_MODULE_VAR, symbol);
+  emit_op(compiler, CODE_POP);
+}
+
+// Starts a new local block scope.
+static void push_scope(LsCompiler *compiler) { compiler->scope_depth++; }
+
+// Generates code to discard local variables at [depth] or greater. Does *not*
+// actually undeclare variables or pop any scopes, though. This is called
+// directly when compiling "break" statements to ditch the local variables
+// before jumping out of the loop even though they are still in scope *past*
+// the break instruction.
+//
+// Returns the number of local variables that were eliminated.
+static int discard_locals(LsCompiler *compiler, int depth) {
+  int local = (int)compiler->locals_count - 1;
+  while (local >= 0 && compiler->locals[local].depth >= depth) {
+    // Use emit_byte() and not emit_op() here because we don't want to track
+    // that stack effect of these pops since the variables are still in scope
+    // after the break.
+    if (compiler->locals[local].captures > 0) {
+      emit_byte(compiler, CODE_CLOSE_UPVALUE);
+    } else {
+      emit_byte(compiler, CODE_POP);
+    }
+    local--;
+  }
+
+  return (int)compiler->locals_count - local - 1;
+}
+
+// Returns true if [fn], whose closure is only called by the enclosing
+// function, can run bare instead: when all the variables it captures are
+// locals of the enclosing function, and none of the functions it defines
+// captures its own upvalues, which only a closure has.
+static bool can_run_bare(LsObjFn *fn) {
+  for (int i = 0; i < fn->num_upvalues; i++) {
+    if (!fn->upvalues.data[i * 2])
+      return false;
+  }
+
+  // The functions a lazy function defines aren't compiled yet, but checking
+  // it told whether they capture its upvalues.
+  if (fn->lazy != NULL)
+    return !fn->lazy->upvalues_captured;
+
+  for (size_t i = 0; i < fn->constants.length; i++) {
+    LsValue constant = fn->constants.data[i];
+    if (!ls_is_obj(constant) || ls_val2obj(constant)->type != LS_OBJ_FN)
+      continue;
+
+    LsObjFn *child = (LsObjFn *)ls_val2obj(constant);
+    for (int j = 0; j < child->num_upvalues; j++) {
+      if (!child->upvalues.data[j * 2])
+        return false;
+    }
+  }
+
+  return true;
+}
+
+// Rewrites the code of [fn] to run bare: its upvalues are the locals of its
+// caller.
+static void run_bare(LsVM *vm, LsObjFn *fn) {
+  const uint8_t *upvalues = fn->upvalues.data;
+  uint8_t *ip = fn->code.data;
+  uint8_t *end = ip + fn->code.length;
+  while (ip < end) {
+    if (*ip == CODE_LOAD_UPVALUE) {
+      ip[0] = CODE_LOAD_PARENT_LOCAL;
+      ip[1] = upvalues[ip[1] * 2 + 1];
+    } else if (*ip == CODE_STORE_UPVALUE) {
+      ip[0] = CODE_STORE_PARENT_LOCAL;
+      ip[1] = upvalues[ip[1] * 2 + 1];
+    }
+
+    ip += 1 + argument_bytes(ip);
+  }
+
+  fn->num_upvalues = 0;
+  ls_byte_buffer_clear(vm, &fn->upvalues);
+}
+
+// Called when [local] goes out of scope. If it was initialized by a closure
+// and never escaped, the function of the closure only ever runs while the
+// current function is its caller. Then it runs bare: the closure isn't
+// created and the function reads the variables it captures directly from
+// the stack frame of its caller, so they don't need to be closed either.
+static void resolve_closure(LsCompiler *compiler, Local *local) {
+  if (local->closure == -1 || local->escapes)
+    return;
+
+  uint8_t *code = compiler->fn->code.data + local->closure;
+  LsValue value = compiler->fn->constants.data[(code[1] << 8) | code[2]];
+  LsObjFn *fn = (LsObjFn *)ls_val2obj(value);
+  if (!can_run_bare(fn))
+    return;
+
+  // Push the function itself instead of a closure.
+  code[0] = CODE_CONSTANT;
+  local->closure = -1;
+
+  for (int i = 0; i < fn->num_upvalues; i++)
+    compiler->locals[fn->upvalues.data[i * 2 + 1]].captures--;
+
+  // A lazy function is rewritten once compiled.
+  if (fn->lazy != NULL) {
+    fn->lazy->bare = true;
+  } else {
+    run_bare(compiler->parser->vm, fn);
+  }
+}
+
+// Resolves the closures of the local variables at [depth] or greater, which
+// are going out of scope.
+static void resolve_closures(LsCompiler *compiler, int depth) {
+  for (int i = (int)compiler->locals_count - 1;
+       i >= 0 && compiler->locals[i].depth >= depth; i--)
+    resolve_closure(compiler, &compiler->locals[i]);
+}
+
+// Closes the last pushed block scope and discards any local variables declared
+// in that scope. This should only be called in a statement context where no
+// temporaries are still on the stack.
+static void pop_scope(LsCompiler *compiler) {
+  resolve_closures(compiler, compiler->scope_depth);
+
+  int popped = discard_locals(compiler, compiler->scope_depth);
+  compiler->locals_count -= popped;
+  compiler->num_slots -= popped;
+  compiler->scope_depth--;
+}
+
+// Attempts to look up the name in the local variables of [compiler]. If found,
+// returns its index, otherwise returns -1.
+static int resolve_local(LsCompiler *compiler, const char *name, int length) {
+  // Look it up in the local scopes. Look in reverse order so that the most
+  // nested variable is found first and shadows outer ones.
+  for (int i = (int)compiler->locals_count - 1; i >= 0; i--) {
+    if (compiler->locals[i].length == length &&
+        memcmp(name, compiler->locals[i].name, length) == 0)
+      return i;
+  }
+
+  return -1;
+}
+
+// Emits the instruction that loads the local in [slot].
+static void load_local(LsCompiler *compiler, int slot) {
+  if (slot <= 8) {
+    emit_op(compiler, (LsCode)(CODE_LOAD_LOCAL_0 + slot));
+    return;
+  }
+
+  emit_byte_arg(compiler, CODE_LOAD_LOCAL, slot);
+}
+
+// Adds an upvalue to [compiler]'s function with the given properties. Does not
+// add one if an upvalue for that variable is already in the list. Returns the
+// index of the upvalue.
+static int add_upvalue(LsCompiler *compiler, bool is_local, int index,
+                       const char *name, int length) {
+  // Look for an existing one.
+  for (int i = 0; i < compiler->fn->num_upvalues; i++) {
+    CompilerUpvalue *upvalue = &compiler->upvalues[i];
+    if (upvalue->index == index && upvalue->is_local == is_local)
+      return i;
+  }
+
+  if (compiler->fn->num_upvalues == MAX_UPVALUES) {
+    error(compiler, "A function may only capture %d variables.", MAX_UPVALUES);
+    return -1;
+  }
+
+  // If we got here, it's a new upvalue.
+  CompilerUpvalue *upvalue = &compiler->upvalues[compiler->fn->num_upvalues];
+  upvalue->is_local = is_local;
+  upvalue->index = index;
+  upvalue->name = name;
+  upvalue->length = length;
+  return compiler->fn->num_upvalues++;
+}
+
+// Attempts to look up [name] in the functions enclosing the one being compiled
+// by [compiler]. If found, it adds an upvalue for it to this compiler's list
+// of upvalues (unless it's already in there) and returns its index. If not
+// found, returns -1.
+//
+// If the name is found outside of the immediately enclosing function, this
+// will flatten the closure and add upvalues to all of the intermediate
+// functions so that it gets walked down to this one.
+static int find_upvalue(LsCompiler *compiler, const char *name, int length) {
+  // A function compiled lazily has no enclosing compiler anymore, but
+  // captures the variables it captured when it was checked.
+  LsLazyFn *lazy = compiler->fn->lazy;
+  if (compiler->parent_compiler == NULL && lazy != NULL) {
+    for (size_t i = 0; i < lazy->upvalue_names.length; i++) {
+      LsObjString *upvalue_name =
+          (LsObjString *)ls_val2obj(lazy->upvalue_names.data[i]);
+      if (upvalue_name->length == (size_t)length &&
+          memcmp(upvalue_name->value, name, length) == 0)
+        return (int)i;
+    }
+  }
+
+  // If we are at the top level, we didn't find it.
+  if (compiler->parent_compiler == NULL)
+    return -1;
+
+  // See if it's a local variable in the immediately enclosing function.
+  LsCompiler *parent = compiler->parent_compiler;
+  int local = resolve_local(parent, name, length);
+  if (local != -1) {
+    // Mark the local as an upvalue so we know to close it when it goes out of
+    // scope. It is read by another function, so it escapes.
+    parent->locals[local].captures++;
+    parent->locals[local].escapes = true;
+    return add_upvalue(compiler, true, local, name, length);
+  }
+
+  // See if it's an upvalue in the immediately enclosing function. In other
+  // words, if it's a local variable in a non-immediately enclosing function.
+  // This "flattens" closures automatically: it adds upvalues to all of the
+  // intermediate functions to get from the function where a local is declared
+  // all the way into the possibly deeply nested function that is closing over
+  // it.
+  int upvalue = find_upvalue(parent, name, length);
+  if (upvalue != -1) {
+    parent->upvalues_captured = true;
+    return add_upvalue(compiler, false, upvalue, name, length);
+  }
+
+  // If we got here, we walked all the way up the parent chain and couldn't
+  // find it.
+  return -1;
+}
+
+// Looks up [name] in the local variables of the functions enclosing the one
+// being compiled by [compiler]. Returns the innermost local found, or NULL.
+static Local *find_enclosing_local(LsCompiler *compiler, const char *name,
+                                   int length) {
+  for (LsCompiler *parent = compiler->parent_compiler; parent != NULL;
+       parent = parent->parent_compiler) {
+    int local = resolve_local(parent, name, length);
+    if (local != -1)
+      return &parent->locals[local];
+  }
+
+  return NULL;
+}
+
+typedef enum {
+  PREC_NONE,
+  PREC_LOWEST,
+  PREC_ASSIGNMENT,    // =
+  PREC_CONDITIONAL,   // ?:
+  PREC_LOGICAL_OR,    // ||
+  PREC_LOGICAL_AND,   // &&
+  PREC_EQUALITY,      // == !=
+  PREC_COMPARISON,    // < > <= >=
+  PREC_BITWISE_OR,    // |
+  PREC_BITWISE_AND,   // &
+  PREC_BITWISE_SHIFT, // << >>
+  PREC_TERM,          // + -
+  PREC_FACTOR,        // * / %
+  PREC_UNARY,         // unary - ! ~
+  PREC_POWER,         // ^
+  PREC_CALL,          // . () []
+  PREC_PRIMARY
+} Precedence;
+
+typedef void (*GrammarFn)(LsCompiler *, bool can_assign);
+
+typedef struct {
+  GrammarFn prefix;
+  GrammarFn infix;
+  Precedence precedence;
+} GrammarRule;
+
+static void expression(LsCompiler *compiler);
+static void statement(LsCompiler *compiler);
+static void definition(LsCompiler *compiler);
+static void finish_block(LsCompiler *compiler);
+static void parse_precedence(LsCompiler *compiler, Precedence precedence);
+static void init_compiler(LsCompiler *compiler, Parser *parser,
+                          LsCompiler *parent, LsObjFn *fn);
+static LsObjFn *end_compiler(LsCompiler *compiler);
+
+// A parenthesized expression.
+static void grouping(LsCompiler *compiler, bool can_assign) {
+  (void)can_assign;
+
+  ignore_newlines(compiler);
+  expression(compiler);
+  ignore_newlines(compiler);
+  consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+}
+
+// A yield expression, after the "yield". Yields null if no value follows.
+static void yield_(LsCompiler *compiler, bool can_assign) {
+  (void)can_assign;
+
+  TokenType next = peek_token(compiler);
+  if (next == TOKEN_LINE || next == TOKEN_RIGHT_BRACE ||
+      next == TOKEN_RIGHT_PAREN || next == TOKEN_COMMA || next == TOKEN_EOF) {
+    emit_op(compiler, CODE_NULL);
+  } else {
+    parse_precedence(compiler, PREC_CONDITIONAL);
+  }
+
+  emit_op(compiler, CODE_YIELD);
+}
+
+static void null(LsCompiler *compiler, bool can_assign) {
+  (void)can_assign;
+  emit_op(compiler, CODE_NULL);
+}
+
+static void boolean(LsCompiler *compiler, bool can_assign) {
+  (void)can_assign;
+  emit_op(compiler, compiler->parser->previous.type == TOKEN_FALSE
+                        ? CODE_FALSE
+                        : CODE_TRUE);
+}
+
+// A number or string literal.
+static void literal(LsCompiler *compiler, bool can_assign) {
+  (void)can_assign;
+
+  // Checked code doesn't need the values of its literals.
+  Parser *parser = compiler->parser;
+  if (compiler->preparse) {
+    emit_op(compiler, CODE_CONSTANT);
+  } else if (parser->previous.type == TOKEN_NUMBER) {
+    emit_constant(compiler, parser->previous.value);
+  } else {
+    emit_constant(compiler, token_string(parser, &parser->previous));
+  }
+}
+
+// Compiles a variable name, or an assignment to it.
+static void name(LsCompiler *compiler, bool can_assign) {
+  Parser *parser = compiler->parser;
+  Token *token = &parser->previous;
+
+  bool is_const;
+  LsValue constant;
+  LsCode load, store;
+  Local *local;
+  int index = resolve_local(compiler, token->start, (int)token->length);
+  if (index != -1) {
+    local = &compiler->locals[index];
+    is_const = local->is_const;
+    constant = local->constant;
+    load = CODE_LOAD_LOCAL;
+    store = CODE_STORE_LOCAL;
+
+    // Calling the function in a local doesn't let it escape.
+    if (peek_token(compiler) != TOKEN_LEFT_PAREN)
+      local->escapes = true;
+  } else if ((local = find_enclosing_local(compiler, token->start,
+                                           (int)token->length)) != NULL ||
+             (index = find_upvalue(compiler, token->start,
+                                   (int)token->length)) != -1) {
+    is_const = local != NULL && local->is_const;
+    constant = LS_UNDEFINED;
+    load = CODE_LOAD_UPVALUE;
+    store = CODE_STORE_UPVALUE;
+
+    // Constants with a known value don't need to be captured. Checked
+    // functions capture them anyway, since once compiled lazily they only
+    // know the variables they captured.
+    if (local != NULL && local->constant != LS_UNDEFINED &&
+        !compiler->preparse) {
+      constant = local->constant;
+    } else if (local != NULL) {
+      index = find_upvalue(compiler, token->start, (int)token->length);
+    }
+  } else {
+    LsValue symbol = ls_map_get(parser->module->variable_names,
+                                token_string(parser, token));
+    if (symbol == LS_UNDEFINED) {
+      error(compiler, "Undefined variable.");
+      return;
+    }
+
+    index = (int)ls_val2num(symbol);
+    is_const = parser->module_variables.data[index].is_const;
+    constant = parser->module_variables.data[index].constant;
+    load = CODE_LOAD_MODULE_VAR;
+    store = CODE_STORE_MODULE_VAR;
+  }
+
+  if (can_assign && match_token(compiler, TOKEN_EQ)) {
+    if (is_const)
+      error(compiler, "Cannot assign to a constant.");
+
+    ignore_newlines(compiler);
+    expression(compiler);
+    if (store == CODE_STORE_MODULE_VAR)
+      emit_short_arg(compiler, store, index);
+    else
+      emit_byte_arg(compiler, store, index);
+    return;
+  }
+
+  // Constants with a known value are inlined, so they fold further.
+  if (constant != LS_UNDEFINED) {
+    emit_constant(compiler, constant);
+  } else if (load == CODE_LOAD_LOCAL) {
+    load_local(compiler, index);
+  } else if (load == CODE_LOAD_UPVALUE) {
+    emit_byte_arg(compiler, load, index);
+  } else {
+    emit_short_arg(compiler, load, index);
+  }
+}
+
+// Compiles a unary operator and its operand, folding it if the operand is
+// constant.
+static void unary_op(LsCompiler *compiler, bool can_assign) {
+  (void)can_assign;
+
+  LsCode instruction =
+      operator_instruction(compiler->parser->previous.type, true);
+  ignore_newlines(compiler);
+
+  CodeMark operand = code_mark(compiler);
+  parse_precedence(compiler, (Precedence)(PREC_UNARY + 1));
+
+  LsValue value, result;
+  if (constant_since(compiler, operand, &value) &&
+      fold_unary(instruction, value, &result)) {
+    discard_code(compiler, operand);
+    emit_constant(compiler, result);
+    return;
+  }
+
+  emit_op(compiler, instruction);
+}
+
+static const GrammarRule *get_rule(TokenType type);
+
+// Compiles the right operand of a binary operator and the operator itself.
+// When both operands are constant, their code is replaced by the result.
+static void binary_op(LsCompiler *compiler, bool can_assign) {
+  (void)can_assign;
+
+  TokenType token = compiler->parser->previous.type;
+  LsCode instruction = operator_instruction(token, false);
+  CodeMark left = compiler->operand;
+  ignore_newlines(compiler);
+
+  // Powers are right-associative, the other operators left-associative.
+  Precedence precedence = get_rule(token)->precedence;
+  if (token != TOKEN_CARET)
+    precedence = (Precedence)(precedence + 1);
+
+  CodeMark right = code_mark(compiler);
+  parse_precedence(compiler, precedence);
+
+  // The left operand is constant if its code is a single constant load.
+  LsValue a, b, result;
+  size_t size = constant_at(compiler, left.code, &a);
+  if (size != 0 && left.code + size == right.code &&
+      constant_since(compiler, right, &b) &&
+      fold_binary(compiler, instruction, a, b, &result)) {
+    discard_code(compiler, left);
+    emit_constant(compiler, result);
+    return;
+  }
+
+  emit_op(compiler, instruction);
+}
+
+// The "&&" operator. When the left operand is constant, only the operand
+// that determines the result is kept.
+static void and_(LsCompiler *compiler, bool can_assign) {
+  (void)can_assign;
+
+  CodeMark left = compiler->operand;
+  ignore_newlines(compiler);
+
+  LsValue value;
+  if (constant_since(compiler, left, &value)) {
+    if (!ls_is_falsy(value)) {
+      discard_code(compiler, left);
+      parse_precedence(compiler, PREC_LOGICAL_AND);
+      return;
+    }
+
+    // Still compile the right operand to report its errors.
+    CodeMark right = code_mark(compiler);
+    parse_precedence(compiler, PREC_LOGICAL_AND);
+    discard_code(compiler, right);
+    return;
+  }
+
+  // Skip the right argument if the left is false.
+  size_t jump = emit_jump(compiler, CODE_AND);
+  parse_precedence(compiler, PREC_LOGICAL_AND);
+  patch_jump(compiler, jump);
+}
+
+// The "||" operator, folded like and_().
+static void or_(LsCompiler *compiler, bool can_assign) {
+  (void)can_assign;
+
+  CodeMark left = compiler->operand;
+  ignore_newlines(compiler);
+
+  LsValue value;
+  if (constant_since(compiler, left, &value)) {
+    if (ls_is_falsy(value)) {
+      discard_code(compiler, left);
+      parse_precedence(compiler, PREC_LOGICAL_OR);
+      return;
+    }
+
+    CodeMark right = code_mark(compiler);
+    parse_precedence(compiler, PREC_LOGICAL_OR);
+    discard_code(compiler, right);
+    return;
+  }
+
+  // Skip the right argument if the left is true.
+  size_t jump = emit_jump(compiler, CODE_OR);
+  parse_precedence(compiler, PREC_LOGICAL_OR);
+  patch_jump(compiler, jump);
+}
+
+// The "?:" operator. A constant condition only keeps the selected branch.
+static void conditional(LsCompiler *compiler, bool can_assign) {
+  (void)can_assign;
+
+  CodeMark condition = compiler->operand;
+
+  // Ignore newline after '?'.
+  ignore_newlines(compiler);
+
+  LsValue value;
+  if (constant_since(compiler, condition, &value)) {
+    discard_code(compiler, condition);
+    bool truthy = !ls_is_falsy(value);
+
+    CodeMark branch = code_mark(compiler);
+    parse_precedence(compiler, PREC_CONDITIONAL);
+    if (!truthy)
+      discard_code(compiler, branch);
+
+    consume(compiler, TOKEN_COLON,
+            "Expect ':' after then branch of conditional operator.");
+    ignore_newlines(compiler);
+
+    branch = code_mark(compiler);
+    parse_precedence(compiler, PREC_ASSIGNMENT);
+    if (truthy)
+      discard_code(compiler, branch);
+    return;
+  }
+
+  // Jump to the else branch if the condition is false.
+  size_t if_jump = emit_jump(compiler, CODE_JUMP_IF);
+
+  // Compile the then branch.
+  parse_precedence(compiler, PREC_CONDITIONAL);
+
+  consume(compiler, TOKEN_COLON,
+          "Expect ':' after then branch of conditional operator.");
+  ignore_newlines(compiler);
+
+  // Jump over the else branch when the if branch is taken.
+  size_t else_jump = emit_jump(compiler, CODE_JUMP);
+
+  // Compile the else branch.
+  patch_jump(compiler, if_jump);
+
+  parse_precedence(compiler, PREC_ASSIGNMENT);
+
+  // Only one of the branches leaves a value on the stack.
+  compiler->num_slots--;
+
+  // Patch the jump over the else.
+  patch_jump(compiler, else_jump);
+}
+
+// Compiles the parameters and the body of the function of [compiler], from
+// the "(".
+static void function_body(LsCompiler *compiler) {
+  LsObjFn *fn = compiler->fn;
+
+  // The parameters are the first locals of the function.
+  compiler->scope_depth = 0;
+  consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' before parameters.");
+  if (!match_token(compiler, TOKEN_RIGHT_PAREN)) {
+    do {
+      ignore_newlines(compiler);
+      consume(compiler, TOKEN_IDENT, "Expect parameter name.");
+      if (fn->arity == MAX_PARAMETERS) {
+        error(compiler, "Functions cannot have more than %d parameters.",
+              MAX_PARAMETERS);
+      }
+      fn->arity++;
+
+      declare_variable(compiler, &compiler->parser->previous, false,
+                       LS_UNDEFINED);
+      compiler->num_slots++;
+      if (compiler->num_slots > fn->max_slots)
+        fn->max_slots = compiler->num_slots;
+    } while (match_token(compiler, TOKEN_COMMA));
+
+    ignore_newlines(compiler);
+    consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  }
+
+  consume(compiler, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  finish_block(compiler);
+}
+
+// Compiles a function, after the "fn" and its name if it has one, and emits
+// the code that pushes it. [name] is the name of the function, or NULL.
+static void function(LsCompiler *compiler, const Token *name) {
+  Parser *parser = compiler->parser;
+  LsVM *vm = parser->vm;
+
+  // The functions nested in a checked function are only checked as well, and
+  // don't need a function object.
+  LsObjFn checked;
+  LsObjFn *fn;
+  if (compiler->preparse) {
+    memset(&checked, 0, sizeof(checked));
+    checked.module = parser->module;
+    fn = &checked;
+  } else {
+    fn = ls_new_fn(vm, parser->module);
+    if (name != NULL)
+      fn->name = (LsObjString *)ls_val2obj(token_string(parser, name));
+  }
+
+  // With the lazy_compile option, the body is only checked. The function
+  // remembers where its parameters start, to compile it on its first call.
+  if (!compiler->preparse && vm->config.lazy_compile) {
+    fn->lazy = ls_allocate(vm, LsLazyFn);
+    // TODO: handle oom.
+    fn->lazy->source = parser->source_copy;
+    fn->lazy->start = (size_t)(parser->current.start - parser->source);
+    fn->lazy->line = (int)parser->current.line;
+    ls_value_buffer_init(&fn->lazy->upvalue_names);
+    fn->lazy->upvalues_captured = false;
+    fn->lazy->bare = false;
+    fn->lazy->image = NULL;
+    fn->lazy->index = 0;
+  }
+
+  LsCompiler fn_compiler;
+  init_compiler(&fn_compiler, parser, compiler, fn);
+  fn_compiler.preparse = compiler->preparse || fn->lazy != NULL;
+
+  function_body(&fn_compiler);
+  if (end_compiler(&fn_compiler) == NULL)
+    return;
+
+  if (compiler->preparse) {
+    emit_op(compiler, CODE_CONSTANT);
+    return;
+  }
+
+  // A function that captures nothing doesn't need a closure.
+  LsCode instruction = fn->num_upvalues > 0 ? CODE_CLOSURE : CODE_CONSTANT;
+  emit_short_arg(compiler, instruction,
+                 add_constant(compiler, ls_obj2val(&fn->obj)));
+}
+
+// An anonymous function expression.
+static void fn_expression(LsCompiler *compiler, bool can_assign) {
+  (void)can_assign;
+  function(compiler, NULL);
+}
+
+// A call of the function on the left of the "(".
+static void call(LsCompiler *compiler, bool can_assign) {
+  (void)can_assign;
+
+  int num_args = 0;
+  ignore_newlines(compiler);
+  if (!match_token(compiler, TOKEN_RIGHT_PAREN)) {
+    do {
+      ignore_newlines(compiler);
+      if (num_args == MAX_PARAMETERS) {
+        error(compiler, "Cannot pass more than %d arguments to a function.",
+              MAX_PARAMETERS);
+      }
+      expression(compiler);
+      num_args++;
+    } while (match_token(compiler, TOKEN_COMMA));
+
+    ignore_newlines(compiler);
+    consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  }
+
+  if (num_args > MAX_PARAMETERS)
+    num_args = MAX_PARAMETERS;
+  emit_op(compiler, (LsCode)(CODE_CALL_0 + num_args));
+}
+
+#define PREFIX(fn) {fn, NULL, PREC_NONE}
+#define INFIX(prec, fn) {NULL, fn, prec}
+#define INFIX_OPERATOR(prec) {NULL, binary_op, prec}
+#define OPERATOR(prec) {unary_op, binary_op, prec}
+
+// The grammar rules of the tokens, for the Pratt parser. Tokens that don't
+// start or continue an expression are left out.
+static const GrammarRule rules[TOKEN_EOF + 1] = {
+    [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
+    [TOKEN_AMP] = INFIX_OPERATOR(PREC_BITWISE_AND),
+    [TOKEN_AMPAMP] = INFIX(PREC_LOGICAL_AND, and_),
+    [TOKEN_BANG] = PREFIX(unary_op),
+    [TOKEN_CARET] = INFIX_OPERATOR(PREC_POWER),
+    [TOKEN_MINUS] = OPERATOR(PREC_TERM),
+    [TOKEN_PERCENT] = INFIX_OPERATOR(PREC_FACTOR),
+    [TOKEN_PIPE] = INFIX_OPERATOR(PREC_BITWISE_OR),
+    [TOKEN_PIPEPIPE] = INFIX(PREC_LOGICAL_OR, or_),
+    [TOKEN_PLUS] = INFIX_OPERATOR(PREC_TERM),
+    [TOKEN_QUESTION] = INFIX(PREC_ASSIGNMENT, conditional),
+    [TOKEN_SLASH] = INFIX_OPERATOR(PREC_FACTOR),
+    [TOKEN_STAR] = INFIX_OPERATOR(PREC_FACTOR),
+    [TOKEN_TILDE] = PREFIX(unary_op),
+    [TOKEN_LT] = INFIX_OPERATOR(PREC_COMPARISON),
+    [TOKEN_LTLT] = INFIX_OPERATOR(PREC_BITWISE_SHIFT),
+    [TOKEN_GT] = INFIX_OPERATOR(PREC_COMPARISON),
+    [TOKEN_GTGT] = INFIX_OPERATOR(PREC_BITWISE_SHIFT),
+    [TOKEN_LTEQ] = INFIX_OPERATOR(PREC_COMPARISON),
+    [TOKEN_GTEQ] = INFIX_OPERATOR(PREC_COMPARISON),
+    [TOKEN_EQEQ] = INFIX_OPERATOR(PREC_EQUALITY),
+    [TOKEN_BANGEQ] = INFIX_OPERATOR(PREC_EQUALITY),
+    [TOKEN_NULL] = PREFIX(null),
+    [TOKEN_TRUE] = PREFIX(boolean),
+    [TOKEN_FALSE] = PREFIX(boolean),
+    [TOKEN_NUMBER] = PREFIX(literal),
+    [TOKEN_STRING] = PREFIX(literal),
+    [TOKEN_IDENT] = PREFIX(name),
+    [TOKEN_FN] = PREFIX(fn_expression),
+    [TOKEN_YIELD] = PREFIX(yield_),
+};
+
+#undef PREFIX
+#undef INFIX
+#undef INFIX_OPERATOR
+#undef OPERATOR
+
+// Gets the GrammarRule associated with tokens of [type].
+static const GrammarRule *get_rule(TokenType type) { return &rules[type]; }
+
+// The main entrypoint for the top-down operator precedence parser.
+static void parse_precedence(LsCompiler *compiler, Precedence precedence) {
+  CodeMark start = code_mark(compiler);
+
+  next_token(compiler->parser);
+  GrammarFn prefix = rules[compiler->parser->previous.type].prefix;
+
+  if (prefix == NULL) {
+    error(compiler, "Expected expression.");
+    return;
+  }
+
+  // Track if the precedence of the surrounding expression is low enough to
+  // allow an assignment inside this one. We can't compile an assignment like
+  // a normal expression because it requires us to handle the LHS specially --
+  // it needs to be an lvalue, not an rvalue. So, for each of the kinds of
+  // expressions that are valid lvalues -- names, subscripts, fields, etc. --
+  // we pass in whether or not it appears in a context loose enough to allow
+  // "=". If so, it will parse the "=" itself and handle it appropriately.
+  bool can_assign = precedence <= PREC_CONDITIONAL;
+  prefix(compiler, can_assign);
+
+  while (precedence <= rules[compiler->parser->current.type].precedence) {
+    next_token(compiler->parser);
+    GrammarFn infix = rules[compiler->parser->previous.type].infix;
+
+    // The infix operators fold their operands, so they need to know where
+    // the left one begins.
+    compiler->operand = start;
+    infix(compiler, can_assign);
+  }
+}
+
+// Parses an expression. Unlike statements, expressions leave a resulting
+// value on the stack.
+static void expression(LsCompiler *compiler) {
+  parse_precedence(compiler, PREC_LOWEST);
+}
+
+// If all the code emitted since [mark] creates a function, names it after the
+// variable [name] when it has no name. Returns the offset of the instruction
+// if it creates a closure, otherwise -1.
+static int closure_since(LsCompiler *compiler, CodeMark mark,
+                         const Token *name) {
+  LsObjFn *fn = compiler->fn;
+  if (compiler->parser->has_error || fn->code.length != mark.code + 3)
+    return -1;
+
+  const uint8_t *code = fn->code.data + mark.code;
+  if (code[0] != CODE_CLOSURE && code[0] != CODE_CONSTANT)
+    return -1;
+
+  LsValue value = fn->constants.data[(code[1] << 8) | code[2]];
+  if (!ls_is_obj(value) || ls_val2obj(value)->type != LS_OBJ_FN)
+    return -1;
+
+  LsObjFn *created = (LsObjFn *)ls_val2obj(value);
+  if (created->name == NULL) {
+    created->name =
+        (LsObjString *)ls_val2obj(token_string(compiler->parser, name));
+  }
+
+  return code[0] == CODE_CLOSURE ? (int)mark.code : -1;
+}
+
+// Compiles a variable definition: "let" or "const", a name and an optional
+// initializer. The "let" or "const" has been consumed.
+static void variable_definition(LsCompiler *compiler) {
+  bool is_const = compiler->parser->previous.type == TOKEN_CONST;
+
+  // Grab its name, but don't declare it yet. A (local) variable shouldn't be
+  // in scope in its own initializer.
+  consume(compiler, TOKEN_IDENT, "Expect variable name.");
+  Token name = compiler->parser->previous;
+
+  // A constant whose initializer is constant is replaced by its value
+  // wherever it is used.
+  LsValue constant = LS_UNDEFINED;
+  int closure = -1;
+  if (match_token(compiler, TOKEN_EQ)) {
+    ignore_newlines(compiler);
+    CodeMark initializer = code_mark(compiler);
+    expression(compiler);
+
+    LsValue value;
+    if (is_const && constant_since(compiler, initializer, &value))
+      constant = value;
+    closure = closure_since(compiler, initializer, &name);
+  } else {
+    if (is_const)
+      error(compiler, "Expect '=' after constant name.");
+
+    // Default initialize it to null.
+    emit_op(compiler, CODE_NULL);
+  }
+
+  int symbol = declare_variable(compiler, &name, is_const, constant);
+  if (compiler->scope_depth >= 0 && symbol != -1)
+    compiler->locals[symbol].closure = closure;
+  define_variable(compiler, symbol);
+}
+
+// Compiles a named function definition, after the "fn". The variable it is
+// stored in is declared first, so the function can call itself.
+static void function_definition(LsCompiler *compiler) {
+  consume(compiler, TOKEN_IDENT, "Expect function name.");
+  Token name = compiler->parser->previous;
+  int symbol = declare_variable(compiler, &name, false, LS_UNDEFINED);
+
+  CodeMark initializer = code_mark(compiler);
+  function(compiler, &name);
+
+  int closure = closure_since(compiler, initializer, &name);
+  if (compiler->scope_depth >= 0 && symbol != -1)
+    compiler->locals[symbol].closure = closure;
+  define_variable(compiler, symbol);
+}
+
+// Compiles a "definition". These are the statements that bind new variables.
+// They can only appear at the top level of a block and are prohibited in places
+// like the non-curly body of an if or while.
+static void definition(LsCompiler *compiler) {
+  if (match_token(compiler, TOKEN_LET) || match_token(compiler, TOKEN_CONST)) {
+    variable_definition(compiler);
+    return;
+  }
+
+  // A "fn" followed by a name defines a function, otherwise it starts an
+  // expression.
+  if (peek_token(compiler) == TOKEN_FN &&
+      peek_next_token(compiler) == TOKEN_IDENT) {
+    next_token(compiler->parser);
+    function_definition(compiler);
+    return;
+  }
+
+  statement(compiler);
+}
+
+// Parses a block body, after the initial "{" has been consumed.
+static void finish_block(LsCompiler *compiler) {
+  // Empty blocks do nothing.
+  if (match_token(compiler, TOKEN_RIGHT_BRACE))
+    return;
+
+  // If there's no line after the "{", it's a single-statement body.
+  if (!match_line(compiler)) {
+    definition(compiler);
+    consume(compiler, TOKEN_RIGHT_BRACE, "Expect '}' at end of block.");
+    return;
+  }
+
+  // Empty blocks (with just a newline inside) do nothing.
+  if (match_token(compiler, TOKEN_RIGHT_BRACE))
+    return;
+
+  do {
+    definition(compiler);
+    consume_line(compiler, "Expect newline after statement.");
+  } while (peek_token(compiler) != TOKEN_RIGHT_BRACE &&
+           peek_token(compiler) != TOKEN_EOF);
+
+  consume(compiler, TOKEN_RIGHT_BRACE, "Expect '}' at end of block.");
+}
+
+// Consumes an "else", which may follow the end of the then branch on the next
+// line. Returns true if there was one.
+static bool match_else(LsCompiler *compiler) {
+  if (peek_token(compiler) == TOKEN_LINE &&
+      peek_next_token(compiler) == TOKEN_ELSE)
+    next_token(compiler->parser);
+
+  return match_token(compiler, TOKEN_ELSE);
+}
+
+// Compiles the parenthesized condition of an if or while statement. Returns
+// true and stores its value in [value] if it is constant, in which case its
+// code is discarded.
+static bool condition(LsCompiler *compiler, LsValue *value) {
+  consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after keyword.");
+  ignore_newlines(compiler);
+
+  CodeMark mark = code_mark(compiler);
+  expression(compiler);
+
+  ignore_newlines(compiler);
+  consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+  if (!constant_since(compiler, mark, value))
+    return false;
+
+  discard_code(compiler, mark);
+  return true;
+}
+
+// Compiles an if statement, after the "if". Only the branch selected by a
+// constant condition is kept, the other is compiled to report its errors and
+// discarded.
+static void if_statement(LsCompiler *compiler) {
+  LsValue value;
+  if (condition(compiler, &value)) {
+    bool truthy = !ls_is_falsy(value);
+
+    CodeMark branch = code_mark(compiler);
+    statement(compiler);
+    if (!truthy)
+      discard_code(compiler, branch);
+
+    if (match_else(compiler)) {
+      branch = code_mark(compiler);
+      statement(compiler);
+      if (truthy)
+        discard_code(compiler, branch);
+    }
+    return;
+  }
+
+  // Jump to the else branch if the condition is false.
+  size_t if_jump = emit_jump(compiler, CODE_JUMP_IF);
+
+  // Compile the then branch.
+  statement(compiler);
+
+  // Compile the else branch if there is one.
+  if (match_else(compiler)) {
+    // Jump over the else branch when the if branch is taken.
+    size_t else_jump = emit_jump(compiler, CODE_JUMP);
+    patch_jump(compiler, if_jump);
+
+    statement(compiler);
+
+    // Patch the jump over the else.
+    patch_jump(compiler, else_jump);
+  } else {
+    patch_jump(compiler, if_jump);
+  }
+}
+
+// Marks the beginning of a loop. Keeps track of the current instruction so we
+// know what to loop back to at the end of the body.
+static void start_loop(LsCompiler *compiler, Loop *loop) {
+  loop->enclosing = compiler->loop;
+  loop->start = compiler->fn->code.length;
+  loop->exit_jump = -1;
+  loop->scope_depth = compiler->scope_depth;
+  compiler->loop = loop;
+}
+
+// Compiles the body of the loop and tracks its extent so that contained "break"
+// statements can be handled correctly.
+static void loop_body(LsCompiler *compiler) {
+  compiler->loop->body = compiler->fn->code.length;
+  statement(compiler);
+}
+
+// Ends the current innermost loop. Patches up all jumps and breaks now that
+// we know where the end of the loop is.
+static void end_loop(LsCompiler *compiler) {
+  Loop *loop = compiler->loop;
+
+  // We don't check for overflow here since the forward jump over the loop
+  // body will report an error for the same problem.
+  size_t offset = compiler->fn->code.length - loop->start + 3;
+  emit_short_arg(compiler, CODE_LOOP, (int)offset);
+
+  // A loop whose condition is always true only exits with a break.
+  if (loop->exit_jump != -1)
+    patch_jump(compiler, (size_t)loop->exit_jump);
+
+  // Find any break placeholder instructions (which will be CODE_END in the
+  // bytecode) and replace them with real jumps.
+  size_t i = loop->body;
+  while (i < compiler->fn->code.length) {
+    if (compiler->fn->code.data[i] == CODE_END) {
+      compiler->fn->code.data[i] = CODE_JUMP;
+      patch_jump(compiler, i + 1);
+      i += 3;
+    } else {
+      // Skip this instruction and its arguments.
+      i += 1 + argument_bytes(compiler->fn->code.data + i);
+    }
+  }
+
+  compiler->loop = loop->enclosing;
+}
+
+// Compiles a while statement, after the "while". A loop whose condition is
+// constant doesn't test it, and is dropped if it is false.
+static void while_statement(LsCompiler *compiler) {
+  Loop loop;
+  start_loop(compiler, &loop);
+
+  LsValue value;
+  bool constant = condition(compiler, &value);
+  if (constant && ls_is_falsy(value)) {
+    CodeMark body = code_mark(compiler);
+    loop_body(compiler);
+    discard_code(compiler, body);
+    compiler->loop = loop.enclosing;
+    return;
+  }
+
+  if (!constant)
+    loop.exit_jump = (int)emit_jump(compiler, CODE_JUMP_IF);
+
+  loop_body(compiler);
+  end_loop(compiler);
+}
+
+// Returns true if the current token ends a statement.
+static bool at_statement_end(LsCompiler *compiler) {
+  TokenType type = peek_token(compiler);
+  return type == TOKEN_LINE || type == TOKEN_RIGHT_BRACE || type == TOKEN_EOF;
+}
+
+// Compiles a simple statement. These can only appear at the top-level or
+// within curly blocks. Simple statements exclude variable binding statements
+// like "let" and "const".
+static void statement(LsCompiler *compiler) {
+  if (match_token(compiler, TOKEN_BREAK)) {
+    if (compiler->loop == NULL) {
+      error(compiler, "Cannot use 'break' outside of a loop.");
+      return;
+    }
+
+    // Since we will be jumping out of the scope, make sure any locals in it
+    // are discarded first.
+    discard_locals(compiler, compiler->loop->scope_depth + 1);
+
+    // Emit a placeholder instruction for the jump to the end of the body. When
+    // we're done compiling the loop body and know where the end is, we'll
+    // replace these with `CODE_JUMP` instructions with appropriate offsets.
+    // We use `CODE_END` here because that can't occur in the middle of
+    // bytecode.
+    emit_jump(compiler, CODE_END);
+  } else if (match_token(compiler, TOKEN_CONTINUE)) {
+    if (compiler->loop == NULL) {
+      error(compiler, "Cannot use 'continue' outside of a loop.");
+      return;
+    }
+
+    // Discard the locals of the body and loop back to the condition.
+    discard_locals(compiler, compiler->loop->scope_depth + 1);
+    size_t offset = compiler->fn->code.length - compiler->loop->start + 3;
+    emit_short_arg(compiler, CODE_LOOP, (int)offset);
+  } else if (match_token(compiler, TOKEN_IF)) {
+    if_statement(compiler);
+  } else if (match_token(compiler, TOKEN_RETURN)) {
+    // Compile the return value.
+    if (at_statement_end(compiler)) {
+      emit_op(compiler, CODE_NULL);
+    } else {
+      expression(compiler);
+    }
+
+    emit_op(compiler, CODE_RETURN);
+  } else if (match_token(compiler, TOKEN_WHILE)) {
+    while_statement(compiler);
+  } else if (match_token(compiler, TOKEN_LEFT_BRACE)) {
+    // Block statement.
+    push_scope(compiler);
+    finish_block(compiler);
+    pop_scope(compiler);
+  } else {
+    // Expression statement. A constant one has no effect, so it isn't even
+    // evaluated.
+    CodeMark mark = code_mark(compiler);
+    expression(compiler);
+
+    LsValue value;
+    if (constant_since(compiler, mark, &value)) {
+      discard_code(compiler, mark);
+    } else {
+      emit_op(compiler, CODE_POP);
+    }
+  }
+}
+
+// Initializes [compiler] to compile the top-level code of [fn], a function of
+// the parser's module, nested in the function compiled by [parent] unless it
+// is NULL.
+static void init_compiler(LsCompiler *compiler, Parser *parser,
+                          LsCompiler *parent, LsObjFn *fn) {
+  compiler->parser = parser;
+  compiler->parent_compiler = parent;
+  compiler->loop = NULL;
+  compiler->preparse = false;
+  compiler->upvalues_captured = false;
+
+  // Declare a fake local variable for the function being run, which lives in
+  // slot zero.
+  compiler->locals_count = 1;
+  compiler->locals[0].name = NULL;
+  compiler->locals[0].length = 0;
+  compiler->locals[0].depth = -1;
+  compiler->locals[0].captures = 0;
+  compiler->locals[0].escapes = false;
+  compiler->locals[0].closure = -1;
+  compiler->locals[0].is_const = true;
+  compiler->locals[0].constant = LS_UNDEFINED;
+  compiler->num_slots = 1;
+
+  // Top-level code declares module variables.
+  compiler->scope_depth = -1;
+
+  compiler->fn = fn;
+  compiler->fn->max_slots = compiler->num_slots;
+  ls_init_map(&compiler->constants);
+}
+
+// Finishes [compiler], which is compiling a function. Returns the function,
+// or NULL if there was a compile error.
+static LsObjFn *end_compiler(LsCompiler *compiler) {
+  ls_map_clear(compiler->parser->vm, &compiler->constants);
+
+  // If we hit an error, don't finish the function since it's borked anyway.
+  if (compiler->parser->has_error)
+    return NULL;
+
+  // The locals of the function go out of scope.
+  resolve_closures(compiler, 0);
+
+  // Describe the variables the function captures, for CODE_CLOSURE. Those
+  // of a function compiled lazily were described when it was checked, and
+  // a function nested in a checked one has no function object.
+  LsVM *vm = compiler->parser->vm;
+  LsCompiler *parent = compiler->parent_compiler;
+  if (parent != NULL && !parent->preparse) {
+    ls_byte_buffer_reserve(vm, &compiler->fn->upvalues,
+                           (size_t)compiler->fn->num_upvalues * 2);
+    for (int i = 0; i < compiler->fn->num_upvalues; i++) {
+      ls_byte_buffer_write(vm, &compiler->fn->upvalues,
+                           compiler->upvalues[i].is_local ? 1 : 0);
+      ls_byte_buffer_write(vm, &compiler->fn->upvalues,
+                           (uint8_t)compiler->upvalues[i].index);
+    }
+  }
+
+  // A checked function only needs to know what it captures.
+  if (compiler->preparse) {
+    LsLazyFn *lazy = compiler->fn->lazy;
+    if (lazy != NULL) {
+      ls_value_buffer_reserve(vm, &lazy->upvalue_names,
+                              (size_t)compiler->fn->num_upvalues);
+      for (int i = 0; i < compiler->fn->num_upvalues; i++) {
+        CompilerUpvalue *upvalue = &compiler->upvalues[i];
+        ls_value_buffer_write(
+            vm, &lazy->upvalue_names,
+            ls_intern_string(vm, upvalue->name, (size_t)upvalue->length));
+      }
+      lazy->upvalues_captured = compiler->upvalues_captured;
+    }
+
+    return compiler->fn;
+  }
+
+  // Falling off the end returns null.
+  emit_op(compiler, CODE_NULL);
+  emit_op(compiler, CODE_RETURN);
+
+  // Mark the end of the bytecode. Since it may contain multiple early returns,
+  // we can't rely on CODE_RETURN to tell us we're at the end.
+  emit_op(compiler, CODE_END);
+
+  return compiler->fn;
+}
+
+LsObjFn *ls_compile(LsVM *vm, const char *source) {
+  return ls_compile_length(vm, source, strlen(source));
+}
+
+LsObjFn *ls_compile_length(LsVM *vm, const char *source, size_t length) {
+  return ls_compile_in_module(vm, ls_new_module(vm), source, length);
+}
+
+LsObjFn *ls_compile_in_module(LsVM *vm, LsObjModule *module,
+                              const char *source, size_t length) {
+  Parser parser;
+  init_parser(&parser, vm, module, source, length, 0, 1);
+
+  // The functions compiled lazily are compiled from a copy of the source.
+  if (vm->config.lazy_compile) {
+    parser.source_copy =
+        (LsObjString *)ls_val2obj(ls_new_string_length(vm, source, length));
+  }
+
+  LsCompiler compiler;
+  init_compiler(&compiler, &parser, NULL, ls_new_fn(vm, module));
+
+  ignore_newlines(&compiler);
+  while (!match_token(&compiler, TOKEN_EOF)) {
+    definition(&compiler);
+
+    // If there is no newline, it must be the end of file on the same line.
+    if (!match_line(&compiler)) {
+      consume(&compiler, TOKEN_EOF, "Expect end of file.");
+      break;
+    }
+  }
+
+  LsObjFn *fn = end_compiler(&compiler);
+  free_parser(&parser);
+  return fn;
+}
+
+LsObjFn *ls_compile_reader(LsVM *vm, LsReadFn read, void *data) {
+  // Tokens and variable names point into the source, so the chunks are read
+  // into a single buffer, which is read into directly as it grows.
+  ByteBuffer source;
+  ls_byte_buffer_init(&source);
+  for (;;) {
+    if (source.capacity - source.length < READ_CHUNK_SIZE)
+      ls_byte_buffer_grow(vm, &source, source.length + READ_CHUNK_SIZE);
+
+    size_t size = read(data, (char *)source.data + source.length,
+                       source.capacity - source.length);
+    if (size == 0)
+      break;
+    source.length += size;
+  }
+
+  LsObjFn *fn = ls_compile_length(vm, (const char *)source.data, source.length);
+  ls_byte_buffer_clear(vm, &source);
+  return fn;
+}
+
+bool ls_compile_lazy(LsVM *vm, LsObjFn *fn) {
+  LsLazyFn *lazy = fn->lazy;
+
+  Parser parser;
+  LsObjString *source = lazy->source;
+  init_parser(&parser, vm, fn->module, source->value, source->length,
+              lazy->start, lazy->line);
+  parser.source_copy = source;
+
+  // Compile the function again from its parameters, this time emitting its
+  // code. It captures the same variables.
+  fn->arity = 0;
+  LsCompiler compiler;
+  init_compiler(&compiler, &parser, NULL, fn);
+  function_body(&compiler);
+
+  bool compiled = end_compiler(&compiler) != NULL;
+  free_parser(&parser);
+  if (!compiled) {
+    ls_byte_buffer_clear(vm, &fn->code);
+    ls_value_buffer_clear(vm, &fn->constants);
+    ls_int_buffer_clear(vm, &fn->lines);
+    return false;
+  }
+
+  if (lazy->bare)
+    run_bare(vm, fn);
+
+  ls_value_buffer_clear(vm, &lazy->upvalue_names);
+  ls_free(vm, lazy);
+  fn->lazy = NULL;
+  return true;
+}
+
+// A compile error of a module compiled by ls_compile_modules(), kept until it
+// can be reported on the VM thread.
+typedef struct {
+  int line;
+  char message[ERROR_MESSAGE_SIZE];
+} ModuleError;
+
+DECLARE_BUFFER(ModuleError, module_error, ModuleError);
+DEFINE_BUFFER(ModuleError, module_error, ModuleError)
+
+// A module compiled by ls_compile_modules().
+typedef struct {
+  // The VM the module is compiled with. It starts without objects and has
+  // its own string table, so the threads compiling modules never share any
+  // memory.
+  LsVM vm;
+
+  // The function that runs the module, or NULL if it has a compile error.
+  LsObjFn *fn;
+
+  // The compile errors of the module.
+  ModuleErrorBuffer errors;
+} ModuleJob;
+
+// The modules compiled by a call to ls_compile_modules().
+typedef struct {
+  const char *const *sources;
+  const size_t *lengths;
+  ModuleJob *jobs;
+  size_t count;
+
+  // The index of the next module to compile, taken by the threads compiling
+  // modules under [lock].
+  size_t next;
+  pthread_mutex_t lock;
+} ModuleQueue;
+
+static void collect_module_error(LsVM *vm, LsErrorType type,
+                                 const char *module, int line,
+                                 const char *message) {
+  (void)type;
+  (void)module;
+
+  ModuleJob *job = vm->config.user_data;
+  ModuleError error;
+  error.line = line;
+  strcpy(error.message, message);
+  ls_module_error_buffer_write(vm, &job->errors, error);
+}
+
+// Compiles modules of [data], a ModuleQueue, until there are none left.
+static void *compile_modules(void *data) {
+  ModuleQueue *queue = data;
+  for (;;) {
+    pthread_mutex_lock(&queue->lock);
+    size_t index = queue->next++;
+    pthread_mutex_unlock(&queue->lock);
+    if (index >= queue->count)
+      return NULL;
+
+    ModuleJob *job = &queue->jobs[index];
+    job->fn = ls_compile_length(&job->vm, queue->sources[index],
+                                queue->lengths[index]);
+  }
+}
+
+// Returns the string of [vm]'s string table equal to [value] if it is a
+// string.
+static LsValue link_string(LsVM *vm, LsValue value) {
+  if (!ls_is_str(value))
+    return value;
+
+  LsValue str = ls_map_get(vm->strings, value);
+  return str != LS_UNDEFINED ? str : value;
+}
+
+// Moves the objects of the module compiled by [job] to [vm], and reports its
+// compile errors with the on_error callback of [vm].
+static void link_module(LsVM *vm, ModuleJob *job) {
+  LsVM *worker = &job->vm;
+
+  for (size_t i = 0; i < job->errors.length; i++) {
+    ModuleError *error = &job->errors.data[i];
+    // TODO: replace "main" with real module name.
+    vm->config.on_error(vm, LS_ERROR_COMPILE, "main", error->line,
+                        error->message);
+  }
+  ls_module_error_buffer_clear(worker, &job->errors);
+
+  // The strings the module interned are added to the string table of [vm],
+  // unless it already has equal ones. Those are then used by the functions
+  // of the module, so the copies of the module are left unused. Module
+  // variable names keep their copies, map keys being compared by content.
+  if (worker->strings != NULL) {
+    if (vm->strings == NULL)
+      vm->strings = (LsObjMap *)ls_val2obj(ls_new_map(vm));
+
+    size_t iterator = 0;
+    LsValue str, value;
+    while (ls_map_next(worker->strings, &iterator, &str, &value)) {
+      if (ls_map_get(vm->strings, str) == LS_UNDEFINED)
+        ls_map_set(vm, vm->strings, str, str);
+    }
+
+    for (LsObj *obj = worker->first_obj; obj != NULL; obj = obj->next) {
+      if (obj->type != LS_OBJ_FN)
+        continue;
+
+      LsObjFn *fn = (LsObjFn *)obj;
+      for (size_t i = 0; i < fn->constants.length; i++)
+        fn->constants.data[i] = link_string(vm, fn->constants.data[i]);
+      if (fn->name != NULL) {
+        fn->name = (LsObjString *)ls_val2obj(
+            link_string(vm, ls_obj2val(&fn->name->obj)));
+      }
+      if (fn->lazy != NULL) {
+        ValueBuffer *names = &fn->lazy->upvalue_names;
+        for (size_t i = 0; i < names->length; i++)
+          names->data[i] = link_string(vm, names->data[i]);
+      }
+    }
+  }
+
+  // Prepend the objects of the module to the ones of [vm], except for its
+  // string table, which isn't needed anymore.
+  if (worker->strings != NULL)
+    ls_free_obj(worker, &worker->strings->obj);
+  LsObj **link = &worker->first_obj;
+  while (*link != NULL)
+    link = &(*link)->next;
+  *link = vm->first_obj;
+  vm->first_obj = worker->first_obj;
+  vm->bytes_allocated += worker->bytes_allocated;
+}
+
+bool ls_compile_modules(LsVM *vm, const char *const *sources,
+                        const size_t *lengths, size_t count, LsObjFn **fns) {
+  ModuleQueue queue;
+  queue.sources = sources;
+  queue.lengths = lengths;
+  queue.count = count;
+  queue.next = 0;
+  queue.jobs = ls_allocate_array(vm, ModuleJob, count);
+  for (size_t i = 0; i < count; i++) {
+    ModuleJob *job = &queue.jobs[i];
+    memset(&job->vm, 0, sizeof(LsVM));
+    job->vm.config = vm->config;
+    job->vm.config.on_error =
+        vm->config.on_error != NULL ? collect_module_error : NULL;
+    job->vm.config.user_data = job;
+    // Garbage is only collected on the VM thread, once the module is linked.
+    job->vm.next_gc = SIZE_MAX;
+    ls_module_error_buffer_init(&job->errors);
+  }
+
+  // The calling thread compiles modules too, along with the other threads.
+  size_t num_threads = vm->config.compile_threads > 0
+                           ? (size_t)vm->config.compile_threads
+                           : DEFAULT_COMPILE_THREADS;
+  if (num_threads > count)
+    num_threads = count;
+
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_t threads[MAX_COMPILE_THREADS];
+  size_t started = 0;
+  while (started + 1 < num_threads && started < MAX_COMPILE_THREADS &&
+         pthread_create(&threads[started], NULL, compile_modules, &queue) == 0)
+    started++;
+  compile_modules(&queue);
+  for (size_t i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&queue.lock);
+
+  bool compiled = true;
+  for (size_t i = 0; i < count; i++) {
+    link_module(vm, &queue.jobs[i]);
+    fns[i] = queue.jobs[i].fn;
+    compiled = compiled && fns[i] != NULL;
+  }
+
+  ls_reallocate(vm, queue.jobs, count * sizeof(ModuleJob), 0);
+  return compiled;
 }
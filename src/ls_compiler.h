@@ -5,6 +5,39 @@
 
 typedef struct ls_compiler LsCompiler;
 
-LsObj *ls_compile(LsVM *vm, const char *source);
+// Compiles [source], a string of LightScript source code, to a function that
+// runs it in a new module. Returns NULL if there is a compile error, which
+// is reported through the on_error callback of [vm].
+LsObjFn *ls_compile(LsVM *vm, const char *source);
+
+// Compiles the [length] bytes of source code at [source], which don't need to
+// be followed by a null terminator, like ls_compile().
+LsObjFn *ls_compile_length(LsVM *vm, const char *source, size_t length);
+
+// Compiles the [length] bytes of source code at [source] to a function that
+// runs it in [module], like ls_compile(). The variables [module] already has
+// are visible to the code, which can't declare them again.
+LsObjFn *ls_compile_in_module(LsVM *vm, LsObjModule *module,
+                              const char *source, size_t length);
+
+// Compiles the source code returned by successive calls to [read] with
+// [data], until it returns 0, like ls_compile().
+LsObjFn *ls_compile_reader(LsVM *vm, LsReadFn read, void *data);
+
+// Compiles the [count] modules whose source code is in [sources], with the
+// lengths in [lengths], and stores the functions that run them in [fns], like
+// ls_compile_length(). Modules are parsed and compiled on the compile_threads
+// of [vm]'s configuration, each with memory of its own. Only linking them,
+// i.e. moving their objects to [vm] and interning their strings, runs on the
+// calling thread, where compile errors are then reported in module order.
+//
+// Returns false if any module has a compile error. Its function is NULL.
+bool ls_compile_modules(LsVM *vm, const char *const *sources,
+                        const size_t *lengths, size_t count, LsObjFn **fns);
+
+// Compiles the code of [fn], a function whose body was only checked when its
+// module was compiled with the lazy_compile option. Returns false if there is
+// a compile error, which is reported through the on_error callback of [vm].
+bool ls_compile_lazy(LsVM *vm, LsObjFn *fn);
 
 #endif
@@ -0,0 +1,373 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ls_image.h"
+#include "ls_options.h"
+#include "ls_vm.h"
+
+// Appends [size] zeroed bytes to [image], aligned to [alignment] bytes, and
+// returns their offset.
+static size_t reserve(LsVM *vm, ByteBuffer *image, size_t size,
+                      size_t alignment) {
+  ls_byte_buffer_fill(vm, image, 0,
+                      (alignment - image->length % alignment) % alignment);
+  size_t offset = image->length;
+  ls_byte_buffer_fill(vm, image, 0, size);
+  return offset;
+}
+
+// Appends the [size] bytes at [data] to [image], aligned to [alignment]
+// bytes, and returns their offset.
+static uint32_t append(LsVM *vm, ByteBuffer *image, const void *data,
+                       size_t size, size_t alignment) {
+  size_t offset = reserve(vm, image, size, alignment);
+  if (size > 0)
+    memcpy(image->data + offset, data, size);
+  return (uint32_t)offset;
+}
+
+// Returns the index of [value] in [values], adding it if it isn't there yet.
+// [indices] maps the values to their index.
+static uint32_t number_value(LsVM *vm, ValueBuffer *values,
+                             LsObjMap *indices, LsValue value) {
+  LsValue index = ls_map_get(indices, value);
+  if (index != LS_UNDEFINED)
+    return (uint32_t)ls_val2num(index);
+
+  ls_map_set(vm, indices, value, ls_num2val((double)values->length));
+  ls_value_buffer_write(vm, values, value);
+  return (uint32_t)(values->length - 1);
+}
+
+bool ls_write_image(LsVM *vm, LsObjFn *fn, ByteBuffer *image) {
+  // Number the functions reachable from [fn] and the strings they use.
+  ValueBuffer fns, strings;
+  LsObjMap fn_indices, string_indices;
+  ls_value_buffer_init(&fns);
+  ls_value_buffer_init(&strings);
+  ls_init_map(&fn_indices);
+  ls_init_map(&string_indices);
+  number_value(vm, &fns, &fn_indices, ls_obj2val(&fn->obj));
+
+  bool written = true;
+  for (size_t i = 0; i < fns.length && written; i++) {
+    LsObjFn *current = (LsObjFn *)ls_val2obj(fns.data[i]);
+    if (current->lazy != NULL && !ls_prepare_fn(vm, current)) {
+      written = false;
+      break;
+    }
+
+    for (size_t j = 0; j < current->constants.length; j++) {
+      LsValue constant = current->constants.data[j];
+      if (!ls_is_obj(constant))
+        continue;
+
+      LsObjType type = ls_val2obj(constant)->type;
+      if (type == LS_OBJ_FN) {
+        number_value(vm, &fns, &fn_indices, constant);
+      } else if (type == LS_OBJ_STRING) {
+        number_value(vm, &strings, &string_indices, constant);
+      } else {
+        written = false;
+      }
+    }
+
+    if (current->name != NULL)
+      number_value(vm, &strings, &string_indices,
+                   ls_obj2val(&current->name->obj));
+  }
+
+  // The names of the module variables, which modules loaded from an image
+  // don't have.
+  LsObjModule *module = fn->module;
+  size_t num_variables = module->variables.length;
+  uint32_t *names = ls_allocate_array(vm, uint32_t, num_variables);
+  for (size_t i = 0; i < num_variables; i++)
+    names[i] = IMAGE_NO_NAME;
+  size_t iterator = 0;
+  LsValue name, index;
+  while (ls_map_next(module->variable_names, &iterator, &name, &index)) {
+    names[(size_t)ls_val2num(index)] =
+        number_value(vm, &strings, &string_indices, name);
+  }
+
+  ImageHeader header;
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  header.version = IMAGE_VERSION;
+  header.num_fns = (uint32_t)fns.length;
+  header.num_strings = (uint32_t)strings.length;
+  header.num_variables = (uint32_t)num_variables;
+
+  image->length = 0;
+  reserve(vm, image, sizeof(ImageHeader), IMAGE_ALIGNMENT);
+  header.fns = (uint32_t)reserve(vm, image, fns.length * sizeof(ImageFn),
+                                 sizeof(uint32_t));
+  header.strings = (uint32_t)reserve(
+      vm, image, strings.length * sizeof(ImageString), sizeof(uint32_t));
+  header.variables = append(vm, image, names, num_variables * sizeof(uint32_t),
+                            sizeof(uint32_t));
+  ls_reallocate(vm, names, num_variables * sizeof(uint32_t), 0);
+
+  for (size_t i = 0; i < fns.length && written; i++) {
+    LsObjFn *current = (LsObjFn *)ls_val2obj(fns.data[i]);
+    ImageFn out;
+    out.constants = (uint32_t)reserve(
+        vm, image, current->constants.length * sizeof(uint64_t),
+        sizeof(uint64_t));
+    for (size_t j = 0; j < current->constants.length; j++) {
+      LsValue constant = current->constants.data[j];
+      uint64_t stored = constant;
+      if (ls_is_obj(constant) && ls_val2obj(constant)->type == LS_OBJ_FN) {
+        stored = IMAGE_REF(number_value(vm, &fns, &fn_indices, constant), 1);
+      } else if (ls_is_obj(constant)) {
+        stored = IMAGE_REF(
+            number_value(vm, &strings, &string_indices, constant), 0);
+      }
+      memcpy(image->data + out.constants + j * sizeof(uint64_t), &stored,
+             sizeof(uint64_t));
+    }
+    out.num_constants = (uint32_t)current->constants.length;
+
+    out.lines = append(vm, image, current->lines.data,
+                       current->lines.length * sizeof(int32_t),
+                       sizeof(int32_t));
+    out.code = append(vm, image, current->code.data, current->code.length, 1);
+    out.code_length = (uint32_t)current->code.length;
+    out.upvalues = append(vm, image, current->upvalues.data,
+                          current->upvalues.length, 1);
+    out.upvalues_length = (uint32_t)current->upvalues.length;
+
+    out.name = current->name == NULL
+                   ? IMAGE_NO_NAME
+                   : number_value(vm, &strings, &string_indices,
+                                  ls_obj2val(&current->name->obj));
+    out.max_slots = (uint32_t)current->max_slots;
+    out.arity = (uint32_t)current->arity;
+    out.num_upvalues = (uint32_t)current->num_upvalues;
+    memcpy(image->data + header.fns + i * sizeof(ImageFn), &out,
+           sizeof(ImageFn));
+  }
+
+  for (size_t i = 0; i < strings.length && written; i++) {
+    LsObjString *str = (LsObjString *)ls_val2obj(strings.data[i]);
+    ImageString out;
+    out.offset = append(vm, image, str->value, str->length, 1);
+    out.length = (uint32_t)str->length;
+    memcpy(image->data + header.strings + i * sizeof(ImageString), &out,
+           sizeof(ImageString));
+  }
+
+  // Offsets are 32-bit.
+  if (image->length > UINT32_MAX)
+    written = false;
+
+  header.length = (uint32_t)image->length;
+  memcpy(image->data, &header, sizeof(ImageHeader));
+
+  ls_value_buffer_clear(vm, &fns);
+  ls_value_buffer_clear(vm, &strings);
+  ls_map_clear(vm, &fn_indices);
+  ls_map_clear(vm, &string_indices);
+  return written;
+}
+
+// Returns true if [count] elements of [size] bytes at [offset], aligned to
+// [alignment] bytes, fit in an image of [length] bytes.
+static bool in_image(size_t length, uint32_t offset, uint32_t count,
+                     size_t size, size_t alignment) {
+  return offset % alignment == 0 && offset <= length &&
+         count <= (length - offset) / size;
+}
+
+// The constants of a function of an image with [num_fns] functions.
+typedef struct {
+  const uint64_t *constants;
+  uint32_t num_fns;
+} ImageConstants;
+
+// Returns whether the constant at [index] of the ImageConstants [data]
+// references a function of the image.
+static bool is_image_fn(const void *data, uint32_t index) {
+  const ImageConstants *constants = data;
+  uint64_t constant = constants->constants[index];
+  uint64_t ref = constant & ~(QNAN | SIGN_BIT);
+  return ls_is_obj(constant) && (ref & 1) == 1 &&
+         (ref >> 1) < constants->num_fns;
+}
+
+// Returns true if the [length] bytes at [data] are an image of this version
+// whose tables all stay inside it, and whose functions describe each of their
+// upvalues, use no more slots than compiled ones can, and have code that
+// passes ls_check_code().
+static bool check_image(LsVM *vm, const uint8_t *data, size_t length) {
+  if ((uintptr_t)data % IMAGE_ALIGNMENT != 0 || length < sizeof(ImageHeader))
+    return false;
+
+  const ImageHeader *header = (const ImageHeader *)data;
+  if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != IMAGE_VERSION || header->length != length ||
+      header->num_fns == 0 || header->num_variables > MAX_MODULE_VARS ||
+      !in_image(length, header->fns, header->num_fns, sizeof(ImageFn),
+                sizeof(uint32_t)) ||
+      !in_image(length, header->strings, header->num_strings,
+                sizeof(ImageString), sizeof(uint32_t)) ||
+      !in_image(length, header->variables, header->num_variables,
+                sizeof(uint32_t), sizeof(uint32_t)))
+    return false;
+
+  const ImageString *strings = (const ImageString *)(data + header->strings);
+  for (uint32_t i = 0; i < header->num_strings; i++) {
+    if (!in_image(length, strings[i].offset, strings[i].length, 1, 1))
+      return false;
+  }
+
+  const ImageFn *fns = (const ImageFn *)(data + header->fns);
+  for (uint32_t i = 0; i < header->num_fns; i++) {
+    const ImageFn *fn = &fns[i];
+    if (!in_image(length, fn->code, fn->code_length, 1, 1) ||
+        fn->code_length == 0 ||
+        !in_image(length, fn->lines, fn->code_length, sizeof(int32_t),
+                  sizeof(int32_t)) ||
+        !in_image(length, fn->constants, fn->num_constants, sizeof(uint64_t),
+                  sizeof(uint64_t)) ||
+        !in_image(length, fn->upvalues, fn->upvalues_length, 1, 1) ||
+        (fn->name != IMAGE_NO_NAME && fn->name >= header->num_strings) ||
+        fn->arity > MAX_PARAMETERS || fn->num_upvalues > MAX_UPVALUES ||
+        fn->upvalues_length != 2 * fn->num_upvalues ||
+        fn->max_slots > MAX_SLOTS)
+      return false;
+
+    ImageConstants constants = {
+        .constants = (const uint64_t *)(data + fn->constants),
+        .num_fns = header->num_fns};
+    LsCodeLimits limits = {.code = data + fn->code,
+                           .code_length = fn->code_length,
+                           .max_slots = fn->max_slots,
+                           .num_upvalues = fn->num_upvalues,
+                           .num_constants = fn->num_constants,
+                           .num_variables = header->num_variables,
+                           .is_fn = is_image_fn,
+                           .data = &constants};
+    if (!ls_check_code(vm, &limits))
+      return false;
+  }
+
+  return true;
+}
+
+LsObjFn *ls_load_image(LsVM *vm, const uint8_t *data, size_t length) {
+  if (!check_image(vm, data, length))
+    return NULL;
+
+  const ImageHeader *header = (const ImageHeader *)data;
+  LsImage *image = ls_allocate(vm, LsImage);
+  // TODO: handle oom.
+  image->data = data;
+  image->header = header;
+  image->num_strings = header->num_strings;
+  image->strings = ls_allocate_array(vm, LsValue, image->num_strings);
+  for (uint32_t i = 0; i < image->num_strings; i++)
+    image->strings[i] = LS_UNDEFINED;
+  image->num_fns = header->num_fns;
+  image->fns = ls_allocate_array(vm, LsObjFn *, image->num_fns);
+
+  // The variables are defined when the module runs. Their names are only
+  // needed to compile code, so they aren't loaded.
+  LsObjModule *module = ls_new_module(vm);
+  module->image = image;
+  ls_value_buffer_fill(vm, &module->variables, LS_NULL,
+                       header->num_variables);
+
+  // The functions run their code in place.
+  const ImageFn *fns = (const ImageFn *)(data + header->fns);
+  for (uint32_t i = 0; i < header->num_fns; i++) {
+    const ImageFn *in = &fns[i];
+    LsObjFn *fn = ls_new_fn(vm, module);
+    fn->borrows_code = true;
+    fn->code.data = (uint8_t *)(data + in->code);
+    fn->code.length = fn->code.capacity = in->code_length;
+    fn->lines.data = (int32_t *)(data + in->lines);
+    fn->lines.length = fn->lines.capacity = in->code_length;
+    fn->upvalues.data = (uint8_t *)(data + in->upvalues);
+    fn->upvalues.length = fn->upvalues.capacity = in->upvalues_length;
+    fn->max_slots = (int)in->max_slots;
+    fn->arity = (int)in->arity;
+    fn->num_upvalues = (int)in->num_upvalues;
+
+    fn->lazy = ls_allocate(vm, LsLazyFn);
+    // TODO: handle oom.
+    fn->lazy->source = NULL;
+    fn->lazy->start = 0;
+    fn->lazy->line = 0;
+    ls_value_buffer_init(&fn->lazy->upvalue_names);
+    fn->lazy->upvalues_captured = false;
+    fn->lazy->bare = false;
+    fn->lazy->image = image;
+    fn->lazy->index = i;
+    image->fns[i] = fn;
+  }
+
+  // The function running the module is called right away.
+  LsObjFn *fn = image->fns[0];
+  return ls_load_constants(vm, fn) ? fn : NULL;
+}
+
+// Returns the string of [image] at [index], creating it on first use, or
+// LS_UNDEFINED if there is none.
+static LsValue load_string(LsVM *vm, LsImage *image, uint64_t index) {
+  if (index >= image->num_strings)
+    return LS_UNDEFINED;
+
+  if (image->strings[index] == LS_UNDEFINED) {
+    const ImageString *str =
+        (const ImageString *)(image->data + image->header->strings) + index;
+    image->strings[index] = ls_intern_string(
+        vm, (const char *)image->data + str->offset, str->length);
+  }
+
+  return image->strings[index];
+}
+
+bool ls_load_constants(LsVM *vm, LsObjFn *fn) {
+  LsLazyFn *lazy = fn->lazy;
+  LsImage *image = lazy->image;
+  const ImageFn *in =
+      (const ImageFn *)(image->data + image->header->fns) + lazy->index;
+
+  const uint64_t *constants = (const uint64_t *)(image->data + in->constants);
+  ls_value_buffer_reserve(vm, &fn->constants, in->num_constants);
+  for (uint32_t i = 0; i < in->num_constants; i++) {
+    LsValue constant = constants[i];
+    if (ls_is_obj(constant)) {
+      uint64_t ref = constant & ~(QNAN | SIGN_BIT);
+      if ((ref & 1) == 0) {
+        constant = load_string(vm, image, ref >> 1);
+      } else if ((ref >> 1) < image->num_fns) {
+        constant = ls_obj2val(&image->fns[ref >> 1]->obj);
+      } else {
+        constant = LS_UNDEFINED;
+      }
+
+      if (constant == LS_UNDEFINED) {
+        ls_value_buffer_clear(vm, &fn->constants);
+        return false;
+      }
+    }
+
+    ls_value_buffer_write(vm, &fn->constants, constant);
+  }
+
+  if (in->name != IMAGE_NO_NAME)
+    fn->name = (LsObjString *)ls_val2obj(load_string(vm, image, in->name));
+
+  ls_free(vm, lazy);
+  fn->lazy = NULL;
+  return true;
+}
+
+void ls_free_image(LsVM *vm, LsImage *image) {
+  ls_reallocate(vm, image->strings, image->num_strings * sizeof(LsValue), 0);
+  ls_reallocate(vm, image->fns, image->num_fns * sizeof(LsObjFn *), 0);
+  ls_free(vm, image);
+}
@@ -0,0 +1,132 @@
+#ifndef LS_IMAGE_H_INCLUDE
+#define LS_IMAGE_H_INCLUDE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ls_buffer.h"
+#include "ls_value.h"
+
+// An image is a compiled module, which runs without being compiled again.
+//
+// Its parts refer to each other by their offset from the start of the image,
+// never by pointer, so an image can be memory mapped read-only and run in
+// place: the code and line tables of its functions aren't copied. Integers
+// are stored in the byte order of the machine that wrote the image, which
+// must be the one of the machine that loads it.
+//
+// An image starts with an ImageHeader, followed by the tables of its
+// functions, strings and module variables, then the data they point to. The
+// first function runs the module.
+//
+// Images are trusted like source code: their bytecode isn't verified, only
+// that the tables stay inside the image.
+
+// The first bytes of every image.
+#define IMAGE_MAGIC "LSBC"
+
+// Bumped whenever the layout of images or the bytecode changes, since images
+// of other versions can't be loaded.
+#define IMAGE_VERSION 2
+
+// The alignment of images in memory, for their 64-bit constants.
+#define IMAGE_ALIGNMENT 8
+
+// The name index of functions without a name.
+#define IMAGE_NO_NAME UINT32_MAX
+
+// Constants that are objects are stored as references to the functions and
+// strings of the image: object values whose "pointer" is the index of the
+// object shifted left by one, with the low bit set for functions.
+#define IMAGE_REF(index, is_fn)                                                \
+  (QNAN | SIGN_BIT | ((uint64_t)(index) << 1) | (uint64_t)(is_fn))
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+
+  // The length of the whole image in bytes.
+  uint32_t length;
+
+  // The offset of an array of [num_fns] ImageFn.
+  uint32_t fns;
+  uint32_t num_fns;
+
+  // The offset of an array of [num_strings] ImageString.
+  uint32_t strings;
+  uint32_t num_strings;
+
+  // The offset of an array with the string index of the name of each of the
+  // [num_variables] module variables.
+  uint32_t variables;
+  uint32_t num_variables;
+} ImageHeader;
+
+// A string of [length] bytes at [offset].
+typedef struct {
+  uint32_t offset;
+  uint32_t length;
+} ImageString;
+
+typedef struct {
+  // The offsets of [code_length] bytes of code, and of the line of each of
+  // them as an int32_t.
+  uint32_t code;
+  uint32_t lines;
+  uint32_t code_length;
+
+  // The offset of [num_constants] constants, stored as uint64_t values.
+  uint32_t constants;
+  uint32_t num_constants;
+
+  // The offset of the [upvalues_length] bytes describing the upvalues.
+  uint32_t upvalues;
+  uint32_t upvalues_length;
+
+  // The index of the name of the function in the strings, or IMAGE_NO_NAME.
+  uint32_t name;
+
+  uint32_t max_slots;
+  uint32_t arity;
+  uint32_t num_upvalues;
+} ImageFn;
+
+// The state of an image while its module is loaded.
+struct ls_image {
+  const uint8_t *data;
+  const ImageHeader *header;
+
+  // The strings of the image, which are created the first time a function
+  // using them is called. LS_UNDEFINED until then.
+  LsValue *strings;
+  uint32_t num_strings;
+
+  // The functions of the image, by index.
+  LsObjFn **fns;
+  uint32_t num_fns;
+};
+
+// Writes the module run by [fn], and all the functions it defines, to
+// [image]. Functions compiled lazily are compiled first.
+//
+// Returns false if there is a compile error, or if the image would be larger
+// than 4GB.
+bool ls_write_image(LsVM *vm, LsObjFn *fn, ByteBuffer *image);
+
+// Loads the module of the [length] bytes image at [data] and returns the
+// function that runs it, or NULL if it isn't a valid image of this version.
+// [data] must be aligned to IMAGE_ALIGNMENT, and must stay unchanged as long
+// as the functions of the module exist.
+LsObjFn *ls_load_image(LsVM *vm, const uint8_t *data, size_t length);
+
+// Creates the constants of [fn], a function loaded from an image that hasn't
+// been called yet. Returns false if the image refers to a function or a
+// string it doesn't have.
+bool ls_load_constants(LsVM *vm, LsObjFn *fn);
+
+// Frees [image], along with its module. Its data isn't read anymore, so it
+// may already be unmapped.
+void ls_free_image(LsVM *vm, LsImage *image);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef LS_NUMBER_H_INCLUDE
+#define LS_NUMBER_H_INCLUDE
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Parses the [length] bytes at [text] as an unsigned number literal and stores
+// it in [result]. The syntax is the one of LightScript literals: decimal
+// digits with an optional fraction and exponent ("12", "1.5", "2e-3"), or
+// hexadecimal digits after a "0x" prefix. A fraction without integer digits
+// (".5") is also accepted.
+//
+// Decimal numbers are rounded to the nearest double, ties to even, like a
+// correctly rounded strtod() but without depending on the locale. Numbers too
+// large for a double are stored as infinity.
+//
+// Returns false and leaves [result] untouched if [text] isn't entirely a
+// number.
+bool ls_parse_number(const char *text, size_t length, double *result);
+
+// The operators on numbers. The interpreter and the compiler's constant
+// folding both use them, so folded code computes the same results.
+
+// Returns the remainder of [a] divided by [b], with the sign of [a].
+static inline double ls_num_mod(double a, double b) { return fmod(a, b); }
+
+// Returns [a] raised to the power [b].
+static inline double ls_num_pow(double a, double b) { return pow(a, b); }
+
+// Converts [num] to the 32-bit integer bitwise operators work on: its
+// integral part modulo 2^32. NaN and infinities convert to zero.
+static inline int32_t ls_num_to_int32(double num) {
+  if (!(num > -4294967296.0 && num < 4294967296.0)) {
+    if (isnan(num) || isinf(num))
+      return 0;
+    num = fmod(num, 4294967296.0);
+  }
+
+  return (int32_t)(uint32_t)(int64_t)num;
+}
+
+static inline double ls_num_band(double a, double b) {
+  return ls_num_to_int32(a) & ls_num_to_int32(b);
+}
+
+static inline double ls_num_bor(double a, double b) {
+  return ls_num_to_int32(a) | ls_num_to_int32(b);
+}
+
+static inline double ls_num_bnot(double a) { return ~ls_num_to_int32(a); }
+
+// Shifts only use the low 5 bits of their count.
+static inline double ls_num_shl(double a, double b) {
+  return (int32_t)((uint32_t)ls_num_to_int32(a) << (ls_num_to_int32(b) & 31));
+}
+
+static inline double ls_num_shr(double a, double b) {
+  return ls_num_to_int32(a) >> (ls_num_to_int32(b) & 31);
+}
+
+#endif
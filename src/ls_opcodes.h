@@ -55,6 +55,15 @@ OPCODE(LOAD_UPVALUE, 1)
 // Stores the top of stack in upvalue [arg]. Does not pop it.
 OPCODE(STORE_UPVALUE, 0)
 
+// Pushes the value in local slot [arg] of the calling function. A function
+// runs bare, without a closure, when it is only called by the function that
+// defines it, and uses these instead of the _UPVALUE instructions.
+OPCODE(LOAD_PARENT_LOCAL, 1)
+
+// Stores the top of stack in local slot [arg] of the calling function. Does
+// not pop it.
+OPCODE(STORE_PARENT_LOCAL, 0)
+
 // Pushes the value of the top-level variable in slot [arg].
 OPCODE(LOAD_MODULE_VAR, 1)
 
@@ -82,8 +91,38 @@ OPCODE(STORE_FIELD, -1)
 // Pop and discard the top of stack.
 OPCODE(POP, -1)
 
-// Invoke the method with symbol [arg]. The number indicates the number of
-// arguments (not including the receiver).
+// Pop two operands and push the result of the operator. Numbers, and strings
+// for ADD, are handled inline. Other operands are an error until metatables
+// are supported.
+OPCODE(ADD, -1)
+OPCODE(SUB, -1)
+OPCODE(MUL, -1)
+OPCODE(DIV, -1)
+OPCODE(MOD, -1)
+OPCODE(POW, -1)
+OPCODE(BAND, -1)
+OPCODE(BOR, -1)
+OPCODE(SHL, -1)
+OPCODE(SHR, -1)
+
+// Pop two operands and push whether they are equal, see ls_val_eq().
+OPCODE(EQ, -1)
+OPCODE(NEQ, -1)
+
+// Pop two numbers and push the result of comparing them.
+OPCODE(LT, -1)
+OPCODE(LE, -1)
+OPCODE(GT, -1)
+OPCODE(GE, -1)
+
+// Replace the top of stack with the result of the unary operator.
+OPCODE(NEGATE, 0)
+OPCODE(NOT, 0)
+OPCODE(BNOT, 0)
+
+// Call the function below the arguments on the stack. The number indicates
+// the number of arguments (not including the function). The function and the
+// arguments are replaced by the value it returns.
 OPCODE(CALL_0, 0)
 OPCODE(CALL_1, -1)
 OPCODE(CALL_2, -2)
@@ -146,12 +185,13 @@ OPCODE(CLOSE_UPVALUE, -1)
 // stack.
 OPCODE(RETURN, 0)
 
+// Suspend the running fiber, and give the value on the top of the stack to
+// the fiber or the host that resumed it. The value is replaced by the one the
+// fiber is resumed with.
+OPCODE(YIELD, 0)
+
 // Creates a closure for the function stored at [arg] in the constant table.
-//
-// Following the function argument is a number of arguments, two for each
-// upvalue. The first is true if the variable being captured is a local (as
-// opposed to an upvalue), and the second is the index of the local or
-// upvalue being captured.
+// The variables it captures are described by the upvalues of the function.
 //
 // Pushes the created closure.
 OPCODE(CLOSURE, 1)
@@ -14,8 +14,40 @@
 // identify the local, only 256 can be in scope at one time.
 #define MAX_LOCALS 256
 
+// The maximum number of module-level variables that may be defined at one
+// time. This limitation comes from the 16 bits used for the arguments to
+// `CODE_LOAD_MODULE_VAR` and `CODE_STORE_MODULE_VAR`.
+#define MAX_MODULE_VARS 65536
+
+// The maximum number of distinct constants that a function can contain. This
+// value is explicit in the bytecode since `CODE_CONSTANT` only takes a single
+// two-byte argument.
+#define MAX_CONSTANTS (1 << 16)
+
+// The maximum distance a CODE_JUMP or CODE_JUMP_IF instruction can move the
+// instruction pointer.
+#define MAX_JUMP (1 << 16)
+
+// The maximum number of parameters a function can take. This limitation comes
+// from the CODE_CALL_n instructions, which exist for 0 to 16 arguments.
+#define MAX_PARAMETERS 16
+
 // The maximum number of upvalues (i.e. variables from enclosing functions)
 // that a function can close over.
 #define MAX_UPVALUES 256
 
+// The maximum number of stack slots a function can use at once, for its
+// locals and the temporaries of the expressions it evaluates. The stack of a
+// fiber grows by that much for each call, so images are checked against it.
+#define MAX_SLOTS (MAX_LOCALS + 768)
+
+// The number of stack slots and of call frames a fiber starts with. Both grow
+// while it runs if needed.
+#define FIBER_STACK_SLOTS 32
+#define FIBER_FRAMES 4
+
+// The maximum number of stacks of fibers that are done a VM keeps for the
+// next fibers to start with. The others are freed.
+#define MAX_FREE_STACKS 1024
+
 #endif
@@ -0,0 +1,276 @@
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ls_pool.h"
+#include "ls_program.h"
+#include "ls_value.h"
+
+static void init_queue(JobQueue *queue) {
+  queue->jobs = NULL;
+  queue->head = 0;
+  queue->count = 0;
+  queue->capacity = 0;
+  pthread_mutex_init(&queue->lock, NULL);
+}
+
+// Appends [job] to [queue].
+static void push_job(LsPool *pool, JobQueue *queue, LsJob *job) {
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count == queue->capacity) {
+    size_t capacity = queue->capacity == 0 ? 16 : queue->capacity * 2;
+    LsJob **jobs = pool->reallocate(NULL, capacity * sizeof(LsJob *));
+    // TODO: handle oom.
+    for (size_t i = 0; i < queue->count; i++)
+      jobs[i] = queue->jobs[(queue->head + i) % queue->capacity];
+    if (queue->jobs != NULL)
+      pool->reallocate(queue->jobs, 0);
+    queue->jobs = jobs;
+    queue->head = 0;
+    queue->capacity = capacity;
+  }
+
+  queue->jobs[(queue->head + queue->count) % queue->capacity] = job;
+  queue->count++;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+// Removes the oldest job of [queue], or the newest one if [newest], and
+// returns it. Returns NULL if [queue] is empty.
+static LsJob *pop_job(JobQueue *queue, bool newest) {
+  pthread_mutex_lock(&queue->lock);
+  LsJob *job = NULL;
+  if (queue->count > 0) {
+    if (newest) {
+      job = queue->jobs[(queue->head + queue->count - 1) % queue->capacity];
+    } else {
+      job = queue->jobs[queue->head];
+      queue->head = (queue->head + 1) % queue->capacity;
+    }
+    queue->count--;
+  }
+
+  pthread_mutex_unlock(&queue->lock);
+  return job;
+}
+
+// Removes [job] from [queue]. Returns false if it isn't there.
+static bool remove_job(JobQueue *queue, LsJob *job) {
+  pthread_mutex_lock(&queue->lock);
+  bool found = false;
+  for (size_t i = 0; i < queue->count && !found; i++) {
+    if (queue->jobs[(queue->head + i) % queue->capacity] != job)
+      continue;
+
+    for (size_t j = i; j + 1 < queue->count; j++) {
+      queue->jobs[(queue->head + j) % queue->capacity] =
+          queue->jobs[(queue->head + j + 1) % queue->capacity];
+    }
+    queue->count--;
+    found = true;
+  }
+
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+// Takes the next job [worker] runs: the oldest of its own queue, or else the
+// newest of the queue of another worker. Returns NULL if all are empty.
+static LsJob *take_job(Worker *worker) {
+  LsPool *pool = worker->pool;
+  LsJob *job = pop_job(&worker->queue, false);
+  for (int i = 1; i < pool->num_workers && job == NULL; i++) {
+    Worker *victim = &pool->workers[(worker->index + i) % pool->num_workers];
+    job = pop_job(&victim->queue, true);
+  }
+
+  return job;
+}
+
+// Sets the [result] of [job] and wakes up those awaiting it. Must be called
+// with the lock of [job] held. [job] may be freed as soon as it is released.
+static void finish_job(LsJob *job, LsInterpretResult result) {
+  job->result = result;
+  job->state = JOB_DONE;
+  pthread_cond_broadcast(&job->done);
+}
+
+// Waits for a post of the semaphore of [pool].
+static void wait_work(LsPool *pool) {
+  while (sem_wait(&pool->work) == -1 && errno == EINTR)
+    ;
+}
+
+// Runs jobs with the Worker [data] until the pool stops.
+static void *run_jobs(void *data) {
+  Worker *worker = data;
+  LsPool *pool = worker->pool;
+  for (;;) {
+    // Each post is made once a job is pushed, so there is one to take unless
+    // it was canceled meanwhile, or the pool stops.
+    wait_work(pool);
+    LsJob *job = take_job(worker);
+    if (job == NULL) {
+      if (__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE))
+        return NULL;
+      continue;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    if (job->canceled) {
+      finish_job(job, LS_RESULT_CANCELED);
+      pthread_mutex_unlock(&job->lock);
+      continue;
+    }
+    job->state = JOB_RUNNING;
+    pthread_mutex_unlock(&job->lock);
+
+    // A job preempted before resumes in the VM it kept.
+    LsVM *vm = job->vm != NULL ? job->vm : worker->vm;
+    LsInterpretResult result =
+        job->vm != NULL ? ls_resume_null(vm, ls_get_preempted_fiber(vm))
+                        : ls_run_program(vm, job->program);
+
+    // A preempted job is queued again behind the others. It keeps the VM it
+    // ran in, since its heap and suspended fiber can't be shared with the
+    // next jobs, and the worker goes on with a new one.
+    if (result == LS_RESULT_SUSPENDED && ls_get_preempted_fiber(vm) != NULL) {
+      if (job->vm == NULL) {
+        job->vm = vm;
+        worker->vm = ls_new_vm(&pool->config);
+      }
+      job->worker = worker->index;
+      push_job(pool, &worker->queue, job);
+      sem_post(&pool->work);
+      continue;
+    }
+
+    if (job->vm != NULL)
+      ls_free_vm(job->vm);
+    else
+      ls_free_objects(vm);
+
+    pthread_mutex_lock(&job->lock);
+    finish_job(job, result);
+    pthread_mutex_unlock(&job->lock);
+  }
+}
+
+// Stops the threads of the first [started] workers of [pool] once the queues
+// are empty, then frees [pool].
+static void free_pool(LsPool *pool, int started) {
+  __atomic_store_n(&pool->stopping, true, __ATOMIC_RELEASE);
+  for (int i = 0; i < started; i++)
+    sem_post(&pool->work);
+
+  for (int i = 0; i < started; i++)
+    pthread_join(pool->workers[i].thread, NULL);
+
+  for (int i = 0; i < pool->num_workers; i++) {
+    Worker *worker = &pool->workers[i];
+    ls_free_vm(worker->vm);
+    if (worker->queue.jobs != NULL)
+      pool->reallocate(worker->queue.jobs, 0);
+    pthread_mutex_destroy(&worker->queue.lock);
+  }
+
+  sem_destroy(&pool->work);
+  pool->reallocate(pool->workers, 0);
+  pool->reallocate(pool, 0);
+}
+
+LsPool *ls_new_pool(LsConfiguration *config, int workers) {
+  if (workers <= 0)
+    workers = DEFAULT_POOL_WORKERS;
+  if (workers > MAX_POOL_WORKERS)
+    workers = MAX_POOL_WORKERS;
+
+  // The VM of the first worker resolves the default configuration.
+  LsVM *first = ls_new_vm(config);
+  LsReallocateFn reallocate = first->config.reallocate;
+
+  LsPool *pool = reallocate(NULL, sizeof(LsPool));
+  // TODO: handle oom.
+  pool->reallocate = reallocate;
+  pool->config = first->config;
+  pool->workers = reallocate(NULL, sizeof(Worker) * (size_t)workers);
+  pool->num_workers = workers;
+  pool->next_worker = 0;
+  pool->stopping = false;
+  sem_init(&pool->work, 0, 0);
+
+  for (int i = 0; i < workers; i++) {
+    Worker *worker = &pool->workers[i];
+    worker->pool = pool;
+    worker->index = i;
+    worker->vm = i == 0 ? first : ls_new_vm(config);
+    init_queue(&worker->queue);
+  }
+
+  int started = 0;
+  while (started < workers &&
+         pthread_create(&pool->workers[started].thread, NULL, run_jobs,
+                        &pool->workers[started]) == 0)
+    started++;
+  if (started < workers) {
+    free_pool(pool, started);
+    return NULL;
+  }
+
+  return pool;
+}
+
+void ls_free_pool(LsPool *pool) { free_pool(pool, pool->num_workers); }
+
+LsJob *ls_pool_submit(LsPool *pool, LsProgram *program) {
+  LsJob *job = pool->reallocate(NULL, sizeof(LsJob));
+  // TODO: handle oom.
+  ls_retain_program(program);
+  job->program = program;
+  job->state = JOB_QUEUED;
+  job->canceled = false;
+  job->vm = NULL;
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->done, NULL);
+
+  // The job is pushed before the post, so the worker woken up finds it.
+  unsigned next = __atomic_fetch_add(&pool->next_worker, 1, __ATOMIC_RELAXED);
+  job->worker = (int)(next % (unsigned)pool->num_workers);
+  push_job(pool, &pool->workers[job->worker].queue, job);
+  sem_post(&pool->work);
+  return job;
+}
+
+bool ls_pool_cancel(LsPool *pool, LsJob *job) {
+  pthread_mutex_lock(&job->lock);
+  bool canceled = job->state == JOB_QUEUED && !job->canceled;
+  if (canceled) {
+    if (remove_job(&pool->workers[job->worker].queue, job)) {
+      // Its post is taken back unless a worker is already awake for it.
+      sem_trywait(&pool->work);
+      finish_job(job, LS_RESULT_CANCELED);
+    } else {
+      // A worker took it, and finishes it without running it.
+      job->canceled = true;
+    }
+  }
+
+  pthread_mutex_unlock(&job->lock);
+  return canceled;
+}
+
+LsInterpretResult ls_pool_await(LsPool *pool, LsJob *job) {
+  pthread_mutex_lock(&job->lock);
+  while (job->state != JOB_DONE)
+    pthread_cond_wait(&job->done, &job->lock);
+  LsInterpretResult result = job->result;
+  pthread_mutex_unlock(&job->lock);
+
+  pthread_mutex_destroy(&job->lock);
+  pthread_cond_destroy(&job->done);
+  ls_release_program(job->program);
+  pool->reallocate(job, 0);
+  return result;
+}
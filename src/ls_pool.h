@@ -0,0 +1,110 @@
+#ifndef LS_POOL_H_INCLUDE
+#define LS_POOL_H_INCLUDE
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ls_vm.h"
+
+// The number of workers of a pool when none is given.
+#define DEFAULT_POOL_WORKERS 4
+
+// The most workers a pool can have.
+#define MAX_POOL_WORKERS 256
+
+typedef enum {
+  // Waiting in the queue of a worker.
+  JOB_QUEUED,
+
+  // Taken by a worker, which runs it unless it was canceled meanwhile. Jobs
+  // stay running while queued again after being preempted.
+  JOB_RUNNING,
+
+  // Finished or canceled, with its result set.
+  JOB_DONE,
+} JobState;
+
+struct ls_job {
+  LsProgram *program;
+
+  // The state of the job and its result, guarded by [lock].
+  JobState state;
+  LsInterpretResult result;
+
+  // If the job was canceled after a worker took it from a queue, but before
+  // it started running.
+  bool canceled;
+
+  // The worker whose queue holds the job while it is queued.
+  int worker;
+
+  // The VM the job was preempted in, or NULL if it wasn't.
+  LsVM *vm;
+
+  pthread_mutex_t lock;
+
+  // Broadcast when the job is done.
+  pthread_cond_t done;
+};
+
+// The jobs queued for a worker, in a ring buffer behind a mutex. The worker
+// takes the oldest job, and idle workers steal the newest one.
+//
+// The queues aren't lock-free deques, like the Chase-Lev ones, which only let
+// their owner push and can't remove a job from their middle. Here any thread
+// submits jobs to any queue, and ls_pool_cancel() removes them from where
+// they are. The lock is only held to move one job, and each queue has its
+// own, so threads only contend on a queue they use at once. Jobs run for
+// much longer than that.
+typedef struct {
+  LsJob **jobs;
+  size_t head;
+  size_t count;
+  size_t capacity;
+  pthread_mutex_t lock;
+} JobQueue;
+
+// A thread running jobs with a VM of its own, or with the VM a preempted job
+// kept, whichever worker ran it before.
+typedef struct {
+  LsPool *pool;
+  int index;
+  LsVM *vm;
+  JobQueue queue;
+  pthread_t thread;
+} Worker;
+
+// A pool of workers, each running the jobs submitted to the pool with a VM of
+// its own. Jobs are queued on the workers in turn, and workers without jobs
+// steal them from the others. A preempted job keeps its VM, so VMs move
+// between threads, but only one runs each at a time.
+//
+// There is no lock for the whole pool. The lock of each queue is only held to
+// push or take a job, the lock of each job guards its state, and idle workers
+// sleep on a semaphore counting the queued jobs. The counter of the next
+// worker and the flag stopping the pool are atomics.
+struct ls_pool {
+  LsReallocateFn reallocate;
+
+  // The configuration of the VMs of the workers.
+  LsConfiguration config;
+
+  Worker *workers;
+  int num_workers;
+
+  // Counts the next job, which is queued on the worker it is modulo the
+  // number of workers. Accessed atomically.
+  unsigned next_worker;
+
+  // Posted once for each job queued, and for each worker when the pool
+  // stops. Canceled jobs may leave extra posts, which workers skip.
+  sem_t work;
+
+  // Set when the pool is freed, to stop the workers once the queues are
+  // empty. Accessed atomically.
+  bool stopping;
+};
+
+#endif
@@ -0,0 +1,68 @@
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "ls_alloc.h"
+#include "ls_compiler.h"
+#include "ls_program.h"
+#include "ls_snapshot.h"
+#include "ls_value.h"
+
+LsProgram *ls_new_program(LsConfiguration *config, const char *source,
+                          size_t length) {
+  LsVM *vm = ls_new_vm(config);
+  LsObjFn *fn = ls_compile_length(vm, source, length);
+  if (fn == NULL || !ls_prepare_fns(vm)) {
+    ls_free_vm(vm);
+    return NULL;
+  }
+
+  LsProgram *program = ls_allocate(vm, LsProgram);
+  // TODO: handle oom.
+  program->vm = vm;
+  program->fn = fn;
+  program->references = 1;
+  pthread_mutex_init(&program->lock, NULL);
+  return program;
+}
+
+void ls_retain_program(LsProgram *program) {
+  pthread_mutex_lock(&program->lock);
+  program->references++;
+  pthread_mutex_unlock(&program->lock);
+}
+
+void ls_release_program(LsProgram *program) {
+  pthread_mutex_lock(&program->lock);
+  bool released = --program->references == 0;
+  pthread_mutex_unlock(&program->lock);
+  if (!released)
+    return;
+
+  LsVM *vm = program->vm;
+  pthread_mutex_destroy(&program->lock);
+  ls_free(vm, program);
+  ls_free_vm(vm);
+}
+
+LsInterpretResult ls_run_program(LsVM *vm, LsProgram *program) {
+  // The program must outlive the functions of it [vm] holds, so [vm] keeps a
+  // reference to it until it is freed.
+  size_t i = 0;
+  while (i < vm->num_programs && vm->programs[i] != program)
+    i++;
+  if (i == vm->num_programs) {
+    if (vm->num_programs == vm->programs_capacity) {
+      size_t capacity =
+          vm->programs_capacity == 0 ? 4 : vm->programs_capacity * 2;
+      vm->programs = ls_reallocate(
+          vm, vm->programs, vm->programs_capacity * sizeof(LsProgram *),
+          capacity * sizeof(LsProgram *));
+      // TODO: handle oom.
+      vm->programs_capacity = capacity;
+    }
+    ls_retain_program(program);
+    vm->programs[vm->num_programs++] = program;
+  }
+
+  return ls_call_fn(vm, ls_copy_module(program->vm, vm, program->fn), NULL);
+}
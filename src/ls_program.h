@@ -0,0 +1,31 @@
+#ifndef LS_PROGRAM_H_INCLUDE
+#define LS_PROGRAM_H_INCLUDE
+
+#include <pthread.h>
+
+#include "ls_vm.h"
+
+// A program is a compiled module shared by the VMs that run it, which may run
+// on different threads.
+//
+// Its functions and strings live in a VM of its own, and never change once it
+// is compiled: every function is compiled upfront, and nothing runs in that
+// VM. VMs running the program read the code, line tables and constants of its
+// functions, and its strings, in place and without locking. What scripts can
+// change, i.e. the variables of the module and the objects created while
+// running, is private to each VM.
+struct ls_program {
+  // The VM holding the functions and strings of the program.
+  LsVM *vm;
+
+  // The function that runs the module.
+  LsObjFn *fn;
+
+  // The number of references to the program: the one returned by
+  // ls_new_program(), those taken by ls_retain_program(), and one per VM that
+  // ran it. Guarded by [lock].
+  int references;
+  pthread_mutex_t lock;
+};
+
+#endif
@@ -0,0 +1,876 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ls_alloc.h"
+#include "ls_options.h"
+#include "ls_program.h"
+#include "ls_snapshot.h"
+#include "ls_value.h"
+
+// The state of ls_write_snapshot().
+typedef struct {
+  LsVM *vm;
+  ByteBuffer *out;
+
+  // Maps the address of each object, as a number, to the number of the
+  // object. Objects aren't used as keys since maps compare strings by
+  // content.
+  LsObjMap numbers;
+} Writer;
+
+// Returns the key of [obj] in the maps of objects of the writer.
+static LsValue address_of(LsObj *obj) {
+  return ls_num2val((double)(uintptr_t)obj);
+}
+
+static void write_bytes(Writer *writer, const void *data, size_t size) {
+  ls_byte_buffer_append_n(writer->vm, writer->out, data, size);
+}
+
+static void write_u32(Writer *writer, uint32_t value) {
+  write_bytes(writer, &value, sizeof(value));
+}
+
+static void write_u64(Writer *writer, uint64_t value) {
+  write_bytes(writer, &value, sizeof(value));
+}
+
+// Writes [value], with the object it references replaced by its number.
+static void write_value(Writer *writer, LsValue value) {
+  if (ls_is_obj(value)) {
+    LsValue number = ls_map_get(&writer->numbers, address_of(ls_val2obj(value)));
+    value = QNAN | SIGN_BIT | (uint64_t)ls_val2num(number);
+  }
+
+  write_u64(writer, value);
+}
+
+// Writes a reference to [obj], which may be NULL.
+static void write_ref(Writer *writer, LsObj *obj) {
+  write_value(writer, obj != NULL ? ls_obj2val(obj) : LS_NULL);
+}
+
+// Writes the number of entries of [map], followed by their keys and values.
+static void write_entries(Writer *writer, LsObjMap *map) {
+  write_u64(writer, map->count);
+
+  size_t iterator = 0;
+  LsValue key, value;
+  while (ls_map_next(map, &iterator, &key, &value)) {
+    write_value(writer, key);
+    write_value(writer, value);
+  }
+}
+
+static void write_object(Writer *writer, LsObj *obj) {
+  write_u32(writer, (uint32_t)obj->type);
+
+  switch (obj->type) {
+  case LS_OBJ_STRING: {
+    LsObjString *str = (LsObjString *)obj;
+    write_u64(writer, str->length);
+    write_bytes(writer, str->value, str->length);
+    break;
+  }
+
+  case LS_OBJ_ARRAY: {
+    LsObjArray *arr = (LsObjArray *)obj;
+    size_t length = ls_array_length(arr);
+    write_u32(writer, (uint32_t)arr->kind);
+    write_u64(writer, length);
+    switch (arr->kind) {
+    case LS_ARRAY_BYTE:
+      write_bytes(writer, arr->elements.bytes.data, length);
+      break;
+    case LS_ARRAY_INT32:
+      write_bytes(writer, arr->elements.ints.data, length * sizeof(int32_t));
+      break;
+    case LS_ARRAY_DOUBLE:
+      write_bytes(writer, arr->elements.doubles.data, length * sizeof(double));
+      break;
+    case LS_ARRAY_VALUE:
+      for (size_t i = 0; i < length; i++)
+        write_value(writer, arr->elements.values.data[i]);
+      break;
+    }
+    break;
+  }
+
+  case LS_OBJ_MAP:
+    write_entries(writer, (LsObjMap *)obj);
+    break;
+
+  case LS_OBJ_MODULE: {
+    LsObjModule *module = (LsObjModule *)obj;
+    write_u64(writer, module->variables.length);
+    for (size_t i = 0; i < module->variables.length; i++)
+      write_value(writer, module->variables.data[i]);
+    write_entries(writer, module->variable_names);
+    break;
+  }
+
+  case LS_OBJ_FN: {
+    LsObjFn *fn = (LsObjFn *)obj;
+    write_u32(writer, (uint32_t)fn->max_slots);
+    write_u32(writer, (uint32_t)fn->arity);
+    write_u32(writer, (uint32_t)fn->num_upvalues);
+    write_u64(writer, fn->code.length);
+    write_bytes(writer, fn->code.data, fn->code.length);
+    write_bytes(writer, fn->lines.data, fn->code.length * sizeof(int32_t));
+    write_u64(writer, fn->constants.length);
+    for (size_t i = 0; i < fn->constants.length; i++)
+      write_value(writer, fn->constants.data[i]);
+    write_u64(writer, fn->upvalues.length);
+    write_bytes(writer, fn->upvalues.data, fn->upvalues.length);
+    write_ref(writer, &fn->module->obj);
+    write_ref(writer, fn->name != NULL ? &fn->name->obj : NULL);
+    break;
+  }
+
+  case LS_OBJ_CLOSURE: {
+    LsObjClosure *closure = (LsObjClosure *)obj;
+    write_ref(writer, &closure->fn->obj);
+    for (int i = 0; i < closure->fn->num_upvalues; i++)
+      write_ref(writer, &closure->upvalues[i]->obj);
+    break;
+  }
+
+  case LS_OBJ_UPVALUE:
+    // Upvalues are all closed while no code runs.
+    write_value(writer, ((LsObjUpvalue *)obj)->closed);
+    break;
+
+  case LS_OBJ_FIBER:
+  case LS_OBJ_FOREIGN:
+  case LS_OBJ_TYPE_COUNT:
+    break;
+  }
+}
+
+// Numbers the objects of [type] of [owner] in [writer], except those in
+// [names], and appends them to [objects].
+static void number_objects(Writer *writer, LsObjMap *names, LsVM *owner,
+                           LsObjType type, ValueBuffer *objects) {
+  for (LsObj *obj = owner->first_obj; obj != NULL; obj = obj->next) {
+    if (obj->type != type || ls_map_get(names, address_of(obj)) != LS_UNDEFINED)
+      continue;
+
+    ls_map_set(writer->vm, &writer->numbers, address_of(obj),
+               ls_num2val((double)objects->length));
+    ls_value_buffer_write(writer->vm, objects, ls_obj2val(obj));
+  }
+}
+
+// Returns true if [vm] has objects of [type].
+static bool has_objects(LsVM *vm, LsObjType type) {
+  for (LsObj *obj = vm->first_obj; obj != NULL; obj = obj->next) {
+    if (obj->type == type)
+      return true;
+  }
+
+  return false;
+}
+
+// Returns true if [vm] runs code, or has fibers which are suspended in the
+// middle of some, since stacks are neither saved nor cloned.
+static bool is_running(LsVM *vm) {
+  return vm->fiber->frame_count > 0 || has_objects(vm, LS_OBJ_FIBER);
+}
+
+bool ls_write_snapshot(LsVM *vm, ByteBuffer *snapshot) {
+  // Foreign functions point into the host, which they are only valid in.
+  if (is_running(vm) || has_objects(vm, LS_OBJ_FOREIGN))
+    return false;
+
+  if (!ls_prepare_fns(vm))
+    return false;
+
+  // The variable names of modules are written with them.
+  LsObjMap names;
+  ls_init_map(&names);
+  for (LsObj *obj = vm->first_obj; obj != NULL; obj = obj->next) {
+    if (obj->type == LS_OBJ_MODULE) {
+      LsObjModule *module = (LsObjModule *)obj;
+      ls_map_set(vm, &names, address_of(&module->variable_names->obj),
+                 LS_TRUE);
+    }
+  }
+
+  // Number the objects, grouped by type.
+  Writer writer;
+  writer.vm = vm;
+  writer.out = snapshot;
+  ls_init_map(&writer.numbers);
+  ValueBuffer objects;
+  ls_value_buffer_init(&objects);
+  for (int type = 0; type < LS_OBJ_TYPE_COUNT; type++) {
+    number_objects(&writer, &names, vm, (LsObjType)type, &objects);
+    if (type != LS_OBJ_STRING)
+      continue;
+
+    // The strings of a VM may also be those of the VMs it was cloned from,
+    // and of the programs they ran.
+    for (LsVM *owner = vm; owner != NULL; owner = owner->parent) {
+      if (owner != vm)
+        number_objects(&writer, &names, owner, LS_OBJ_STRING, &objects);
+      for (size_t i = 0; i < owner->num_programs; i++) {
+        number_objects(&writer, &names, owner->programs[i]->vm, LS_OBJ_STRING,
+                       &objects);
+      }
+    }
+  }
+
+  SnapshotHeader header;
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.num_objects = objects.length;
+  header.strings = 0;
+  if (vm->strings != NULL) {
+    header.strings =
+        (uint64_t)ls_val2num(
+            ls_map_get(&writer.numbers, address_of(&vm->strings->obj))) +
+        1;
+  }
+  header.modules = 0;
+  if (vm->modules != NULL) {
+    header.modules =
+        (uint64_t)ls_val2num(
+            ls_map_get(&writer.numbers, address_of(&vm->modules->obj))) +
+        1;
+  }
+
+  snapshot->length = 0;
+  write_bytes(&writer, &header, sizeof(header));
+  for (size_t i = 0; i < objects.length; i++)
+    write_object(&writer, ls_val2obj(objects.data[i]));
+
+  ls_value_buffer_clear(vm, &objects);
+  ls_map_clear(vm, &writer.numbers);
+  ls_map_clear(vm, &names);
+  return true;
+}
+
+// The state of ls_read_snapshot().
+typedef struct {
+  LsVM *vm;
+
+  // The snapshot, and the offset of the next byte to read.
+  const uint8_t *data;
+  size_t length;
+  size_t offset;
+
+  // The restored objects, by number. NULL until they are created.
+  LsObj **objects;
+  uint64_t num_objects;
+} Reader;
+
+// Returns the next [count] elements of [size] bytes and skips them, or NULL
+// if they don't fit in the snapshot.
+static const uint8_t *read_array(Reader *reader, uint64_t count,
+                                 size_t size) {
+  if (count > (reader->length - reader->offset) / size)
+    return NULL;
+
+  const uint8_t *data = reader->data + reader->offset;
+  reader->offset += (size_t)count * size;
+  return data;
+}
+
+static bool read_u32(Reader *reader, uint32_t *value) {
+  const uint8_t *data = read_array(reader, 1, sizeof(uint32_t));
+  if (data != NULL)
+    memcpy(value, data, sizeof(uint32_t));
+  return data != NULL;
+}
+
+static bool read_u64(Reader *reader, uint64_t *value) {
+  const uint8_t *data = read_array(reader, 1, sizeof(uint64_t));
+  if (data != NULL)
+    memcpy(value, data, sizeof(uint64_t));
+  return data != NULL;
+}
+
+// Stores in [value] the value stored at [data], with the object it references
+// relocated. Returns false if the object doesn't exist.
+static bool relocate(Reader *reader, const uint8_t *data, LsValue *value) {
+  uint64_t stored;
+  memcpy(&stored, data, sizeof(uint64_t));
+  if (ls_is_obj(stored)) {
+    uint64_t number = stored & ~(QNAN | SIGN_BIT);
+    if (number >= reader->num_objects || reader->objects[number] == NULL)
+      return false;
+    stored = ls_obj2val(reader->objects[number]);
+  }
+
+  *value = stored;
+  return true;
+}
+
+// Stores in [obj] the object of [type] referenced by the value at [data], or
+// NULL if it is null and [nullable]. Returns false if there is none.
+static bool relocate_ref(Reader *reader, const uint8_t *data, LsObjType type,
+                         bool nullable, LsObj **obj) {
+  LsValue value;
+  if (!relocate(reader, data, &value))
+    return false;
+
+  if (value == LS_NULL && nullable) {
+    *obj = NULL;
+    return true;
+  }
+
+  if (!ls_is_obj(value) || ls_val2obj(value)->type != type)
+    return false;
+  *obj = ls_val2obj(value);
+  return true;
+}
+
+// Returns whether the constant at [index] of the LsObjFn [data] is a
+// function.
+static bool is_fn_constant(const void *data, uint32_t index) {
+  LsValue constant = ((const LsObjFn *)data)->constants.data[index];
+  return ls_is_obj(constant) && ls_val2obj(constant)->type == LS_OBJ_FN;
+}
+
+// Reads the record of the object numbered [number]. Unless [link], creates
+// the object. Otherwise, all objects exist, and the values of the object
+// that reference others are restored.
+static bool read_object(Reader *reader, uint64_t number, bool link) {
+  LsVM *vm = reader->vm;
+  LsObj *obj = reader->objects[number];
+
+  uint32_t type;
+  if (!read_u32(reader, &type) || type >= LS_OBJ_TYPE_COUNT)
+    return false;
+
+  switch ((LsObjType)type) {
+  case LS_OBJ_STRING: {
+    uint64_t length;
+    const uint8_t *bytes;
+    if (!read_u64(reader, &length) ||
+        (bytes = read_array(reader, length, 1)) == NULL)
+      return false;
+
+    if (!link)
+      obj = ls_val2obj(ls_new_string_length(vm, (const char *)bytes, length));
+    break;
+  }
+
+  case LS_OBJ_ARRAY: {
+    static const size_t element_sizes[] = {
+        sizeof(uint8_t), sizeof(int32_t), sizeof(double), sizeof(LsValue)};
+    uint32_t kind;
+    uint64_t length;
+    const uint8_t *elements;
+    if (!read_u32(reader, &kind) || kind > LS_ARRAY_VALUE ||
+        !read_u64(reader, &length) ||
+        (elements = read_array(reader, length, element_sizes[kind])) == NULL)
+      return false;
+
+    if (link) {
+      LsObjArray *arr = (LsObjArray *)obj;
+      for (size_t i = 0; kind == LS_ARRAY_VALUE && i < length; i++) {
+        if (!relocate(reader, elements + i * sizeof(LsValue),
+                      &arr->elements.values.data[i]))
+          return false;
+      }
+      break;
+    }
+
+    switch ((LsArrayKind)kind) {
+    case LS_ARRAY_BYTE:
+      obj = ls_val2obj(ls_new_byte_array(vm, elements, length));
+      break;
+    case LS_ARRAY_INT32:
+      obj = ls_val2obj(ls_new_int32_array(vm, NULL, length));
+      if (length > 0)
+        memcpy(((LsObjArray *)obj)->elements.ints.data, elements,
+               length * sizeof(int32_t));
+      break;
+    case LS_ARRAY_DOUBLE:
+      obj = ls_val2obj(ls_new_double_array(vm, NULL, length));
+      if (length > 0)
+        memcpy(((LsObjArray *)obj)->elements.doubles.data, elements,
+               length * sizeof(double));
+      break;
+    case LS_ARRAY_VALUE:
+      obj = ls_val2obj(ls_new_array(vm, length));
+      break;
+    }
+    break;
+  }
+
+  case LS_OBJ_MAP: {
+    uint64_t count;
+    const uint8_t *entries;
+    if (!read_u64(reader, &count) ||
+        (entries = read_array(reader, count, 2 * sizeof(LsValue))) == NULL)
+      return false;
+
+    if (!link) {
+      obj = ls_val2obj(ls_new_map(vm));
+      break;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      LsValue key, value;
+      if (!relocate(reader, entries + 2 * i * sizeof(LsValue), &key) ||
+          !relocate(reader, entries + (2 * i + 1) * sizeof(LsValue), &value))
+        return false;
+      ls_map_set(vm, (LsObjMap *)obj, key, value);
+    }
+    break;
+  }
+
+  case LS_OBJ_MODULE: {
+    uint64_t num_variables, num_names;
+    const uint8_t *variables, *names;
+    if (!read_u64(reader, &num_variables) ||
+        num_variables > MAX_MODULE_VARS ||
+        (variables = read_array(reader, num_variables, sizeof(LsValue))) ==
+            NULL ||
+        !read_u64(reader, &num_names) ||
+        (names = read_array(reader, num_names, 2 * sizeof(LsValue))) == NULL)
+      return false;
+
+    if (!link) {
+      LsObjModule *module = ls_new_module(vm);
+      ls_value_buffer_fill(vm, &module->variables, LS_NULL, num_variables);
+      obj = &module->obj;
+      break;
+    }
+
+    LsObjModule *module = (LsObjModule *)obj;
+    for (size_t i = 0; i < num_variables; i++) {
+      if (!relocate(reader, variables + i * sizeof(LsValue),
+                    &module->variables.data[i]))
+        return false;
+    }
+
+    for (size_t i = 0; i < num_names; i++) {
+      LsObj *name;
+      LsValue index;
+      if (!relocate_ref(reader, names + 2 * i * sizeof(LsValue),
+                        LS_OBJ_STRING, false, &name) ||
+          !relocate(reader, names + (2 * i + 1) * sizeof(LsValue), &index) ||
+          !ls_is_num(index) || !(ls_val2num(index) >= 0) ||
+          ls_val2num(index) >= (double)num_variables)
+        return false;
+      ls_map_set(vm, module->variable_names, ls_obj2val(name), index);
+    }
+    break;
+  }
+
+  case LS_OBJ_FN: {
+    uint32_t max_slots, arity, num_upvalues;
+    uint64_t code_length, num_constants, upvalues_length;
+    const uint8_t *code, *lines, *constants, *upvalues, *refs;
+    if (!read_u32(reader, &max_slots) || max_slots > MAX_SLOTS ||
+        !read_u32(reader, &arity) || arity > MAX_PARAMETERS ||
+        !read_u32(reader, &num_upvalues) ||
+        num_upvalues > MAX_UPVALUES || !read_u64(reader, &code_length) ||
+        code_length == 0 || (code = read_array(reader, code_length, 1)) == NULL ||
+        (lines = read_array(reader, code_length, sizeof(int32_t))) == NULL ||
+        !read_u64(reader, &num_constants) || num_constants > MAX_CONSTANTS ||
+        (constants = read_array(reader, num_constants, sizeof(LsValue))) ==
+            NULL ||
+        !read_u64(reader, &upvalues_length) ||
+        upvalues_length != 2 * (uint64_t)num_upvalues ||
+        (upvalues = read_array(reader, upvalues_length, 1)) == NULL ||
+        (refs = read_array(reader, 2, sizeof(LsValue))) == NULL)
+      return false;
+
+    if (!link) {
+      LsObjFn *fn = ls_new_fn(vm, NULL);
+      fn->max_slots = (int)max_slots;
+      fn->arity = (int)arity;
+      fn->num_upvalues = (int)num_upvalues;
+      ls_byte_buffer_append_n(vm, &fn->code, code, code_length);
+      ls_int_buffer_fill(vm, &fn->lines, 0, code_length);
+      memcpy(fn->lines.data, lines, code_length * sizeof(int32_t));
+      ls_byte_buffer_append_n(vm, &fn->upvalues, upvalues, upvalues_length);
+      obj = &fn->obj;
+      break;
+    }
+
+    LsObjFn *fn = (LsObjFn *)obj;
+    LsObj *module, *name;
+    if (!relocate_ref(reader, refs, LS_OBJ_MODULE, false, &module) ||
+        !relocate_ref(reader, refs + sizeof(LsValue), LS_OBJ_STRING, true,
+                      &name))
+      return false;
+    fn->module = (LsObjModule *)module;
+    fn->name = (LsObjString *)name;
+
+    ls_value_buffer_fill(vm, &fn->constants, LS_NULL, num_constants);
+    for (size_t i = 0; i < num_constants; i++) {
+      if (!relocate(reader, constants + i * sizeof(LsValue),
+                    &fn->constants.data[i]))
+        return false;
+    }
+
+    // The code runs as it is, like the code of images.
+    LsCodeLimits limits = {
+        .code = fn->code.data,
+        .code_length = fn->code.length,
+        .max_slots = max_slots,
+        .num_upvalues = num_upvalues,
+        .num_constants = (uint32_t)num_constants,
+        .num_variables = (uint32_t)fn->module->variables.length,
+        .is_fn = is_fn_constant,
+        .data = fn};
+    if (!ls_check_code(vm, &limits))
+      return false;
+    break;
+  }
+
+  case LS_OBJ_CLOSURE: {
+    // Functions come before closures, so the function already exists.
+    const uint8_t *ref;
+    LsObj *fn;
+    const uint8_t *upvalues;
+    if ((ref = read_array(reader, 1, sizeof(LsValue))) == NULL ||
+        !relocate_ref(reader, ref, LS_OBJ_FN, false, &fn) ||
+        (upvalues = read_array(reader, (uint64_t)((LsObjFn *)fn)->num_upvalues,
+                               sizeof(LsValue))) == NULL)
+      return false;
+
+    if (!link) {
+      obj = &ls_new_closure(vm, (LsObjFn *)fn)->obj;
+      break;
+    }
+
+    LsObjClosure *closure = (LsObjClosure *)obj;
+    for (int i = 0; i < closure->fn->num_upvalues; i++) {
+      if (!relocate_ref(reader, upvalues + i * sizeof(LsValue),
+                        LS_OBJ_UPVALUE, false,
+                        (LsObj **)&closure->upvalues[i]))
+        return false;
+    }
+    break;
+  }
+
+  case LS_OBJ_UPVALUE: {
+    const uint8_t *closed = read_array(reader, 1, sizeof(LsValue));
+    if (closed == NULL)
+      return false;
+
+    if (!link) {
+      LsObjUpvalue *upvalue = ls_new_upvalue(vm, NULL);
+      upvalue->value = &upvalue->closed;
+      obj = &upvalue->obj;
+      break;
+    }
+
+    if (!relocate(reader, closed, &((LsObjUpvalue *)obj)->closed))
+      return false;
+    break;
+  }
+
+  case LS_OBJ_FIBER:
+  case LS_OBJ_FOREIGN:
+  case LS_OBJ_TYPE_COUNT:
+    return false;
+  }
+
+  if (obj->type != (LsObjType)type)
+    return false;
+  reader->objects[number] = obj;
+  return true;
+}
+
+// Stores in [map] the map numbered [number] minus one, or NULL if [number] is
+// zero. Returns false if it isn't a map.
+static bool restore_map(Reader *reader, uint64_t number, LsObjMap **map) {
+  if (number == 0) {
+    *map = NULL;
+    return true;
+  }
+
+  if (number > reader->num_objects ||
+      reader->objects[number - 1]->type != LS_OBJ_MAP)
+    return false;
+  *map = (LsObjMap *)reader->objects[number - 1];
+  return true;
+}
+
+LsVM *ls_read_snapshot(LsConfiguration *config, const uint8_t *data,
+                       size_t length) {
+  SnapshotHeader header;
+  if (length < sizeof(header))
+    return NULL;
+  memcpy(&header, data, sizeof(header));
+
+  // Every record is at least 4 bytes long.
+  if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != SNAPSHOT_VERSION ||
+      header.num_objects > (length - sizeof(header)) / sizeof(uint32_t))
+    return NULL;
+
+  LsVM *vm = ls_new_vm(config);
+  Reader reader;
+  reader.vm = vm;
+  reader.data = data;
+  reader.length = length;
+  reader.num_objects = header.num_objects;
+  reader.objects = ls_allocate_array(vm, LsObj *, header.num_objects);
+  for (uint64_t i = 0; i < header.num_objects; i++)
+    reader.objects[i] = NULL;
+
+  // The first pass creates the objects, the second one relocates the
+  // references between them.
+  bool restored = true;
+  for (int pass = 0; pass < 2 && restored; pass++) {
+    reader.offset = sizeof(header);
+    for (uint64_t i = 0; i < header.num_objects && restored; i++)
+      restored = read_object(&reader, i, pass == 1);
+  }
+  restored = restored && reader.offset == length &&
+             restore_map(&reader, header.strings, &vm->strings) &&
+             restore_map(&reader, header.modules, &vm->modules);
+  ls_reallocate(vm, reader.objects, header.num_objects * sizeof(LsObj *), 0);
+
+  if (!restored) {
+    ls_free_vm(vm);
+    return NULL;
+  }
+
+  return vm;
+}
+
+// The state of ls_clone_heap().
+typedef struct {
+  LsVM *to;
+
+  // Maps the address of each object of [from], as a number, to its copy.
+  // Strings are shared, so they have none.
+  LsObjMap copies;
+} Cloner;
+
+// Returns the copy of [value] in the VM being cloned to.
+static LsValue copy_of(Cloner *cloner, LsValue value) {
+  if (!ls_is_obj(value) || ls_val2obj(value)->type == LS_OBJ_STRING)
+    return value;
+
+  return ls_map_get(&cloner->copies, address_of(ls_val2obj(value)));
+}
+
+#define COPY_OF(cloner, obj) ((void *)ls_val2obj(copy_of(cloner, ls_obj2val(obj))))
+
+// Creates the copy of [obj], without the values referencing other objects.
+static void create_copy(Cloner *cloner, LsObj *obj) {
+  LsVM *vm = cloner->to;
+  LsObj *copy = NULL;
+
+  switch (obj->type) {
+  case LS_OBJ_ARRAY: {
+    LsObjArray *arr = (LsObjArray *)obj;
+    size_t length = ls_array_length(arr);
+    switch (arr->kind) {
+    case LS_ARRAY_BYTE:
+      copy = ls_val2obj(ls_new_byte_array(vm, arr->elements.bytes.data, length));
+      break;
+    case LS_ARRAY_INT32:
+      copy = ls_val2obj(ls_new_int32_array(vm, arr->elements.ints.data, length));
+      break;
+    case LS_ARRAY_DOUBLE:
+      copy = ls_val2obj(
+          ls_new_double_array(vm, arr->elements.doubles.data, length));
+      break;
+    case LS_ARRAY_VALUE:
+      copy = ls_val2obj(ls_new_array(vm, length));
+      break;
+    }
+    break;
+  }
+
+  case LS_OBJ_MAP:
+    copy = ls_val2obj(ls_new_map(vm));
+    break;
+
+  case LS_OBJ_MODULE: {
+    LsObjModule *module = (LsObjModule *)obj;
+    LsObjModule *module_copy = ls_new_module(vm);
+    ls_value_buffer_fill(vm, &module_copy->variables, LS_NULL,
+                         module->variables.length);
+    ls_map_set(vm, &cloner->copies, address_of(&module->variable_names->obj),
+               ls_obj2val(&module_copy->variable_names->obj));
+    copy = &module_copy->obj;
+    break;
+  }
+
+  case LS_OBJ_FN: {
+    // The code is shared. So are the constants, unless they hold functions,
+    // whose copies are used instead.
+    LsObjFn *fn = (LsObjFn *)obj;
+    LsObjFn *fn_copy = ls_new_fn(vm, NULL);
+    fn_copy->code = fn->code;
+    fn_copy->lines = fn->lines;
+    fn_copy->upvalues = fn->upvalues;
+    fn_copy->borrows_code = true;
+    fn_copy->borrows_constants = true;
+    for (size_t i = 0; i < fn->constants.length; i++) {
+      if (ls_is_obj(fn->constants.data[i]) && !ls_is_str(fn->constants.data[i]))
+        fn_copy->borrows_constants = false;
+    }
+    if (fn_copy->borrows_constants)
+      fn_copy->constants = fn->constants;
+    fn_copy->name = fn->name;
+    fn_copy->max_slots = fn->max_slots;
+    fn_copy->arity = fn->arity;
+    fn_copy->num_upvalues = fn->num_upvalues;
+    copy = &fn_copy->obj;
+    break;
+  }
+
+  case LS_OBJ_CLOSURE: {
+    LsObjClosure *closure = (LsObjClosure *)obj;
+    copy = &ls_new_closure(vm, COPY_OF(cloner, &closure->fn->obj))->obj;
+    break;
+  }
+
+  case LS_OBJ_UPVALUE: {
+    LsObjUpvalue *upvalue = ls_new_upvalue(vm, NULL);
+    upvalue->value = &upvalue->closed;
+    copy = &upvalue->obj;
+    break;
+  }
+
+  case LS_OBJ_FOREIGN: {
+    LsObjForeign *foreign = (LsObjForeign *)obj;
+    copy = &ls_new_foreign(vm, foreign->arity, foreign->fn)->obj;
+    break;
+  }
+
+  case LS_OBJ_STRING:
+  case LS_OBJ_FIBER:
+  case LS_OBJ_TYPE_COUNT:
+    return;
+  }
+
+  ls_map_set(vm, &cloner->copies, address_of(obj), ls_obj2val(copy));
+}
+
+// Stores in the copy of [obj] the copies of the values it references.
+static void link_copy(Cloner *cloner, LsObj *obj) {
+  LsVM *vm = cloner->to;
+
+  switch (obj->type) {
+  case LS_OBJ_ARRAY: {
+    LsObjArray *arr = (LsObjArray *)obj;
+    LsObjArray *arr_copy = COPY_OF(cloner, obj);
+    for (size_t i = 0; arr->kind == LS_ARRAY_VALUE &&
+                       i < arr->elements.values.length;
+         i++)
+      arr_copy->elements.values.data[i] =
+          copy_of(cloner, arr->elements.values.data[i]);
+    break;
+  }
+
+  case LS_OBJ_MAP: {
+    LsObjMap *map_copy = COPY_OF(cloner, obj);
+    size_t iterator = 0;
+    LsValue key, value;
+    while (ls_map_next((LsObjMap *)obj, &iterator, &key, &value))
+      ls_map_set(vm, map_copy, copy_of(cloner, key), copy_of(cloner, value));
+    break;
+  }
+
+  case LS_OBJ_MODULE: {
+    LsObjModule *module = (LsObjModule *)obj;
+    LsObjModule *module_copy = COPY_OF(cloner, obj);
+    for (size_t i = 0; i < module->variables.length; i++)
+      module_copy->variables.data[i] =
+          copy_of(cloner, module->variables.data[i]);
+    break;
+  }
+
+  case LS_OBJ_FN: {
+    LsObjFn *fn = (LsObjFn *)obj;
+    LsObjFn *fn_copy = COPY_OF(cloner, obj);
+    fn_copy->module = COPY_OF(cloner, &fn->module->obj);
+    if (fn_copy->borrows_constants)
+      break;
+
+    ls_value_buffer_reserve(vm, &fn_copy->constants, fn->constants.length);
+    for (size_t i = 0; i < fn->constants.length; i++)
+      ls_value_buffer_write(vm, &fn_copy->constants,
+                            copy_of(cloner, fn->constants.data[i]));
+    break;
+  }
+
+  case LS_OBJ_CLOSURE: {
+    LsObjClosure *closure = (LsObjClosure *)obj;
+    LsObjClosure *closure_copy = COPY_OF(cloner, obj);
+    for (int i = 0; i < closure->fn->num_upvalues; i++)
+      closure_copy->upvalues[i] = COPY_OF(cloner, &closure->upvalues[i]->obj);
+    break;
+  }
+
+  case LS_OBJ_UPVALUE: {
+    LsObjUpvalue *upvalue_copy = COPY_OF(cloner, obj);
+    upvalue_copy->closed = copy_of(cloner, ((LsObjUpvalue *)obj)->closed);
+    break;
+  }
+
+  case LS_OBJ_STRING:
+  case LS_OBJ_FIBER:
+  case LS_OBJ_FOREIGN:
+  case LS_OBJ_TYPE_COUNT:
+    break;
+  }
+}
+
+// Copies the objects of [from] into [to] with [cloner]. The string table of
+// [from] is copied only if [strings].
+static void copy_objects(Cloner *cloner, LsVM *from, bool strings) {
+  // Modules come first, since they create the copies of their variable
+  // names, then functions, before the closures of them.
+  static const LsObjType order[] = {
+      LS_OBJ_MODULE,  LS_OBJ_ARRAY,   LS_OBJ_MAP,    LS_OBJ_FN,
+      LS_OBJ_CLOSURE, LS_OBJ_UPVALUE, LS_OBJ_FOREIGN};
+  LsObj *skipped = strings ? NULL : (LsObj *)from->strings;
+  for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+    for (LsObj *obj = from->first_obj; obj != NULL; obj = obj->next) {
+      if (obj->type == order[i] && obj != skipped &&
+          ls_map_get(&cloner->copies, address_of(obj)) == LS_UNDEFINED)
+        create_copy(cloner, obj);
+    }
+  }
+
+  for (LsObj *obj = from->first_obj; obj != NULL; obj = obj->next) {
+    if (obj != skipped)
+      link_copy(cloner, obj);
+  }
+}
+
+bool ls_clone_heap(LsVM *from, LsVM *to) {
+  if (is_running(from) || !ls_prepare_fns(from))
+    return false;
+
+  Cloner cloner;
+  cloner.to = to;
+  ls_init_map(&cloner.copies);
+  copy_objects(&cloner, from, true);
+
+  if (from->strings != NULL)
+    to->strings = COPY_OF(&cloner, &from->strings->obj);
+  if (from->modules != NULL)
+    to->modules = COPY_OF(&cloner, &from->modules->obj);
+  to->parent = from;
+
+  ls_map_clear(to, &cloner.copies);
+  return true;
+}
+
+LsObjFn *ls_copy_module(LsVM *from, LsVM *to, LsObjFn *fn) {
+  Cloner cloner;
+  cloner.to = to;
+  ls_init_map(&cloner.copies);
+  copy_objects(&cloner, from, false);
+
+  LsObjFn *copy = COPY_OF(&cloner, &fn->obj);
+  ls_map_clear(to, &cloner.copies);
+  return copy;
+}
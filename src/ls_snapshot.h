@@ -0,0 +1,72 @@
+#ifndef LS_SNAPSHOT_H_INCLUDE
+#define LS_SNAPSHOT_H_INCLUDE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ls_buffer.h"
+#include "ls_vm.h"
+
+// A snapshot is an image of the whole heap of a VM: every object, with the
+// variables of its modules and the functions and closures they hold. A VM
+// restored from it starts where the saved one was, without running any code.
+//
+// A snapshot starts with a SnapshotHeader, followed by a record for each
+// object: its type, then its contents. Objects are numbered in the order of
+// their records, grouped by type in the order of LsObjType so that functions
+// come before the closures of them. Values referencing objects are stored as
+// object values whose "pointer" is the number of the object, and are
+// relocated when restoring.
+//
+// Integers are stored in the byte order of the machine that saved the
+// snapshot, which must be the one of the machine that restores it.
+
+// The first bytes of every snapshot.
+#define SNAPSHOT_MAGIC "LSHI"
+
+// Bumped whenever the layout of snapshots or the bytecode changes, since
+// snapshots of other versions can't be restored.
+#define SNAPSHOT_VERSION 2
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+
+  // The number of objects.
+  uint64_t num_objects;
+
+  // The numbers plus one of the string table and of the module table of the
+  // VM, or zero if it has none.
+  uint64_t strings;
+  uint64_t modules;
+} SnapshotHeader;
+
+// Writes a snapshot of the heap of [vm] to [snapshot]. Functions which
+// weren't compiled yet are compiled first.
+//
+// Returns false if [vm] is running code, or if a function can't be compiled.
+bool ls_write_snapshot(LsVM *vm, ByteBuffer *snapshot);
+
+// Creates a VM configured with [config] whose heap is restored from the
+// [length] bytes snapshot at [data], which can be freed once it returns.
+// Returns NULL if it isn't a valid snapshot of this version.
+LsVM *ls_read_snapshot(LsConfiguration *config, const uint8_t *data,
+                       size_t length);
+
+// Copies the heap of [from] into [to], a new VM, which becomes a clone of it.
+// Only the objects scripts can change are copied: the strings and the code of
+// the functions of [to] are those of [from], which must outlive it.
+// Functions which weren't compiled yet are compiled first.
+//
+// Returns false if [from] is running code, or if a function can't be
+// compiled.
+bool ls_clone_heap(LsVM *from, LsVM *to);
+
+// Copies the objects of [from], which holds a compiled module, into [to] like
+// ls_clone_heap(), and returns the copy of [fn], one of them. The string table
+// of [from] isn't copied, nor made the one of [to]. [from] isn't changed, so
+// several VMs can copy it at once.
+LsObjFn *ls_copy_module(LsVM *from, LsVM *to, LsObjFn *fn);
+
+#endif
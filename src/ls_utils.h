@@ -1,6 +1,7 @@
 #ifndef LS_UTILS_H_INCLUDE
 #define LS_UTILS_H_INCLUDE
 
+#include <stdint.h>
 #include <stdio.h>
 
 #ifdef DEBUG
@@ -34,4 +35,44 @@
 
 #endif // DEBUG
 
+// Returns the number of trailing zero bits in [x], which must not be zero.
+static inline int ls_ctz64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(x);
+#else
+  int count = 0;
+  while ((x & 1) == 0) {
+    x >>= 1;
+    count++;
+  }
+  return count;
+#endif
+}
+
+// Returns the number of leading zero bits in [x], which must not be zero.
+static inline int ls_clz64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_clzll(x);
+#else
+  int count = 0;
+  while ((x & ((uint64_t)1 << 63)) == 0) {
+    x <<= 1;
+    count++;
+  }
+  return count;
+#endif
+}
+
+// Returns the number of set bits in [x].
+static inline int ls_popcount64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(x);
+#else
+  int count = 0;
+  for (; x != 0; x &= x - 1)
+    count++;
+  return count;
+#endif
+}
+
 #endif
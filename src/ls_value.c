@@ -2,11 +2,20 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "ls_image.h"
+#include "ls_number.h"
+#include "ls_utils.h"
 #include "ls_value.h"
 #include "ls_vm.h"
 #include "string.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 DEFINE_BUFFER(Value, value, LsValue)
+DEFINE_BUFFER(Double, double, double)
+DEFINE_BUFFER(Int, int, int32_t)
 
 inline LsValue ls_obj2val(LsObj *obj) {
   // The triple casting is necessary here to satisfy some compilers:
@@ -48,14 +57,6 @@ bool ls_val_eq(LsValue a, LsValue b) {
     break;
   }
 
-  case LS_OBJ_ARRAY: {
-    LsObjArray *arrA = (LsObjArray *)objA;
-    LsObjArray *arrB = (LsObjArray *)objB;
-    return arrA->elements.length == arrB->elements.length &&
-           memcmp(arrA->elements.data, arrB->elements.data,
-                  arrA->elements.length) == 0;
-  }
-
   default:
     // All other types are only equal if they are same, which they aren't if
     // we get here.
@@ -77,13 +78,84 @@ void ls_free_obj(LsVM *vm, LsObj *obj) {
   assert(vm != NULL);
   assert(obj != NULL);
 
+  // Objects are usually freed from the most recent one, which comes first.
+  LsObj **link = &vm->first_obj;
+  while (*link != NULL && *link != obj)
+    link = &(*link)->next;
+  if (*link != NULL)
+    *link = obj->next;
+
   switch (obj->type) {
   case LS_OBJ_ARRAY: {
     LsObjArray *arr = (LsObjArray *)obj;
-    ls_value_buffer_clear(vm, &arr->elements);
+    switch (arr->kind) {
+    case LS_ARRAY_BYTE:
+      ls_byte_buffer_clear(vm, &arr->elements.bytes);
+      break;
+    case LS_ARRAY_INT32:
+      ls_int_buffer_clear(vm, &arr->elements.ints);
+      break;
+    case LS_ARRAY_DOUBLE:
+      ls_double_buffer_clear(vm, &arr->elements.doubles);
+      break;
+    case LS_ARRAY_VALUE:
+      ls_value_buffer_clear(vm, &arr->elements.values);
+      break;
+    }
+    break;
+  }
+
+  case LS_OBJ_MAP:
+    ls_map_clear(vm, (LsObjMap *)obj);
+    break;
+
+  case LS_OBJ_MODULE: {
+    LsObjModule *module = (LsObjModule *)obj;
+    ls_value_buffer_clear(vm, &module->variables);
+    if (module->image != NULL)
+      ls_free_image(vm, module->image);
+    break;
+  }
+
+  case LS_OBJ_FN: {
+    LsObjFn *fn = (LsObjFn *)obj;
+    if (!fn->borrows_code) {
+      ls_byte_buffer_clear(vm, &fn->code);
+      ls_int_buffer_clear(vm, &fn->lines);
+      ls_byte_buffer_clear(vm, &fn->upvalues);
+    }
+    if (!fn->borrows_constants)
+      ls_value_buffer_clear(vm, &fn->constants);
+    if (fn->lazy != NULL) {
+      ls_value_buffer_clear(vm, &fn->lazy->upvalue_names);
+      ls_free(vm, fn->lazy);
+    }
     break;
   }
 
+  case LS_OBJ_CLOSURE: {
+    LsObjClosure *closure = (LsObjClosure *)obj;
+    ls_reallocate(vm, closure,
+                  sizeof(LsObjClosure) +
+                      sizeof(LsObjUpvalue *) * closure->fn->num_upvalues,
+                  0);
+    return;
+  }
+
+  case LS_OBJ_FIBER: {
+    LsObjFiber *fiber = (LsObjFiber *)obj;
+    ls_reallocate(vm, fiber->stack, fiber->stack_capacity * sizeof(LsValue),
+                  0);
+    ls_reallocate(vm, fiber->frames, fiber->frame_capacity * sizeof(CallFrame),
+                  0);
+    ls_reallocate(vm, fiber, sizeof(LsObjFiber), 0);
+    return;
+  }
+
+  case LS_OBJ_FOREIGN:
+    ls_reallocate(vm, obj, sizeof(LsObjForeign), 0);
+    return;
+
   default:
     break;
   }
@@ -102,12 +174,31 @@ static LsObjString *ls_allocate_string(LsVM *vm, size_t length) {
   return str;
 }
 
+// Returns the hash of the [length] bytes of [text] using FNV-1a.
+static uint32_t hash_bytes(const char *text, size_t length) {
+  // FNV-1a hash. See: http://www.isthe.com/chongo/tech/comp/fnv/
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)text[i];
+    hash *= 16777619;
+  }
+
+  return hash;
+}
+
+// Computes and stores the hash of [str]'s contents.
+static void hash_string(LsObjString *str) {
+  str->hash = hash_bytes(str->value, str->length);
+}
+
 LsValue ls_new_string_length(LsVM *vm, const char *text, size_t length) {
   LsObjString *str = ls_allocate_string(vm, length);
 
   if (length > 0 && text != NULL)
     memcpy(str->value, text, length);
 
+  hash_string(str);
   return ls_obj2val(&str->obj);
 }
 
@@ -115,38 +206,1419 @@ LsValue ls_new_string(LsVM *vm, const char *text) {
   return ls_new_string_length(vm, text, strlen(text));
 }
 
-LsValue ls_new_array(LsVM *vm, size_t initial_length) {
+LsValue ls_string_concat(LsVM *vm, LsObjString *a, LsObjString *b) {
+  LsObjString *str = ls_allocate_string(vm, a->length + b->length);
+  memcpy(str->value, a->value, a->length);
+  memcpy(str->value + a->length, b->value, b->length);
+
+  hash_string(str);
+  return ls_obj2val(&str->obj);
+}
+
+// Needles up to this length are searched by scanning for their first byte
+// with memchr() and comparing the rest in place. The worst case is
+// O(haystack * needle), which stays linear for such short needles. Longer
+// needles use the Two-Way algorithm to guarantee linear time.
+#define SHORT_NEEDLE_MAX 32
+
+// Searches [needle] in [haystack] by jumping from one candidate first byte to
+// the next with memchr(), which libc implements with wide vector loads.
+static const char *find_short(const char *haystack, size_t haystack_length,
+                              const char *needle, size_t needle_length) {
+  const char *cursor = haystack;
+  // The last position where the needle could still start.
+  const char *last = haystack + haystack_length - needle_length;
+  char first = needle[0];
+  char final = needle[needle_length - 1];
+
+  while (cursor <= last) {
+    cursor = memchr(cursor, first, last - cursor + 1);
+    if (cursor == NULL)
+      return NULL;
+
+    // Checking the last byte first rejects most false candidates before
+    // touching the middle of the needle.
+    if (cursor[needle_length - 1] == final &&
+        memcmp(cursor + 1, needle + 1, needle_length - 1) == 0)
+      return cursor;
+
+    cursor++;
+  }
+
+  return NULL;
+}
+
+// Computes the critical factorization of [needle] with respect to the byte
+// ordering [reversed] selects. Returns the position of the maximal suffix and
+// stores its period in [period].
+static size_t maximal_suffix(const uint8_t *needle, size_t length,
+                             bool reversed, size_t *period) {
+  // [suffix] is the start of the current maximal suffix minus one, so it
+  // starts at SIZE_MAX and wraps to 0 on the first increment.
+  size_t suffix = (size_t)-1;
+  size_t j = 0;
+  size_t k = 1;
+  size_t p = 1;
+
+  while (j + k < length) {
+    uint8_t a = needle[suffix + k];
+    uint8_t b = needle[j + k];
+
+    if (a == b) {
+      if (k == p) {
+        j += p;
+        k = 1;
+      } else {
+        k++;
+      }
+    } else if (reversed ? a < b : a > b) {
+      j += k;
+      k = 1;
+      p = j - suffix;
+    } else {
+      suffix = j++;
+      k = p = 1;
+    }
+  }
+
+  *period = p;
+  return suffix;
+}
+
+// Searches [needle] in [haystack] using the Two-Way algorithm of Crochemore
+// and Perrin. It runs in linear time with constant extra space and, combined
+// with a bad character shift on the last needle byte, skips ahead quickly on
+// typical text.
+static const char *find_two_way(const char *haystack, size_t haystack_length,
+                                const char *needle_chars,
+                                size_t needle_length) {
+  const uint8_t *h = (const uint8_t *)haystack;
+  const uint8_t *end = h + haystack_length;
+  const uint8_t *needle = (const uint8_t *)needle_chars;
+
+  // For each byte value, one past its last position in the needle or zero if
+  // it doesn't occur.
+  size_t shift[256] = {0};
+  for (size_t i = 0; i < needle_length; i++)
+    shift[needle[i]] = i + 1;
+
+  // The critical factorization is the later of the two maximal suffixes.
+  size_t period, reversed_period;
+  size_t split = maximal_suffix(needle, needle_length, false, &period);
+  size_t reversed_split =
+      maximal_suffix(needle, needle_length, true, &reversed_period);
+  if (reversed_split + 1 > split + 1) {
+    split = reversed_split;
+    period = reversed_period;
+  }
+
+  // If the needle is periodic, a partial match of the left half is
+  // remembered across shifts in [memory] so it is never compared twice.
+  size_t memory_after_shift;
+  if (memcmp(needle, needle + period, split + 1) == 0) {
+    memory_after_shift = needle_length - period;
+  } else {
+    size_t right = needle_length - split - 1;
+    period = (split > right ? split : right) + 1;
+    memory_after_shift = 0;
+  }
+  size_t memory = 0;
+
+  while ((size_t)(end - h) >= needle_length) {
+    // Look at the byte aligned with the end of the needle and shift past it
+    // if it can't be part of a match here.
+    size_t k = needle_length - shift[h[needle_length - 1]];
+    if (k != 0) {
+      if (k < memory)
+        k = memory;
+      h += k;
+      memory = 0;
+      continue;
+    }
+
+    // Compare the right half of the factorization.
+    k = split + 1 > memory ? split + 1 : memory;
+    while (k < needle_length && needle[k] == h[k])
+      k++;
+    if (k < needle_length) {
+      h += k - split;
+      memory = 0;
+      continue;
+    }
+
+    // Compare the left half of the factorization.
+    k = split + 1;
+    while (k > memory && needle[k - 1] == h[k - 1])
+      k--;
+    if (k <= memory)
+      return (const char *)h;
+
+    h += period;
+    memory = memory_after_shift;
+  }
+
+  return NULL;
+}
+
+// Returns a pointer to the first occurrence of [needle] in [haystack], or
+// NULL if there is none.
+static const char *find_bytes(const char *haystack, size_t haystack_length,
+                              const char *needle, size_t needle_length) {
+  if (needle_length == 0)
+    return haystack;
+  if (needle_length > haystack_length)
+    return NULL;
+  if (needle_length == 1)
+    return memchr(haystack, needle[0], haystack_length);
+  if (needle_length <= SHORT_NEEDLE_MAX)
+    return find_short(haystack, haystack_length, needle, needle_length);
+
+  return find_two_way(haystack, haystack_length, needle, needle_length);
+}
+
+size_t ls_string_index_of(LsObjString *haystack, LsObjString *needle,
+                          size_t start) {
+  assert(haystack != NULL);
+  assert(needle != NULL);
+
+  if (start > haystack->length)
+    return LS_STRING_NOT_FOUND;
+
+  const char *found = find_bytes(haystack->value + start,
+                                 haystack->length - start, needle->value,
+                                 needle->length);
+  if (found == NULL)
+    return LS_STRING_NOT_FOUND;
+
+  return (size_t)(found - haystack->value);
+}
+
+bool ls_string_contains(LsObjString *haystack, LsObjString *needle) {
+  return ls_string_index_of(haystack, needle, 0) != LS_STRING_NOT_FOUND;
+}
+
+bool ls_string_starts_with(LsObjString *str, LsObjString *prefix) {
+  assert(str != NULL);
+  assert(prefix != NULL);
+
+  return str->length >= prefix->length &&
+         memcmp(str->value, prefix->value, prefix->length) == 0;
+}
+
+LsValue ls_string_split(LsVM *vm, LsObjString *str, LsObjString *separator) {
+  assert(separator->length > 0 && "Separator must not be empty.");
+
+  LsValue result = ls_new_array(vm, 0);
+  LsObjArray *arr = (LsObjArray *)ls_val2obj(result);
+
+  const char *cursor = str->value;
+  const char *end = str->value + str->length;
+  const char *found =
+      find_bytes(cursor, str->length, separator->value, separator->length);
+
+  // Nothing to split, so the only piece is the string itself.
+  if (found == NULL) {
+    ls_array_push(vm, arr, ls_obj2val(&str->obj));
+    return result;
+  }
+
+  while (found != NULL) {
+    ls_array_push(vm, arr,
+                  ls_new_string_length(vm, cursor, (size_t)(found - cursor)));
+
+    cursor = found + separator->length;
+    found = find_bytes(cursor, (size_t)(end - cursor), separator->value,
+                       separator->length);
+  }
+
+  // The remaining piece after the last separator, possibly empty.
+  ls_array_push(vm, arr,
+                ls_new_string_length(vm, cursor, (size_t)(end - cursor)));
+
+  return result;
+}
+
+LsValue ls_string_replace(LsVM *vm, LsObjString *str, LsObjString *from,
+                          LsObjString *to) {
+  assert(from->length > 0 && "Replaced string must not be empty.");
+
+  // Replacing with the same bytes can't change anything.
+  if (from->length == to->length &&
+      memcmp(from->value, to->value, from->length) == 0)
+    return ls_obj2val(&str->obj);
+
+  const char *end = str->value + str->length;
+
+  // Count the occurrences first so the result is allocated exactly once.
+  size_t count = 0;
+  const char *found =
+      find_bytes(str->value, str->length, from->value, from->length);
+  const char *first = found;
+  while (found != NULL) {
+    count++;
+    found += from->length;
+    found = find_bytes(found, (size_t)(end - found), from->value,
+                       from->length);
+  }
+
+  if (count == 0)
+    return ls_obj2val(&str->obj);
+
+  size_t length = str->length - count * from->length + count * to->length;
+  LsObjString *result = ls_allocate_string(vm, length);
+
+  const char *cursor = str->value;
+  char *out = result->value;
+  found = first;
+  while (found != NULL) {
+    size_t prefix = (size_t)(found - cursor);
+    memcpy(out, cursor, prefix);
+    out += prefix;
+    memcpy(out, to->value, to->length);
+    out += to->length;
+
+    cursor = found + from->length;
+    found = find_bytes(cursor, (size_t)(end - cursor), from->value,
+                       from->length);
+  }
+  memcpy(out, cursor, (size_t)(end - cursor));
+
+  hash_string(result);
+  return ls_obj2val(&result->obj);
+}
+
+static inline bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+LsValue ls_string_to_number(LsObjString *str) {
+  assert(str != NULL);
+
+  const char *start = str->value;
+  const char *end = str->value + str->length;
+  while (start < end && is_space(*start))
+    start++;
+  while (end > start && is_space(end[-1]))
+    end--;
+
+  bool negative = false;
+  if (start < end && (*start == '-' || *start == '+'))
+    negative = *start++ == '-';
+
+  double num;
+  if (!ls_parse_number(start, (size_t)(end - start), &num))
+    return LS_NULL;
+
+  return ls_num2val(negative ? -num : num);
+}
+
+static LsObjArray *ls_allocate_array_of(LsVM *vm, LsArrayKind kind) {
   LsObjArray *arr = ls_allocate(vm, LsObjArray);
+  // TODO: handle oom.
   ls_init_obj(vm, &arr->obj, LS_OBJ_ARRAY);
-  ls_value_buffer_init(&arr->elements);
-  ls_value_buffer_fill(vm, &arr->elements, LS_NULL, initial_length);
+  arr->kind = kind;
+
+  switch (kind) {
+  case LS_ARRAY_BYTE:
+    ls_byte_buffer_init(&arr->elements.bytes);
+    break;
+  case LS_ARRAY_INT32:
+    ls_int_buffer_init(&arr->elements.ints);
+    break;
+  case LS_ARRAY_DOUBLE:
+    ls_double_buffer_init(&arr->elements.doubles);
+    break;
+  case LS_ARRAY_VALUE:
+    ls_value_buffer_init(&arr->elements.values);
+    break;
+  }
+
+  return arr;
+}
+
+LsValue ls_new_array(LsVM *vm, size_t initial_length) {
+  // An empty array starts with small integers, as that's what most arrays
+  // built by scripts hold.
+  if (initial_length == 0)
+    return ls_obj2val(&ls_allocate_array_of(vm, LS_ARRAY_INT32)->obj);
+
+  LsObjArray *arr = ls_allocate_array_of(vm, LS_ARRAY_VALUE);
+  ls_value_buffer_fill(vm, &arr->elements.values, LS_NULL, initial_length);
+
+  return ls_obj2val(&arr->obj);
+}
+
+LsValue ls_new_byte_array(LsVM *vm, const uint8_t *data, size_t length) {
+  LsObjArray *arr = ls_allocate_array_of(vm, LS_ARRAY_BYTE);
+  if (data != NULL)
+    ls_byte_buffer_append_n(vm, &arr->elements.bytes, data, length);
+  else
+    ls_byte_buffer_fill(vm, &arr->elements.bytes, 0, length);
 
   return ls_obj2val(&arr->obj);
 }
 
+LsValue ls_new_int32_array(LsVM *vm, const int32_t *data, size_t length) {
+  LsObjArray *arr = ls_allocate_array_of(vm, LS_ARRAY_INT32);
+  if (data != NULL)
+    ls_int_buffer_append_n(vm, &arr->elements.ints, data, length);
+  else
+    ls_int_buffer_fill(vm, &arr->elements.ints, 0, length);
+
+  return ls_obj2val(&arr->obj);
+}
+
+LsValue ls_new_double_array(LsVM *vm, const double *data, size_t length) {
+  LsObjArray *arr = ls_allocate_array_of(vm, LS_ARRAY_DOUBLE);
+  if (data != NULL)
+    ls_double_buffer_append_n(vm, &arr->elements.doubles, data, length);
+  else
+    ls_double_buffer_fill(vm, &arr->elements.doubles, 0, length);
+
+  return ls_obj2val(&arr->obj);
+}
+
+// Returns the most compact array kind that can hold [value].
+static LsArrayKind array_kind_of(LsValue value) {
+  if (!ls_is_num(value))
+    return LS_ARRAY_VALUE;
+
+  double num = ls_val2num(value);
+  // Compare bits so -0 and fractional numbers are rejected.
+  if (num >= 0 && num <= UINT8_MAX &&
+      ls_num2val((double)(uint8_t)num) == value)
+    return LS_ARRAY_BYTE;
+  if (num >= INT32_MIN && num <= INT32_MAX &&
+      ls_num2val((double)(int32_t)num) == value)
+    return LS_ARRAY_INT32;
+
+  return LS_ARRAY_DOUBLE;
+}
+
+size_t ls_array_length(LsObjArray *arr) {
+  // All buffers start with their length, so any member can read it.
+  return arr->elements.values.length;
+}
+
+LsValue ls_array_get(LsObjArray *arr, size_t index) {
+  assert(index < ls_array_length(arr) && "Index out of bounds.");
+
+  switch (arr->kind) {
+  case LS_ARRAY_BYTE:
+    return ls_num2val(arr->elements.bytes.data[index]);
+  case LS_ARRAY_INT32:
+    return ls_num2val(arr->elements.ints.data[index]);
+  case LS_ARRAY_DOUBLE:
+    return ls_num2val(arr->elements.doubles.data[index]);
+  case LS_ARRAY_VALUE:
+    return arr->elements.values.data[index];
+  }
+
+  UNREACHABLE();
+  return LS_NULL;
+}
+
+// Converts the elements of [arr] to the more general [kind].
+static void array_generalize(LsVM *vm, LsObjArray *arr, LsArrayKind kind) {
+  assert(kind > arr->kind);
+
+  size_t length = ls_array_length(arr);
+  // Keep the spare capacity so arrays generalized while being built by pushes
+  // don't reallocate again right away.
+  size_t capacity = arr->elements.values.capacity;
+  LsObjArray generalized;
+  generalized.kind = kind;
+
+  switch (kind) {
+  case LS_ARRAY_BYTE:
+    UNREACHABLE();
+    break;
+
+  case LS_ARRAY_INT32: {
+    IntBuffer *ints = &generalized.elements.ints;
+    ls_int_buffer_init(ints);
+    ls_int_buffer_reserve(vm, ints, capacity);
+    for (size_t i = 0; i < length; i++)
+      ints->data[i] = arr->elements.bytes.data[i];
+    ints->length = length;
+    break;
+  }
+
+  case LS_ARRAY_DOUBLE: {
+    DoubleBuffer *doubles = &generalized.elements.doubles;
+    ls_double_buffer_init(doubles);
+    ls_double_buffer_reserve(vm, doubles, capacity);
+    for (size_t i = 0; i < length; i++)
+      doubles->data[i] = ls_val2num(ls_array_get(arr, i));
+    doubles->length = length;
+    break;
+  }
+
+  case LS_ARRAY_VALUE: {
+    ValueBuffer *values = &generalized.elements.values;
+    ls_value_buffer_init(values);
+    ls_value_buffer_reserve(vm, values, capacity);
+    for (size_t i = 0; i < length; i++)
+      values->data[i] = ls_array_get(arr, i);
+    values->length = length;
+    break;
+  }
+  }
+
+  // Release the old storage the same way objects do.
+  switch (arr->kind) {
+  case LS_ARRAY_BYTE:
+    ls_byte_buffer_clear(vm, &arr->elements.bytes);
+    break;
+  case LS_ARRAY_INT32:
+    ls_int_buffer_clear(vm, &arr->elements.ints);
+    break;
+  case LS_ARRAY_DOUBLE:
+    ls_double_buffer_clear(vm, &arr->elements.doubles);
+    break;
+  case LS_ARRAY_VALUE:
+    UNREACHABLE();
+    break;
+  }
+
+  arr->kind = kind;
+  arr->elements = generalized.elements;
+}
+
+// Stores [value] at [index] in [arr], which must be in bounds and of a kind
+// that can hold [value].
+static inline void array_store(LsObjArray *arr, size_t index, LsValue value) {
+  switch (arr->kind) {
+  case LS_ARRAY_BYTE:
+    arr->elements.bytes.data[index] = (uint8_t)ls_val2num(value);
+    break;
+  case LS_ARRAY_INT32:
+    arr->elements.ints.data[index] = (int32_t)ls_val2num(value);
+    break;
+  case LS_ARRAY_DOUBLE:
+    arr->elements.doubles.data[index] = ls_val2num(value);
+    break;
+  case LS_ARRAY_VALUE:
+    arr->elements.values.data[index] = value;
+    break;
+  }
+}
+
+void ls_array_set(LsVM *vm, LsObjArray *arr, size_t index, LsValue value) {
+  assert(index < ls_array_length(arr) && "Index out of bounds.");
+
+  LsArrayKind kind = array_kind_of(value);
+  if (kind > arr->kind)
+    array_generalize(vm, arr, kind);
+
+  array_store(arr, index, value);
+}
+
+void ls_array_push(LsVM *vm, LsObjArray *arr, LsValue value) {
+  LsArrayKind kind = array_kind_of(value);
+  if (kind > arr->kind)
+    array_generalize(vm, arr, kind);
+
+  switch (arr->kind) {
+  case LS_ARRAY_BYTE:
+    ls_byte_buffer_write(vm, &arr->elements.bytes, 0);
+    break;
+  case LS_ARRAY_INT32:
+    ls_int_buffer_write(vm, &arr->elements.ints, 0);
+    break;
+  case LS_ARRAY_DOUBLE:
+    ls_double_buffer_write(vm, &arr->elements.doubles, 0);
+    break;
+  case LS_ARRAY_VALUE:
+    ls_value_buffer_write(vm, &arr->elements.values, LS_NULL);
+    break;
+  }
+
+  array_store(arr, ls_array_length(arr) - 1, value);
+}
+
+// Returns the size in bytes of one element of an array of [kind].
+static size_t array_element_size(LsArrayKind kind) {
+  switch (kind) {
+  case LS_ARRAY_BYTE:
+    return sizeof(uint8_t);
+  case LS_ARRAY_INT32:
+    return sizeof(int32_t);
+  case LS_ARRAY_DOUBLE:
+    return sizeof(double);
+  case LS_ARRAY_VALUE:
+    return sizeof(LsValue);
+  }
+
+  UNREACHABLE();
+  return 0;
+}
+
+// Returns the packed elements of [arr].
+static void *array_data(LsObjArray *arr) {
+  switch (arr->kind) {
+  case LS_ARRAY_BYTE:
+    return arr->elements.bytes.data;
+  case LS_ARRAY_INT32:
+    return arr->elements.ints.data;
+  case LS_ARRAY_DOUBLE:
+    return arr->elements.doubles.data;
+  case LS_ARRAY_VALUE:
+    return arr->elements.values.data;
+  }
+
+  UNREACHABLE();
+  return NULL;
+}
+
+// Creates a new array of [kind] with [length] uninitialized elements. The
+// caller must store all of them before the array is used.
+static LsObjArray *array_new_of_length(LsVM *vm, LsArrayKind kind,
+                                       size_t length) {
+  LsObjArray *arr = ls_allocate_array_of(vm, kind);
+
+  switch (kind) {
+  case LS_ARRAY_BYTE:
+    ls_byte_buffer_reserve(vm, &arr->elements.bytes, length);
+    break;
+  case LS_ARRAY_INT32:
+    ls_int_buffer_reserve(vm, &arr->elements.ints, length);
+    break;
+  case LS_ARRAY_DOUBLE:
+    ls_double_buffer_reserve(vm, &arr->elements.doubles, length);
+    break;
+  case LS_ARRAY_VALUE:
+    ls_value_buffer_reserve(vm, &arr->elements.values, length);
+    break;
+  }
+  arr->elements.values.length = length;
+
+  return arr;
+}
+
+// Copies the elements of [from] to [to] starting at [index]. [to] must be
+// large enough and of a kind at least as general as [from].
+static void array_copy_into(LsObjArray *to, size_t index, LsObjArray *from) {
+  size_t length = ls_array_length(from);
+
+  if (to->kind == from->kind) {
+    size_t size = array_element_size(to->kind);
+    if (length > 0)
+      memcpy((char *)array_data(to) + index * size, array_data(from),
+             length * size);
+    return;
+  }
+
+  for (size_t i = 0; i < length; i++)
+    array_store(to, index + i, ls_array_get(from, i));
+}
+
+void ls_array_fill(LsVM *vm, LsObjArray *arr, LsValue value, size_t start,
+                   size_t end) {
+  assert(start <= end && end <= ls_array_length(arr) && "Invalid range.");
+  if (start == end)
+    return;
+
+  LsArrayKind kind = array_kind_of(value);
+  if (kind > arr->kind)
+    array_generalize(vm, arr, kind);
+
+  if (arr->kind == LS_ARRAY_BYTE) {
+    memset(arr->elements.bytes.data + start, (uint8_t)ls_val2num(value),
+           end - start);
+    return;
+  }
+
+  // Store the first element, then keep doubling the filled range with
+  // memcpy() so the bulk of the work is done by wide copies.
+  array_store(arr, start, value);
+
+  size_t size = array_element_size(arr->kind);
+  char *data = (char *)array_data(arr) + start * size;
+  size_t filled = 1;
+  size_t count = end - start;
+  while (filled < count) {
+    size_t chunk = filled < count - filled ? filled : count - filled;
+    memcpy(data + filled * size, data, chunk * size);
+    filled += chunk;
+  }
+}
+
+void ls_array_copy_within(LsObjArray *arr, size_t target, size_t start,
+                          size_t end) {
+  assert(start <= end && end <= ls_array_length(arr) && "Invalid range.");
+  assert(target + (end - start) <= ls_array_length(arr) &&
+         "Target out of bounds.");
+
+  if (end == start)
+    return;
+
+  size_t size = array_element_size(arr->kind);
+  char *data = (char *)array_data(arr);
+  memmove(data + target * size, data + start * size, (end - start) * size);
+}
+
+LsValue ls_array_slice(LsVM *vm, LsObjArray *arr, size_t start, size_t end) {
+  assert(start <= end && end <= ls_array_length(arr) && "Invalid range.");
+
+  LsObjArray *slice = array_new_of_length(vm, arr->kind, end - start);
+
+  size_t size = array_element_size(arr->kind);
+  if (end > start)
+    memcpy(array_data(slice), (char *)array_data(arr) + start * size,
+           (end - start) * size);
+
+  return ls_obj2val(&slice->obj);
+}
+
+LsValue ls_array_concat(LsVM *vm, LsObjArray *a, LsObjArray *b) {
+  LsArrayKind kind = a->kind > b->kind ? a->kind : b->kind;
+  size_t length_a = ls_array_length(a);
+
+  LsObjArray *result =
+      array_new_of_length(vm, kind, length_a + ls_array_length(b));
+  array_copy_into(result, 0, a);
+  array_copy_into(result, length_a, b);
+
+  return ls_obj2val(&result->obj);
+}
+
+// Reverses the [length] elements of type [type] at [data] in place. The loop
+// is simple enough for compilers to vectorize it.
+#define REVERSE_ELEMENTS(type, data, length)                                   \
+  do {                                                                         \
+    type *head = (data);                                                       \
+    type *tail = head + (length)-1;                                            \
+    while (head < tail) {                                                      \
+      type tmp = *head;                                                        \
+      *head++ = *tail;                                                         \
+      *tail-- = tmp;                                                           \
+    }                                                                          \
+  } while (false)
+
+void ls_array_reverse(LsObjArray *arr) {
+  size_t length = ls_array_length(arr);
+  if (length < 2)
+    return;
+
+  switch (arr->kind) {
+  case LS_ARRAY_BYTE:
+    REVERSE_ELEMENTS(uint8_t, arr->elements.bytes.data, length);
+    break;
+  case LS_ARRAY_INT32:
+    REVERSE_ELEMENTS(int32_t, arr->elements.ints.data, length);
+    break;
+  case LS_ARRAY_DOUBLE:
+    REVERSE_ELEMENTS(double, arr->elements.doubles.data, length);
+    break;
+  case LS_ARRAY_VALUE:
+    REVERSE_ELEMENTS(LsValue, arr->elements.values.data, length);
+    break;
+  }
+}
+
+size_t ls_array_index_of(LsObjArray *arr, LsValue value, size_t start) {
+  size_t length = ls_array_length(arr);
+  if (start >= length)
+    return LS_ARRAY_NOT_FOUND;
+
+  // A value can only be in a packed array if its kind can hold it.
+  if (array_kind_of(value) > arr->kind)
+    return LS_ARRAY_NOT_FOUND;
+
+  switch (arr->kind) {
+  case LS_ARRAY_BYTE: {
+    const uint8_t *data = arr->elements.bytes.data;
+    const uint8_t *found =
+        memchr(data + start, (uint8_t)ls_val2num(value), length - start);
+    return found == NULL ? LS_ARRAY_NOT_FOUND : (size_t)(found - data);
+  }
+
+  case LS_ARRAY_INT32: {
+    int32_t needle = (int32_t)ls_val2num(value);
+    const int32_t *data = arr->elements.ints.data;
+    for (size_t i = start; i < length; i++) {
+      if (data[i] == needle)
+        return i;
+    }
+    return LS_ARRAY_NOT_FOUND;
+  }
+
+  case LS_ARRAY_DOUBLE: {
+    // Numbers are equal if their bits are, so compare them as integers.
+    const double *data = arr->elements.doubles.data;
+    for (size_t i = start; i < length; i++) {
+      if (ls_num2val(data[i]) == value)
+        return i;
+    }
+    return LS_ARRAY_NOT_FOUND;
+  }
+
+  case LS_ARRAY_VALUE: {
+    const LsValue *data = arr->elements.values.data;
+
+    // Only strings are equal without being the same value.
+    if (ls_is_str(value)) {
+      for (size_t i = start; i < length; i++) {
+        if (ls_val_eq(data[i], value))
+          return i;
+      }
+    } else {
+      for (size_t i = start; i < length; i++) {
+        if (ls_val_same(data[i], value))
+          return i;
+      }
+    }
+    return LS_ARRAY_NOT_FOUND;
+  }
+  }
+
+  UNREACHABLE();
+  return LS_ARRAY_NOT_FOUND;
+}
+
 LsValue ls_new_map(LsVM *vm) {
   LsObjMap *map = ls_allocate(vm, LsObjMap);
   ls_init_obj(vm, &map->obj, LS_OBJ_MAP);
+  ls_init_map(map);
+  return ls_obj2val(&map->obj);
+}
+
+void ls_init_map(LsObjMap *map) {
+  map->obj.type = LS_OBJ_MAP;
+  map->array_capacity = 0;
+  map->array_count = 0;
   map->capacity = 0;
   map->count = 0;
+  map->growth_left = 0;
+  map->array = NULL;
+  map->controls = NULL;
   map->entries = NULL;
-  return ls_obj2val(&map->obj);
 }
 
-LsValue ls_num2val(double num) {
-  union {
-    double num;
-    LsValue val;
-  } u = {num};
+// Control byte of a slot that was never used.
+#define CONTROL_EMPTY ((uint8_t)0x80)
+
+// Control byte of a slot whose entry was removed. Lookups must probe past it.
+#define CONTROL_DELETED ((uint8_t)0xfe)
+
+// The number of control bytes matched at once, and so the smallest capacity
+// of a non-empty map.
+#if defined(__SSE2__)
+#define GROUP_WIDTH 16
+#else
+#define GROUP_WIDTH 8
+#endif
+
+// The maximum number of entries in a map of [capacity] slots. Probing a whole
+// group at once keeps long probe sequences rare even at 7/8 load, which keeps
+// the 16 bytes entries of LsValue pairs dense in cache.
+#define MAP_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+// A bit mask with one bit per slot in a control group. With SSE2 bit N stands
+// for slot N, in the portable version bit 8 * N + 7 does.
+typedef uint64_t GroupMask;
+
+// Returns the index in its group of the first slot in [mask].
+static inline size_t mask_first(GroupMask mask) {
+#if defined(__SSE2__)
+  return (size_t)ls_ctz64(mask);
+#else
+  return (size_t)ls_ctz64(mask) / 8;
+#endif
+}
+
+#if defined(__SSE2__)
+
+typedef __m128i Group;
+
+static inline Group group_load(const uint8_t *controls) {
+  return _mm_loadu_si128((const __m128i *)controls);
+}
+
+// Returns the slots whose control byte is [h2]. May have false positives.
+static inline GroupMask group_match(Group group, uint8_t h2) {
+  return (GroupMask)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_set1_epi8((char)h2), group));
+}
+
+// Returns the empty slots.
+static inline GroupMask group_match_empty(Group group) {
+  return group_match(group, CONTROL_EMPTY);
+}
+
+// Returns the empty or deleted slots, which are the only ones with their high
+// bit set.
+static inline GroupMask group_match_free(Group group) {
+  return (GroupMask)_mm_movemask_epi8(group);
+}
+
+#else
+
+// Without SSE2, the group is packed in an integer and matched with bitwise
+// tricks ("SIMD within a register").
+typedef uint64_t Group;
+
+#define GROUP_LSBS ((uint64_t)0x0101010101010101)
+#define GROUP_MSBS ((uint64_t)0x8080808080808080)
+
+static inline Group group_load(const uint8_t *controls) {
+  // Assemble the word byte by byte so slot N is always in byte N, whatever
+  // the host's endianness. Compilers turn this into a single load.
+  Group group = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++)
+    group |= (uint64_t)controls[i] << (8 * i);
+  return group;
+}
+
+static inline GroupMask group_match(Group group, uint8_t h2) {
+  // Zero the matching bytes, then detect zero bytes. This can report a false
+  // positive for a byte right after a true match, which callers handle by
+  // comparing keys anyway.
+  uint64_t x = group ^ (GROUP_LSBS * h2);
+  return (x - GROUP_LSBS) & ~x & GROUP_MSBS;
+}
+
+static inline GroupMask group_match_empty(Group group) {
+  // EMPTY is the only control byte with its high bit set and bit 1 clear.
+  return (group & ~(group << 6)) & GROUP_MSBS;
+}
+
+static inline GroupMask group_match_free(Group group) {
+  return group & GROUP_MSBS;
+}
+
+#endif
+
+// Mixes the bits of [x] so that keys differing only in a few bits, such as
+// small integers or aligned pointers, spread over the whole table.
+static inline uint64_t mix_bits(uint64_t x) {
+  // The finalizer of MurmurHash3.
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+// Returns the hash of [key].
+static uint64_t hash_value(LsValue key) {
+  if (ls_is_obj(key)) {
+    LsObj *obj = ls_val2obj(key);
+
+    // Strings are hashed by content, which is cached on creation, so only
+    // spread it over 64 bits.
+    if (obj->type == LS_OBJ_STRING)
+      return ((LsObjString *)obj)->hash * 0x9e3779b97f4a7c15ULL;
+
+    // Other objects are hashed by identity. Their pointers are at least 8
+    // bytes aligned so the low bits carry no information.
+    return ((uint64_t)(uintptr_t)obj >> 3) * 0x9e3779b97f4a7c15ULL;
+  }
+
+  // Numbers and singletons are hashed by their bits. Small integral numbers
+  // only differ in the high mantissa bits, so they need a full mix.
+  return mix_bits(key);
+}
+
+// Returns true if map keys [a] and [b] are the same key.
+static inline bool map_keys_equal(LsValue a, LsValue b) {
+  if (ls_val_same(a, b))
+    return true;
+
+  if (!ls_is_str(a) || !ls_is_str(b))
+    return false;
+
+  LsObjString *strA = (LsObjString *)ls_val2obj(a);
+  LsObjString *strB = (LsObjString *)ls_val2obj(b);
+  return strA->hash == strB->hash && strA->length == strB->length &&
+         memcmp(strA->value, strB->value, strA->length) == 0;
+}
+
+// The 7 bits of [hash] stored in the control byte of a slot.
+#define HASH_H2(hash) ((uint8_t)((hash)&0x7f))
+
+// The bits of [hash] that select the first group probed.
+#define HASH_H1(hash) ((size_t)((hash) >> 7))
+
+// Iterates the probe sequence for [hash] in [map], a group at a time. The
+// sequence visits groups at triangular offsets, which covers every group of
+// a power of two table.
+typedef struct {
+  size_t mask;
+  size_t group;
+  size_t step;
+} Probe;
+
+static inline Probe probe_start(LsObjMap *map, uint64_t hash) {
+  Probe probe;
+  probe.mask = map->capacity / GROUP_WIDTH - 1;
+  probe.group = HASH_H1(hash) & probe.mask;
+  probe.step = 0;
+  return probe;
+}
+
+static inline void probe_next(Probe *probe) {
+  probe->step++;
+  probe->group = (probe->group + probe->step) & probe->mask;
+}
+
+// Returns the index of the slot holding [key] in [map], or [map->capacity] if
+// there is none.
+static size_t map_find(LsObjMap *map, LsValue key, uint64_t hash) {
+  if (map->capacity == 0)
+    return 0;
+
+  uint8_t h2 = HASH_H2(hash);
+  for (Probe probe = probe_start(map, hash);; probe_next(&probe)) {
+    size_t base = probe.group * GROUP_WIDTH;
+    Group group = group_load(map->controls + base);
+
+    for (GroupMask mask = group_match(group, h2); mask != 0;
+         mask &= mask - 1) {
+      size_t index = base + mask_first(mask);
+      if (map_keys_equal(map->entries[index].key, key))
+        return index;
+    }
+
+    // A group with an empty slot ends the probe sequence: the key would have
+    // been inserted there.
+    if (group_match_empty(group) != 0)
+      return map->capacity;
+  }
+}
+
+// Returns the index of the first empty or deleted slot on the probe sequence
+// of [hash]. The map must have room for it.
+static size_t map_find_free(LsObjMap *map, uint64_t hash) {
+  for (Probe probe = probe_start(map, hash);; probe_next(&probe)) {
+    size_t base = probe.group * GROUP_WIDTH;
+    GroupMask mask = group_match_free(group_load(map->controls + base));
+    if (mask != 0)
+      return base + mask_first(mask);
+  }
+}
+
+// Returns the number of bytes of the storage of a map of [capacity] slots.
+static size_t map_storage_size(size_t capacity) {
+  return capacity * (sizeof(MapEntry) + sizeof(uint8_t));
+}
+
+// Returns the smallest capacity that can hold [count] entries.
+static size_t map_capacity_for(size_t count) {
+  size_t capacity = GROUP_WIDTH;
+  while (MAP_MAX_LOAD(capacity) < count)
+    capacity *= 2;
+  return capacity;
+}
+
+// Numbers from 2^53 on aren't all representable, so they are never stored in
+// the array part.
+#define MAP_ARRAY_INDEX_LIMIT 9007199254740992.0
 
-  return u.val;
+// If [key] is a non-negative integral number, stores it in [index] and
+// returns true.
+static inline bool map_int_key(LsValue key, uint64_t *index) {
+  double num = ls_val2num(key);
+
+  // Fails for NaN, so for every non-number value too.
+  if (!(num >= 0 && num < MAP_ARRAY_INDEX_LIMIT))
+    return false;
+
+  // Compare bits so -0 and fractional numbers are rejected.
+  *index = (uint64_t)num;
+  return ls_num2val((double)*index) == key;
+}
+
+// If [key] belongs in the array part of [map], stores its slot in [index]
+// and returns true.
+static inline bool map_array_index(LsObjMap *map, LsValue key, size_t *index) {
+  uint64_t i;
+  if (!map_int_key(key, &i) || i >= map->array_capacity)
+    return false;
+
+  *index = (size_t)i;
+  return true;
+}
+
+// Stores [key], which is absent from [map], in the part it belongs to. The
+// map must have room for it and [count] isn't updated.
+static void map_place(LsObjMap *map, LsValue key, LsValue value) {
+  size_t index;
+  if (map_array_index(map, key, &index)) {
+    map->array[index] = value;
+    map->array_count++;
+    return;
+  }
+
+  uint64_t hash = hash_value(key);
+  index = map_find_free(map, hash);
+  if (map->controls[index] == CONTROL_EMPTY)
+    map->growth_left--;
+
+  map->controls[index] = HASH_H2(hash);
+  map->entries[index].key = key;
+  map->entries[index].value = value;
+}
+
+// Returns the bin [key] is counted in when sizing the array part: bin 0 holds
+// key 0 and bin N the keys in [2^(N - 1), 2^N).
+static inline int map_key_bin(uint64_t key) {
+  return key == 0 ? 0 : 64 - ls_clz64(key);
+}
+
+// Picks the size of the array part, as Lua does: the largest power of two N
+// such that more than half of the slots 0 to N - 1 would be in use. [bins]
+// holds the number of integer keys per bin and [int_keys] their total. The
+// number of keys that go to the array part is stored in [array_count].
+static size_t map_array_capacity_for(const size_t *bins, size_t int_keys,
+                                     size_t *array_count) {
+  size_t capacity = 0;
+  size_t below = 0;
+  *array_count = 0;
+
+  for (size_t bin = 0, size = 1; bin < 64 && int_keys > size / 2;
+       bin++, size *= 2) {
+    below += bins[bin];
+    if (below > size / 2) {
+      capacity = size;
+      *array_count = below;
+    }
+  }
+
+  return capacity;
+}
+
+// Rebuilds both parts of [map] so it has room for the absent [key]. The array
+// part is resized to fit the integer keys, counting [key], and the hash part
+// gets the rest, dropping every deleted slot.
+static void map_rehash(LsVM *vm, LsObjMap *map, LsValue key) {
+  size_t bins[64] = {0};
+  size_t int_keys = 0;
+  uint64_t int_key;
+
+  for (size_t i = 0; i < map->array_capacity; i++) {
+    if (map->array[i] != LS_UNDEFINED) {
+      bins[map_key_bin(i)]++;
+      int_keys++;
+    }
+  }
+  for (size_t i = 0; i < map->capacity; i++) {
+    if (!(map->controls[i] & 0x80) &&
+        map_int_key(map->entries[i].key, &int_key)) {
+      bins[map_key_bin(int_key)]++;
+      int_keys++;
+    }
+  }
+  if (map_int_key(key, &int_key)) {
+    bins[map_key_bin(int_key)]++;
+    int_keys++;
+  }
+
+  size_t array_count;
+  size_t array_capacity = map_array_capacity_for(bins, int_keys, &array_count);
+  size_t hash_count = map->count + 1 - array_count;
+  size_t capacity = hash_count == 0 ? 0 : map_capacity_for(hash_count);
+
+  LsValue *old_array = map->array;
+  size_t old_array_capacity = map->array_capacity;
+  MapEntry *old_entries = map->entries;
+  uint8_t *old_controls = map->controls;
+  size_t old_capacity = map->capacity;
+
+  map->array = NULL;
+  if (array_capacity > 0) {
+    map->array = ls_allocate_array(vm, LsValue, array_capacity);
+    // TODO: handle oom.
+    for (size_t i = 0; i < array_capacity; i++)
+      map->array[i] = LS_UNDEFINED;
+  }
+  map->array_capacity = array_capacity;
+  map->array_count = 0;
+
+  map->entries = NULL;
+  map->controls = NULL;
+  if (capacity > 0) {
+    // Entries come first so they stay aligned, followed by the control bytes.
+    map->entries = (MapEntry *)ls_reallocate(vm, NULL, 0,
+                                             map_storage_size(capacity));
+    // TODO: handle oom.
+    map->controls = (uint8_t *)(map->entries + capacity);
+    memset(map->controls, CONTROL_EMPTY, capacity);
+  }
+  map->capacity = capacity;
+  map->growth_left = MAP_MAX_LOAD(capacity);
+
+  // Keys are known to be distinct, so they go straight to a free slot.
+  for (size_t i = 0; i < old_array_capacity; i++) {
+    if (old_array[i] != LS_UNDEFINED)
+      map_place(map, ls_num2val((double)i), old_array[i]);
+  }
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (!(old_controls[i] & 0x80))
+      map_place(map, old_entries[i].key, old_entries[i].value);
+  }
+
+  if (old_array != NULL)
+    ls_reallocate(vm, old_array, old_array_capacity * sizeof(LsValue), 0);
+  if (old_entries != NULL)
+    ls_reallocate(vm, old_entries, map_storage_size(old_capacity), 0);
+}
+
+LsValue ls_map_get(LsObjMap *map, LsValue key) {
+  // Integer keys in the array part need no hashing.
+  size_t index;
+  if (map_array_index(map, key, &index))
+    return map->array[index];
+
+  index = map_find(map, key, hash_value(key));
+  if (index == map->capacity)
+    return LS_UNDEFINED;
+
+  return map->entries[index].value;
+}
+
+void ls_map_set(LsVM *vm, LsObjMap *map, LsValue key, LsValue value) {
+  assert(key != LS_UNDEFINED && "Map key must not be undefined.");
+
+  size_t index;
+  if (map_array_index(map, key, &index)) {
+    if (map->array[index] == LS_UNDEFINED) {
+      map->array_count++;
+      map->count++;
+    }
+    map->array[index] = value;
+    return;
+  }
+
+  uint64_t hash = hash_value(key);
+  index = map_find(map, key, hash);
+  if (index != map->capacity) {
+    map->entries[index].value = value;
+    return;
+  }
+
+  // Reusing a deleted slot doesn't consume growth. Otherwise, make room by
+  // rebalancing both parts, which also grows the hash part or drops its
+  // deleted slots.
+  if (map->capacity == 0 ||
+      (map->growth_left == 0 &&
+       map->controls[map_find_free(map, hash)] == CONTROL_EMPTY))
+    map_rehash(vm, map, key);
+
+  map_place(map, key, value);
+  map->count++;
+}
+
+LsValue ls_map_remove(LsVM *vm, LsObjMap *map, LsValue key) {
+  LsValue value;
+
+  size_t index;
+  if (map_array_index(map, key, &index)) {
+    value = map->array[index];
+    if (value == LS_UNDEFINED)
+      return LS_UNDEFINED;
+
+    map->array[index] = LS_UNDEFINED;
+    map->array_count--;
+  } else {
+    index = map_find(map, key, hash_value(key));
+    if (index == map->capacity)
+      return LS_UNDEFINED;
+
+    value = map->entries[index].value;
+
+    // Lookups only probe past a group that has no empty slot. If this group
+    // still has one, it has never been full since the last rehash, so no
+    // probe sequence goes through it and the slot can simply become empty
+    // again. Only slots of groups that overflowed need a tombstone.
+    size_t base = index - index % GROUP_WIDTH;
+    if (group_match_empty(group_load(map->controls + base)) != 0) {
+      map->controls[index] = CONTROL_EMPTY;
+      map->growth_left++;
+    } else {
+      map->controls[index] = CONTROL_DELETED;
+    }
+  }
+
+  // Release the storage once the map is empty.
+  map->count--;
+  if (map->count == 0)
+    ls_map_clear(vm, map);
+
+  return value;
+}
+
+void ls_map_clear(LsVM *vm, LsObjMap *map) {
+  if (map->array != NULL)
+    ls_reallocate(vm, map->array, map->array_capacity * sizeof(LsValue), 0);
+  if (map->entries != NULL)
+    ls_reallocate(vm, map->entries, map_storage_size(map->capacity), 0);
+
+  map->array_capacity = 0;
+  map->array_count = 0;
+  map->capacity = 0;
+  map->count = 0;
+  map->growth_left = 0;
+  map->array = NULL;
+  map->controls = NULL;
+  map->entries = NULL;
+}
+
+// Returns the string key of [map] whose contents are the [length] bytes of
+// [text] hashing to [hash], or LS_UNDEFINED if there is none.
+static LsValue map_find_string(LsObjMap *map, const char *text, size_t length,
+                               uint32_t hash) {
+  if (map->capacity == 0)
+    return LS_UNDEFINED;
+
+  // Same probing as map_find(), with the hash_value() of a string.
+  uint64_t key_hash = hash * 0x9e3779b97f4a7c15ULL;
+  uint8_t h2 = HASH_H2(key_hash);
+  for (Probe probe = probe_start(map, key_hash);; probe_next(&probe)) {
+    size_t base = probe.group * GROUP_WIDTH;
+    Group group = group_load(map->controls + base);
+
+    for (GroupMask mask = group_match(group, h2); mask != 0;
+         mask &= mask - 1) {
+      LsValue key = map->entries[base + mask_first(mask)].key;
+      if (!ls_is_str(key))
+        continue;
+
+      LsObjString *str = (LsObjString *)ls_val2obj(key);
+      if (str->hash == hash && str->length == length &&
+          memcmp(str->value, text, length) == 0)
+        return key;
+    }
+
+    if (group_match_empty(group) != 0)
+      return LS_UNDEFINED;
+  }
+}
+
+LsValue ls_intern_string(LsVM *vm, const char *text, size_t length) {
+  if (vm->strings == NULL)
+    vm->strings = (LsObjMap *)ls_val2obj(ls_new_map(vm));
+
+  uint32_t hash = hash_bytes(text, length);
+  LsValue str = map_find_string(vm->strings, text, length, hash);
+  if (str != LS_UNDEFINED)
+    return str;
+
+  str = ls_new_string_length(vm, text, length);
+  ls_map_set(vm, vm->strings, str, str);
+  return str;
+}
+
+bool ls_map_next(LsObjMap *map, size_t *iterator, LsValue *key,
+                 LsValue *value) {
+  size_t i = *iterator;
+
+  // Visit the array part first, in key order.
+  for (; i < map->array_capacity; i++) {
+    if (map->array[i] == LS_UNDEFINED)
+      continue;
+
+    *key = ls_num2val((double)i);
+    *value = map->array[i];
+    *iterator = i + 1;
+    return true;
+  }
+
+  for (; i < map->array_capacity + map->capacity; i++) {
+    size_t slot = i - map->array_capacity;
+
+    // Skip empty and deleted slots.
+    if (map->controls[slot] & 0x80)
+      continue;
+
+    *key = map->entries[slot].key;
+    *value = map->entries[slot].value;
+    *iterator = i + 1;
+    return true;
+  }
+
+  *iterator = i;
+  return false;
+}
+
+LsObjModule *ls_new_module(LsVM *vm) {
+  LsObjModule *module = ls_allocate(vm, LsObjModule);
+  // TODO: handle oom.
+  ls_init_obj(vm, &module->obj, LS_OBJ_MODULE);
+  ls_value_buffer_init(&module->variables);
+  module->variable_names = (LsObjMap *)ls_val2obj(ls_new_map(vm));
+  module->image = NULL;
+  return module;
+}
+
+LsObjFn *ls_new_fn(LsVM *vm, LsObjModule *module) {
+  LsObjFn *fn = ls_allocate(vm, LsObjFn);
+  // TODO: handle oom.
+  ls_init_obj(vm, &fn->obj, LS_OBJ_FN);
+  ls_byte_buffer_init(&fn->code);
+  ls_value_buffer_init(&fn->constants);
+  ls_int_buffer_init(&fn->lines);
+  ls_byte_buffer_init(&fn->upvalues);
+  fn->module = module;
+  fn->name = NULL;
+  fn->max_slots = 0;
+  fn->arity = 0;
+  fn->num_upvalues = 0;
+  fn->lazy = NULL;
+  fn->borrows_code = false;
+  fn->borrows_constants = false;
+  return fn;
 }
 
-double ls_val2num(LsValue val) {
-  union {
-    double num;
-    LsValue val;
-  } u = {val};
+LsObjClosure *ls_new_closure(LsVM *vm, LsObjFn *fn) {
+  LsObjClosure *closure =
+      ls_allocate_flex(vm, LsObjClosure, LsObjUpvalue *, fn->num_upvalues);
+  // TODO: handle oom.
+  ls_init_obj(vm, &closure->obj, LS_OBJ_CLOSURE);
+  closure->fn = fn;
+
+  // Clear the upvalue array. We need to do this in case a GC is triggered
+  // after the closure is created but before the upvalue array is populated.
+  for (int i = 0; i < fn->num_upvalues; i++)
+    closure->upvalues[i] = NULL;
 
-  return u.num;
+  return closure;
+}
+
+LsObjUpvalue *ls_new_upvalue(LsVM *vm, LsValue *value) {
+  LsObjUpvalue *upvalue = ls_allocate(vm, LsObjUpvalue);
+  // TODO: handle oom.
+  ls_init_obj(vm, &upvalue->obj, LS_OBJ_UPVALUE);
+  upvalue->value = value;
+  upvalue->closed = LS_NULL;
+  upvalue->next = NULL;
+  return upvalue;
+}
+
+LsObjFiber *ls_new_fiber(LsVM *vm, LsValue fn) {
+  LsObjFiber *fiber = ls_allocate(vm, LsObjFiber);
+  // TODO: handle oom.
+  ls_init_obj(vm, &fiber->obj, LS_OBJ_FIBER);
+  fiber->state = LS_FIBER_NEW;
+  fiber->fn = fn;
+  fiber->caller = NULL;
+  fiber->stack = NULL;
+  fiber->stack_capacity = 0;
+  fiber->stack_top = NULL;
+  fiber->frames = NULL;
+  fiber->frame_count = 0;
+  fiber->frame_capacity = 0;
+  fiber->open_upvalues = NULL;
+  return fiber;
+}
+
+LsObjForeign *ls_new_foreign(LsVM *vm, int arity, LsForeignFn fn) {
+  LsObjForeign *foreign = ls_allocate(vm, LsObjForeign);
+  // TODO: handle oom.
+  ls_init_obj(vm, &foreign->obj, LS_OBJ_FOREIGN);
+  foreign->arity = arity;
+  foreign->fn = fn;
+  return foreign;
 }
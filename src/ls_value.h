@@ -21,21 +21,38 @@
 #define LS_TAG_NULL (1)
 #define LS_TAG_FALSE (2)
 #define LS_TAG_TRUE (3)
+#define LS_TAG_UNDEFINED (4)
 
 #define LS_NULL ((LsValue)(uint64_t)(QNAN | LS_TAG_NULL))
 #define LS_FALSE ((LsValue)(uint64_t)(QNAN | LS_TAG_FALSE))
 #define LS_TRUE ((LsValue)(uint64_t)(QNAN | LS_TAG_TRUE))
 
+// An internal sentinel used to mark missing entries. It is never visible to
+// scripts.
+#define LS_UNDEFINED ((LsValue)(uint64_t)(QNAN | LS_TAG_UNDEFINED))
+
 // An object pointer is a NaN with a set sign bit.
 #define ls_is_obj(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 #define ls_is_str(value)                                                       \
   (ls_is_obj(value) && ls_val2obj(value)->type == LS_OBJ_STRING)
 
+// If the NaN bits are set, it's not a number.
+#define ls_is_num(value) (((value)&QNAN) != QNAN)
+
+// Only false and null are falsy, every other value is truthy.
+#define ls_is_falsy(value) ((value) == LS_FALSE || (value) == LS_NULL)
+
 // Identifies which specific type a heap-allocated object is.
 typedef enum {
   LS_OBJ_STRING,
   LS_OBJ_ARRAY,
   LS_OBJ_MAP,
+  LS_OBJ_MODULE,
+  LS_OBJ_FN,
+  LS_OBJ_CLOSURE,
+  LS_OBJ_UPVALUE,
+  LS_OBJ_FIBER,
+  LS_OBJ_FOREIGN,
   LS_OBJ_TYPE_COUNT, // Must be last.
 } LsObjType;
 
@@ -50,7 +67,8 @@ typedef struct ls_obj {
   struct ls_obj *next;
 } LsObj;
 
-// Releases all memory owned by [obj], including [obj] itself.
+// Releases all memory owned by [obj], including [obj] itself, and removes it
+// from the objects of [vm] if it is one of them.
 void ls_free_obj(LsVM *vm, LsObj *obj);
 
 // NaN boxed value.
@@ -126,10 +144,13 @@ LsObj *ls_val2obj(LsValue value);
 
 // Returns true if [a] and [b] are equivalent. Immutable values (null, bools,
 // numbers, ranges, and strings) are equal if they have the same data. All
-// other values are equal if they are identical objects (e.g. ls_val_same).
+// other values, arrays and maps included, are equal if they are identical
+// objects (e.g. ls_val_same).
 bool ls_val_eq(LsValue a, LsValue b);
 
 DECLARE_BUFFER(Value, value, LsValue);
+DECLARE_BUFFER(Double, double, double);
+DECLARE_BUFFER(Int, int, int32_t);
 
 // A heap-allocated string object.
 typedef struct ls_obj_string {
@@ -138,14 +159,42 @@ typedef struct ls_obj_string {
   // Number of bytes in the string, not including the null terminator.
   size_t length;
 
+  // The hash value of the string's contents, computed once on creation.
+  uint32_t hash;
+
   // Inline array of the string's bytes followed by a null terminator.
   char value[];
 } LsObjString;
 
+// The representation of the elements of an array, from the most compact to
+// the most general. An array moves to a more general kind on the first store
+// of a value its kind can't hold, and never moves back.
+typedef enum {
+  // Integral numbers from 0 to 255, one byte each.
+  LS_ARRAY_BYTE,
+
+  // Integral numbers that fit in 32 bits signed integers.
+  LS_ARRAY_INT32,
+
+  // Any number, stored as a plain double.
+  LS_ARRAY_DOUBLE,
+
+  // Any value.
+  LS_ARRAY_VALUE,
+} LsArrayKind;
+
 typedef struct ls_obj_array {
   LsObj obj;
 
-  ValueBuffer elements;
+  LsArrayKind kind;
+
+  // The packed elements. The member in use is selected by [kind].
+  union {
+    ByteBuffer bytes;
+    IntBuffer ints;
+    DoubleBuffer doubles;
+    ValueBuffer values;
+  } elements;
 } LsObjArray;
 
 typedef struct {
@@ -153,15 +202,264 @@ typedef struct {
   LsValue value;
 } MapEntry;
 
+// A hash table mapping keys to values.
+//
+// Like Lua tables, it has two parts. Dense non-negative integer keys live in
+// the array part, indexed directly by the key. Every other key lives in the
+// hash part. The split is recomputed whenever the hash part is rebuilt.
+//
+// The hash part is an open addressing table in the style of Abseil's "Swiss
+// tables": every slot has a one byte control word that is either empty,
+// deleted or holds 7 bits of the key's hash. Slots are probed a group of
+// control bytes at a time, matching all of them at once with SIMD (or SWAR on
+// targets without SSE2), so [entries] is only touched for likely hits.
 typedef struct ls_obj_map {
   LsObj obj;
 
+  // The values of the keys 0 to [array_capacity - 1]. Missing keys hold
+  // LS_UNDEFINED.
+  LsValue *array;
+
+  // The number of slots of the array part. Either zero or a power of two.
+  size_t array_capacity;
+
+  // The number of entries stored in the array part.
+  size_t array_count;
+
+  // The number of entry slots allocated in the hash part. Either zero or a
+  // power of two that is a multiple of the control group width.
   size_t capacity;
+
+  // The number of entries stored in the map, in both parts.
   size_t count;
 
+  // The number of empty slots that can still be filled before the map must
+  // grow. Deleted slots don't count as they can't be reused in place.
+  size_t growth_left;
+
+  // The control bytes, one per slot. They live in the same allocation as
+  // [entries], right after it.
+  uint8_t *controls;
+
+  // Pointer to a contiguous array of [capacity] entries.
   MapEntry *entries;
 } LsObjMap;
 
+// The state of a bytecode image a module was loaded from, see ls_image.h.
+typedef struct ls_image LsImage;
+
+// A module: the top-level variables shared by the code of a script.
+typedef struct ls_obj_module {
+  LsObj obj;
+
+  // The values of the module level variables.
+  ValueBuffer variables;
+
+  // Maps the name of each module level variable to its index in [variables].
+  LsObjMap *variable_names;
+
+  // The image the module was loaded from, otherwise NULL.
+  LsImage *image;
+} LsObjModule;
+
+// What a function compiled lazily needs to be compiled on its first call.
+// Its body was only checked for errors when its module was compiled.
+//
+// Functions loaded from an image are already compiled, but their constants
+// are only created on their first call too.
+typedef struct {
+  // A copy of the source code the function was defined in, kept until it is
+  // compiled.
+  LsObjString *source;
+
+  // The offset of the parameters of the function in [source], and the line
+  // they are on.
+  size_t start;
+  int line;
+
+  // The names of the variables the function captures, by upvalue index.
+  ValueBuffer upvalue_names;
+
+  // If a function nested in this one captures one of its upvalues, which
+  // then can't run bare.
+  bool upvalues_captured;
+
+  // If the function runs bare once compiled.
+  bool bare;
+
+  // If the function was loaded from an image, the image and the index of the
+  // function in it. Otherwise NULL.
+  LsImage *image;
+  uint32_t index;
+} LsLazyFn;
+
+// A compiled function: its bytecode and the constants the bytecode refers to.
+//
+// Functions that capture variables run as closures. A function only ever
+// called by the function that defines it may instead run bare, and read the
+// variables it captures directly from the stack frame of its caller.
+typedef struct ls_obj_fn {
+  LsObj obj;
+
+  // The instructions, see ls_opcodes.h.
+  ByteBuffer code;
+
+  // The values loaded by CODE_CONSTANT.
+  ValueBuffer constants;
+
+  // The source line of each byte of [code], for error reporting.
+  IntBuffer lines;
+
+  // The module the function was defined in.
+  LsObjModule *module;
+
+  // The name of the function, or NULL if it has none.
+  LsObjString *name;
+
+  // The number of stack slots the function needs, including its locals.
+  int max_slots;
+
+  // The number of parameters the function expects.
+  int arity;
+
+  // The number of variables the function captures.
+  int num_upvalues;
+
+  // Where each captured variable comes from, as [num_upvalues] pairs of
+  // bytes: 1 and the slot of a local of the enclosing function, or 0 and the
+  // index of one of its upvalues.
+  ByteBuffer upvalues;
+
+  // If the function hasn't been compiled yet, how to compile it. Otherwise
+  // NULL.
+  LsLazyFn *lazy;
+
+  // If [code], [lines] and [upvalues] aren't owned by the function: they
+  // point into the image it was loaded from, or are those of the function it
+  // was cloned from.
+  bool borrows_code;
+
+  // If [constants] are those of the function it was cloned from, which holds
+  // no other function.
+  bool borrows_constants;
+} LsObjFn;
+
+// A variable captured by a closure. While the variable is on the stack, the
+// upvalue is "open" and points to its slot. When the variable goes out of
+// scope, it is "closed": its value moves into the upvalue itself.
+typedef struct ls_obj_upvalue {
+  LsObj obj;
+
+  // Pointer to the variable this upvalue is referencing.
+  LsValue *value;
+
+  // If the upvalue is closed (i.e. the local variable it was pointing to has
+  // been popped off the stack) then the closed-over value will be hoisted out
+  // of the stack into here. [value] will then be changed to point to this.
+  LsValue closed;
+
+  // Open upvalues are stored in a linked list by the VM. This points to the
+  // next upvalue in that list.
+  struct ls_obj_upvalue *next;
+} LsObjUpvalue;
+
+// A function with the variables it captured.
+typedef struct ls_obj_closure {
+  LsObj obj;
+
+  // The function that this closure is an instance of.
+  LsObjFn *fn;
+
+  // The upvalues this function has closed over.
+  LsObjUpvalue *upvalues[];
+} LsObjClosure;
+
+// A function call being executed.
+typedef struct {
+  // Pointer to the current (really next-to-be-executed) instruction in the
+  // function's bytecode.
+  const uint8_t *ip;
+
+  // The function being executed.
+  LsObjFn *fn;
+
+  // The closure of [fn], or NULL if it runs bare.
+  LsObjClosure *closure;
+
+  // Pointer to the first stack slot used by this call frame. This will contain
+  // the function, followed by the function's parameters, then local variables
+  // and temporaries.
+  LsValue *slots;
+} CallFrame;
+
+typedef enum {
+  // Created, and waiting for its first resume to call its function.
+  LS_FIBER_NEW,
+
+  // Stopped by a yield, and waiting to be resumed.
+  LS_FIBER_SUSPENDED,
+
+  // Stopped by a foreign function with ls_suspend_fiber(), and waiting for
+  // the host to resume it with the result of the call.
+  LS_FIBER_WAITING,
+
+  // Stopped when it ran out of budget, and waiting to continue where it was.
+  LS_FIBER_PREEMPTED,
+
+  // Running, or waiting for a fiber it resumed.
+  LS_FIBER_RUNNING,
+
+  // Returned from its function, or stopped by a runtime error.
+  LS_FIBER_DONE,
+} LsFiberState;
+
+// A thread of execution: a stack of calls that can be suspended and resumed.
+//
+// Fibers start with no stack, and borrow one of the pooled stacks of their VM
+// on their first resume. The stack grows while they run, and goes back to the
+// pool once they are done unless it grew.
+typedef struct ls_obj_fiber {
+  LsObj obj;
+
+  LsFiberState state;
+
+  // The function the fiber calls when first resumed, as a function or a
+  // closure.
+  LsValue fn;
+
+  // The fiber that resumed this one and gets the value it yields or returns
+  // next, or NULL if it was resumed by the host.
+  struct ls_obj_fiber *caller;
+
+  // The stack of values of the running code, with room for
+  // [stack_capacity] slots. It grows to fit the functions that run.
+  LsValue *stack;
+  size_t stack_capacity;
+
+  // A pointer one past the top-most value on the stack.
+  LsValue *stack_top;
+
+  // The stack of function calls being executed.
+  CallFrame *frames;
+  size_t frame_count;
+  size_t frame_capacity;
+
+  // Pointer to the first node in the linked list of open upvalues that are
+  // pointing to values still on the stack. The head of the list will be the
+  // upvalue closest to the top of the stack, and then the list works downwards.
+  LsObjUpvalue *open_upvalues;
+} LsObjFiber;
+
+// A function implemented by the host in C.
+typedef struct {
+  LsObj obj;
+
+  // The number of arguments it takes.
+  int arity;
+
+  LsForeignFn fn;
+} LsObjForeign;
+
 // Creates a new string object and copies [text] into it.
 //
 // [text] must be non-NULL.
@@ -172,18 +470,183 @@ LsValue ls_new_string(LsVM *vm, const char *text);
 // [text] may be NULL if [length] is zero.
 LsValue ls_new_string_length(LsVM *vm, const char *text, size_t length);
 
+// Returns the string with the contents [text] of [length] bytes interned in
+// [vm], creating it on first use. Interned strings are unique, so they can be
+// compared by identity, and looking one up doesn't allocate.
+//
+// [text] may be NULL if [length] is zero.
+LsValue ls_intern_string(LsVM *vm, const char *text, size_t length);
+
+// Returned by the string search functions when there is no match.
+#define LS_STRING_NOT_FOUND ((size_t)-1)
+
+// Creates a new string with the contents of [a] followed by those of [b].
+LsValue ls_string_concat(LsVM *vm, LsObjString *a, LsObjString *b);
+
+// Returns the byte index of the first occurrence of [needle] in [haystack]
+// at or after byte [start], or LS_STRING_NOT_FOUND if there is none.
+//
+// An empty [needle] matches at [start].
+size_t ls_string_index_of(LsObjString *haystack, LsObjString *needle,
+                          size_t start);
+
+// Returns true if [needle] occurs somewhere in [haystack].
+bool ls_string_contains(LsObjString *haystack, LsObjString *needle);
+
+// Returns true if [str] begins with [prefix].
+bool ls_string_starts_with(LsObjString *str, LsObjString *prefix);
+
+// Splits [str] around every occurrence of [separator] and returns a new array
+// of the pieces. If [separator] does not occur, the array only contains [str]
+// itself and no string is allocated.
+//
+// [separator] must not be empty.
+LsValue ls_string_split(LsVM *vm, LsObjString *str, LsObjString *separator);
+
+// Returns a string where every occurrence of [from] in [str] is replaced by
+// [to]. If nothing would change, [str] itself is returned and nothing is
+// allocated.
+//
+// [from] must not be empty.
+LsValue ls_string_replace(LsVM *vm, LsObjString *str, LsObjString *from,
+                          LsObjString *to);
+
+// Returns the number written in [str], or LS_NULL if it isn't one. Leading
+// and trailing whitespace and a sign are allowed around a number literal, see
+// ls_parse_number().
+LsValue ls_string_to_number(LsObjString *str);
+
 // Creates a new array with [initial_length] LS_NULL elements.
 LsValue ls_new_array(LsVM *vm, size_t initial_length);
 
-LsValue ls_array_index(LsValue val);
+// Creates a new LS_ARRAY_BYTE array of [length] elements and copies [data]
+// into it.
+//
+// If [data] is NULL, the elements are zero.
+LsValue ls_new_byte_array(LsVM *vm, const uint8_t *data, size_t length);
+
+// Creates a new LS_ARRAY_INT32 array of [length] elements and copies [data]
+// into it.
+//
+// If [data] is NULL, the elements are zero.
+LsValue ls_new_int32_array(LsVM *vm, const int32_t *data, size_t length);
+
+// Creates a new LS_ARRAY_DOUBLE array of [length] elements and copies [data]
+// into it.
+//
+// If [data] is NULL, the elements are zero.
+LsValue ls_new_double_array(LsVM *vm, const double *data, size_t length);
+
+// Returns the number of elements in [arr].
+size_t ls_array_length(LsObjArray *arr);
+
+// Returns the element at [index] in [arr], which must be in bounds.
+LsValue ls_array_get(LsObjArray *arr, size_t index);
+
+// Stores [value] at [index] in [arr], which must be in bounds. Converts the
+// elements to a more general kind first if the current one can't hold
+// [value].
+void ls_array_set(LsVM *vm, LsObjArray *arr, size_t index, LsValue value);
+
+// Appends [value] to [arr], converting its elements like ls_array_set.
+void ls_array_push(LsVM *vm, LsObjArray *arr, LsValue value);
+
+// Returned by ls_array_index_of when there is no match.
+#define LS_ARRAY_NOT_FOUND ((size_t)-1)
+
+// Stores [value] in the elements of [arr] from [start] up to, but not
+// including, [end]. The range must be in bounds.
+void ls_array_fill(LsVM *vm, LsObjArray *arr, LsValue value, size_t start,
+                   size_t end);
+
+// Copies the elements of [arr] from [start] up to, but not including, [end]
+// to [target]. The ranges may overlap and must be in bounds.
+void ls_array_copy_within(LsObjArray *arr, size_t target, size_t start,
+                          size_t end);
+
+// Creates a new array with the elements of [arr] from [start] up to, but not
+// including, [end]. The range must be in bounds.
+LsValue ls_array_slice(LsVM *vm, LsObjArray *arr, size_t start, size_t end);
+
+// Creates a new array with the elements of [a] followed by those of [b].
+LsValue ls_array_concat(LsVM *vm, LsObjArray *a, LsObjArray *b);
+
+// Reverses the order of the elements of [arr] in place.
+void ls_array_reverse(LsObjArray *arr);
+
+// Returns the index of the first element of [arr] at or after [start] that is
+// equal to [value] (see ls_val_eq), or LS_ARRAY_NOT_FOUND if there is none.
+size_t ls_array_index_of(LsObjArray *arr, LsValue value, size_t start);
 
 // Creates a new empty map.
 LsValue ls_new_map(LsVM *vm);
 
+// Initializes [map] to an empty map. Only used for maps that aren't heap
+// objects, such as the private tables of the compiler, which must be released
+// with ls_map_clear().
+void ls_init_map(LsObjMap *map);
+
+// Looks up [key] in [map]. If found, returns the value. Otherwise, returns
+// LS_UNDEFINED.
+LsValue ls_map_get(LsObjMap *map, LsValue key);
+
+// Associates [key] with [value] in [map].
+//
+// [key] must not be LS_UNDEFINED.
+void ls_map_set(LsVM *vm, LsObjMap *map, LsValue key, LsValue value);
+
+// Removes [key] from [map], if present. Returns the value for the key if found
+// or LS_UNDEFINED otherwise.
+LsValue ls_map_remove(LsVM *vm, LsObjMap *map, LsValue key);
+
+// Removes all entries from [map] and releases its storage.
+void ls_map_clear(LsVM *vm, LsObjMap *map);
+
+// Advances the iteration over [map] starting at [*iterator], which must be
+// zero for the first call. If there is an entry left, stores it in [key] and
+// [value], updates [iterator] and returns true. Returns false once all entries
+// were visited. The array part is visited first, in key order. The map must
+// not be modified during an iteration.
+bool ls_map_next(LsObjMap *map, size_t *iterator, LsValue *key,
+                 LsValue *value);
+
+// Creates a new module without variables.
+LsObjModule *ls_new_module(LsVM *vm);
+
+// Creates a new function of [module] without code.
+LsObjFn *ls_new_fn(LsVM *vm, LsObjModule *module);
+
+// Creates a new closure of [fn], whose upvalues must then be set.
+LsObjClosure *ls_new_closure(LsVM *vm, LsObjFn *fn);
+
+// Creates a new open upvalue pointing to [value].
+LsObjUpvalue *ls_new_upvalue(LsVM *vm, LsValue *value);
+
+// Creates a new fiber that calls [fn], a function or a closure, when first
+// resumed.
+LsObjFiber *ls_new_fiber(LsVM *vm, LsValue fn);
+
+// Creates a new foreign function calling [fn] with [arity] arguments.
+LsObjForeign *ls_new_foreign(LsVM *vm, int arity, LsForeignFn fn);
+
 // Converts [num] to an [LsValue].
-LsValue ls_num2val(double num);
+static inline LsValue ls_num2val(double num) {
+  union {
+    double num;
+    LsValue val;
+  } u = {num};
+
+  return u.val;
+}
 
 // Interprets [val] as a [double].
-double ls_val2num(LsValue val);
+static inline double ls_val2num(LsValue val) {
+  union {
+    double num;
+    LsValue val;
+  } u = {.val = val};
+
+  return u.num;
+}
 
 #endif
@@ -1,9 +1,21 @@
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "ls_compiler.h"
+#include "ls_image.h"
+#include "ls_number.h"
+#include "ls_options.h"
+#include "ls_snapshot.h"
+#include "ls_utils.h"
 #include "ls_value.h"
 #include "ls_vm.h"
 
+// The buffer size used to format a runtime error message.
+#define ERROR_MESSAGE_SIZE 128
+
 // The behavior of realloc() when the size is 0 is implementation defined. It
 // may return a non-NULL pointer which must not be dereferenced but nevertheless
 // should be freed. To prevent that, we avoid calling realloc() with a zero
@@ -54,7 +66,1502 @@ LsVM *ls_new_vm(LsConfiguration *config) {
   }
   vm->config.reallocate = reallocate;
 
+  vm->main_fiber.obj.type = LS_OBJ_FIBER;
+  vm->main_fiber.state = LS_FIBER_RUNNING;
+  vm->main_fiber.fn = LS_NULL;
+  vm->fiber = &vm->main_fiber;
+  vm->budget = SIZE_MAX;
+
   return vm;
 }
 
-void ls_free_vm(LsVM *vm) { ls_reallocate(vm, vm, 0, 0); }
+void *ls_get_user_data(LsVM *vm) { return vm->config.user_data; }
+
+void ls_free_objects(LsVM *vm) {
+  while (vm->first_obj != NULL)
+    ls_free_obj(vm, vm->first_obj);
+
+  vm->strings = NULL;
+  vm->modules = NULL;
+  for (int i = 0; i < vm->host_slots_capacity; i++)
+    vm->host_slots[i] = LS_NULL;
+}
+
+void ls_free_vm(LsVM *vm) {
+  ls_free_objects(vm);
+  for (size_t i = 0; i < vm->num_programs; i++)
+    ls_release_program(vm->programs[i]);
+  ls_reallocate(vm, vm->programs, vm->programs_capacity * sizeof(LsProgram *),
+                0);
+  ls_reallocate(vm, vm->main_fiber.stack,
+                vm->main_fiber.stack_capacity * sizeof(LsValue), 0);
+  ls_reallocate(vm, vm->main_fiber.frames,
+                vm->main_fiber.frame_capacity * sizeof(CallFrame), 0);
+  for (size_t i = 0; i < vm->num_free_stacks; i++) {
+    ls_reallocate(vm, vm->free_stacks[i].stack,
+                  FIBER_STACK_SLOTS * sizeof(LsValue), 0);
+    ls_reallocate(vm, vm->free_stacks[i].frames,
+                  FIBER_FRAMES * sizeof(CallFrame), 0);
+  }
+  ls_reallocate(vm, vm->free_stacks,
+                vm->free_stacks_capacity * sizeof(FiberStack), 0);
+  ls_reallocate(vm, vm->host_slots,
+                (size_t)vm->host_slots_capacity * sizeof(LsValue), 0);
+  ls_reallocate(vm, vm, 0, 0);
+}
+
+// Gives [fiber], which has no stack, one of the pooled stacks of [vm], or a
+// new one if there is none.
+static void start_stack(LsVM *vm, LsObjFiber *fiber) {
+  if (vm->num_free_stacks > 0) {
+    FiberStack *free = &vm->free_stacks[--vm->num_free_stacks];
+    fiber->stack = free->stack;
+    fiber->frames = free->frames;
+  } else {
+    fiber->stack = ls_allocate_array(vm, LsValue, FIBER_STACK_SLOTS);
+    fiber->frames = ls_allocate_array(vm, CallFrame, FIBER_FRAMES);
+    // TODO: handle oom.
+  }
+
+  fiber->stack_capacity = FIBER_STACK_SLOTS;
+  fiber->stack_top = fiber->stack;
+  fiber->frame_capacity = FIBER_FRAMES;
+  fiber->frame_count = 0;
+}
+
+// Takes the stack of [fiber], which is done, and pools it in [vm] unless it
+// grew, or [vm] already pools enough of them.
+static void release_stack(LsVM *vm, LsObjFiber *fiber) {
+  if (fiber->stack_capacity == FIBER_STACK_SLOTS &&
+      fiber->frame_capacity == FIBER_FRAMES &&
+      vm->num_free_stacks < MAX_FREE_STACKS) {
+    if (vm->num_free_stacks == vm->free_stacks_capacity) {
+      size_t capacity = vm->free_stacks_capacity * 2;
+      if (capacity < 16)
+        capacity = 16;
+
+      vm->free_stacks = ls_reallocate(
+          vm, vm->free_stacks, vm->free_stacks_capacity * sizeof(FiberStack),
+          capacity * sizeof(FiberStack));
+      // TODO: handle oom.
+      vm->free_stacks_capacity = capacity;
+    }
+
+    FiberStack *free = &vm->free_stacks[vm->num_free_stacks++];
+    free->stack = fiber->stack;
+    free->frames = fiber->frames;
+  } else {
+    ls_reallocate(vm, fiber->stack, fiber->stack_capacity * sizeof(LsValue),
+                  0);
+    ls_reallocate(vm, fiber->frames, fiber->frame_capacity * sizeof(CallFrame),
+                  0);
+  }
+
+  fiber->stack = NULL;
+  fiber->stack_capacity = 0;
+  fiber->stack_top = NULL;
+  fiber->frames = NULL;
+  fiber->frame_count = 0;
+  fiber->frame_capacity = 0;
+}
+
+// Grows the stack of [fiber] so it has room for at least [slots] values.
+static void ensure_stack(LsVM *vm, LsObjFiber *fiber, size_t slots) {
+  if (fiber->stack == NULL)
+    start_stack(vm, fiber);
+  if (slots <= fiber->stack_capacity)
+    return;
+
+  size_t capacity = fiber->stack_capacity * 2;
+  if (capacity < slots)
+    capacity = slots;
+
+  LsValue *old_stack = fiber->stack;
+  fiber->stack = ls_reallocate(vm, fiber->stack,
+                               fiber->stack_capacity * sizeof(LsValue),
+                               capacity * sizeof(LsValue));
+  // TODO: handle oom.
+  fiber->stack_capacity = capacity;
+
+  // If the reallocation moves the stack, then we need to recalculate every
+  // pointer that points into the old stack to into the same relative distance
+  // in the new stack. We have to be a little careful about how these are
+  // calculated because pointer subtraction is only well-defined within a
+  // single array, hence the slightly redundant-looking arithmetic below.
+  if (fiber->stack == old_stack)
+    return;
+
+  // Top of the stack.
+  fiber->stack_top = fiber->stack + (fiber->stack_top - old_stack);
+
+  // Stack pointer for each call frame.
+  for (size_t i = 0; i < fiber->frame_count; i++) {
+    CallFrame *frame = &fiber->frames[i];
+    frame->slots = fiber->stack + (frame->slots - old_stack);
+  }
+
+  // Open upvalues.
+  for (LsObjUpvalue *upvalue = fiber->open_upvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->value = fiber->stack + (upvalue->value - old_stack);
+  }
+}
+
+// Pushes a new call frame of [fn], which runs as [closure] unless it is NULL,
+// on the running fiber of [vm]. [num_args] arguments follow the function on
+// top of its stack.
+static void push_frame(LsVM *vm, LsObjFn *fn, LsObjClosure *closure,
+                       int num_args) {
+  LsObjFiber *fiber = vm->fiber;
+  if (fiber->frame_count == fiber->frame_capacity) {
+    size_t capacity = fiber->frame_capacity * 2;
+    fiber->frames = ls_reallocate(vm, fiber->frames,
+                                  fiber->frame_capacity * sizeof(CallFrame),
+                                  capacity * sizeof(CallFrame));
+    // TODO: handle oom.
+    fiber->frame_capacity = capacity;
+  }
+
+  // Grow the stack if needed.
+  size_t stack_size = (size_t)(fiber->stack_top - fiber->stack) - num_args - 1;
+  ensure_stack(vm, fiber, stack_size + (size_t)fn->max_slots);
+
+  CallFrame *frame = &fiber->frames[fiber->frame_count++];
+  frame->fn = fn;
+  frame->closure = closure;
+  frame->slots = fiber->stack_top - num_args - 1;
+  frame->ip = fn->code.data;
+}
+
+// Captures the local variable [local] into an [LsObjUpvalue]. If that local is
+// already in an upvalue, the existing one will be used. (This is important to
+// ensure that multiple closures closing over the same variable actually see
+// the same variable.) Otherwise, it will create a new open upvalue and add it
+// the running fiber's list of upvalues.
+static LsObjUpvalue *capture_upvalue(LsVM *vm, LsValue *local) {
+  LsObjFiber *fiber = vm->fiber;
+
+  // If there are no open upvalues at all, we must need a new one.
+  if (fiber->open_upvalues == NULL) {
+    fiber->open_upvalues = ls_new_upvalue(vm, local);
+    return fiber->open_upvalues;
+  }
+
+  LsObjUpvalue *prev_upvalue = NULL;
+  LsObjUpvalue *upvalue = fiber->open_upvalues;
+
+  // Walk towards the bottom of the stack until we find a previously existing
+  // upvalue or pass where it should be.
+  while (upvalue != NULL && upvalue->value > local) {
+    prev_upvalue = upvalue;
+    upvalue = upvalue->next;
+  }
+
+  // Found an existing upvalue for this local.
+  if (upvalue != NULL && upvalue->value == local)
+    return upvalue;
+
+  // We've walked past this local on the stack, so there must not be an
+  // upvalue for it already. Make a new one and link it in in the right
+  // place to keep the list sorted.
+  LsObjUpvalue *created_upvalue = ls_new_upvalue(vm, local);
+  if (prev_upvalue == NULL) {
+    // The new one is the first one in the list.
+    fiber->open_upvalues = created_upvalue;
+  } else {
+    prev_upvalue->next = created_upvalue;
+  }
+
+  created_upvalue->next = upvalue;
+  return created_upvalue;
+}
+
+// Closes any open upvalues that have been created for stack slots of [fiber]
+// at [last] and above.
+static void close_upvalues(LsObjFiber *fiber, LsValue *last) {
+  while (fiber->open_upvalues != NULL && fiber->open_upvalues->value >= last) {
+    LsObjUpvalue *upvalue = fiber->open_upvalues;
+
+    // Move the value into the upvalue itself and point the upvalue to it.
+    upvalue->closed = *upvalue->value;
+    upvalue->value = &upvalue->closed;
+
+    // Remove it from the open upvalue list.
+    fiber->open_upvalues = upvalue->next;
+  }
+}
+
+// Reports a runtime error raised in the innermost call frame of the running
+// fiber of [vm], whose instruction pointer is past the failing instruction,
+// followed by the stack trace of its frames above [base].
+static void runtime_error(LsVM *vm, size_t base, const char *format, ...) {
+  if (vm->config.on_error == NULL)
+    return;
+
+  char message[ERROR_MESSAGE_SIZE];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+
+  vm->config.on_error(vm, LS_ERROR_RUNTIME, NULL, -1, message);
+
+  for (size_t i = vm->fiber->frame_count; i > base; i--) {
+    CallFrame *frame = &vm->fiber->frames[i - 1];
+    LsObjFn *fn = frame->fn;
+
+    // The instruction pointer is past the instruction being executed, so look
+    // up the line of its last byte.
+    int line = fn->lines.data[frame->ip - fn->code.data - 1];
+    // TODO: replace "main" with real module name.
+    vm->config.on_error(vm, LS_ERROR_STACK_TRACE, "main", line,
+                        fn->name != NULL ? fn->name->value : "(script)");
+  }
+}
+
+bool ls_prepare_fn(LsVM *vm, LsObjFn *fn) {
+  return fn->lazy->image != NULL ? ls_load_constants(vm, fn)
+                                 : ls_compile_lazy(vm, fn);
+}
+
+bool ls_prepare_fns(LsVM *vm) {
+  // Compiling creates the functions the compiled one defines, which may need
+  // to be compiled too.
+  bool prepared;
+  do {
+    prepared = false;
+    for (LsObj *obj = vm->first_obj; obj != NULL; obj = obj->next) {
+      if (obj->type != LS_OBJ_FN || ((LsObjFn *)obj)->lazy == NULL)
+        continue;
+      if (!ls_prepare_fn(vm, (LsObjFn *)obj))
+        return false;
+      prepared = true;
+    }
+  } while (prepared);
+
+  return true;
+}
+
+// Calls [foreign] with the [num_args] arguments on top of the stack, and
+// replaces them and the function by its result, unless it suspends the
+// running fiber. Returns false and reports an error if it fails.
+static bool call_foreign(LsVM *vm, size_t base, LsObjForeign *foreign,
+                         int num_args) {
+  if (num_args != foreign->arity) {
+    runtime_error(vm, base, "Expected %d arguments but got %d.",
+                  foreign->arity, num_args);
+    return false;
+  }
+
+  // The slots of the foreign function calling the host that runs this one,
+  // if any, are restored once it returns.
+  size_t api_base = vm->api_base;
+  int num_api_slots = vm->num_api_slots;
+  bool in_foreign = vm->in_foreign;
+  bool can_suspend = vm->can_suspend;
+
+  // Only fibers that give control back to the host when suspended can be:
+  // those it resumes and that have no call of the host below, in a function
+  // to continue once resumed.
+  LsObjFiber *fiber = vm->fiber;
+  vm->api_base = (size_t)(fiber->stack_top - fiber->stack) - num_args - 1;
+  vm->num_api_slots = num_args + 1;
+  vm->in_foreign = true;
+  vm->api_error = NULL;
+  vm->can_suspend =
+      fiber->caller == NULL && base == 0 && fiber->frame_count > 0;
+  foreign->fn(vm);
+
+  const char *error = vm->api_error;
+  LsValue *result = fiber->stack + vm->api_base;
+  vm->api_base = api_base;
+  vm->num_api_slots = num_api_slots;
+  vm->in_foreign = in_foreign;
+  vm->api_error = NULL;
+  vm->can_suspend = can_suspend;
+  if (error != NULL) {
+    fiber->state = LS_FIBER_RUNNING;
+    runtime_error(vm, base, "%s", error);
+    return false;
+  }
+
+  // A suspended fiber gets the result when resumed.
+  fiber->stack_top = fiber->state == LS_FIBER_WAITING ? result : result + 1;
+  return true;
+}
+
+// Pushes a call frame for calling [callee] with the [num_args] arguments on
+// top of the stack, or calls it right away if it is a foreign function.
+// Returns false and reports an error if [callee] can't be called with them.
+static bool call_value(LsVM *vm, size_t base, LsValue callee, int num_args) {
+  LsObjFn *fn;
+  LsObjClosure *closure = NULL;
+  if (ls_is_obj(callee) && ls_val2obj(callee)->type == LS_OBJ_FOREIGN) {
+    return call_foreign(vm, base, (LsObjForeign *)ls_val2obj(callee),
+                        num_args);
+  } else if (ls_is_obj(callee) && ls_val2obj(callee)->type == LS_OBJ_CLOSURE) {
+    closure = (LsObjClosure *)ls_val2obj(callee);
+    fn = closure->fn;
+  } else if (ls_is_obj(callee) && ls_val2obj(callee)->type == LS_OBJ_FN) {
+    fn = (LsObjFn *)ls_val2obj(callee);
+  } else {
+    runtime_error(vm, base, "Can only call functions.");
+    return false;
+  }
+
+  // A function compiled lazily is compiled on its first call, and one loaded
+  // from an image creates its constants then.
+  if (fn->lazy != NULL && !ls_prepare_fn(vm, fn)) {
+    runtime_error(vm, base, fn->lazy->image != NULL
+                                ? "Could not load function."
+                                : "Could not compile function.");
+    return false;
+  }
+
+  if (num_args != fn->arity) {
+    runtime_error(vm, base, "Expected %d arguments but got %d.", fn->arity,
+                  num_args);
+    return false;
+  }
+
+  push_frame(vm, fn, closure, num_args);
+  return true;
+}
+
+// Marks [fiber] as done, and releases its stack.
+static void finish_fiber(LsVM *vm, LsObjFiber *fiber) {
+  close_upvalues(fiber, fiber->stack);
+  fiber->state = LS_FIBER_DONE;
+  fiber->caller = NULL;
+  release_stack(vm, fiber);
+}
+
+// Makes [fiber] the running fiber of [vm], resumed with [value]. Returns false
+// and reports an error if it is running or done, or if its function can't be
+// called.
+static bool enter_fiber(LsVM *vm, size_t base, LsObjFiber *fiber,
+                        LsValue value) {
+  if (fiber->state == LS_FIBER_RUNNING) {
+    runtime_error(vm, base, "Fiber is already running.");
+    return false;
+  }
+  if (fiber->state == LS_FIBER_DONE) {
+    runtime_error(vm, base, "Cannot resume a finished fiber.");
+    return false;
+  }
+
+  LsObjFiber *previous = vm->fiber;
+  LsFiberState state = fiber->state;
+  fiber->state = LS_FIBER_RUNNING;
+  vm->fiber = fiber;
+
+  // A preempted fiber continues where it was, without [value].
+  if (state == LS_FIBER_PREEMPTED)
+    return true;
+
+  // A suspended fiber gets [value] as the value of its yield, or as the
+  // result of the call that suspended it. Yielding popped the yielded value,
+  // and suspending the function and its arguments, so there is room for it.
+  if (state == LS_FIBER_SUSPENDED || state == LS_FIBER_WAITING) {
+    *fiber->stack_top++ = value;
+    return true;
+  }
+
+  // A new one calls its function, with [value] as argument if it takes one.
+  LsObj *fn = ls_val2obj(fiber->fn);
+  int arity = fn->type == LS_OBJ_CLOSURE ? ((LsObjClosure *)fn)->fn->arity
+                                         : ((LsObjFn *)fn)->arity;
+  ensure_stack(vm, fiber, 2);
+  *fiber->stack_top++ = fiber->fn;
+  if (arity == 1)
+    *fiber->stack_top++ = value;
+  if (!call_value(vm, 0, fiber->fn, arity)) {
+    vm->fiber = previous;
+    finish_fiber(vm, fiber);
+    return false;
+  }
+
+  return true;
+}
+
+// Preempts [fiber], which ran out of budget with its frames from [base] run
+// by the host, and returns true if it can be. Like yields, only fibers the
+// host resumed, and which don't run below a call of the host, give control
+// back to it. The others run on until they can, which the next check catches.
+static bool preempt(LsVM *vm, LsObjFiber *fiber, size_t base) {
+  if (fiber->caller != NULL || base > 0 || vm->config.budget == 0) {
+    vm->budget = vm->config.budget == 0 ? SIZE_MAX : 1;
+    return false;
+  }
+
+  fiber->state = LS_FIBER_PREEMPTED;
+  vm->preempted = fiber;
+  return true;
+}
+
+// Returns the number of bytes of arguments of [instruction], or -1 if the
+// interpreter doesn't run it.
+static int argument_bytes(LsCode instruction) {
+  switch (instruction) {
+  case CODE_LOAD_LOCAL:
+  case CODE_STORE_LOCAL:
+  case CODE_LOAD_UPVALUE:
+  case CODE_STORE_UPVALUE:
+  case CODE_LOAD_PARENT_LOCAL:
+  case CODE_STORE_PARENT_LOCAL:
+    return 1;
+
+  case CODE_CONSTANT:
+  case CODE_CLOSURE:
+  case CODE_LOAD_MODULE_VAR:
+  case CODE_STORE_MODULE_VAR:
+  case CODE_JUMP:
+  case CODE_LOOP:
+  case CODE_JUMP_IF:
+  case CODE_AND:
+  case CODE_OR:
+    return 2;
+
+  default:
+    // Of the others, it only runs those without arguments.
+    if ((instruction >= CODE_NULL && instruction <= CODE_LOAD_LOCAL_8) ||
+        (instruction >= CODE_POP && instruction <= CODE_CALL_16) ||
+        (instruction >= CODE_CLOSE_UPVALUE && instruction <= CODE_YIELD))
+      return 0;
+    return -1;
+  }
+}
+
+bool ls_check_code(LsVM *vm, const LsCodeLimits *limits) {
+  const uint8_t *code = limits->code;
+  size_t length = limits->code_length;
+  if (length < 2 || code[length - 1] != CODE_END)
+    return false;
+
+  // Jumps can go backward, so the start of every instruction is marked
+  // before any jump is checked.
+  ByteBuffer starts;
+  ls_byte_buffer_init(&starts);
+  ls_byte_buffer_fill(vm, &starts, 0, length);
+
+  bool valid = true;
+  size_t last = 0;
+  for (size_t i = 0; i < length - 1;) {
+    int size = argument_bytes((LsCode)code[i]);
+    if (size < 0 || i + (size_t)size >= length - 1) {
+      valid = false;
+      break;
+    }
+    starts.data[i] = 1;
+    last = i;
+    i += 1 + (size_t)size;
+  }
+  valid = valid && code[last] == CODE_RETURN;
+
+  size_t next;
+  for (size_t i = 0; valid && i < length - 1; i = next) {
+    LsCode instruction = (LsCode)code[i];
+    int size = argument_bytes(instruction);
+    uint32_t arg = size == 1   ? code[i + 1]
+                   : size == 2 ? (uint32_t)(code[i + 1] << 8 | code[i + 2])
+                               : 0;
+    next = i + 1 + (size_t)size;
+
+    switch (instruction) {
+    case CODE_CONSTANT:
+      valid = arg < limits->num_constants;
+      break;
+    case CODE_CLOSURE:
+      valid = arg < limits->num_constants && limits->is_fn(limits->data, arg);
+      break;
+    case CODE_LOAD_LOCAL_0:
+    case CODE_LOAD_LOCAL_1:
+    case CODE_LOAD_LOCAL_2:
+    case CODE_LOAD_LOCAL_3:
+    case CODE_LOAD_LOCAL_4:
+    case CODE_LOAD_LOCAL_5:
+    case CODE_LOAD_LOCAL_6:
+    case CODE_LOAD_LOCAL_7:
+    case CODE_LOAD_LOCAL_8:
+      valid = (uint32_t)(instruction - CODE_LOAD_LOCAL_0) < limits->max_slots;
+      break;
+    // Parent slots are read below the slots of the function, which the
+    // interpreter makes room for.
+    case CODE_LOAD_LOCAL:
+    case CODE_STORE_LOCAL:
+    case CODE_LOAD_PARENT_LOCAL:
+    case CODE_STORE_PARENT_LOCAL:
+      valid = arg < limits->max_slots;
+      break;
+    case CODE_LOAD_MODULE_VAR:
+    case CODE_STORE_MODULE_VAR:
+      valid = arg < limits->num_variables;
+      break;
+    case CODE_LOAD_UPVALUE:
+    case CODE_STORE_UPVALUE:
+      valid = arg < limits->num_upvalues;
+      break;
+    // The end isn't an instruction to jump to, since it never runs.
+    case CODE_JUMP:
+    case CODE_JUMP_IF:
+    case CODE_AND:
+    case CODE_OR:
+      valid = next + arg < length - 1 && starts.data[next + arg];
+      break;
+    case CODE_LOOP:
+      valid = arg <= next && starts.data[next - arg];
+      break;
+    default:
+      break;
+    }
+  }
+
+  ls_byte_buffer_clear(vm, &starts);
+  return valid;
+}
+
+// Runs the call frames of the running fiber of [vm] above [base] until the
+// frame at [base] returns, and stores the value it returns in [result] unless
+// it is NULL. Fibers resumed meanwhile run until they yield or return.
+//
+// Returns LS_RESULT_SUSPENDED and stores the yielded value in [result] if the
+// fiber yields, which is only allowed if [base] is zero and it isn't the main
+// fiber. Returns it too if the fiber waits for the host or is preempted, which
+// is only allowed if [base] is zero.
+static LsInterpretResult run(LsVM *vm, size_t base, LsValue *result) {
+  // The fiber [base] is a frame of.
+  LsObjFiber *entry = vm->fiber;
+
+  // Code run by the host rather than by a foreign function it called starts
+  // with a new budget.
+  vm->preempted = NULL;
+  if (base == 0)
+    vm->budget = vm->config.budget > 0 ? vm->config.budget : SIZE_MAX;
+
+  // Remember the current frame along with its fields, so they don't have to
+  // be loaded from memory by each instruction.
+  LsObjFiber *fiber;
+  CallFrame *frame;
+  LsValue *slots;
+  const uint8_t *ip;
+  const LsValue *constants;
+  LsValue *module_variables;
+  LsValue *top;
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+
+#define PUSH(value) (*top++ = (value))
+#define POP() (*(--top))
+#define PEEK() (top[-1])
+
+// Use this before a CallFrame is pushed or popped, or the running fiber
+// changes, to store the local variables back into the current frame.
+#define STORE_FRAME()                                                          \
+  do {                                                                         \
+    frame->ip = ip;                                                            \
+    fiber->stack_top = top;                                                    \
+  } while (false)
+
+// Use this after a CallFrame has been pushed or popped, or the running fiber
+// changed, to refresh the local variables.
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    fiber = vm->fiber;                                                         \
+    frame = &fiber->frames[fiber->frame_count - 1];                            \
+    slots = frame->slots;                                                      \
+    ip = frame->ip;                                                            \
+    constants = frame->fn->constants.data;                                     \
+    module_variables = frame->fn->module->variables.data;                      \
+    top = fiber->stack_top;                                                    \
+  } while (false)
+
+// The first frame of the running fiber that belongs to this run.
+#define FIBER_BASE() (fiber == entry ? base : 0)
+
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    STORE_FRAME();                                                             \
+    runtime_error(vm, FIBER_BASE(), __VA_ARGS__);                              \
+    goto error;                                                                \
+  } while (false)
+
+// Counts a loop iteration or a call against the budget, and preempts the
+// running fiber once it runs out, if it can be.
+#define CHECK_BUDGET()                                                         \
+  do {                                                                         \
+    if (--vm->budget == 0 && preempt(vm, fiber, FIBER_BASE())) {               \
+      STORE_FRAME();                                                           \
+      return LS_RESULT_SUSPENDED;                                              \
+    }                                                                          \
+  } while (false)
+
+// Replaces the two numbers on top of the stack by [expr], computed from them
+// as [a] and [b].
+#define NUMBER_OP(expr)                                                        \
+  do {                                                                         \
+    LsValue right = POP();                                                     \
+    LsValue left = PEEK();                                                     \
+    if (!ls_is_num(left) || !ls_is_num(right))                                 \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+                                                                               \
+    double a = ls_val2num(left);                                               \
+    double b = ls_val2num(right);                                              \
+    top[-1] = (expr);                                                          \
+  } while (false)
+
+  LOAD_FRAME();
+  for (;;) {
+    LsCode instruction = (LsCode)READ_BYTE();
+    switch (instruction) {
+    case CODE_CONSTANT:
+      PUSH(constants[READ_SHORT()]);
+      break;
+
+    case CODE_NULL:
+      PUSH(LS_NULL);
+      break;
+
+    case CODE_FALSE:
+      PUSH(LS_FALSE);
+      break;
+
+    case CODE_TRUE:
+      PUSH(LS_TRUE);
+      break;
+
+    case CODE_LOAD_LOCAL_0:
+    case CODE_LOAD_LOCAL_1:
+    case CODE_LOAD_LOCAL_2:
+    case CODE_LOAD_LOCAL_3:
+    case CODE_LOAD_LOCAL_4:
+    case CODE_LOAD_LOCAL_5:
+    case CODE_LOAD_LOCAL_6:
+    case CODE_LOAD_LOCAL_7:
+    case CODE_LOAD_LOCAL_8:
+      PUSH(slots[instruction - CODE_LOAD_LOCAL_0]);
+      break;
+
+    case CODE_LOAD_LOCAL:
+      PUSH(slots[READ_BYTE()]);
+      break;
+
+    case CODE_STORE_LOCAL:
+      slots[READ_BYTE()] = PEEK();
+      break;
+
+    case CODE_LOAD_UPVALUE:
+      PUSH(*frame->closure->upvalues[READ_BYTE()]->value);
+      break;
+
+    case CODE_STORE_UPVALUE:
+      *frame->closure->upvalues[READ_BYTE()]->value = PEEK();
+      break;
+
+    case CODE_LOAD_PARENT_LOCAL:
+      PUSH(frame[-1].slots[READ_BYTE()]);
+      break;
+
+    case CODE_STORE_PARENT_LOCAL:
+      frame[-1].slots[READ_BYTE()] = PEEK();
+      break;
+
+    case CODE_LOAD_MODULE_VAR:
+      PUSH(module_variables[READ_SHORT()]);
+      break;
+
+    case CODE_STORE_MODULE_VAR:
+      module_variables[READ_SHORT()] = PEEK();
+      break;
+
+    case CODE_POP:
+      top--;
+      break;
+
+    case CODE_ADD: {
+      LsValue right = top[-1];
+      LsValue left = top[-2];
+      if (ls_is_str(left) && ls_is_str(right)) {
+        top[-2] = ls_string_concat(vm, (LsObjString *)ls_val2obj(left),
+                                   (LsObjString *)ls_val2obj(right));
+        top--;
+        break;
+      }
+
+      NUMBER_OP(ls_num2val(a + b));
+      break;
+    }
+
+    case CODE_SUB:
+      NUMBER_OP(ls_num2val(a - b));
+      break;
+    case CODE_MUL:
+      NUMBER_OP(ls_num2val(a * b));
+      break;
+    case CODE_DIV:
+      NUMBER_OP(ls_num2val(a / b));
+      break;
+    case CODE_MOD:
+      NUMBER_OP(ls_num2val(ls_num_mod(a, b)));
+      break;
+    case CODE_POW:
+      NUMBER_OP(ls_num2val(ls_num_pow(a, b)));
+      break;
+    case CODE_BAND:
+      NUMBER_OP(ls_num2val(ls_num_band(a, b)));
+      break;
+    case CODE_BOR:
+      NUMBER_OP(ls_num2val(ls_num_bor(a, b)));
+      break;
+    case CODE_SHL:
+      NUMBER_OP(ls_num2val(ls_num_shl(a, b)));
+      break;
+    case CODE_SHR:
+      NUMBER_OP(ls_num2val(ls_num_shr(a, b)));
+      break;
+
+    // Numbers compare by value rather than by bits, so 0 equals -0 and NaN
+    // equals nothing.
+    case CODE_EQ: {
+      LsValue right = POP();
+      LsValue left = top[-1];
+      bool equal = ls_is_num(left) && ls_is_num(right)
+                       ? ls_val2num(left) == ls_val2num(right)
+                       : ls_val_eq(left, right);
+      top[-1] = equal ? LS_TRUE : LS_FALSE;
+      break;
+    }
+
+    case CODE_NEQ: {
+      LsValue right = POP();
+      LsValue left = top[-1];
+      bool equal = ls_is_num(left) && ls_is_num(right)
+                       ? ls_val2num(left) == ls_val2num(right)
+                       : ls_val_eq(left, right);
+      top[-1] = equal ? LS_FALSE : LS_TRUE;
+      break;
+    }
+
+    case CODE_LT:
+      NUMBER_OP(a < b ? LS_TRUE : LS_FALSE);
+      break;
+    case CODE_LE:
+      NUMBER_OP(a <= b ? LS_TRUE : LS_FALSE);
+      break;
+    case CODE_GT:
+      NUMBER_OP(a > b ? LS_TRUE : LS_FALSE);
+      break;
+    case CODE_GE:
+      NUMBER_OP(a >= b ? LS_TRUE : LS_FALSE);
+      break;
+
+    case CODE_NEGATE:
+      if (!ls_is_num(PEEK()))
+        RUNTIME_ERROR("Operand must be a number.");
+      top[-1] = ls_num2val(-ls_val2num(PEEK()));
+      break;
+
+    case CODE_NOT:
+      top[-1] = ls_is_falsy(PEEK()) ? LS_TRUE : LS_FALSE;
+      break;
+
+    case CODE_BNOT:
+      if (!ls_is_num(PEEK()))
+        RUNTIME_ERROR("Operand must be a number.");
+      top[-1] = ls_num2val(ls_num_bnot(ls_val2num(PEEK())));
+      break;
+
+    case CODE_CALL_0:
+    case CODE_CALL_1:
+    case CODE_CALL_2:
+    case CODE_CALL_3:
+    case CODE_CALL_4:
+    case CODE_CALL_5:
+    case CODE_CALL_6:
+    case CODE_CALL_7:
+    case CODE_CALL_8:
+    case CODE_CALL_9:
+    case CODE_CALL_10:
+    case CODE_CALL_11:
+    case CODE_CALL_12:
+    case CODE_CALL_13:
+    case CODE_CALL_14:
+    case CODE_CALL_15:
+    case CODE_CALL_16: {
+      int num_args = instruction - CODE_CALL_0;
+      LsValue callee = top[-num_args - 1];
+      STORE_FRAME();
+      if (ls_is_obj(callee) && ls_val2obj(callee)->type == LS_OBJ_FIBER) {
+        // Resuming a fiber replaces it and the value it is resumed with by
+        // the value it yields or returns, once it does.
+        if (num_args > 1)
+          RUNTIME_ERROR("A fiber is resumed with at most one value.");
+
+        LsObjFiber *resumed = (LsObjFiber *)ls_val2obj(callee);
+        if (resumed->state == LS_FIBER_WAITING)
+          RUNTIME_ERROR("Fiber is waiting for the host.");
+
+        LsValue value = num_args == 1 ? top[-1] : LS_NULL;
+        fiber->stack_top -= num_args + 1;
+        if (!enter_fiber(vm, FIBER_BASE(), resumed, value))
+          goto error;
+        resumed->caller = fiber;
+      } else if (!call_value(vm, FIBER_BASE(), callee, num_args)) {
+        goto error;
+      }
+      LOAD_FRAME();
+
+      // A foreign function suspended the fiber, which gives control back to
+      // the host.
+      if (fiber->state == LS_FIBER_WAITING)
+        return LS_RESULT_SUSPENDED;
+      CHECK_BUDGET();
+      break;
+    }
+
+    case CODE_JUMP: {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      break;
+    }
+
+    case CODE_LOOP: {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+      CHECK_BUDGET();
+      break;
+    }
+
+    case CODE_JUMP_IF: {
+      uint16_t offset = READ_SHORT();
+      LsValue condition = POP();
+      if (ls_is_falsy(condition))
+        ip += offset;
+      break;
+    }
+
+    case CODE_AND: {
+      uint16_t offset = READ_SHORT();
+      if (ls_is_falsy(PEEK()))
+        ip += offset;
+      else
+        top--;
+      break;
+    }
+
+    case CODE_OR: {
+      uint16_t offset = READ_SHORT();
+      if (!ls_is_falsy(PEEK()))
+        ip += offset;
+      else
+        top--;
+      break;
+    }
+
+    case CODE_CLOSE_UPVALUE:
+      // Close the upvalue for the local if we have one.
+      close_upvalues(fiber, top - 1);
+      top--;
+      break;
+
+    case CODE_RETURN: {
+      LsValue value = POP();
+
+      // Close any upvalues still in scope.
+      close_upvalues(fiber, slots);
+      fiber->frame_count--;
+
+      // Replace the function and its arguments by the value it returns.
+      fiber->stack_top = slots;
+      if (fiber == entry && fiber->frame_count == base) {
+        if (result != NULL)
+          *result = value;
+        return LS_RESULT_SUCCESS;
+      }
+
+      // A fiber returning from its function gives the value to the fiber
+      // that resumed it.
+      if (fiber->frame_count == 0) {
+        vm->fiber = fiber->caller;
+        finish_fiber(vm, fiber);
+      }
+
+      *vm->fiber->stack_top++ = value;
+      LOAD_FRAME();
+      break;
+    }
+
+    case CODE_YIELD: {
+      LsValue value = POP();
+      STORE_FRAME();
+      if (fiber->caller == NULL) {
+        // Fibers resumed by the host give the value back to it. The host
+        // can't be suspended, so neither can the main fiber, nor calls made
+        // by the host while a fiber runs.
+        if (fiber == &vm->main_fiber)
+          RUNTIME_ERROR("Cannot yield from the main fiber.");
+        if (fiber != entry || base > 0)
+          RUNTIME_ERROR("Cannot yield across a call from the host.");
+
+        fiber->state = LS_FIBER_SUSPENDED;
+        if (result != NULL)
+          *result = value;
+        return LS_RESULT_SUSPENDED;
+      }
+
+      fiber->state = LS_FIBER_SUSPENDED;
+      vm->fiber = fiber->caller;
+      fiber->caller = NULL;
+      *vm->fiber->stack_top++ = value;
+      LOAD_FRAME();
+      break;
+    }
+
+    case CODE_CLOSURE: {
+      // Create the closure and push it on the stack before creating upvalues
+      // so that it doesn't get collected.
+      LsObjFn *fn = (LsObjFn *)ls_val2obj(constants[READ_SHORT()]);
+      LsObjClosure *closure = ls_new_closure(vm, fn);
+      PUSH(ls_obj2val(&closure->obj));
+
+      // Capture upvalues, if any.
+      const uint8_t *upvalues = fn->upvalues.data;
+      for (int i = 0; i < fn->num_upvalues; i++) {
+        uint8_t is_local = upvalues[i * 2];
+        uint8_t index = upvalues[i * 2 + 1];
+        if (is_local) {
+          // Make an new upvalue to close over the parent's local variable.
+          closure->upvalues[i] = capture_upvalue(vm, slots + index);
+        } else {
+          // Use the same upvalue as the current call frame.
+          closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+      }
+      break;
+    }
+
+    default:
+      // The compiler doesn't emit the other instructions yet.
+      UNREACHABLE();
+    }
+  }
+
+error:
+  // The fibers resumed by this run are done, and the frames of the fiber it
+  // started with are unwound.
+  while (vm->fiber != entry) {
+    fiber = vm->fiber;
+    vm->fiber = fiber->caller;
+    finish_fiber(vm, fiber);
+  }
+  close_upvalues(entry, entry->frames[base].slots);
+  entry->stack_top = entry->frames[base].slots;
+  entry->frame_count = base;
+  return LS_RESULT_RUNTIME_ERROR;
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef FIBER_BASE
+#undef RUNTIME_ERROR
+#undef CHECK_BUDGET
+#undef NUMBER_OP
+}
+
+LsInterpretResult ls_call_fn(LsVM *vm, LsObjFn *fn, LsValue *result) {
+  if (fn->lazy != NULL && !ls_prepare_fn(vm, fn))
+    return LS_RESULT_COMPILE_ERROR;
+
+  // Slot zero holds the function being run, its locals follow.
+  LsObjFiber *fiber = vm->fiber;
+  if (fiber->stack == NULL)
+    start_stack(vm, fiber);
+  ensure_stack(vm, fiber, (size_t)(fiber->stack_top - fiber->stack) + 1);
+  size_t base = fiber->frame_count;
+  *fiber->stack_top++ = ls_obj2val(&fn->obj);
+  push_frame(vm, fn, NULL, 0);
+
+  return run(vm, base, result);
+}
+
+LsInterpretResult ls_run_fiber(LsVM *vm, LsObjFiber *fiber, LsValue value,
+                               LsValue *result) {
+  LsObjFiber *previous = vm->fiber;
+  if (!enter_fiber(vm, 0, fiber, value))
+    return LS_RESULT_RUNTIME_ERROR;
+
+  // The main fiber is resumed once suspended, and runs the next calls of the
+  // host once done.
+  LsInterpretResult outcome = run(vm, 0, result);
+  if (fiber == &vm->main_fiber && outcome != LS_RESULT_SUSPENDED) {
+    fiber->state = LS_FIBER_RUNNING;
+  } else if (outcome != LS_RESULT_SUSPENDED) {
+    finish_fiber(vm, fiber);
+  }
+  vm->fiber = previous;
+  return outcome;
+}
+
+// Returns true if [value] is a function or a closure taking at most one
+// argument, which fibers can run.
+static bool is_fiber_fn(LsValue value) {
+  if (!ls_is_obj(value))
+    return false;
+
+  LsObj *obj = ls_val2obj(value);
+  if (obj->type == LS_OBJ_CLOSURE)
+    obj = &((LsObjClosure *)obj)->fn->obj;
+  return obj->type == LS_OBJ_FN && ((LsObjFn *)obj)->arity <= 1;
+}
+
+bool ls_spawn_fiber(LsVM *vm, const char *module, const char *fn,
+                    const char *fiber) {
+  LsValue *slot = ls_find_variable(vm, module, fn, false);
+  if (slot == NULL || !is_fiber_fn(*slot))
+    return false;
+
+  LsValue value = *slot;
+  slot = ls_find_variable(vm, module, fiber, true);
+  if (slot == NULL)
+    return false;
+
+  *slot = ls_obj2val(&ls_new_fiber(vm, value)->obj);
+  return true;
+}
+
+LsInterpretResult ls_resume_fiber(LsVM *vm, const char *module,
+                                  const char *fiber) {
+  LsValue *slot = ls_find_variable(vm, module, fiber, false);
+  if (slot == NULL || !ls_is_obj(*slot) ||
+      ls_val2obj(*slot)->type != LS_OBJ_FIBER)
+    return LS_RESULT_RUNTIME_ERROR;
+
+  return ls_run_fiber(vm, (LsObjFiber *)ls_val2obj(*slot), LS_NULL, NULL);
+}
+
+bool ls_define_foreign(LsVM *vm, const char *module, const char *name,
+                       int arity, LsForeignFn fn) {
+  LsValue *slot = ls_find_variable(vm, module, name, true);
+  if (slot == NULL)
+    return false;
+
+  *slot = ls_obj2val(&ls_new_foreign(vm, arity, fn)->obj);
+  return true;
+}
+
+// Returns [slot] of the foreign function being called, or of the host.
+static LsValue *api_slot(LsVM *vm, int slot) {
+  assert(slot >= 0 && slot < vm->num_api_slots);
+  if (!vm->in_foreign)
+    return &vm->host_slots[slot];
+  return &vm->fiber->stack[vm->api_base + (size_t)slot];
+}
+
+// Returns true if [value] is an array of bytes.
+static bool is_bytes(LsValue value) {
+  return ls_is_obj(value) && ls_val2obj(value)->type == LS_OBJ_ARRAY &&
+         ((LsObjArray *)ls_val2obj(value))->kind == LS_ARRAY_BYTE;
+}
+
+int ls_get_slot_count(LsVM *vm) { return vm->num_api_slots; }
+
+void ls_ensure_slots(LsVM *vm, int num_slots) {
+  if (num_slots <= vm->num_api_slots)
+    return;
+
+  // The slots of a foreign function grow on the stack of its fiber, past its
+  // arguments, which it pops when it returns.
+  if (vm->in_foreign) {
+    LsObjFiber *fiber = vm->fiber;
+    ensure_stack(vm, fiber, vm->api_base + (size_t)num_slots);
+    for (int i = vm->num_api_slots; i < num_slots; i++)
+      fiber->stack[vm->api_base + (size_t)i] = LS_NULL;
+    fiber->stack_top = fiber->stack + vm->api_base + num_slots;
+    vm->num_api_slots = num_slots;
+    return;
+  }
+
+  if (num_slots > vm->host_slots_capacity) {
+    int capacity = vm->host_slots_capacity == 0 ? 8 : vm->host_slots_capacity;
+    while (capacity < num_slots)
+      capacity *= 2;
+    vm->host_slots = ls_reallocate(
+        vm, vm->host_slots, (size_t)vm->host_slots_capacity * sizeof(LsValue),
+        (size_t)capacity * sizeof(LsValue));
+    // TODO: handle oom.
+    vm->host_slots_capacity = capacity;
+  }
+  for (int i = vm->num_api_slots; i < num_slots; i++)
+    vm->host_slots[i] = LS_NULL;
+  vm->num_api_slots = num_slots;
+}
+
+LsType ls_get_slot_type(LsVM *vm, int slot) {
+  LsValue value = *api_slot(vm, slot);
+  if (value == LS_NULL)
+    return LS_TYPE_NULL;
+  if (value == LS_TRUE || value == LS_FALSE)
+    return LS_TYPE_BOOL;
+  if (ls_is_num(value))
+    return LS_TYPE_NUMBER;
+  if (ls_is_str(value))
+    return LS_TYPE_STRING;
+  if (is_bytes(value))
+    return LS_TYPE_BYTES;
+  return LS_TYPE_UNKNOWN;
+}
+
+bool ls_get_slot_bool(LsVM *vm, int slot) {
+  LsValue value = *api_slot(vm, slot);
+  assert(value == LS_TRUE || value == LS_FALSE);
+  return value == LS_TRUE;
+}
+
+double ls_get_slot_double(LsVM *vm, int slot) {
+  LsValue value = *api_slot(vm, slot);
+  assert(ls_is_num(value));
+  return ls_val2num(value);
+}
+
+const char *ls_get_slot_string(LsVM *vm, int slot, size_t *length) {
+  LsValue value = *api_slot(vm, slot);
+  assert(ls_is_str(value));
+  LsObjString *str = (LsObjString *)ls_val2obj(value);
+  *length = str->length;
+  return str->value;
+}
+
+const char *ls_get_slot_bytes(LsVM *vm, int slot, size_t *length) {
+  LsValue value = *api_slot(vm, slot);
+  assert(is_bytes(value));
+  LsObjArray *arr = (LsObjArray *)ls_val2obj(value);
+  *length = arr->elements.bytes.length;
+  return (const char *)arr->elements.bytes.data;
+}
+
+void ls_set_slot_null(LsVM *vm, int slot) { *api_slot(vm, slot) = LS_NULL; }
+
+void ls_set_slot_bool(LsVM *vm, int slot, bool value) {
+  *api_slot(vm, slot) = value ? LS_TRUE : LS_FALSE;
+}
+
+void ls_set_slot_double(LsVM *vm, int slot, double value) {
+  *api_slot(vm, slot) = ls_num2val(value);
+}
+
+void ls_set_slot_string(LsVM *vm, int slot, const char *text, size_t length) {
+  LsValue value = ls_new_string_length(vm, text, length);
+  *api_slot(vm, slot) = value;
+}
+
+void ls_set_slot_bytes(LsVM *vm, int slot, const char *bytes, size_t length) {
+  LsValue value = ls_new_byte_array(vm, (const uint8_t *)bytes, length);
+  *api_slot(vm, slot) = value;
+}
+
+bool ls_get_variable(LsVM *vm, const char *module, const char *name,
+                     int slot) {
+  LsValue *variable = ls_find_variable(vm, module, name, false);
+  if (variable == NULL)
+    return false;
+
+  *api_slot(vm, slot) = *variable;
+  return true;
+}
+
+// Copies the function in slot 0 and the [num_args] arguments after it on top
+// of the stack of the running fiber, to be called there like by a script.
+// Returns where the function was copied.
+static size_t push_slots(LsVM *vm, int num_args) {
+  LsObjFiber *fiber = vm->fiber;
+  size_t top = fiber->stack == NULL ? 0 : (size_t)(fiber->stack_top -
+                                                   fiber->stack);
+  ensure_stack(vm, fiber, top + (size_t)num_args + 1);
+  for (int i = 0; i <= num_args; i++)
+    *fiber->stack_top++ = *api_slot(vm, i);
+  return top;
+}
+
+// Runs the function the host called from [top] of the stack until it returns,
+// if it pushed frames above [base], and stores its result in slot 0.
+static LsInterpretResult finish_call(LsVM *vm, size_t top, size_t base) {
+  // Foreign functions are done once called, and leave their result where
+  // they were.
+  LsObjFiber *fiber = vm->fiber;
+  LsValue value = fiber->stack[top];
+  LsInterpretResult result = LS_RESULT_SUCCESS;
+  if (fiber->frame_count > base)
+    result = run(vm, base, &value);
+  if (result == LS_RESULT_SUCCESS) {
+    fiber->stack_top = fiber->stack + top;
+    *api_slot(vm, 0) = value;
+  }
+
+  return result;
+}
+
+LsInterpretResult ls_call(LsVM *vm, int num_args) {
+  assert(num_args >= 0 && num_args < vm->num_api_slots);
+
+  LsObjFiber *fiber = vm->fiber;
+  size_t top = push_slots(vm, num_args);
+  size_t base = fiber->frame_count;
+  if (!call_value(vm, base, fiber->stack[top], num_args)) {
+    fiber->stack_top = fiber->stack + top;
+    return LS_RESULT_RUNTIME_ERROR;
+  }
+
+  return finish_call(vm, top, base);
+}
+
+LsCallHandle *ls_make_call_handle(LsVM *vm, const char *module,
+                                  const char *name, int arity) {
+  LsValue *variable = ls_find_variable(vm, module, name, false);
+  if (variable == NULL || !ls_is_obj(*variable))
+    return NULL;
+
+  LsCallHandle handle = {0};
+  LsObj *obj = ls_val2obj(*variable);
+  if (obj->type == LS_OBJ_FOREIGN) {
+    handle.foreign = (LsObjForeign *)obj;
+    handle.arity = handle.foreign->arity;
+  } else if (obj->type == LS_OBJ_CLOSURE) {
+    handle.closure = (LsObjClosure *)obj;
+    handle.fn = handle.closure->fn;
+  } else if (obj->type == LS_OBJ_FN) {
+    handle.fn = (LsObjFn *)obj;
+  } else {
+    return NULL;
+  }
+
+  // Functions are prepared now rather than on their first call, so that
+  // calls can push their frame right away.
+  if (handle.fn != NULL) {
+    if (handle.fn->lazy != NULL && !ls_prepare_fn(vm, handle.fn))
+      return NULL;
+    handle.arity = handle.fn->arity;
+  }
+  if (handle.arity != arity)
+    return NULL;
+
+  LsCallHandle *result = ls_reallocate(vm, NULL, 0, sizeof(LsCallHandle));
+  // TODO: handle oom.
+  *result = handle;
+  return result;
+}
+
+LsInterpretResult ls_call_handle(LsVM *vm, LsCallHandle *handle) {
+  assert(handle->arity < vm->num_api_slots);
+
+  LsObjFiber *fiber = vm->fiber;
+  size_t top = push_slots(vm, handle->arity);
+  size_t base = fiber->frame_count;
+  if (handle->foreign == NULL) {
+    push_frame(vm, handle->fn, handle->closure, handle->arity);
+  } else if (!call_foreign(vm, base, handle->foreign, handle->arity)) {
+    fiber->stack_top = fiber->stack + top;
+    return LS_RESULT_RUNTIME_ERROR;
+  }
+
+  return finish_call(vm, top, base);
+}
+
+void ls_release_call_handle(LsVM *vm, LsCallHandle *handle) {
+  ls_reallocate(vm, handle, sizeof(LsCallHandle), 0);
+}
+
+void ls_abort_fiber(LsVM *vm, const char *message) { vm->api_error = message; }
+
+LsFiber *ls_spawn_fiber_in_slot(LsVM *vm, int slot) {
+  LsValue *value = api_slot(vm, slot);
+  if (!is_fiber_fn(*value))
+    return NULL;
+
+  LsObjFiber *fiber = ls_new_fiber(vm, *value);
+  *value = ls_obj2val(&fiber->obj);
+  return fiber;
+}
+
+LsFiber *ls_suspend_fiber(LsVM *vm) {
+  if (!vm->can_suspend)
+    return NULL;
+
+  // Once is enough.
+  vm->can_suspend = false;
+  vm->fiber->state = LS_FIBER_WAITING;
+  return vm->fiber;
+}
+
+LsInterpretResult ls_resume_null(LsVM *vm, LsFiber *fiber) {
+  return ls_run_fiber(vm, fiber, LS_NULL, NULL);
+}
+
+LsInterpretResult ls_resume_double(LsVM *vm, LsFiber *fiber, double value) {
+  return ls_run_fiber(vm, fiber, ls_num2val(value), NULL);
+}
+
+LsInterpretResult ls_resume_string(LsVM *vm, LsFiber *fiber, const char *text,
+                                   size_t length) {
+  return ls_run_fiber(vm, fiber, ls_new_string_length(vm, text, length), NULL);
+}
+
+LsFiber *ls_get_preempted_fiber(LsVM *vm) { return vm->preempted; }
+
+// Runs [fn], the result of compiling a module, unless it failed to compile.
+static LsInterpretResult interpret(LsVM *vm, LsObjFn *fn) {
+  if (fn == NULL)
+    return LS_RESULT_COMPILE_ERROR;
+
+  return ls_call_fn(vm, fn, NULL);
+}
+
+LsInterpretResult ls_interpret(LsVM *vm, const char *source) {
+  return interpret(vm, ls_compile(vm, source));
+}
+
+LsObjModule *ls_find_module(LsVM *vm, const char *name, bool create) {
+  if (vm->modules == NULL) {
+    if (!create)
+      return NULL;
+    vm->modules = (LsObjMap *)ls_val2obj(ls_new_map(vm));
+  }
+
+  LsValue key = ls_intern_string(vm, name, strlen(name));
+  LsValue found = ls_map_get(vm->modules, key);
+  if (found == LS_UNDEFINED) {
+    if (!create)
+      return NULL;
+    found = ls_obj2val(&ls_new_module(vm)->obj);
+    ls_map_set(vm, vm->modules, key, found);
+  }
+
+  return (LsObjModule *)ls_val2obj(found);
+}
+
+LsValue *ls_find_variable(LsVM *vm, const char *module, const char *name,
+                          bool declare) {
+  LsObjModule *found = ls_find_module(vm, module, declare);
+  if (found == NULL)
+    return NULL;
+
+  LsValue key = ls_intern_string(vm, name, strlen(name));
+  LsValue index = ls_map_get(found->variable_names, key);
+  if (index == LS_UNDEFINED) {
+    if (!declare || found->variables.length == MAX_MODULE_VARS)
+      return NULL;
+
+    ls_value_buffer_write(vm, &found->variables, LS_NULL);
+    index = ls_num2val((double)(found->variables.length - 1));
+    ls_map_set(vm, found->variable_names, key, index);
+  }
+
+  return &found->variables.data[(size_t)ls_val2num(index)];
+}
+
+LsInterpretResult ls_interpret_in_module(LsVM *vm, const char *module,
+                                         const char *source) {
+  return interpret(vm, ls_compile_in_module(vm, ls_find_module(vm, module, true),
+                                            source, strlen(source)));
+}
+
+LsInterpretResult ls_interpret_length(LsVM *vm, const char *source,
+                                      size_t length) {
+  return interpret(vm, ls_compile_length(vm, source, length));
+}
+
+LsInterpretResult ls_interpret_length_in_module(LsVM *vm, const char *module,
+                                                const char *source,
+                                                size_t length) {
+  return interpret(vm, ls_compile_in_module(vm, ls_find_module(vm, module, true),
+                                            source, length));
+}
+
+LsInterpretResult ls_interpret_reader(LsVM *vm, LsReadFn read, void *data) {
+  return interpret(vm, ls_compile_reader(vm, read, data));
+}
+
+// Reports [message] about an image, as a compile error.
+static void image_error(LsVM *vm, const char *message) {
+  if (vm->config.on_error == NULL)
+    return;
+
+  // TODO: replace "main" with real module name.
+  vm->config.on_error(vm, LS_ERROR_COMPILE, "main", 0, message);
+}
+
+LsInterpretResult ls_compile_image(LsVM *vm, const char *source, size_t length,
+                                   LsImageFn save, void *data) {
+  LsObjFn *fn = ls_compile_length(vm, source, length);
+  if (fn == NULL)
+    return LS_RESULT_COMPILE_ERROR;
+
+  ByteBuffer image;
+  ls_byte_buffer_init(&image);
+  bool written = ls_write_image(vm, fn, &image);
+  if (written) {
+    save(data, (const char *)image.data, image.length);
+  } else {
+    image_error(vm, "Could not write image.");
+  }
+  ls_byte_buffer_clear(vm, &image);
+
+  return written ? LS_RESULT_SUCCESS : LS_RESULT_COMPILE_ERROR;
+}
+
+bool ls_is_image(const char *data, size_t length) {
+  return length >= sizeof(IMAGE_MAGIC) - 1 &&
+         memcmp(data, IMAGE_MAGIC, sizeof(IMAGE_MAGIC) - 1) == 0;
+}
+
+LsInterpretResult ls_interpret_image(LsVM *vm, const char *image,
+                                     size_t length) {
+  LsObjFn *fn = ls_load_image(vm, (const uint8_t *)image, length);
+  if (fn == NULL)
+    image_error(vm, "Invalid image.");
+
+  return interpret(vm, fn);
+}
+
+LsInterpretResult ls_interpret_modules(LsVM *vm, const char *const *sources,
+                                       const size_t *lengths, size_t count) {
+  LsObjFn **fns = ls_allocate_array(vm, LsObjFn *, count);
+  LsInterpretResult result = LS_RESULT_COMPILE_ERROR;
+  if (ls_compile_modules(vm, sources, lengths, count, fns)) {
+    result = LS_RESULT_SUCCESS;
+    for (size_t i = 0; i < count && result == LS_RESULT_SUCCESS; i++)
+      result = ls_call_fn(vm, fns[i], NULL);
+  }
+
+  ls_reallocate(vm, fns, count * sizeof(LsObjFn *), 0);
+  return result;
+}
+
+bool ls_save_image(LsVM *vm, LsImageFn save, void *data) {
+  ByteBuffer image;
+  ls_byte_buffer_init(&image);
+  bool saved = ls_write_snapshot(vm, &image);
+  if (saved)
+    save(data, (const char *)image.data, image.length);
+
+  ls_byte_buffer_clear(vm, &image);
+  return saved;
+}
+
+LsVM *ls_new_vm_from_image(LsConfiguration *config, const char *image,
+                           size_t length) {
+  return ls_read_snapshot(config, (const uint8_t *)image, length);
+}
+
+LsVM *ls_clone_vm(LsVM *parent) {
+  LsVM *vm = ls_new_vm(&parent->config);
+  if (!ls_clone_heap(parent, vm)) {
+    ls_free_vm(vm);
+    return NULL;
+  }
+
+  return vm;
+}
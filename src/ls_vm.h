@@ -3,6 +3,44 @@
 
 #include "ls_value.h"
 
+// The instructions of compiled functions. Their arguments and stack effects
+// are documented in ls_opcodes.h.
+typedef enum {
+#define OPCODE(name, _) CODE_##name,
+#include "ls_opcodes.h"
+} LsCode;
+
+// A stack of FIBER_STACK_SLOTS values with FIBER_FRAMES call frames, pooled
+// for the next fiber to start.
+typedef struct {
+  LsValue *stack;
+  CallFrame *frames;
+} FiberStack;
+
+// A function resolved by ls_make_call_handle(): either [foreign], or [fn] and
+// its [closure], if any, prepared to be called with [arity] arguments.
+struct ls_call_handle {
+  LsObjForeign *foreign;
+  LsObjFn *fn;
+  LsObjClosure *closure;
+  int arity;
+};
+
+// The code of a function loaded from outside the compiler, and the sizes of
+// the tables its instructions index, checked by ls_check_code().
+typedef struct {
+  const uint8_t *code;
+  size_t code_length;
+  uint32_t max_slots;
+  uint32_t num_upvalues;
+  uint32_t num_constants;
+  uint32_t num_variables;
+
+  // Returns whether the constant at [index] is a function, given [data].
+  bool (*is_fn)(const void *data, uint32_t index);
+  const void *data;
+} LsCodeLimits;
+
 struct ls_vm {
   LsConfiguration config;
 
@@ -18,6 +56,107 @@ struct ls_vm {
   // The first object in the linked list of all currently allocated objects.
   // Objects are prepended on allocation.
   LsObj *first_obj;
+
+  // The table of interned strings, mapping each of them to itself. It is
+  // created by the first call to ls_intern_string().
+  LsObjMap *strings;
+
+  // The modules code was interpreted in by ls_interpret_in_module(), by name.
+  // Created with the first of them.
+  LsObjMap *modules;
+
+  // The VM this one was cloned from by ls_clone_vm(), or NULL. The strings of
+  // this VM and the code of its functions are those of [parent], rather than
+  // copies owned by this VM.
+  LsVM *parent;
+
+  // The programs this VM ran with ls_run_program(), each of which it holds a
+  // reference to. The code and strings of their functions aren't copied.
+  LsProgram **programs;
+  size_t num_programs;
+  size_t programs_capacity;
+
+  // The fiber running code. Calls made by the host run on [main_fiber],
+  // unless they are made while another fiber runs. [main_fiber] isn't in the
+  // list of objects: it lives as long as the VM.
+  LsObjFiber *fiber;
+  LsObjFiber main_fiber;
+
+  // The stacks of the fibers that are done, for the next fibers to start
+  // with.
+  FiberStack *free_stacks;
+  size_t num_free_stacks;
+  size_t free_stacks_capacity;
+
+  // The slots of the foreign function being called: the function followed by
+  // its arguments, on the stack of the running fiber from [api_base]. An
+  // index rather than a pointer, since the stack moves when it grows.
+  size_t api_base;
+  int num_api_slots;
+
+  // Whether a foreign function is being called. Otherwise, the slots are
+  // those of the host, in [host_slots], which has room for
+  // [host_slots_capacity] of them.
+  bool in_foreign;
+  LsValue *host_slots;
+  int host_slots_capacity;
+
+  // The error the foreign function being called fails with, or NULL.
+  const char *api_error;
+
+  // Whether the foreign function being called may suspend its fiber.
+  bool can_suspend;
+
+  // The loop iterations and calls the running code makes before it is
+  // preempted, or SIZE_MAX without a budget, which never runs out.
+  size_t budget;
+
+  // The fiber preempted by the last run, or NULL.
+  LsObjFiber *preempted;
 };
 
+// Frees every object of [vm], leaving it with an empty heap, no strings and
+// no modules, to run other code. The host slots are set to null.
+void ls_free_objects(LsVM *vm);
+
+// Returns true if the code of [limits] only has instructions the interpreter
+// runs, whose arguments stay inside the code and index its tables, whose jumps
+// land on instructions, and which ends with CODE_RETURN and CODE_END. The
+// closures it creates must be of function constants.
+bool ls_check_code(LsVM *vm, const LsCodeLimits *limits);
+
+// Finishes [fn] before its first call: compiles it if it was compiled lazily,
+// or creates its constants if it was loaded from an image. Returns false if
+// that fails.
+bool ls_prepare_fn(LsVM *vm, LsObjFn *fn);
+
+// Prepares every function of [vm] with ls_prepare_fn(), including those the
+// prepared ones define. Returns false if one of them fails.
+bool ls_prepare_fns(LsVM *vm);
+
+// Returns the module named [name] run by ls_interpret_in_module(), which is
+// created if [create]. Returns NULL if there is none.
+LsObjModule *ls_find_module(LsVM *vm, const char *name, bool create);
+
+// Returns the slot of the variable [name] of the module named [module], which
+// are declared if [declare]. Returns NULL if there is none, or if the module
+// has too many variables to declare it. The slot moves when the module
+// declares more variables.
+LsValue *ls_find_variable(LsVM *vm, const char *module, const char *name,
+                          bool declare);
+
+// Runs [fn] and stores the value it returns in [result], unless [result] is
+// NULL.
+LsInterpretResult ls_call_fn(LsVM *vm, LsObjFn *fn, LsValue *result);
+
+// Resumes [fiber] with [value], which is the argument of its function when it
+// starts, or the value of the yield it was suspended by otherwise. Runs it
+// until it yields or returns, and stores the value it yields or returns in
+// [result], unless it is NULL.
+//
+// Returns LS_RESULT_SUSPENDED if it yields. Reports a runtime error if it is
+// running or done.
+LsInterpretResult ls_run_fiber(LsVM *vm, LsObjFiber *fiber, LsValue value,
+                               LsValue *result);
+
 #endif
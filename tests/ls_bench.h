@@ -0,0 +1,60 @@
+#ifndef LS_BENCH_H_INCLUDE
+#define LS_BENCH_H_INCLUDE
+
+// Must be included before any other header to expose clock_gettime().
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <time.h>
+
+// Returns the current time of a monotonic clock, in seconds.
+static inline double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Prints the time per operation of [name], which ran [count] operations in
+// [seconds].
+static inline void bench_report(const char *name, double seconds,
+                                double count) {
+  printf("%-44s %10.3f ns/op %14.0f op/s\n", name, seconds * 1e9 / count,
+         count / seconds);
+}
+
+// Prints the throughput of [name], which processed [bytes] bytes in [seconds].
+static inline void bench_report_bytes(const char *name, double seconds,
+                                      double bytes) {
+  printf("%-44s %10.1f MB/s\n", name, bytes / seconds / 1e6);
+}
+
+// Prints the memory used by [name], [bytes] bytes.
+static inline void bench_report_size(const char *name, double bytes) {
+  printf("%-44s %10.1f KB\n", name, bytes / 1024);
+}
+
+// Runs [body] [iterations] times and reports it as [count] operations per
+// iteration.
+#define BENCH(name, iterations, count, body)                                   \
+  do {                                                                         \
+    double start = bench_now();                                                \
+    for (long bench_i = 0; bench_i < (iterations); bench_i++) {                \
+      body;                                                                    \
+    }                                                                          \
+    bench_report((name), bench_now() - start,                                  \
+                 (double)(iterations) * (double)(count));                      \
+  } while (0)
+
+// Runs [body] [iterations] times and reports its throughput as [bytes] bytes
+// processed per iteration.
+#define BENCH_BYTES(name, iterations, bytes, body)                             \
+  do {                                                                         \
+    double start = bench_now();                                                \
+    for (long bench_i = 0; bench_i < (iterations); bench_i++) {                \
+      body;                                                                    \
+    }                                                                          \
+    bench_report_bytes((name), bench_now() - start,                            \
+                       (double)(iterations) * (double)(bytes));                \
+  } while (0)
+
+#endif
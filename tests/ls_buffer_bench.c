@@ -0,0 +1,85 @@
+#include "ls_bench.h"
+
+#include <stdlib.h>
+
+#include "ls_buffer.h"
+#include "ls_vm.h"
+
+// The number of bytes appended to the benchmarked buffers.
+#define LENGTH 65536
+
+// The number of times each operation is repeated.
+#define ITERATIONS 2000
+
+// The number of bytes appended at once by bulk appends.
+#define CHUNK 64
+
+// Defeats dead code elimination of benchmarked results.
+static volatile size_t sink;
+
+static void bench_write(LsVM *vm) {
+  ByteBuffer buffer;
+  ls_byte_buffer_init(&buffer);
+
+  // What writing used to cost: a reallocation per byte, even with spare room.
+  BENCH("write (per byte, realloc each byte)", ITERATIONS, LENGTH, {
+    for (size_t i = 0; i < LENGTH; i++) {
+      if (buffer.length == buffer.capacity)
+        ls_byte_buffer_grow(vm, &buffer, buffer.length + 1);
+      buffer.data = ls_reallocate(vm, buffer.data, buffer.capacity,
+                                  buffer.capacity);
+      buffer.data[buffer.length++] = (uint8_t)i;
+    }
+    sink = buffer.length;
+    ls_byte_buffer_clear(vm, &buffer);
+  });
+
+  BENCH("write (per byte, amortized growth)", ITERATIONS, LENGTH, {
+    for (size_t i = 0; i < LENGTH; i++)
+      ls_byte_buffer_write(vm, &buffer, (uint8_t)i);
+    sink = buffer.length;
+    ls_byte_buffer_clear(vm, &buffer);
+  });
+
+  BENCH("write (per byte, reserved)", ITERATIONS, LENGTH, {
+    ls_byte_buffer_reserve(vm, &buffer, LENGTH);
+    for (size_t i = 0; i < LENGTH; i++)
+      ls_byte_buffer_write(vm, &buffer, (uint8_t)i);
+    sink = buffer.length;
+    ls_byte_buffer_clear(vm, &buffer);
+  });
+}
+
+static void bench_bulk(LsVM *vm) {
+  ByteBuffer buffer;
+  ls_byte_buffer_init(&buffer);
+
+  uint8_t chunk[CHUNK];
+  for (size_t i = 0; i < CHUNK; i++)
+    chunk[i] = (uint8_t)i;
+
+  BENCH("append_n (64 byte chunks)", ITERATIONS, LENGTH, {
+    for (size_t i = 0; i < LENGTH; i += CHUNK)
+      ls_byte_buffer_append_n(vm, &buffer, chunk, CHUNK);
+    sink = buffer.length;
+    ls_byte_buffer_clear(vm, &buffer);
+  });
+
+  BENCH("fill", ITERATIONS, LENGTH, {
+    ls_byte_buffer_fill(vm, &buffer, 42, LENGTH);
+    sink = buffer.length;
+    ls_byte_buffer_clear(vm, &buffer);
+  });
+}
+
+int main(void) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  bench_write(vm);
+  bench_bulk(vm);
+
+  // Free VM.
+  ls_free_vm(vm);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <check.h>
+
+#include "ls_buffer.h"
+#include "ls_vm.h"
+
+START_TEST(test_buffer_write) {
+  LsVM *vm = ls_new_vm(NULL);
+  size_t vm_size = vm->bytes_allocated;
+
+  ByteBuffer buffer;
+  ls_byte_buffer_init(&buffer);
+  ck_assert_int_eq(buffer.length, 0);
+  ck_assert_int_eq(buffer.capacity, 0);
+  ck_assert_ptr_null(buffer.data);
+
+  // The first write allocates the minimum capacity.
+  ls_byte_buffer_write(vm, &buffer, 'a');
+  ck_assert_int_eq(buffer.length, 1);
+  ck_assert_int_eq(buffer.capacity, BUFFER_MIN_CAPACITY);
+  ck_assert_int_eq(buffer.data[0], 'a');
+
+  // Writes don't reallocate while there is room left.
+  uint8_t *data = buffer.data;
+  for (size_t i = 1; i < BUFFER_MIN_CAPACITY; i++)
+    ls_byte_buffer_write(vm, &buffer, 'a' + i);
+  ck_assert_ptr_eq(buffer.data, data);
+  ck_assert_int_eq(buffer.capacity, BUFFER_MIN_CAPACITY);
+
+  // Running out of room doubles the capacity.
+  ls_byte_buffer_write(vm, &buffer, 'z');
+  ck_assert_int_eq(buffer.length, BUFFER_MIN_CAPACITY + 1);
+  ck_assert_int_eq(buffer.capacity, 2 * BUFFER_MIN_CAPACITY);
+  ck_assert_int_eq(vm->bytes_allocated, vm_size + 2 * BUFFER_MIN_CAPACITY);
+  for (size_t i = 0; i < BUFFER_MIN_CAPACITY; i++)
+    ck_assert_int_eq(buffer.data[i], 'a' + i);
+
+  // Clearing frees the whole capacity.
+  ls_byte_buffer_clear(vm, &buffer);
+  ck_assert_int_eq(buffer.length, 0);
+  ck_assert_int_eq(buffer.capacity, 0);
+  ck_assert_ptr_null(buffer.data);
+  ck_assert_int_eq(vm->bytes_allocated, vm_size);
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_buffer_reserve) {
+  LsVM *vm = ls_new_vm(NULL);
+  size_t vm_size = vm->bytes_allocated;
+
+  ByteBuffer buffer;
+  ls_byte_buffer_init(&buffer);
+
+  // Reserving allocates the exact capacity.
+  ls_byte_buffer_reserve(vm, &buffer, 100);
+  ck_assert_int_eq(buffer.length, 0);
+  ck_assert_int_eq(buffer.capacity, 100);
+  ck_assert_int_eq(vm->bytes_allocated, vm_size + 100);
+
+  // Reserving less never shrinks.
+  uint8_t *data = buffer.data;
+  ls_byte_buffer_reserve(vm, &buffer, 10);
+  ck_assert_int_eq(buffer.capacity, 100);
+  ck_assert_ptr_eq(buffer.data, data);
+
+  // Filling the reserved capacity doesn't reallocate.
+  ls_byte_buffer_fill(vm, &buffer, 7, 100);
+  ck_assert_int_eq(buffer.length, 100);
+  ck_assert_int_eq(buffer.capacity, 100);
+  ck_assert_ptr_eq(buffer.data, data);
+  for (size_t i = 0; i < 100; i++)
+    ck_assert_int_eq(buffer.data[i], 7);
+
+  // Free buffer.
+  ls_byte_buffer_clear(vm, &buffer);
+  ck_assert_int_eq(vm->bytes_allocated, vm_size);
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_buffer_append_n) {
+  LsVM *vm = ls_new_vm(NULL);
+  const uint8_t *hello = (const uint8_t *)"hello ";
+  const uint8_t *world = (const uint8_t *)"world, this doesn't fit";
+
+  ByteBuffer buffer;
+  ls_byte_buffer_init(&buffer);
+
+  // Appending nothing doesn't allocate.
+  ls_byte_buffer_append_n(vm, &buffer, hello, 0);
+  ck_assert_ptr_null(buffer.data);
+
+  // Appending within the capacity doesn't reallocate.
+  ls_byte_buffer_append_n(vm, &buffer, hello, 6);
+  ck_assert_int_eq(buffer.length, 6);
+  ck_assert_int_eq(buffer.capacity, BUFFER_MIN_CAPACITY);
+
+  // Appending more than twice the capacity grows to fit it exactly.
+  ls_byte_buffer_append_n(vm, &buffer, world, 23);
+  ck_assert_int_eq(buffer.length, 29);
+  ck_assert_int_eq(buffer.capacity, 29);
+  ck_assert_mem_eq(buffer.data, "hello world, this doesn't fit", 29);
+
+  // Free buffer.
+  ls_byte_buffer_clear(vm, &buffer);
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_buffer_shrink_to_fit) {
+  LsVM *vm = ls_new_vm(NULL);
+  size_t vm_size = vm->bytes_allocated;
+
+  ByteBuffer buffer;
+  ls_byte_buffer_init(&buffer);
+
+  // Shrinking an empty buffer does nothing.
+  ls_byte_buffer_shrink_to_fit(vm, &buffer);
+  ck_assert_ptr_null(buffer.data);
+
+  // Shrinking releases the spare capacity.
+  ls_byte_buffer_reserve(vm, &buffer, 64);
+  ls_byte_buffer_fill(vm, &buffer, 1, 3);
+  ls_byte_buffer_shrink_to_fit(vm, &buffer);
+  ck_assert_int_eq(buffer.length, 3);
+  ck_assert_int_eq(buffer.capacity, 3);
+  ck_assert_int_eq(vm->bytes_allocated, vm_size + 3);
+  for (size_t i = 0; i < 3; i++)
+    ck_assert_int_eq(buffer.data[i], 1);
+
+  // Shrinking an emptied buffer frees it.
+  buffer.length = 0;
+  ls_byte_buffer_shrink_to_fit(vm, &buffer);
+  ck_assert_int_eq(buffer.capacity, 0);
+  ck_assert_ptr_null(buffer.data);
+  ck_assert_int_eq(vm->bytes_allocated, vm_size);
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+static Suite *alloc_suite(void) {
+  Suite *s = suite_create("ls_buffer");
+  TCase *tc_core = tcase_create("Core");
+
+  tcase_add_test(tc_core, test_buffer_write);
+  tcase_add_test(tc_core, test_buffer_reserve);
+  tcase_add_test(tc_core, test_buffer_append_n);
+  tcase_add_test(tc_core, test_buffer_shrink_to_fit);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void) {
+  Suite *suite = alloc_suite();
+  SRunner *sr = srunner_create(suite);
+
+  srunner_run_all(sr, CK_NORMAL);
+  int number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
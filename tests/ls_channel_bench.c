@@ -0,0 +1,89 @@
+#include "ls_bench.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ls_channel.h"
+#include "ls_value.h"
+#include "ls_vm.h"
+
+// The size of the arrays of bytes bounced between the threads.
+#define TRANSFER_SIZE (1 << 20)
+
+// The number of maps in the graphs bounced between the threads.
+#define GRAPH_SIZE 1000
+
+// The channels between the main thread and the echo thread.
+typedef struct {
+  LsChannel *ping;
+  LsChannel *pong;
+} Echo;
+
+// Sends back every value received from the ping channel of the Echo [data]
+// with a VM of its own, until it is closed.
+static void *echo(void *data) {
+  Echo *channels = data;
+  LsVM *vm = ls_new_vm(NULL);
+  while (ls_channel_receive(channels->ping, vm, "app", "x"))
+    ls_channel_send(channels->pong, vm, "app", "x");
+
+  ls_free_vm(vm);
+  return NULL;
+}
+
+// Sends the variable "x" of [vm] to the echo thread, and receives it back.
+static void round_trip(Echo *channels, LsVM *vm) {
+  ls_channel_send(channels->ping, vm, "app", "x");
+  ls_channel_receive(channels->pong, vm, "app", "x");
+}
+
+// Returns an array of GRAPH_SIZE maps, each holding a string and the map
+// before it.
+static LsValue new_graph(LsVM *vm) {
+  LsObjArray *arr = (LsObjArray *)ls_val2obj(ls_new_array(vm, 0));
+  LsValue name = ls_new_string(vm, "name");
+  LsValue previous = LS_NULL;
+  for (int i = 0; i < GRAPH_SIZE; i++) {
+    LsObjMap *map = (LsObjMap *)ls_val2obj(ls_new_map(vm));
+    ls_map_set(vm, map, name, ls_new_string(vm, "node"));
+    ls_map_set(vm, map, ls_num2val(0), previous);
+    previous = ls_obj2val(&map->obj);
+    ls_array_push(vm, arr, previous);
+  }
+
+  return ls_obj2val(&arr->obj);
+}
+
+int main(void) {
+  Echo channels = {ls_new_channel(NULL, 1), ls_new_channel(NULL, 1)};
+  pthread_t thread;
+  pthread_create(&thread, NULL, echo, &channels);
+  LsVM *vm = ls_new_vm(NULL);
+  LsValue *x = ls_find_variable(vm, "app", "x", true);
+
+  // A round trip of a number is the latency of the channels themselves.
+  *x = ls_num2val(1);
+  BENCH("ping-pong a number", 20000, 2, round_trip(&channels, vm));
+
+  // Arrays of bytes are handed over, so their size doesn't matter.
+  *x = ls_new_byte_array(vm, NULL, TRANSFER_SIZE);
+  BENCH("ping-pong a 1 MB array of bytes", 20000, 2,
+        round_trip(&channels, vm));
+  BENCH_BYTES("transfer a 1 MB array of bytes", 20000, 2 * TRANSFER_SIZE,
+              round_trip(&channels, vm));
+
+  // Graphs are cloned, map by map.
+  *x = new_graph(vm);
+  BENCH("ping-pong a graph of 1000 maps", 200, 2, round_trip(&channels, vm));
+  BENCH("clone a map of a graph", 200, 2 * GRAPH_SIZE,
+        round_trip(&channels, vm));
+
+  ls_close_channel(channels.ping);
+  pthread_join(thread, NULL);
+  ls_free_channel(channels.ping);
+  ls_free_channel(channels.pong);
+
+  ls_free_vm(vm);
+  return 0;
+}
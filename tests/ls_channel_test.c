@@ -0,0 +1,238 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "ls_channel.h"
+#include "ls_value.h"
+#include "ls_vm.h"
+
+#include "ls_test.h"
+
+// Returns the slot of the variable [name] of the module "app" of [vm], which
+// is declared if needed.
+static LsValue *variable(LsVM *vm, const char *name) {
+  LsValue *slot = ls_find_variable(vm, "app", name, true);
+  ck_assert_ptr_nonnull(slot);
+  return slot;
+}
+
+START_TEST(test_channel_clone) {
+  LsVM *a = ls_new_vm(NULL);
+  LsVM *b = ls_new_vm(NULL);
+  LsChannel *channel = ls_new_channel(NULL, 0);
+  ck_assert_uint_eq(channel->capacity, DEFAULT_CHANNEL_CAPACITY);
+  ck_assert_ptr_nonnull(variable(b, "y"));
+  int received_maps = count_objects(b, LS_OBJ_MAP);
+
+  // An array holding the same map twice, which holds the array.
+  LsObjArray *arr = (LsObjArray *)ls_val2obj(ls_new_array(a, 0));
+  LsObjMap *map = (LsObjMap *)ls_val2obj(ls_new_map(a));
+  LsValue name = ls_new_string(a, "name");
+  ls_map_set(a, map, name, ls_new_string(a, "value"));
+  ls_map_set(a, map, ls_new_string(a, "parent"), ls_obj2val(&arr->obj));
+  ls_array_push(a, arr, ls_obj2val(&map->obj));
+  ls_array_push(a, arr, ls_obj2val(&map->obj));
+  ls_array_push(a, arr, ls_num2val(1.5));
+  *variable(a, "x") = ls_obj2val(&arr->obj);
+
+  int strings = count_objects(a, LS_OBJ_STRING);
+  int maps = count_objects(a, LS_OBJ_MAP);
+  size_t bytes = a->bytes_allocated;
+  ck_assert(ls_channel_send(channel, a, "app", "x"));
+  ck_assert(ls_channel_receive(channel, b, "app", "y"));
+
+  // The sender keeps its objects, and none of the copies.
+  ck_assert_int_eq(count_objects(a, LS_OBJ_STRING), strings);
+  ck_assert_int_eq(count_objects(a, LS_OBJ_ARRAY), 1);
+  ck_assert_int_eq(count_objects(a, LS_OBJ_MAP), maps);
+  ck_assert_uint_eq(a->bytes_allocated, bytes);
+  ck_assert_uint_eq(ls_array_length(arr), 3);
+
+  // The copy shares what the value shared.
+  LsValue y = *variable(b, "y");
+  ck_assert(ls_is_obj(y) && ls_val2obj(y) != &arr->obj);
+  LsObjArray *arr_copy = (LsObjArray *)ls_val2obj(y);
+  ck_assert_uint_eq(ls_array_length(arr_copy), 3);
+  ck_assert(ls_array_get(arr_copy, 0) == ls_array_get(arr_copy, 1));
+  ck_assert(ls_array_get(arr_copy, 2) == ls_num2val(1.5));
+  LsObjMap *map_copy = (LsObjMap *)ls_val2obj(ls_array_get(arr_copy, 0));
+  ck_assert(ls_map_get(map_copy, ls_new_string(b, "parent")) == y);
+  ck_assert(ls_val_eq(ls_map_get(map_copy, name), ls_new_string(b, "value")));
+  ck_assert_int_eq(count_objects(b, LS_OBJ_ARRAY), 1);
+  ck_assert_int_eq(count_objects(b, LS_OBJ_MAP), received_maps + 1);
+
+  // Scripts of the receiver use it like their own values.
+  ck_assert_int_eq(ls_interpret_in_module(a, "app", "let s = \"hi\""),
+                   LS_RESULT_SUCCESS);
+  ck_assert(ls_channel_send(channel, a, "app", "s"));
+  ck_assert(ls_channel_receive(channel, b, "app", "s"));
+  ck_assert_int_eq(ls_interpret_in_module(b, "app", "let same = s == \"hi\""),
+                   LS_RESULT_SUCCESS);
+  ck_assert(*variable(b, "same") == LS_TRUE);
+
+  ls_free_channel(channel);
+  ls_free_vm(a);
+  ls_free_vm(b);
+}
+END_TEST
+
+START_TEST(test_channel_transfer) {
+  LsVM *a = ls_new_vm(NULL);
+  LsVM *b = ls_new_vm(NULL);
+  LsChannel *channel = ls_new_channel(NULL, 1);
+
+  uint8_t data[1024];
+  memset(data, 7, sizeof(data));
+  LsValue bytes = ls_new_byte_array(a, data, sizeof(data));
+  LsObjArray *arr = (LsObjArray *)ls_val2obj(bytes);
+  const uint8_t *elements = arr->elements.bytes.data;
+  *variable(a, "x") = bytes;
+
+  // The elements are handed over, with the memory they are counted for.
+  size_t allocated = a->bytes_allocated;
+  ck_assert(ls_channel_send(channel, a, "app", "x"));
+  ck_assert_uint_eq(ls_array_length(arr), 0);
+  ck_assert_uint_lt(a->bytes_allocated, allocated - sizeof(data) + 1);
+
+  allocated = b->bytes_allocated;
+  ck_assert(ls_channel_receive(channel, b, "app", "x"));
+  LsObjArray *received = (LsObjArray *)ls_val2obj(*variable(b, "x"));
+  ck_assert_int_eq(received->kind, LS_ARRAY_BYTE);
+  ck_assert_ptr_eq(received->elements.bytes.data, elements);
+  ck_assert_uint_eq(ls_array_length(received), sizeof(data));
+  ck_assert_uint_ge(b->bytes_allocated, allocated + sizeof(data));
+
+  // The sender can fill its array again.
+  ls_array_push(a, arr, ls_num2val(1));
+  ck_assert_uint_eq(ls_array_length(arr), 1);
+
+  // So do arrays of numbers, and numbers are sent as they are.
+  double doubles[] = {0.5, 1.5};
+  *variable(a, "d") = ls_new_double_array(a, doubles, 2);
+  *variable(a, "n") = ls_num2val(42);
+  ck_assert(ls_channel_send(channel, a, "app", "d"));
+  ck_assert(ls_channel_receive(channel, b, "app", "d"));
+  ck_assert(ls_array_get((LsObjArray *)ls_val2obj(*variable(b, "d")), 1) ==
+            ls_num2val(1.5));
+  ck_assert(ls_channel_send(channel, a, "app", "n"));
+  ck_assert(ls_channel_receive(channel, b, "app", "n"));
+  ck_assert(*variable(b, "n") == ls_num2val(42));
+
+  ls_free_channel(channel);
+  ls_free_vm(a);
+  ls_free_vm(b);
+}
+END_TEST
+
+START_TEST(test_channel_unsendable) {
+  LsVM *vm = ls_new_vm(NULL);
+  LsChannel *channel = ls_new_channel(NULL, 1);
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app", "fn f() { return 1 }"),
+                   LS_RESULT_SUCCESS);
+
+  // Functions can't be sent, even inside other values.
+  int maps = count_objects(vm, LS_OBJ_MAP);
+  ck_assert(!ls_channel_send(channel, vm, "app", "f"));
+  LsObjMap *map = (LsObjMap *)ls_val2obj(ls_new_map(vm));
+  ls_map_set(vm, map, ls_num2val(1), *variable(vm, "f"));
+  *variable(vm, "m") = ls_obj2val(&map->obj);
+  ck_assert(!ls_channel_send(channel, vm, "app", "m"));
+  ck_assert_int_eq(count_objects(vm, LS_OBJ_MAP), maps + 1);
+
+  // Neither can missing variables.
+  ck_assert(!ls_channel_send(channel, vm, "app", "missing"));
+  ck_assert(!ls_channel_send(channel, vm, "other", "f"));
+  ck_assert_uint_eq(channel->count, 0);
+
+  ls_free_channel(channel);
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_channel_close) {
+  LsVM *vm = ls_new_vm(NULL);
+  LsChannel *channel = ls_new_channel(NULL, 4);
+  *variable(vm, "s") = ls_new_string(vm, "pending");
+  ck_assert(ls_channel_send(channel, vm, "app", "s"));
+  ck_assert(ls_channel_send(channel, vm, "app", "s"));
+  ls_close_channel(channel);
+
+  // The values sent before can still be received, but no more can be sent.
+  ck_assert(!ls_channel_send(channel, vm, "app", "s"));
+  ck_assert(ls_channel_receive(channel, vm, "app", "r"));
+  ck_assert(ls_val_eq(*variable(vm, "r"), *variable(vm, "s")));
+
+  // Freeing the channel frees the value left in it.
+  ls_free_channel(channel);
+  ls_free_vm(vm);
+}
+END_TEST
+
+#define MESSAGES 200
+
+// Sends MESSAGES arrays of bytes from a VM of its own with the channel
+// [data], then closes it.
+static void *send_on_thread(void *data) {
+  LsChannel *channel = data;
+  LsVM *vm = ls_new_vm(NULL);
+  for (int i = 0; i < MESSAGES; i++) {
+    uint8_t bytes[64];
+    memset(bytes, i % 256, sizeof(bytes));
+    *variable(vm, "x") = ls_new_byte_array(vm, bytes, sizeof(bytes));
+    ls_channel_send(channel, vm, "app", "x");
+  }
+
+  ls_close_channel(channel);
+  ls_free_vm(vm);
+  return NULL;
+}
+
+START_TEST(test_channel_threads) {
+  LsChannel *channel = ls_new_channel(NULL, 4);
+  pthread_t thread;
+  ck_assert_int_eq(pthread_create(&thread, NULL, send_on_thread, channel), 0);
+
+  // The values arrive in the order they were sent.
+  LsVM *vm = ls_new_vm(NULL);
+  int received = 0;
+  while (ls_channel_receive(channel, vm, "app", "x")) {
+    LsObjArray *arr = (LsObjArray *)ls_val2obj(*variable(vm, "x"));
+    ck_assert_uint_eq(ls_array_length(arr), 64);
+    ck_assert(ls_array_get(arr, 63) == ls_num2val(received % 256));
+    received++;
+  }
+  ck_assert_int_eq(received, MESSAGES);
+
+  pthread_join(thread, NULL);
+  ls_free_channel(channel);
+  ls_free_vm(vm);
+}
+END_TEST
+
+static Suite *alloc_suite(void) {
+  Suite *s = suite_create("ls_channel");
+  TCase *tc_core = tcase_create("Core");
+
+  tcase_add_test(tc_core, test_channel_clone);
+  tcase_add_test(tc_core, test_channel_transfer);
+  tcase_add_test(tc_core, test_channel_unsendable);
+  tcase_add_test(tc_core, test_channel_close);
+  tcase_add_test(tc_core, test_channel_threads);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void) {
+  Suite *suite = alloc_suite();
+  SRunner *sr = srunner_create(suite);
+
+  srunner_run_all(sr, CK_NORMAL);
+  int number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
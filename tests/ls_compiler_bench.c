@@ -0,0 +1,331 @@
+#include "ls_bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ls_compiler.h"
+#include "ls_image.h"
+#include "ls_program.h"
+#include "ls_vm.h"
+
+// The number of lines of the generated corpus.
+#define LINES 50000
+
+// The number of times the corpus is compiled.
+#define ITERATIONS 20
+
+// The number of modules compiled at once, and the number of lines of each.
+#define MODULES 300
+#define MODULE_LINES 160
+
+// The number of VMs running the same code.
+#define PROGRAM_VMS 8
+
+// The number of iterations of the loop of the run benchmark.
+#define LOOP_ITERATIONS 1000000
+
+// The module variables used by the corpus.
+static const char *prelude =
+    "let offset = 1\n"
+    "let limit = 100\n"
+    "let done = false\n"
+    "let message = null\n"
+    "let escaped = null\n"
+    "let count = 0\n"
+    "let total = 0\n"
+    "let n = 0\n";
+
+// The lines the corpus is made of. They cover every kind of token, comments
+// and indentation.
+static const char *lines[] = {
+    "{",
+    "  // Computes the answer to an important question.",
+    "  let answer = 42 * 0x2a + 3.14e2 - offset * 2",
+    "  if (answer >= limit && !done) {",
+    "    message = \"the answer is \" + \"42\"",
+    "    escaped = \"tab\\tseparated\\nvalues\"",
+    "  } else while (count < 100) { count = count + 1 }",
+    "  /* A block comment",
+    "     spanning a few lines. */",
+    "  const day = 60 * 60 * 24",
+    "  if (false) { total = 0 } else { total = total + day * answer }",
+    "}",
+    "",
+};
+
+// The lines of a large numeric table, as found in configuration scripts.
+static const char *number_lines[] = {
+    "n = n + 12.5 + 0.000731 + 6.02214076e23 + 1e-7 + 0x7fff + 987654321",
+    "n = n + 3.141592653589793 + 2.718281828459045 + 1.4142135623730951 + 0",
+    "n = n - 0.25 + 1024 + 65535.99609375 + 9007199254740993 + 0xDEADBEEF",
+    "n = n + 1.7976931348623157e308 + 2.2250738585072014e-308 + 5e-324 + 1e22",
+};
+
+// The lines of a bundle of functions, which don't run.
+static const char *function_lines[] = {
+    "{",
+    "  let scale = 2",
+    "  fn area(width, height) {",
+    "    let result = width * height * scale",
+    "    if (result > limit) return \"large\"",
+    "    while (result < 10) result = result + offset",
+    "    return result",
+    "  }",
+    "  escaped = area",
+    "}",
+};
+
+// A loop whose body is made of constant expressions.
+static const char *loop =
+    "let i = 0\n"
+    "let seconds = 0\n"
+    "while (i < 1000000) {\n"
+    "  seconds = seconds + 60 * 60 * 24 * (1 + 6 / 2) % (2 ^ 20)\n"
+    "  if (1 > 2 || !true) seconds = 0\n"
+    "  i = i + 1\n"
+    "}\n";
+
+// The number of calls of the function of the closure benchmarks.
+#define CALLS 100000
+
+// Calls a function which defines a helper and calls it 10 times. %s is empty
+// when the helper only runs bare, and makes it escape otherwise.
+static const char *closures =
+    "fn sum(n) {\n"
+    "  let total = 0\n"
+    "  fn add(x) { total = total + x }\n"
+    "  %s\n"
+    "  let i = 0\n"
+    "  while (i < n) {\n"
+    "    add(i)\n"
+    "    i = i + 1\n"
+    "  }\n"
+    "  return total\n"
+    "}\n"
+    "let i = 0\n"
+    "while (i < 100000) {\n"
+    "  sum(10)\n"
+    "  i = i + 1\n"
+    "}\n";
+
+// Returns a NUL-terminated corpus made of [prelude] followed by the [count]
+// lines of the [line_count] [pattern] lines repeated as many whole times as
+// they fit. Sets [length] to its length in bytes.
+static char *generate_corpus(const char *prelude, const char **pattern,
+                             size_t line_count, size_t count, size_t *length) {
+  count -= count % line_count;
+
+  size_t size = strlen(prelude);
+  for (size_t i = 0; i < count; i++)
+    size += strlen(pattern[i % line_count]) + 1;
+
+  char *corpus = malloc(size + 1);
+  char *end = corpus;
+  memcpy(end, prelude, strlen(prelude));
+  end += strlen(prelude);
+  for (size_t i = 0; i < count; i++) {
+    size_t line_length = strlen(pattern[i % line_count]);
+    memcpy(end, pattern[i % line_count], line_length);
+    end += line_length;
+    *end++ = '\n';
+  }
+  *end = '\0';
+
+  *length = size;
+  return corpus;
+}
+
+// Stores the heap image saved by ls_save_image() in the ByteBuffer [data].
+static void save_heap(void *data, const char *image, size_t length) {
+  ByteBuffer *buffer = data;
+  buffer->data = malloc(length);
+  memcpy(buffer->data, image, length);
+  buffer->length = length;
+  buffer->capacity = length;
+}
+
+int main(void) {
+  size_t length;
+  char *corpus = generate_corpus(prelude, lines,
+                                 sizeof(lines) / sizeof(lines[0]), LINES,
+                                 &length);
+  size_t numbers_length;
+  char *numbers = generate_corpus(
+      prelude, number_lines, sizeof(number_lines) / sizeof(number_lines[0]),
+      LINES, &numbers_length);
+
+  size_t functions_length;
+  char *functions = generate_corpus(
+      prelude, function_lines,
+      sizeof(function_lines) / sizeof(function_lines[0]), LINES,
+      &functions_length);
+
+  size_t module_length;
+  char *module = generate_corpus(prelude, lines,
+                                 sizeof(lines) / sizeof(lines[0]),
+                                 MODULE_LINES, &module_length);
+  const char *modules[MODULES];
+  size_t module_lengths[MODULES];
+  for (size_t i = 0; i < MODULES; i++) {
+    modules[i] = module;
+    module_lengths[i] = module_length;
+  }
+  LsObjFn *module_fns[MODULES];
+
+  LsVM *vm = ls_new_vm(NULL);
+  LsConfiguration config = vm->config;
+  config.lazy_compile = true;
+  LsVM *lazy_vm = ls_new_vm(&config);
+  config = vm->config;
+  config.compile_threads = 1;
+  LsVM *serial_vm = ls_new_vm(&config);
+
+  BENCH_BYTES("compile (50k lines)", ITERATIONS, length, {
+    ls_compile(vm, corpus);
+    ls_free_objects(vm);
+  });
+  BENCH_BYTES("compile numbers (50k lines)", ITERATIONS, numbers_length, {
+    ls_compile(vm, numbers);
+    ls_free_objects(vm);
+  });
+
+  // Modules are compiled on several threads at once.
+  BENCH_BYTES("compile 300 modules on one thread", ITERATIONS,
+              MODULES * module_length, {
+                ls_compile_modules(serial_vm, modules, module_lengths,
+                                   MODULES, module_fns);
+                ls_free_objects(serial_vm);
+              });
+  BENCH_BYTES("compile 300 modules on 4 threads", ITERATIONS,
+              MODULES * module_length, {
+                ls_compile_modules(vm, modules, module_lengths, MODULES,
+                                   module_fns);
+                ls_free_objects(vm);
+              });
+
+  // Lazily compiled functions are only checked, so compiling them is faster
+  // and they take less memory until they run.
+  BENCH_BYTES("compile functions (50k lines)", ITERATIONS, functions_length, {
+    ls_compile(vm, functions);
+    ls_free_objects(vm);
+  });
+  BENCH_BYTES("compile functions lazily (50k lines)", ITERATIONS,
+              functions_length, {
+                ls_compile(lazy_vm, functions);
+                ls_free_objects(lazy_vm);
+              });
+
+  size_t bytes = vm->bytes_allocated;
+  ls_compile(vm, functions);
+  bench_report_size("memory of functions", vm->bytes_allocated - bytes);
+  ls_free_objects(vm);
+
+  bytes = lazy_vm->bytes_allocated;
+  ls_compile(lazy_vm, functions);
+  bench_report_size("memory of lazy functions",
+                    lazy_vm->bytes_allocated - bytes);
+  ls_free_objects(lazy_vm);
+
+  // Starting from an image skips compiling: its code runs in place, and only
+  // the functions that are called create their constants.
+  BENCH_BYTES("start from source (50k lines)", ITERATIONS, functions_length, {
+    ls_call_fn(vm, ls_compile(vm, functions), NULL);
+    ls_free_objects(vm);
+  });
+  ByteBuffer image;
+  ls_byte_buffer_init(&image);
+  ls_write_image(vm, ls_compile(vm, functions), &image);
+  ls_free_objects(vm);
+  BENCH_BYTES("start from image (50k lines)", ITERATIONS, functions_length, {
+    ls_call_fn(vm, ls_load_image(vm, image.data, image.length), NULL);
+    ls_free_objects(vm);
+  });
+  bench_report_size("image of functions", (double)image.length);
+  ls_byte_buffer_clear(vm, &image);
+
+  // A VM restored from a heap image starts with the state the corpus left,
+  // without compiling nor running anything.
+  BENCH_BYTES("warm start from source (50k lines)", ITERATIONS,
+              functions_length, {
+                LsVM *warm = ls_new_vm(NULL);
+                ls_interpret_in_module(warm, "app", functions);
+                ls_free_vm(warm);
+              });
+  LsVM *warm = ls_new_vm(NULL);
+  ls_interpret_in_module(warm, "app", functions);
+  ls_byte_buffer_clear(vm, &image);
+  ls_save_image(warm, save_heap, &image);
+  ls_free_vm(warm);
+  BENCH_BYTES("warm start from heap image (50k lines)", ITERATIONS,
+              functions_length, {
+                warm = ls_new_vm_from_image(NULL, (const char *)image.data,
+                                            image.length);
+                ls_free_vm(warm);
+              });
+  bench_report_size("heap image of functions", (double)image.length);
+  free(image.data);
+
+  // A clone shares the strings and code of its parent, so it only copies the
+  // state scripts can change.
+  LsVM *parent = ls_new_vm(NULL);
+  ls_interpret_in_module(parent, "app", functions);
+  BENCH_BYTES("warm start from clone (50k lines)", ITERATIONS,
+              functions_length, {
+                warm = ls_clone_vm(parent);
+                ls_free_vm(warm);
+              });
+  warm = ls_clone_vm(parent);
+  bench_report_size("memory of clone", (double)warm->bytes_allocated);
+  bench_report_size("memory of parent", (double)parent->bytes_allocated);
+  ls_free_vm(warm);
+  ls_free_vm(parent);
+
+  // VMs running a program share its code, constants and strings, so their
+  // memory grows with the number of programs rather than of VMs.
+  size_t compiled_bytes = 0, program_bytes = 0;
+  LsProgram *program = ls_new_program(NULL, functions, functions_length);
+  for (int i = 0; i < PROGRAM_VMS; i++) {
+    LsVM *compiled = ls_new_vm(NULL);
+    ls_interpret(compiled, functions);
+    compiled_bytes += compiled->bytes_allocated;
+    ls_free_vm(compiled);
+
+    LsVM *running = ls_new_vm(NULL);
+    ls_run_program(running, program);
+    program_bytes += running->bytes_allocated;
+    ls_free_vm(running);
+  }
+  program_bytes += program->vm->bytes_allocated;
+  ls_release_program(program);
+  bench_report_size("memory of 8 VMs compiling", (double)compiled_bytes);
+  bench_report_size("memory of 8 VMs running a program", (double)program_bytes);
+
+  // Constant expressions are folded, so they cost nothing at runtime.
+  LsObjFn *fn = ls_compile(vm, loop);
+  BENCH("run constant expressions (per iteration)", 1, LOOP_ITERATIONS,
+        ls_call_fn(vm, fn, NULL));
+
+  // Functions that never escape run without allocating a closure or
+  // upvalues.
+  char script[1024];
+  snprintf(script, sizeof(script), closures, "");
+  fn = ls_compile(vm, script);
+  BENCH("run bare closure (per call)", 1, CALLS, ls_call_fn(vm, fn, NULL));
+  ls_free_objects(vm);
+
+  snprintf(script, sizeof(script), closures, "let escaped = add");
+  fn = ls_compile(vm, script);
+  BENCH("run escaping closure (per call)", 1, CALLS,
+        ls_call_fn(vm, fn, NULL));
+
+  // Free VM.
+  ls_free_vm(vm);
+  ls_free_vm(lazy_vm);
+  ls_free_vm(serial_vm);
+  free(module);
+  free(corpus);
+  free(numbers);
+  free(functions);
+
+  return EXIT_SUCCESS;
+}
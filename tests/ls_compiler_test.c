@@ -0,0 +1,633 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "ls_compiler.h"
+#include "ls_value.h"
+#include "ls_vm.h"
+
+#include "ls_test.h"
+
+// Compiles and runs [source], which must succeed, and returns the value it
+// returns.
+static LsValue run(LsVM *vm, const char *source) {
+  LsObjFn *fn = ls_compile(vm, source);
+  ck_assert_msg(fn != NULL, "failed to compile: %s", source);
+
+  LsValue result = LS_UNDEFINED;
+  ck_assert_int_eq(ls_call_fn(vm, fn, &result), LS_RESULT_SUCCESS);
+  return result;
+}
+
+// Compiles the [length] bytes of [source] from a copy without a null
+// terminator, so reading past them is an error.
+static LsObjFn *compile_unterminated(LsVM *vm, const char *source,
+                                     size_t length) {
+  char *copy = malloc(length);
+  memcpy(copy, source, length);
+  LsObjFn *fn = ls_compile_length(vm, copy, length);
+  free(copy);
+  return fn;
+}
+
+// A source read a few bytes at a time by read_chunk().
+typedef struct {
+  const char *source;
+  size_t remaining;
+} Chunks;
+
+static size_t read_chunk(void *data, char *buffer, size_t size) {
+  Chunks *chunks = data;
+  if (size > 3)
+    size = 3;
+  if (size > chunks->remaining)
+    size = chunks->remaining;
+
+  memcpy(buffer, chunks->source, size);
+  chunks->source += size;
+  chunks->remaining -= size;
+  return size;
+}
+
+// Records the line of each compile error reported to [vm] in its user data,
+// an IntBuffer.
+static void record_error(LsVM *vm, LsErrorType type, const char *module,
+                         int line, const char *message) {
+  (void)module;
+  (void)message;
+  ck_assert_int_eq(type, LS_ERROR_COMPILE);
+  ls_int_buffer_write(vm, vm->config.user_data, line);
+}
+
+// Returns the first string constant of [fn], or NULL if it has none.
+static LsObjString *string_constant(LsObjFn *fn) {
+  for (size_t i = 0; i < fn->constants.length; i++) {
+    if (ls_is_str(fn->constants.data[i]))
+      return (LsObjString *)ls_val2obj(fn->constants.data[i]);
+  }
+
+  return NULL;
+}
+
+// Checks that the code of [fn] is exactly [expected], followed by the
+// implicit "return null".
+static void assert_code(LsObjFn *fn, const uint8_t *expected, size_t length) {
+  const uint8_t end[] = {CODE_NULL, CODE_RETURN, CODE_END};
+  ck_assert_uint_eq(fn->code.length, length + sizeof(end));
+  ck_assert_mem_eq(fn->code.data, expected, length);
+  ck_assert_mem_eq(fn->code.data + length, end, sizeof(end));
+}
+
+START_TEST(test_fold_arithmetic) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  // A whole expression of literals is a single constant.
+  LsObjFn *fn = ls_compile(vm, "return 60 * 60 * 24");
+  const uint8_t code[] = {CODE_CONSTANT, 0, 0, CODE_RETURN};
+  assert_code(fn, code, sizeof(code));
+  ck_assert_uint_eq(fn->constants.length, 1);
+  ck_assert(fn->constants.data[0] == ls_num2val(86400));
+
+  // Folded operators compute the same results as the interpreter.
+  ck_assert(run(vm, "return 1 + 2 * 3 - 4 / 8") == ls_num2val(6.5));
+  ck_assert(run(vm, "return -7 % 3") == ls_num2val(-1));
+  ck_assert(run(vm, "return 2 ^ 3 ^ 2") == ls_num2val(512));
+  ck_assert(run(vm, "return -2 ^ 2") == ls_num2val(-4));
+  ck_assert(run(vm, "return 1 << 31") == ls_num2val(-2147483648.0));
+  ck_assert(run(vm, "return ~5 & 0xff | 1") == ls_num2val(251));
+  ck_assert(run(vm, "return 3 < 4 == !false") == LS_TRUE);
+
+  // Numbers are equal by value, whether folded or not.
+  ck_assert(run(vm, "return 0 == -0") == LS_TRUE);
+  ck_assert(run(vm, "return (0 / 0) == (0 / 0)") == LS_FALSE);
+  ck_assert(run(vm, "return (0 / 0) != (0 / 0)") == LS_TRUE);
+  ck_assert(run(vm, "let z = 0\n"
+                    "return z == -z") == LS_TRUE);
+  ck_assert(run(vm, "let n = 0 / 0\n"
+                    "return n == n") == LS_FALSE);
+  ck_assert(run(vm, "let n = 0 / 0\n"
+                    "return n != n") == LS_TRUE);
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_fold_strings) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  LsObjFn *fn = ls_compile(vm, "return \"prefix\" + \"suffix\"");
+  const uint8_t code[] = {CODE_CONSTANT, 0, 0, CODE_RETURN};
+  assert_code(fn, code, sizeof(code));
+
+  // The operands aren't kept as constants, only the result.
+  ck_assert_uint_eq(fn->constants.length, 1);
+  LsValue expected = ls_intern_string(vm, "prefixsuffix", 12);
+  ck_assert(fn->constants.data[0] == expected);
+
+  ck_assert(run(vm, "return \"a\" == \"a\"") == LS_TRUE);
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_fold_partial) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  // Constant subexpressions fold around a variable.
+  LsObjFn *fn = ls_compile(vm, "let x = 3\n"
+                               "return x * (2 + 5)");
+  const uint8_t code[] = {
+      CODE_CONSTANT,  0, 0, CODE_STORE_MODULE_VAR, 0, 0, CODE_POP,
+      CODE_LOAD_MODULE_VAR, 0, 0, CODE_CONSTANT, 0, 1, CODE_MUL,
+      CODE_RETURN};
+  assert_code(fn, code, sizeof(code));
+  ck_assert_uint_eq(fn->constants.length, 2);
+
+  LsValue result;
+  ck_assert_int_eq(ls_call_fn(vm, fn, &result), LS_RESULT_SUCCESS);
+  ck_assert(result == ls_num2val(21));
+
+  // Operations that fail are left for the interpreter to report.
+  fn = ls_compile(vm, "return -\"a\"");
+  const uint8_t negate[] = {CODE_CONSTANT, 0, 0, CODE_NEGATE, CODE_RETURN};
+  assert_code(fn, negate, sizeof(negate));
+  ck_assert_int_eq(ls_call_fn(vm, fn, NULL), LS_RESULT_RUNTIME_ERROR);
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_fold_constants) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  // Constants with a constant initializer are inlined where they are used.
+  LsObjFn *fn = ls_compile(vm, "const day = 60 * 60 * 24\n"
+                               "return day * 7");
+  const uint8_t code[] = {CODE_CONSTANT,        0, 0, CODE_STORE_MODULE_VAR,
+                          0, 0, CODE_POP, CODE_CONSTANT, 0, 1, CODE_RETURN};
+  assert_code(fn, code, sizeof(code));
+  ck_assert(fn->constants.data[1] == ls_num2val(604800));
+
+  // Also in blocks.
+  ck_assert(run(vm, "{\n"
+                    "  const a = 2\n"
+                    "  const b = a ^ 10\n"
+                    "  return b - a\n"
+                    "}") == ls_num2val(1022));
+
+  // But variables are not.
+  ck_assert(run(vm, "let a = 2\n"
+                    "a = 3\n"
+                    "return a * 2") == ls_num2val(6));
+
+  // Constants can't be assigned.
+  ck_assert_ptr_null(ls_compile(vm, "const a = 1\n"
+                                    "a = 2"));
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_prune_dead_branches) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  // Branches that can't be taken emit no code.
+  LsObjFn *fn = ls_compile(vm, "if (false) {\n"
+                               "  return 1\n"
+                               "}\n"
+                               "while (1 > 2) {\n"
+                               "  return 2\n"
+                               "}");
+  const uint8_t empty[] = {CODE_END};
+  assert_code(fn, empty, 0);
+  ck_assert_uint_eq(fn->constants.length, 0);
+
+  // Only the taken branch remains, without a test.
+  fn = ls_compile(vm, "if (!null) return \"then\"\n"
+                      "else return \"else\"");
+  const uint8_t code[] = {CODE_CONSTANT, 0, 0, CODE_RETURN};
+  assert_code(fn, code, sizeof(code));
+  ck_assert_uint_eq(fn->constants.length, 1);
+
+  // Same for the operators.
+  ck_assert(run(vm, "return true ? 1 : 2") == ls_num2val(1));
+  ck_assert(run(vm, "return null ? 1 : 2") == ls_num2val(2));
+  ck_assert(run(vm, "return 0 && \"b\"") == ls_intern_string(vm, "b", 1));
+  ck_assert(run(vm, "return false || null") == LS_NULL);
+
+  fn = ls_compile(vm, "let x = 1\n"
+                      "return false && x");
+  const uint8_t and_code[] = {CODE_CONSTANT, 0, 0, CODE_STORE_MODULE_VAR,
+                              0, 0, CODE_POP, CODE_FALSE, CODE_RETURN};
+  assert_code(fn, and_code, sizeof(and_code));
+
+  // A loop whose condition is always true only exits with a break.
+  ck_assert(run(vm, "let i = 0\n"
+                    "while (true) {\n"
+                    "  i = i + 1\n"
+                    "  if (i == 10) break\n"
+                    "}\n"
+                    "return i") == ls_num2val(10));
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_control_flow) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  ck_assert(run(vm, "let sum = 0\n"
+                    "let i = 0\n"
+                    "while (i < 100) {\n"
+                    "  i = i + 1\n"
+                    "  if (i % 2 == 0) continue\n"
+                    "  let odd = i\n"
+                    "  sum = sum + odd\n"
+                    "}\n"
+                    "return sum") == ls_num2val(2500));
+
+  ck_assert(run(vm, "let x = 3\n"
+                    "if (x > 5) {\n"
+                    "  return \"big\"\n"
+                    "} else if (x > 2) {\n"
+                    "  return \"medium\"\n"
+                    "}\n"
+                    "else {\n"
+                    "  return \"small\"\n"
+                    "}") == ls_intern_string(vm, "medium", 6));
+
+  // Strings built at runtime aren't interned.
+  ck_assert(ls_val_eq(run(vm, "let a = \"x\"\n"
+                              "return a && a + \"y\" || \"z\""),
+                      ls_intern_string(vm, "xy", 2)));
+
+  ck_assert(run(vm, "let x = 0\n"
+                    "x = x + 1") == LS_NULL);
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_functions) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  ck_assert(run(vm, "fn fib(n) {\n"
+                    "  if (n < 2) return n\n"
+                    "  return fib(n - 1) + fib(n - 2)\n"
+                    "}\n"
+                    "return fib(20)") == ls_num2val(6765));
+
+  ck_assert(run(vm, "let add = fn(a, b) { return a + b }\n"
+                    "return add(\n"
+                    "  1,\n"
+                    "  2\n"
+                    ")") == ls_num2val(3));
+
+  // Local functions can call themselves too.
+  ck_assert(run(vm, "{\n"
+                    "  fn fact(n) { return n < 2 ? 1 : n * fact(n - 1) }\n"
+                    "  return fact(10)\n"
+                    "}") == ls_num2val(3628800));
+
+  ck_assert(run(vm, "fn f() {}\n"
+                    "return f()") == LS_NULL);
+
+  ck_assert_int_eq(ls_interpret(vm, "fn f(a) {}\n"
+                                    "f()"),
+                   LS_RESULT_RUNTIME_ERROR);
+  ck_assert_int_eq(ls_interpret(vm, "let f = 1\n"
+                                    "f()"),
+                   LS_RESULT_RUNTIME_ERROR);
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_closures) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  // A closure keeps the variables it captures alive.
+  ck_assert(run(vm, "fn counter() {\n"
+                    "  let n = 0\n"
+                    "  return fn() {\n"
+                    "    n = n + 1\n"
+                    "    return n\n"
+                    "  }\n"
+                    "}\n"
+                    "let c = counter()\n"
+                    "c()\n"
+                    "c()\n"
+                    "return c()") == ls_num2val(3));
+
+  // Closures capturing the same variable share it.
+  ck_assert(run(vm, "let get = null\n"
+                    "let set = null\n"
+                    "{\n"
+                    "  let x = 1\n"
+                    "  get = fn() { return x }\n"
+                    "  set = fn(value) { x = value }\n"
+                    "}\n"
+                    "set(5)\n"
+                    "return get()") == ls_num2val(5));
+
+  // Each iteration has its own variables.
+  ck_assert(run(vm, "let first = null\n"
+                    "let i = 0\n"
+                    "while (i < 3) {\n"
+                    "  let j = i\n"
+                    "  let f = fn() { return j }\n"
+                    "  if (first == null) first = f\n"
+                    "  i = i + 1\n"
+                    "}\n"
+                    "return first()") == ls_num2val(0));
+
+  // Variables of functions further out are captured through the functions
+  // in between.
+  ck_assert(run(vm, "fn outer() {\n"
+                    "  let x = \"outer\"\n"
+                    "  fn middle() {\n"
+                    "    return fn() { return x }\n"
+                    "  }\n"
+                    "  return middle()\n"
+                    "}\n"
+                    "return outer()()") == ls_intern_string(vm, "outer", 5));
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_bare_closures) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  // A function only called where it is defined reads the variables of its
+  // caller directly, without a closure.
+  LsObjFn *fn = ls_compile(vm, "{\n"
+                               "  let sum = 0\n"
+                               "  fn add(x) { sum = sum + x }\n"
+                               "  let i = 0\n"
+                               "  while (i < 10) {\n"
+                               "    add(i)\n"
+                               "    i = i + 1\n"
+                               "  }\n"
+                               "  return sum\n"
+                               "}");
+  ck_assert_ptr_nonnull(fn);
+  const uint8_t start[] = {CODE_CONSTANT, 0, 0, CODE_CONSTANT, 0, 1};
+  ck_assert_mem_eq(fn->code.data, start, sizeof(start));
+
+  LsObjFn *add = (LsObjFn *)ls_val2obj(fn->constants.data[1]);
+  ck_assert_int_eq(add->num_upvalues, 0);
+  const uint8_t add_code[] = {CODE_LOAD_PARENT_LOCAL, 1, CODE_LOAD_LOCAL_1,
+                              CODE_ADD, CODE_STORE_PARENT_LOCAL, 1, CODE_POP};
+  ck_assert_mem_eq(add->code.data, add_code, sizeof(add_code));
+
+  LsValue result;
+  ck_assert_int_eq(ls_call_fn(vm, fn, &result), LS_RESULT_SUCCESS);
+  ck_assert(result == ls_num2val(45));
+  ck_assert_int_eq(count_objects(vm, LS_OBJ_CLOSURE), 0);
+  ck_assert_int_eq(count_objects(vm, LS_OBJ_UPVALUE), 0);
+
+  // But once it escapes, it needs one.
+  ck_assert(run(vm, "fn make() {\n"
+                    "  let sum = 0\n"
+                    "  fn add(x) {\n"
+                    "    sum = sum + x\n"
+                    "    return sum\n"
+                    "  }\n"
+                    "  add(1)\n"
+                    "  return add\n"
+                    "}\n"
+                    "return make()(2)") == ls_num2val(3));
+  ck_assert_int_eq(count_objects(vm, LS_OBJ_CLOSURE), 1);
+  ck_assert_int_eq(count_objects(vm, LS_OBJ_UPVALUE), 1);
+
+  // Bare functions can return closures of their own variables.
+  ck_assert(run(vm, "{\n"
+                    "  let x = 1\n"
+                    "  fn f() {\n"
+                    "    let y = x\n"
+                    "    return fn() { return y }\n"
+                    "  }\n"
+                    "  return f()()\n"
+                    "}") == ls_num2val(1));
+  ck_assert_int_eq(count_objects(vm, LS_OBJ_CLOSURE), 2);
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_lazy_compile) {
+  LsConfiguration config;
+  memset(&config, 0, sizeof(config));
+  config.lazy_compile = true;
+  LsVM *vm = ls_new_vm(&config);
+
+  // Functions are only compiled when they are called.
+  LsObjFn *fn = ls_compile(vm, "fn unused(a) {\n"
+                               "  return \"unused\" + a\n"
+                               "}\n"
+                               "fn used(a) {\n"
+                               "  return a * 2\n"
+                               "}\n"
+                               "return used(21)");
+  ck_assert_ptr_nonnull(fn);
+  LsObjFn *unused = (LsObjFn *)ls_val2obj(fn->constants.data[0]);
+  LsObjFn *used = (LsObjFn *)ls_val2obj(fn->constants.data[1]);
+  ck_assert_ptr_nonnull(unused->lazy);
+  ck_assert_uint_eq(unused->code.length, 0);
+  ck_assert_uint_eq(unused->constants.length, 0);
+
+  LsValue result;
+  ck_assert_int_eq(ls_call_fn(vm, fn, &result), LS_RESULT_SUCCESS);
+  ck_assert(result == ls_num2val(42));
+  ck_assert_ptr_null(used->lazy);
+  ck_assert_uint_ne(used->code.length, 0);
+  ck_assert_ptr_nonnull(unused->lazy);
+
+  // Their bodies are still checked for errors.
+  ck_assert_ptr_null(ls_compile(vm, "fn f() {\n"
+                                    "  return undefined\n"
+                                    "}"));
+  ck_assert_ptr_null(ls_compile(vm, "fn f() {\n"
+                                    "  fn g() { break }\n"
+                                    "}"));
+
+  // They capture the same variables as when they are compiled eagerly.
+  ck_assert(run(vm, "fn counter() {\n"
+                    "  let n = 0\n"
+                    "  return fn() {\n"
+                    "    n = n + 1\n"
+                    "    return n\n"
+                    "  }\n"
+                    "}\n"
+                    "let c = counter()\n"
+                    "c()\n"
+                    "return c()") == ls_num2val(2));
+  ck_assert(run(vm, "fn outer() {\n"
+                    "  const k = 40\n"
+                    "  let x = 1\n"
+                    "  fn middle() {\n"
+                    "    return fn() { return k + x + 1 }\n"
+                    "  }\n"
+                    "  return middle()\n"
+                    "}\n"
+                    "return outer()()") == ls_num2val(42));
+  ck_assert(run(vm, "fn sum(n) {\n"
+                    "  let total = 0\n"
+                    "  fn add(x) { total = total + x }\n"
+                    "  let i = 0\n"
+                    "  while (i < n) {\n"
+                    "    add(i)\n"
+                    "    i = i + 1\n"
+                    "  }\n"
+                    "  return total\n"
+                    "}\n"
+                    "return sum(10)") == ls_num2val(45));
+  // Only the variables of the closures that escape were captured: "n", "k"
+  // and "x". The function "add" ran bare.
+  ck_assert_int_eq(count_objects(vm, LS_OBJ_UPVALUE), 3);
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_compile_length) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  // Only the given bytes are compiled.
+  LsObjFn *fn = ls_compile_length(vm, "return 1 + 2 garbage", 12);
+  ck_assert_ptr_nonnull(fn);
+  LsValue result;
+  ck_assert_int_eq(ls_call_fn(vm, fn, &result), LS_RESULT_SUCCESS);
+  ck_assert(result == ls_num2val(3));
+
+  // The lexer never reads past the end, whatever token it is in.
+  const char *sources[] = {"return 12", "return 1.5e3", "return 0xff",
+                           "return \"abc\"", "return \"a\\n\"",
+                           "let name = 1", "return 1 // comment",
+                           "/* comment */", "return \"unterminated",
+                           "return \"escape\\", "return \"\\x4", "/* open",
+                           "return 1 <"};
+  for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++)
+    compile_unterminated(vm, sources[i], strlen(sources[i]));
+
+  ck_assert_ptr_nonnull(compile_unterminated(vm, "return 0xff", 11));
+  ck_assert_ptr_null(compile_unterminated(vm, "return \"abc", 11));
+
+  // Null bytes are only valid in strings.
+  ck_assert_ptr_null(ls_compile_length(vm, "return 1\0", 10));
+  ck_assert(ls_val_eq(run(vm, "return \"a\\0b\""),
+                      ls_new_string_length(vm, "a\0b", 3)));
+
+  // A reader returns the source in chunks.
+  const char *source = "let sum = 0\n"
+                       "let i = 0\n"
+                       "while (i < 10) {\n"
+                       "  sum = sum + i\n"
+                       "  i = i + 1\n"
+                       "}\n"
+                       "return sum";
+  Chunks chunks = {source, strlen(source)};
+  fn = ls_compile_reader(vm, read_chunk, &chunks);
+  ck_assert_ptr_nonnull(fn);
+  ck_assert_int_eq(ls_call_fn(vm, fn, &result), LS_RESULT_SUCCESS);
+  ck_assert(result == ls_num2val(45));
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_compile_modules) {
+  IntBuffer errors;
+  ls_int_buffer_init(&errors);
+  LsConfiguration config = {0};
+  config.on_error = record_error;
+  config.lazy_compile = true;
+  config.user_data = &errors;
+  LsVM *vm = ls_new_vm(&config);
+
+  // Enough modules for each thread to compile several.
+  enum { COUNT = 32 };
+  char texts[COUNT][64];
+  const char *sources[COUNT];
+  size_t lengths[COUNT];
+  for (int i = 0; i < COUNT; i++) {
+    sprintf(texts[i],
+            "let s = \"shared\"\n"
+            "fn f(x) { return x * %d }\n"
+            "return f(2)",
+            i);
+    sources[i] = texts[i];
+    lengths[i] = strlen(texts[i]);
+  }
+
+  LsObjFn *fns[COUNT];
+  ck_assert(ls_compile_modules(vm, sources, lengths, COUNT, fns));
+  for (int i = 0; i < COUNT; i++) {
+    // Their functions are compiled lazily, on the VM thread.
+    LsValue result;
+    ck_assert_int_eq(ls_call_fn(vm, fns[i], &result), LS_RESULT_SUCCESS);
+    ck_assert(result == ls_num2val(2 * i));
+
+    // Equal strings are interned once.
+    ck_assert_ptr_eq(string_constant(fns[i]), string_constant(fns[0]));
+  }
+  ck_assert_int_eq(errors.length, 0);
+
+  // Errors are reported in module order, and only the modules without errors
+  // compile.
+  sources[3] = "return 1\n)";
+  lengths[3] = strlen(sources[3]);
+  sources[7] = "return 1\n\nreturn )";
+  lengths[7] = strlen(sources[7]);
+  ck_assert(!ls_compile_modules(vm, sources, lengths, COUNT, fns));
+  ck_assert_ptr_null(fns[3]);
+  ck_assert_ptr_null(fns[7]);
+  ck_assert_ptr_nonnull(fns[4]);
+  ck_assert_int_eq(errors.length, 2);
+  ck_assert_int_eq(errors.data[0], 2);
+  ck_assert_int_eq(errors.data[1], 3);
+
+  ck_assert_int_eq(ls_interpret_modules(vm, sources, lengths, 3),
+                   LS_RESULT_SUCCESS);
+  ck_assert_int_eq(ls_interpret_modules(vm, sources, lengths, 8),
+                   LS_RESULT_COMPILE_ERROR);
+
+  ls_int_buffer_clear(vm, &errors);
+  ls_free_vm(vm);
+}
+END_TEST
+
+static Suite *alloc_suite(void) {
+  Suite *s = suite_create("ls_compiler");
+  TCase *tc_core = tcase_create("Core");
+
+  tcase_add_test(tc_core, test_fold_arithmetic);
+  tcase_add_test(tc_core, test_fold_strings);
+  tcase_add_test(tc_core, test_fold_partial);
+  tcase_add_test(tc_core, test_fold_constants);
+  tcase_add_test(tc_core, test_prune_dead_branches);
+  tcase_add_test(tc_core, test_control_flow);
+  tcase_add_test(tc_core, test_functions);
+  tcase_add_test(tc_core, test_closures);
+  tcase_add_test(tc_core, test_bare_closures);
+  tcase_add_test(tc_core, test_lazy_compile);
+  tcase_add_test(tc_core, test_compile_length);
+  tcase_add_test(tc_core, test_compile_modules);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void) {
+  Suite *suite = alloc_suite();
+  SRunner *sr = srunner_create(suite);
+
+  srunner_run_all(sr, CK_NORMAL);
+  int number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,82 @@
+#include "ls_bench.h"
+
+#include <stdlib.h>
+
+#include "ls_value.h"
+#include "ls_vm.h"
+
+// The number of fibers suspended at once.
+#define FIBERS 100000
+
+int main(void) {
+  LsVM *vm = ls_new_vm(NULL);
+  ls_interpret_in_module(vm, "app",
+                         "let f = null\n"
+                         "fn echo(x) {\n"
+                         "  while (true) { x = yield x }\n"
+                         "}\n"
+                         "fn ping(n) {\n"
+                         "  let i = 0\n"
+                         "  while (i < n) { i = f(i) + 1 }\n"
+                         "}\n"
+                         "fn pause() { yield }");
+  ls_spawn_fiber(vm, "app", "echo", "f");
+
+  // A round trip resumes the fiber and switches back when it yields.
+  LsValue n = ls_num2val(1000);
+  *ls_find_variable(vm, "app", "n", true) = n;
+  BENCH("resume and yield from a script", 1000, 1000,
+        ls_interpret_in_module(vm, "app", "ping(n)"));
+
+  // The host resumes it the same way.
+  LsObjFiber *fiber = (LsObjFiber *)ls_val2obj(
+      *ls_find_variable(vm, "app", "f", false));
+  BENCH("resume and yield from the host", 1000000, 1,
+        ls_run_fiber(vm, fiber, n, NULL));
+
+  // Fibers get a pooled stack, so short-lived ones allocate nothing but
+  // themselves.
+  LsValue pause = *ls_find_variable(vm, "app", "pause", false);
+  BENCH("spawn and run a fiber to its end", 100000, 1, {
+    LsObjFiber *once = ls_new_fiber(vm, pause);
+    ls_run_fiber(vm, once, LS_NULL, NULL);
+    ls_run_fiber(vm, once, LS_NULL, NULL);
+  });
+
+  // Each suspended fiber holds its object and a stack of its own.
+  LsObjFiber **fibers = malloc(FIBERS * sizeof(LsObjFiber *));
+  size_t bytes = vm->bytes_allocated;
+  for (int i = 0; i < FIBERS; i++) {
+    fibers[i] = ls_new_fiber(vm, pause);
+    ls_run_fiber(vm, fibers[i], LS_NULL, NULL);
+  }
+  bench_report_size("memory of a suspended fiber",
+                    (double)(vm->bytes_allocated - bytes) / FIBERS);
+
+  free(fibers);
+  ls_free_vm(vm);
+
+  // Budgets are only checked by loops and calls, so they cost little, even
+  // when the host resumes the code each time it runs out.
+  const char *spin = "fn spin() {\n"
+                     "  let i = 0\n"
+                     "  while (i < 100000) { i = i + 1 }\n"
+                     "}";
+  vm = ls_new_vm(NULL);
+  ls_interpret_in_module(vm, "app", spin);
+  BENCH("loop without a budget", 100, 100000,
+        ls_interpret_in_module(vm, "app", "spin()"));
+  ls_free_vm(vm);
+
+  LsConfiguration config = {0};
+  config.budget = 1000;
+  vm = ls_new_vm(&config);
+  ls_interpret_in_module(vm, "app", spin);
+  BENCH("loop preempted every 1000 iterations", 100, 100000, {
+    LsInterpretResult result = ls_interpret_in_module(vm, "app", "spin()");
+    while (result == LS_RESULT_SUSPENDED)
+      result = ls_resume_null(vm, ls_get_preempted_fiber(vm));
+  });
+  ls_free_vm(vm);
+  return 0;
+}
@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "ls_options.h"
+#include "ls_value.h"
+#include "ls_vm.h"
+
+// Returns the value of the variable [name] of the module "app" of [vm].
+static LsValue variable(LsVM *vm, const char *name) {
+  LsValue *slot = ls_find_variable(vm, "app", name, false);
+  ck_assert_ptr_nonnull(slot);
+  return *slot;
+}
+
+// Runs [source] in the module "app" of [vm], which must succeed.
+static void run(LsVM *vm, const char *source) {
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app", source),
+                   LS_RESULT_SUCCESS);
+}
+
+START_TEST(test_fiber_script_resume) {
+  LsVM *vm = ls_new_vm(NULL);
+  run(vm, "fn count(step) {\n"
+          "  let i = 0\n"
+          "  while (i < 3) {\n"
+          "    i = i + step\n"
+          "    step = yield i\n"
+          "  }\n"
+          "  return \"done\"\n"
+          "}");
+  ck_assert(ls_spawn_fiber(vm, "app", "count", "f"));
+
+  // The first call passes the argument of the function, the next ones the
+  // value of the yield.
+  run(vm, "let a = f(1)\n"
+          "let b = f(1)\n"
+          "let c = f(5)\n"
+          "let d = true\n"
+          "if (a != 1 || b != 2 || c != 7) { d = false }");
+  ck_assert(variable(vm, "d") == LS_TRUE);
+
+  // Locals survive between resumes, and the fiber returns once done.
+  run(vm, "let e = f(0)");
+  ck_assert(ls_val_eq(variable(vm, "e"), ls_new_string(vm, "done")));
+  ck_assert_int_eq(((LsObjFiber *)ls_val2obj(variable(vm, "f")))->state,
+                   LS_FIBER_DONE);
+  ck_assert_int_eq(vm->fiber->frame_count, 0);
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_fiber_host_resume) {
+  LsVM *vm = ls_new_vm(NULL);
+  run(vm, "let steps = 0\n"
+          "fn work() {\n"
+          "  steps = steps + 1\n"
+          "  yield\n"
+          "  steps = steps + 1\n"
+          "  yield\n"
+          "  steps = steps + 1\n"
+          "}");
+  ck_assert(ls_spawn_fiber(vm, "app", "work", "w"));
+
+  ck_assert_int_eq(ls_resume_fiber(vm, "app", "w"), LS_RESULT_SUSPENDED);
+  ck_assert(variable(vm, "steps") == ls_num2val(1));
+  ck_assert_int_eq(ls_resume_fiber(vm, "app", "w"), LS_RESULT_SUSPENDED);
+  ck_assert(variable(vm, "steps") == ls_num2val(2));
+  ck_assert_int_eq(ls_resume_fiber(vm, "app", "w"), LS_RESULT_SUCCESS);
+  ck_assert(variable(vm, "steps") == ls_num2val(3));
+
+  // Finished fibers can't be resumed again.
+  ck_assert_int_eq(ls_resume_fiber(vm, "app", "w"), LS_RESULT_RUNTIME_ERROR);
+  ck_assert_int_eq(ls_resume_fiber(vm, "app", "steps"),
+                   LS_RESULT_RUNTIME_ERROR);
+  ck_assert_int_eq(ls_resume_fiber(vm, "app", "missing"),
+                   LS_RESULT_RUNTIME_ERROR);
+
+  // Only functions taking at most one argument run in fibers.
+  run(vm, "fn two(a, b) { return a }");
+  ck_assert(!ls_spawn_fiber(vm, "app", "two", "x"));
+  ck_assert(!ls_spawn_fiber(vm, "app", "steps", "x"));
+  ck_assert(!ls_spawn_fiber(vm, "app", "missing", "x"));
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_fiber_nested) {
+  LsVM *vm = ls_new_vm(NULL);
+  run(vm, "let i = null\n"
+          "fn inner() {\n"
+          "  yield 1\n"
+          "  return 2\n"
+          "}\n"
+          "fn outer() {\n"
+          "  let a = i()\n"
+          "  yield a + 10\n"
+          "  return i() + 20\n"
+          "}");
+  ck_assert(ls_spawn_fiber(vm, "app", "inner", "i"));
+  ck_assert(ls_spawn_fiber(vm, "app", "outer", "o"));
+
+  // A fiber resumed by another one yields back to it, not to the host.
+  run(vm, "let x = o()\n"
+          "let y = o()");
+  ck_assert(variable(vm, "x") == ls_num2val(11));
+  ck_assert(variable(vm, "y") == ls_num2val(22));
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_fiber_closures) {
+  LsVM *vm = ls_new_vm(NULL);
+  run(vm, "let get = null\n"
+          "fn body() {\n"
+          "  let n = 1\n"
+          "  get = fn() { return n }\n"
+          "  yield\n"
+          "  n = 2\n"
+          "}");
+  ck_assert(ls_spawn_fiber(vm, "app", "body", "f"));
+
+  // Closures see the locals of a suspended fiber, and keep them once done.
+  run(vm, "f()\n"
+          "let a = get()\n"
+          "f()\n"
+          "let b = get()");
+  ck_assert(variable(vm, "a") == ls_num2val(1));
+  ck_assert(variable(vm, "b") == ls_num2val(2));
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_fiber_errors) {
+  LsVM *vm = ls_new_vm(NULL);
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app", "yield 1"),
+                   LS_RESULT_RUNTIME_ERROR);
+
+  run(vm, "let f = null\n"
+          "fn once() { return 1 }\n"
+          "fn twice() { return f() }");
+  ck_assert(ls_spawn_fiber(vm, "app", "once", "f"));
+  run(vm, "f()");
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app", "f()"),
+                   LS_RESULT_RUNTIME_ERROR);
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app", "f(1, 2)"),
+                   LS_RESULT_RUNTIME_ERROR);
+
+  // A fiber can't resume itself.
+  ck_assert(ls_spawn_fiber(vm, "app", "twice", "f"));
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app", "f()"),
+                   LS_RESULT_RUNTIME_ERROR);
+
+  // An error in a fiber ends it, and the ones that resumed it.
+  run(vm, "let g = null\n"
+          "fn fail() {\n"
+          "  yield 1\n"
+          "  return -\"x\"\n"
+          "}\n"
+          "fn relay() { return g() + g() }");
+  ck_assert(ls_spawn_fiber(vm, "app", "fail", "g"));
+  ck_assert(ls_spawn_fiber(vm, "app", "relay", "r"));
+  ck_assert_int_eq(ls_resume_fiber(vm, "app", "r"), LS_RESULT_RUNTIME_ERROR);
+  ck_assert_int_eq(((LsObjFiber *)ls_val2obj(variable(vm, "g")))->state,
+                   LS_FIBER_DONE);
+  ck_assert_int_eq(((LsObjFiber *)ls_val2obj(variable(vm, "r")))->state,
+                   LS_FIBER_DONE);
+  ck_assert_ptr_eq(vm->fiber, &vm->main_fiber);
+  ck_assert_int_eq(vm->fiber->frame_count, 0);
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_fiber_stack_growth) {
+  LsVM *vm = ls_new_vm(NULL);
+  run(vm, "fn depth(n) {\n"
+          "  if (n == 0) { return yield 0 }\n"
+          "  return depth(n - 1) + 1\n"
+          "}\n"
+          "fn deep() { return depth(200) }");
+  ck_assert(ls_spawn_fiber(vm, "app", "deep", "f"));
+
+  // The stack grows past its initial size while the fiber is suspended deep
+  // in calls, and is freed rather than pooled once it is done.
+  run(vm, "let a = f()");
+  LsObjFiber *fiber = (LsObjFiber *)ls_val2obj(variable(vm, "f"));
+  ck_assert_uint_gt(fiber->frame_count, FIBER_FRAMES);
+  ck_assert_uint_gt(fiber->stack_capacity, FIBER_STACK_SLOTS);
+  size_t pooled = vm->num_free_stacks;
+  run(vm, "let b = f(5)");
+  ck_assert(variable(vm, "b") == ls_num2val(205));
+  ck_assert_uint_eq(vm->num_free_stacks, pooled);
+  ck_assert_ptr_null(fiber->stack);
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+#define FIBERS 1000
+
+START_TEST(test_fiber_stack_pool) {
+  LsVM *vm = ls_new_vm(NULL);
+  run(vm, "fn pause() {\n"
+          "  yield\n"
+          "}");
+
+  // Fibers take no stack until they start, and give it back once done.
+  ck_assert(ls_spawn_fiber(vm, "app", "pause", "f"));
+  LsObjFiber *fiber = (LsObjFiber *)ls_val2obj(variable(vm, "f"));
+  ck_assert_ptr_null(fiber->stack);
+  ck_assert_int_eq(ls_resume_fiber(vm, "app", "f"), LS_RESULT_SUSPENDED);
+  const LsValue *stack = fiber->stack;
+  ck_assert_ptr_nonnull(stack);
+  ck_assert_int_eq(ls_resume_fiber(vm, "app", "f"), LS_RESULT_SUCCESS);
+  ck_assert_uint_eq(vm->num_free_stacks, 1);
+
+  // The next fiber reuses it.
+  ck_assert(ls_spawn_fiber(vm, "app", "pause", "f"));
+  ck_assert_int_eq(ls_resume_fiber(vm, "app", "f"), LS_RESULT_SUSPENDED);
+  fiber = (LsObjFiber *)ls_val2obj(variable(vm, "f"));
+  ck_assert_ptr_eq(fiber->stack, stack);
+  ck_assert_uint_eq(vm->num_free_stacks, 0);
+
+  // Many fibers can be suspended at once.
+  LsObjFiber *fibers[FIBERS];
+  LsValue fn = variable(vm, "pause");
+  for (int i = 0; i < FIBERS; i++) {
+    fibers[i] = ls_new_fiber(vm, fn);
+    ck_assert_int_eq(ls_run_fiber(vm, fibers[i], LS_NULL, NULL),
+                     LS_RESULT_SUSPENDED);
+  }
+  for (int i = 0; i < FIBERS; i++) {
+    ck_assert_int_eq(ls_run_fiber(vm, fibers[i], LS_NULL, NULL),
+                     LS_RESULT_SUCCESS);
+  }
+  ck_assert_uint_eq(vm->num_free_stacks, FIBERS);
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_fiber_unsaved) {
+  LsVM *vm = ls_new_vm(NULL);
+  run(vm, "fn pause() { yield }");
+  LsVM *clone = ls_clone_vm(vm);
+  ck_assert_ptr_nonnull(clone);
+  ls_free_vm(clone);
+
+  // Stacks are neither saved nor cloned, so heaps holding fibers aren't.
+  ck_assert(ls_spawn_fiber(vm, "app", "pause", "f"));
+  ck_assert_ptr_null(ls_clone_vm(vm));
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+// Returns the sum of its two number arguments, or fails.
+static void add(LsVM *vm) {
+  ck_assert_int_eq(ls_get_slot_count(vm), 3);
+  if (ls_get_slot_type(vm, 1) != LS_TYPE_NUMBER ||
+      ls_get_slot_type(vm, 2) != LS_TYPE_NUMBER) {
+    ls_abort_fiber(vm, "Operands must be numbers.");
+    return;
+  }
+
+  ls_set_slot_double(vm, 0, ls_get_slot_double(vm, 1) +
+                                ls_get_slot_double(vm, 2));
+}
+
+// Returns its string argument twice.
+static void twice(LsVM *vm) {
+  size_t length;
+  const char *text = ls_get_slot_string(vm, 1, &length);
+  char buffer[64];
+  ck_assert_uint_lt(length, sizeof(buffer) / 2);
+  memcpy(buffer, text, length);
+  memcpy(buffer + length, text, length);
+  ls_set_slot_string(vm, 0, buffer, 2 * length);
+}
+
+START_TEST(test_fiber_foreign) {
+  LsVM *vm = ls_new_vm(NULL);
+  ck_assert(ls_define_foreign(vm, "app", "add", 2, add));
+  ck_assert(ls_define_foreign(vm, "app", "twice", 1, twice));
+  run(vm, "let a = add(1, add(2, 3))\n"
+          "let b = twice(\"ab\")");
+  ck_assert(variable(vm, "a") == ls_num2val(6));
+  ck_assert(ls_val_eq(variable(vm, "b"), ls_new_string(vm, "abab")));
+
+  // Aborting fails the call, which is checked for its arity like others.
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app", "add(1, \"2\")"),
+                   LS_RESULT_RUNTIME_ERROR);
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app", "add(1)"),
+                   LS_RESULT_RUNTIME_ERROR);
+  run(vm, "let c = add(4, 5)");
+  ck_assert(variable(vm, "c") == ls_num2val(9));
+
+  // Clones call the same functions, but images can't hold them.
+  LsVM *clone = ls_clone_vm(vm);
+  ck_assert_ptr_nonnull(clone);
+  ck_assert_int_eq(ls_interpret_in_module(clone, "app", "let d = add(a, 1)"),
+                   LS_RESULT_SUCCESS);
+  ck_assert(variable(clone, "d") == ls_num2val(7));
+  ls_free_vm(clone);
+  ck_assert(!ls_save_image(vm, NULL, NULL));
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+// The fiber suspended by the last call to host_wait().
+static LsFiber *waiting;
+
+// Suspends the calling fiber, which the host resumes with the result, or
+// returns -1 if it can't be.
+static void host_wait(LsVM *vm) {
+  waiting = ls_suspend_fiber(vm);
+  if (waiting == NULL) {
+    ls_set_slot_double(vm, 0, -1);
+    return;
+  }
+
+  // A fiber is only suspended once.
+  ck_assert_ptr_null(ls_suspend_fiber(vm));
+}
+
+START_TEST(test_fiber_host_wait) {
+  LsVM *vm = ls_new_vm(NULL);
+  ck_assert(ls_define_foreign(vm, "app", "wait", 0, host_wait));
+  run(vm, "let f = null\n"
+          "let results = 0\n"
+          "fn work(x) {\n"
+          "  results = results + wait()\n"
+          "  yield\n"
+          "  results = results + wait()\n"
+          "  return results\n"
+          "}");
+
+  // The main fiber is suspended too, and continues once completed.
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app", "let m = wait() + 1"),
+                   LS_RESULT_SUSPENDED);
+  LsFiber *main = waiting;
+  ck_assert_int_eq(ls_resume_double(vm, main, 41), LS_RESULT_SUCCESS);
+  ck_assert(variable(vm, "m") == ls_num2val(42));
+  run(vm, "let n = 1");
+
+  // Fibers wait for the host and yield alike.
+  ck_assert(ls_spawn_fiber(vm, "app", "work", "f"));
+  LsFiber *fiber = (LsFiber *)ls_val2obj(variable(vm, "f"));
+  ck_assert_int_eq(ls_resume_null(vm, fiber), LS_RESULT_SUSPENDED);
+  ck_assert_ptr_eq(waiting, fiber);
+  ck_assert_int_eq(ls_resume_double(vm, fiber, 2), LS_RESULT_SUSPENDED);
+  ck_assert(variable(vm, "results") == ls_num2val(2));
+  ck_assert_int_eq(ls_resume_null(vm, fiber), LS_RESULT_SUSPENDED);
+
+  // Scripts can't resume a fiber waiting for the host.
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app", "f()"),
+                   LS_RESULT_RUNTIME_ERROR);
+  ck_assert_int_eq(ls_resume_double(vm, fiber, 3), LS_RESULT_SUCCESS);
+  ck_assert(variable(vm, "results") == ls_num2val(5));
+
+  // Nor can fibers resumed by other fibers wait.
+  ck_assert(ls_spawn_fiber(vm, "app", "work", "f"));
+  run(vm, "let o = results\n"
+          "f(0)\n"
+          "let p = results - o");
+  ck_assert(variable(vm, "p") == ls_num2val(-1));
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_fiber_preempt) {
+  LsConfiguration config = {0};
+  config.budget = 100;
+  LsVM *vm = ls_new_vm(&config);
+  run(vm, "let f = null\n"
+          "let g = null\n"
+          "let i = 0\n"
+          "fn count(n) {\n"
+          "  while (i < n) { i = i + 1 }\n"
+          "  yield i\n"
+          "  return 0\n"
+          "}\n"
+          "fn depth(n) {\n"
+          "  if (n == 0) { return 0 }\n"
+          "  return depth(n - 1) + 1\n"
+          "}");
+
+  // Code run by the host stops each time it runs out of budget, and goes on
+  // where it was once resumed.
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app", "count(1000)"),
+                   LS_RESULT_SUSPENDED);
+  LsFiber *main = ls_get_preempted_fiber(vm);
+  ck_assert_ptr_nonnull(main);
+  ck_assert(variable(vm, "i") == ls_num2val(99));
+  int resumes = 1;
+  while (ls_resume_null(vm, main) == LS_RESULT_SUSPENDED)
+    resumes++;
+  ck_assert_int_eq(resumes, 10);
+  ck_assert(variable(vm, "i") == ls_num2val(1000));
+  ck_assert_ptr_null(ls_get_preempted_fiber(vm));
+
+  // Calls count too, and fibers keep their yields apart from preemptions.
+  run(vm, "i = 0");
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app", "depth(150)"),
+                   LS_RESULT_SUSPENDED);
+  ck_assert_int_eq(ls_resume_null(vm, main), LS_RESULT_SUCCESS);
+  ck_assert(ls_spawn_fiber(vm, "app", "count", "f"));
+  LsFiber *fiber = (LsFiber *)ls_val2obj(variable(vm, "f"));
+  LsValue yielded = LS_NULL;
+  ck_assert_int_eq(ls_run_fiber(vm, fiber, ls_num2val(150), &yielded),
+                   LS_RESULT_SUSPENDED);
+  ck_assert_ptr_eq(ls_get_preempted_fiber(vm), fiber);
+  ck_assert_int_eq(ls_run_fiber(vm, fiber, LS_NULL, &yielded),
+                   LS_RESULT_SUSPENDED);
+  ck_assert_ptr_null(ls_get_preempted_fiber(vm));
+  ck_assert(yielded == ls_num2val(150));
+
+  // Fibers resumed by a script run on until they yield, and the fiber that
+  // resumed them is preempted at its next call.
+  run(vm, "i = 0");
+  ck_assert(ls_spawn_fiber(vm, "app", "count", "g"));
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app",
+                                          "let j = g(500)\n"
+                                          "let k = depth(1)"),
+                   LS_RESULT_SUSPENDED);
+  ck_assert_ptr_eq(ls_get_preempted_fiber(vm), main);
+  ck_assert(variable(vm, "j") == ls_num2val(500));
+  ck_assert_int_eq(ls_resume_null(vm, main), LS_RESULT_SUCCESS);
+  ck_assert(variable(vm, "k") == ls_num2val(1));
+
+  // Without a budget, code runs until it returns.
+  LsVM *unbounded = ls_new_vm(NULL);
+  run(unbounded, "let k = 0\n"
+                 "while (k < 100000) { k = k + 1 }");
+  ck_assert_ptr_null(ls_get_preempted_fiber(unbounded));
+  ls_free_vm(unbounded);
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+static Suite *alloc_suite(void) {
+  Suite *s = suite_create("ls_fiber");
+  TCase *tc_core = tcase_create("Core");
+
+  tcase_add_test(tc_core, test_fiber_script_resume);
+  tcase_add_test(tc_core, test_fiber_host_resume);
+  tcase_add_test(tc_core, test_fiber_nested);
+  tcase_add_test(tc_core, test_fiber_closures);
+  tcase_add_test(tc_core, test_fiber_errors);
+  tcase_add_test(tc_core, test_fiber_stack_growth);
+  tcase_add_test(tc_core, test_fiber_stack_pool);
+  tcase_add_test(tc_core, test_fiber_unsaved);
+  tcase_add_test(tc_core, test_fiber_foreign);
+  tcase_add_test(tc_core, test_fiber_host_wait);
+  tcase_add_test(tc_core, test_fiber_preempt);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void) {
+  Suite *suite = alloc_suite();
+  SRunner *sr = srunner_create(suite);
+
+  srunner_run_all(sr, CK_NORMAL);
+  int number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
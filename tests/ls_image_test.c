@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "ls_image.h"
+#include "ls_value.h"
+#include "ls_vm.h"
+
+#include "ls_test.h"
+
+// Compiles [source] with a VM configured with [config] to an image, which
+// must succeed.
+static Image compile_image(LsConfiguration *config, const char *source) {
+  LsVM *vm = ls_new_vm(config);
+  Image image = {NULL, 0};
+  ck_assert_int_eq(
+      ls_compile_image(vm, source, strlen(source), save_image, &image),
+      LS_RESULT_SUCCESS);
+  ls_free_vm(vm);
+  return image;
+}
+
+// Loads and runs [image] in [vm], which must succeed, and returns the value
+// it returns.
+static LsValue run_image(LsVM *vm, Image image) {
+  LsObjFn *fn = ls_load_image(vm, (const uint8_t *)image.data, image.length);
+  ck_assert_ptr_nonnull(fn);
+
+  LsValue result = LS_UNDEFINED;
+  ck_assert_int_eq(ls_call_fn(vm, fn, &result), LS_RESULT_SUCCESS);
+  return result;
+}
+
+static const char *counter = "let greeting = \"hello\"\n"
+                             "fn counter(step) {\n"
+                             "  let n = 0\n"
+                             "  return fn() {\n"
+                             "    n = n + step\n"
+                             "    return n\n"
+                             "  }\n"
+                             "}\n"
+                             "fn sum(n) {\n"
+                             "  let total = 0\n"
+                             "  fn add(x) { total = total + x }\n"
+                             "  let i = 0\n"
+                             "  while (i < n) {\n"
+                             "    add(i)\n"
+                             "    i = i + 1\n"
+                             "  }\n"
+                             "  return total\n"
+                             "}\n"
+                             "let c = counter(2)\n"
+                             "c()\n"
+                             "return c() + sum(10) + 0.5";
+
+START_TEST(test_image_run) {
+  Image image = compile_image(NULL, counter);
+  ck_assert(ls_is_image(image.data, image.length));
+  ck_assert(!ls_is_image(counter, strlen(counter)));
+
+  LsVM *vm = ls_new_vm(NULL);
+  ck_assert(run_image(vm, image) == ls_num2val(4 + 45 + 0.5));
+
+  // Functions compiled lazily are compiled before they are written.
+  LsConfiguration config = vm->config;
+  config.lazy_compile = true;
+  Image lazy = compile_image(&config, counter);
+  ck_assert(run_image(vm, lazy) == ls_num2val(4 + 45 + 0.5));
+  ck_assert_uint_eq(lazy.length, image.length);
+  ck_assert_mem_eq(lazy.data, image.data, image.length);
+  free(lazy.data);
+
+  // An image can be run several times.
+  ck_assert(run_image(vm, image) == ls_num2val(4 + 45 + 0.5));
+
+  ls_free_vm(vm);
+  free(image.data);
+}
+END_TEST
+
+START_TEST(test_image_in_place) {
+  Image image = compile_image(NULL, "fn greet() { return \"hello\" }\n"
+                                    "return greet");
+
+  // The code runs in place, and the strings are created on first use.
+  LsVM *vm = ls_new_vm(NULL);
+  LsValue greet = run_image(vm, image);
+  LsObjFn *fn = (LsObjFn *)ls_val2obj(greet);
+  ck_assert(fn->borrows_code);
+  ck_assert((char *)fn->code.data >= image.data &&
+            (char *)fn->code.data < image.data + image.length);
+  ck_assert_int_eq(count_objects(vm, LS_OBJ_STRING), 0);
+
+  LsValue result;
+  ck_assert_int_eq(ls_call_fn(vm, fn, &result), LS_RESULT_SUCCESS);
+  ck_assert(ls_val_eq(result, ls_new_string(vm, "hello")));
+  ck_assert_str_eq(fn->name->value, "greet");
+
+  ls_free_vm(vm);
+  free(image.data);
+}
+END_TEST
+
+START_TEST(test_image_invalid) {
+  Image image = compile_image(NULL, counter);
+  const ImageHeader *header = (const ImageHeader *)image.data;
+  LsVM *vm = ls_new_vm(NULL);
+
+  // Truncated images are rejected.
+  for (size_t length = 0; length < image.length; length++)
+    ck_assert_ptr_null(
+        ls_load_image(vm, (const uint8_t *)image.data, length));
+
+  // So are images of other versions, and images whose tables don't fit.
+  Image copy = {malloc(image.length), image.length};
+  ImageHeader *copy_header = (ImageHeader *)copy.data;
+  memcpy(copy.data, image.data, image.length);
+  copy_header->version++;
+  ck_assert_ptr_null(ls_load_image(vm, (const uint8_t *)copy.data, copy.length));
+
+  memcpy(copy.data, image.data, image.length);
+  copy_header->num_strings = UINT32_MAX;
+  ck_assert_ptr_null(ls_load_image(vm, (const uint8_t *)copy.data, copy.length));
+
+  memcpy(copy.data, image.data, image.length);
+  ImageFn *fns = (ImageFn *)(copy.data + header->fns);
+  fns[1].code_length = (uint32_t)image.length;
+  ck_assert_ptr_null(ls_load_image(vm, (const uint8_t *)copy.data, copy.length));
+
+  // Or whose functions don't describe each of their upvalues, or use more
+  // slots than compiled ones can.
+  memcpy(copy.data, image.data, image.length);
+  fns[1].num_upvalues = 255;
+  ck_assert_ptr_null(ls_load_image(vm, (const uint8_t *)copy.data, copy.length));
+
+  memcpy(copy.data, image.data, image.length);
+  fns[1].max_slots = UINT32_MAX;
+  ck_assert_ptr_null(ls_load_image(vm, (const uint8_t *)copy.data, copy.length));
+
+  // Or whose code the interpreter can't run safely. The module starts by
+  // loading its first constant, the string "hello", into a variable.
+  uint8_t *code = (uint8_t *)copy.data + fns[0].code;
+  memcpy(copy.data, image.data, image.length);
+  ck_assert_int_eq(code[0], CODE_CONSTANT);
+  ck_assert_ptr_nonnull(
+      ls_load_image(vm, (const uint8_t *)copy.data, copy.length));
+
+  code[1] = 0x7f;
+  code[2] = 0xff;
+  ck_assert_ptr_null(ls_load_image(vm, (const uint8_t *)copy.data, copy.length));
+  ck_assert_int_eq(ls_interpret_image(vm, copy.data, copy.length),
+                   LS_RESULT_COMPILE_ERROR);
+
+  memcpy(copy.data, image.data, image.length);
+  code[4] = 0x7f;
+  ck_assert_ptr_null(ls_load_image(vm, (const uint8_t *)copy.data, copy.length));
+
+  memcpy(copy.data, image.data, image.length);
+  code[0] = CODE_CLOSURE;
+  ck_assert_ptr_null(ls_load_image(vm, (const uint8_t *)copy.data, copy.length));
+
+  memcpy(copy.data, image.data, image.length);
+  code[0] = CODE_CLASS;
+  ck_assert_ptr_null(ls_load_image(vm, (const uint8_t *)copy.data, copy.length));
+
+  memcpy(copy.data, image.data, image.length);
+  code[fns[0].code_length - 1] = CODE_RETURN;
+  ck_assert_ptr_null(ls_load_image(vm, (const uint8_t *)copy.data, copy.length));
+
+  // Jumps must land on an instruction of the code.
+  memcpy(copy.data, image.data, image.length);
+  code[0] = CODE_JUMP;
+  code[2] = 0;
+  ck_assert_ptr_nonnull(
+      ls_load_image(vm, (const uint8_t *)copy.data, copy.length));
+  code[2] = 1;
+  ck_assert_ptr_null(ls_load_image(vm, (const uint8_t *)copy.data, copy.length));
+  code[1] = 0x7f;
+  code[2] = 0xff;
+  ck_assert_ptr_null(ls_load_image(vm, (const uint8_t *)copy.data, copy.length));
+  code[0] = CODE_LOOP;
+  code[1] = 0;
+  code[2] = 3;
+  ck_assert_ptr_nonnull(
+      ls_load_image(vm, (const uint8_t *)copy.data, copy.length));
+  code[2] = 4;
+  ck_assert_ptr_null(ls_load_image(vm, (const uint8_t *)copy.data, copy.length));
+
+  // A constant referring to a missing function fails its first call.
+  memcpy(copy.data, image.data, image.length);
+  uint64_t *constants = (uint64_t *)(copy.data + fns[0].constants);
+  for (uint32_t i = 0; i < fns[0].num_constants; i++) {
+    if (constants[i] == IMAGE_REF(1, 1))
+      constants[i] = IMAGE_REF(header->num_fns, 1);
+  }
+  ck_assert_ptr_null(ls_load_image(vm, (const uint8_t *)copy.data, copy.length));
+
+  // The public API reports them as compile errors.
+  ck_assert_int_eq(ls_interpret_image(vm, copy.data, 10),
+                   LS_RESULT_COMPILE_ERROR);
+
+  free(copy.data);
+  ls_free_vm(vm);
+  free(image.data);
+}
+END_TEST
+
+static Suite *alloc_suite(void) {
+  Suite *s = suite_create("ls_image");
+  TCase *tc_core = tcase_create("Core");
+
+  tcase_add_test(tc_core, test_image_run);
+  tcase_add_test(tc_core, test_image_in_place);
+  tcase_add_test(tc_core, test_image_invalid);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void) {
+  Suite *suite = alloc_suite();
+  SRunner *sr = srunner_create(suite);
+
+  srunner_run_all(sr, CK_NORMAL);
+  int number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
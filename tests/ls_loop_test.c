@@ -0,0 +1,292 @@
+// Must be defined before any header is included to expose the POSIX
+// functions.
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include "loop.h"
+#include "ls_value.h"
+#include "ls_vm.h"
+
+// Creates a loop whose scripts can use the variables [names], set to the
+// [count] numbers [values].
+static Loop *new_test_loop(const char **names, const int *values, int count) {
+  LsConfiguration config = {0};
+  Loop *loop = new_loop(&config);
+  ck_assert_ptr_nonnull(loop);
+  for (int i = 0; i < count; i++) {
+    LsValue *slot =
+        ls_find_variable(loop_vm(loop), LOOP_MODULE, names[i], true);
+    *slot = ls_num2val(values[i]);
+  }
+
+  return loop;
+}
+
+// Returns the value of the variable [name] of the scripts of [loop].
+static LsValue variable(Loop *loop, const char *name) {
+  LsValue *slot = ls_find_variable(loop_vm(loop), LOOP_MODULE, name, false);
+  ck_assert_ptr_nonnull(slot);
+  return *slot;
+}
+
+// Runs [source] with [loop] until its fibers are done, and returns the
+// result.
+static LsInterpretResult run(Loop *loop, const char *source) {
+  LsInterpretResult result =
+      ls_interpret_in_module(loop_vm(loop), LOOP_MODULE, source);
+  if (result == LS_RESULT_SUCCESS || result == LS_RESULT_SUSPENDED)
+    result = run_loop(loop);
+  return result;
+}
+
+START_TEST(test_loop_pipe) {
+  int fds[2];
+  ck_assert_int_eq(pipe(fds), 0);
+  const char *names[] = {"input", "output"};
+  Loop *loop = new_test_loop(names, fds, 2);
+
+  // The reader waits for the writer, which only runs once it does.
+  ck_assert_int_eq(run(loop, "let got = null\n"
+                             "let sent = null\n"
+                             "spawn(fn() {\n"
+                             "  sent = write(output, \"hello\")\n"
+                             "})\n"
+                             "got = read(input, 100)"),
+                   LS_RESULT_SUCCESS);
+  ck_assert(ls_val_eq(variable(loop, "got"),
+                      ls_new_string(loop_vm(loop), "hello")));
+  ck_assert(variable(loop, "sent") == ls_num2val(5));
+
+  // Texts larger than the pipe are written in parts, as they are read.
+  ck_assert_int_eq(run(loop, "let big = \"0123456789abcdef\"\n"
+                             "let i = 0\n"
+                             "while (i < 16) {\n"
+                             "  big = big + big\n"
+                             "  i = i + 1\n"
+                             "}\n"
+                             "let received = \"\"\n"
+                             "spawn(fn() {\n"
+                             "  sent = write(output, big)\n"
+                             "})\n"
+                             "while (received != big) {\n"
+                             "  received = received + read(input, 65536)\n"
+                             "}"),
+                   LS_RESULT_SUCCESS);
+  ck_assert(variable(loop, "sent") == ls_num2val(16 << 16));
+
+  // Once waited on, the pipe doesn't block, so a reader woken up after
+  // another took the data waits again. Whoever reads first writes for the
+  // other.
+  ck_assert(fcntl(fds[0], F_GETFL) & O_NONBLOCK);
+  ck_assert(fcntl(fds[1], F_GETFL) & O_NONBLOCK);
+  int copy = dup(fds[0]);
+  LsValue *slot = ls_find_variable(loop_vm(loop), LOOP_MODULE, "copy", true);
+  *slot = ls_num2val(copy);
+  ck_assert_int_eq(write(fds[1], "x", 1), 1);
+  ck_assert_int_eq(run(loop, "let first = null\n"
+                             "let second = null\n"
+                             "spawn(fn() {\n"
+                             "  first = read(input, 1)\n"
+                             "  write(output, \"y\")\n"
+                             "})\n"
+                             "spawn(fn() {\n"
+                             "  second = read(copy, 1)\n"
+                             "  write(output, \"y\")\n"
+                             "})"),
+                   LS_RESULT_SUCCESS);
+  LsValue both = ls_new_string(loop_vm(loop), "xy");
+  LsValue reversed = ls_new_string(loop_vm(loop), "yx");
+  ck_assert_int_eq(run(loop, "let both = first + second"), LS_RESULT_SUCCESS);
+  ck_assert(ls_val_eq(variable(loop, "both"), both) ||
+            ls_val_eq(variable(loop, "both"), reversed));
+  close(copy);
+  ck_assert_int_eq(run(loop, "read(input, 1)"), LS_RESULT_SUCCESS);
+
+  // The end of the file reads as an empty string.
+  close(fds[1]);
+  ck_assert_int_eq(run(loop, "got = read(input, 100)"), LS_RESULT_SUCCESS);
+  ck_assert(ls_val_eq(variable(loop, "got"), ls_new_string(loop_vm(loop), "")));
+
+  close(fds[0]);
+  free_loop(loop);
+}
+END_TEST
+
+START_TEST(test_loop_socket) {
+  int fds[2];
+  ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  const char *names[] = {"client", "server"};
+  Loop *loop = new_test_loop(names, fds, 2);
+
+  // Both ends wait on the same thread, in turns.
+  ck_assert_int_eq(run(loop, "let replies = \"\"\n"
+                             "spawn(fn() {\n"
+                             "  let request = read(server, 100)\n"
+                             "  while (request != \"quit\") {\n"
+                             "    write(server, request + \"!\")\n"
+                             "    request = read(server, 100)\n"
+                             "  }\n"
+                             "})\n"
+                             "write(client, \"ping\")\n"
+                             "replies = replies + read(client, 100)\n"
+                             "write(client, \"pong\")\n"
+                             "replies = replies + read(client, 100)\n"
+                             "write(client, \"quit\")"),
+                   LS_RESULT_SUCCESS);
+  ck_assert(ls_val_eq(variable(loop, "replies"),
+                      ls_new_string(loop_vm(loop), "ping!pong!")));
+
+  close(fds[0]);
+  close(fds[1]);
+  free_loop(loop);
+}
+END_TEST
+
+// Returns the time of the monotonic clock, in milliseconds.
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+START_TEST(test_loop_sleep) {
+  Loop *loop = new_test_loop(NULL, NULL, 0);
+
+  // Fibers wake up in the order of their deadlines, or of their sleeps.
+  double start = now_ms();
+  ck_assert_int_eq(run(loop, "let order = \"\"\n"
+                             "fn nap(ms, name) {\n"
+                             "  spawn(fn() {\n"
+                             "    sleep(ms)\n"
+                             "    order = order + name\n"
+                             "  })\n"
+                             "}\n"
+                             "nap(30, \"c\")\n"
+                             "nap(10, \"a\")\n"
+                             "nap(20, \"b\")\n"
+                             "nap(20, \"B\")\n"
+                             "nap(0, \"0\")"),
+                   LS_RESULT_SUCCESS);
+  ck_assert(ls_val_eq(variable(loop, "order"),
+                      ls_new_string(loop_vm(loop), "0abBc")));
+  ck_assert(now_ms() - start >= 30);
+
+  // Fibers that yield run again once the others had their turn.
+  ck_assert_int_eq(run(loop, "order = \"\"\n"
+                             "fn turns(name) {\n"
+                             "  spawn(fn() {\n"
+                             "    order = order + name\n"
+                             "    yield\n"
+                             "    order = order + name\n"
+                             "  })\n"
+                             "}\n"
+                             "turns(\"a\")\n"
+                             "turns(\"b\")"),
+                   LS_RESULT_SUCCESS);
+  ck_assert(ls_val_eq(variable(loop, "order"),
+                      ls_new_string(loop_vm(loop), "abab")));
+
+  free_loop(loop);
+}
+END_TEST
+
+#define SLEEPERS 5000
+
+START_TEST(test_loop_many) {
+  int sleepers = SLEEPERS;
+  const char *names[] = {"sleepers"};
+  Loop *loop = new_test_loop(names, &sleepers, 1);
+
+  // Thousands of fibers wait at once, with small stacks, on one thread.
+  double start = now_ms();
+  ck_assert_int_eq(run(loop, "let awake = 0\n"
+                             "let i = 0\n"
+                             "while (i < sleepers) {\n"
+                             "  spawn(fn() {\n"
+                             "    sleep(20)\n"
+                             "    awake = awake + 1\n"
+                             "  })\n"
+                             "  i = i + 1\n"
+                             "}"),
+                   LS_RESULT_SUCCESS);
+  ck_assert(variable(loop, "awake") == ls_num2val(SLEEPERS));
+  ck_assert(now_ms() - start < 20 * SLEEPERS);
+
+  free_loop(loop);
+}
+END_TEST
+
+START_TEST(test_loop_errors) {
+  int fds[2];
+  ck_assert_int_eq(pipe(fds), 0);
+  close(fds[0]);
+  const char *names[] = {"output"};
+  Loop *loop = new_test_loop(names, fds + 1, 1);
+
+  // Writing to a pipe without reader fails, but the script goes on.
+  ck_assert_int_eq(run(loop, "let result = write(output, \"lost\")"),
+                   LS_RESULT_SUCCESS);
+  ck_assert(variable(loop, "result") == LS_NULL);
+
+  // Bad arguments fail the fiber, which doesn't stop the others.
+  ck_assert_int_eq(run(loop, "let done = false\n"
+                             "spawn(fn() {\n"
+                             "  sleep(1)\n"
+                             "  read(-1, 10)\n"
+                             "})\n"
+                             "spawn(fn() {\n"
+                             "  sleep(2)\n"
+                             "  done = true\n"
+                             "})"),
+                   LS_RESULT_RUNTIME_ERROR);
+  ck_assert(variable(loop, "done") == LS_TRUE);
+
+  // Fibers resumed by other fibers can't wait.
+  ck_assert_int_eq(run(loop, "fn nap() {\n"
+                             "  sleep(1)\n"
+                             "}"),
+                   LS_RESULT_SUCCESS);
+  ck_assert(ls_spawn_fiber(loop_vm(loop), LOOP_MODULE, "nap", "f"));
+  ck_assert_int_eq(run(loop, "spawn(fn() {\n"
+                             "  f()\n"
+                             "})"),
+                   LS_RESULT_RUNTIME_ERROR);
+
+  close(fds[1]);
+  free_loop(loop);
+}
+END_TEST
+
+static Suite *alloc_suite(void) {
+  Suite *s = suite_create("ls_loop");
+  TCase *tc_core = tcase_create("Core");
+
+  tcase_add_test(tc_core, test_loop_pipe);
+  tcase_add_test(tc_core, test_loop_socket);
+  tcase_add_test(tc_core, test_loop_sleep);
+  tcase_add_test(tc_core, test_loop_many);
+  tcase_add_test(tc_core, test_loop_errors);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void) {
+  Suite *suite = alloc_suite();
+  SRunner *sr = srunner_create(suite);
+
+  srunner_run_all(sr, CK_NORMAL);
+  int number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
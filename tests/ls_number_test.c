@@ -0,0 +1,120 @@
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "ls_number.h"
+
+// Parses [text] and checks it is exactly [expected].
+#define ck_assert_number(text, expected)                                       \
+  do {                                                                         \
+    double num = -1;                                                           \
+    ck_assert(ls_parse_number(text, strlen(text), &num));                      \
+    ck_assert_msg(num == (expected), "%s parsed as %.17g", text, num);        \
+  } while (0)
+
+START_TEST(test_parse_decimal) {
+  ck_assert_number("0", 0.0);
+  ck_assert_number("000", 0.0);
+  ck_assert_number("7", 7.0);
+  ck_assert_number("1234567890", 1234567890.0);
+  ck_assert_number("1.5", 1.5);
+  ck_assert_number(".25", 0.25);
+  ck_assert_number("0.1", 0.1);
+  ck_assert_number("3.14159265358979", 3.14159265358979);
+  ck_assert_number("1e3", 1000.0);
+  ck_assert_number("1E3", 1000.0);
+  ck_assert_number("2.5e+2", 250.0);
+  ck_assert_number("2.5e-2", 0.025);
+  ck_assert_number("0.000001", 1e-6);
+  ck_assert_number("1e22", 1e22);
+  ck_assert_number("1e23", 1e23);
+  ck_assert_number("123456789012345678901234567890",
+                   123456789012345678901234567890.0);
+}
+END_TEST
+
+START_TEST(test_parse_decimal_rounding) {
+  // Exactly halfway between 2^53 and 2^53 + 2: ties to even.
+  ck_assert_number("9007199254740993", 9007199254740992.0);
+  ck_assert_number("9007199254740995", 9007199254740996.0);
+
+  // Just above halfway, only visible past the 19th digit.
+  ck_assert_number("9007199254740993.0000000000000000000001",
+                   9007199254740994.0);
+  ck_assert_number("9007199254740992.9999999999999999999999",
+                   9007199254740992.0);
+
+  // The largest double, and the first number that rounds to infinity.
+  ck_assert_number("1.7976931348623157e308", DBL_MAX);
+  ck_assert_number("1.7976931348623158e308", DBL_MAX);
+  ck_assert_number("1.7976931348623159e308", HUGE_VAL);
+  ck_assert_number("1e400", HUGE_VAL);
+
+  // The smallest normal and subnormal doubles.
+  ck_assert_number("2.2250738585072014e-308", DBL_MIN);
+  ck_assert_number("4.9406564584124654e-324", 4.9406564584124654e-324);
+  ck_assert_number("2.4703282292062328e-324", 4.9406564584124654e-324);
+  ck_assert_number("2.4703282292062327e-324", 0.0);
+  ck_assert_number("1e-400", 0.0);
+}
+END_TEST
+
+START_TEST(test_parse_hex) {
+  ck_assert_number("0x0", 0.0);
+  ck_assert_number("0xff", 255.0);
+  ck_assert_number("0xDEADBEEF", 3735928559.0);
+  ck_assert_number("0xffffffffffffffff", 18446744073709551616.0);
+
+  // Beyond 16 digits, dropped digits still round correctly.
+  ck_assert_number("0x20000000000001", 9007199254740992.0);
+  ck_assert_number("0x200000000000010000000000000001",
+                   166153499473114502559719956244594689.0);
+}
+END_TEST
+
+START_TEST(test_parse_invalid) {
+  const char *invalid[] = {"",   ".",   "1e",   "1e+", "e5", "1.5.2",
+                           "0x", "0xg", "12a",  "-1",  " 1", "1 ",
+                           "1_0", "0x1.8", "inf", "nan", NULL};
+
+  for (int i = 0; invalid[i] != NULL; i++) {
+    double num = 42;
+    ck_assert_msg(!ls_parse_number(invalid[i], strlen(invalid[i]), &num),
+                  "%s should be invalid", invalid[i]);
+    ck_assert(num == 42);
+  }
+
+  // Only [length] bytes are read.
+  double num;
+  ck_assert(ls_parse_number("12abc", 2, &num));
+  ck_assert(num == 12);
+}
+END_TEST
+
+static Suite *alloc_suite(void) {
+  Suite *s = suite_create("ls_number");
+  TCase *tc_core = tcase_create("Core");
+
+  tcase_add_test(tc_core, test_parse_decimal);
+  tcase_add_test(tc_core, test_parse_decimal_rounding);
+  tcase_add_test(tc_core, test_parse_hex);
+  tcase_add_test(tc_core, test_parse_invalid);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void) {
+  Suite *suite = alloc_suite();
+  SRunner *sr = srunner_create(suite);
+
+  srunner_run_all(sr, CK_NORMAL);
+  int number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,51 @@
+#include "ls_bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ls_vm.h"
+
+// The number of jobs run by each benchmark.
+#define JOBS 2000
+
+// A job of about a millisecond.
+static const char *job = "fn sum(n) {\n"
+                         "  let total = 0\n"
+                         "  fn add(x) { total = total + x }\n"
+                         "  let i = 0\n"
+                         "  while (i < n) {\n"
+                         "    add(i)\n"
+                         "    i = i + 1\n"
+                         "  }\n"
+                         "  return total\n"
+                         "}\n"
+                         "sum(20000)";
+
+// Runs JOBS jobs of [program] on [pool], and waits for them.
+static void run_jobs(LsPool *pool, LsProgram *program, LsJob **jobs) {
+  for (int i = 0; i < JOBS; i++)
+    jobs[i] = ls_pool_submit(pool, program);
+  for (int i = 0; i < JOBS; i++)
+    ls_pool_await(pool, jobs[i]);
+}
+
+int main(void) {
+  LsProgram *program = ls_new_program(NULL, job, strlen(job));
+  LsJob **jobs = malloc(sizeof(LsJob *) * JOBS);
+
+  // Throughput should scale with the workers, up to the number of cores.
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  for (long workers = 1; workers <= cores;
+       workers = workers < cores && workers * 2 > cores ? cores : workers * 2) {
+    LsPool *pool = ls_new_pool(NULL, (int)workers);
+    char name[64];
+    snprintf(name, sizeof(name), "run jobs on %ld workers", workers);
+    BENCH(name, 1, JOBS, run_jobs(pool, program, jobs));
+    ls_free_pool(pool);
+  }
+
+  free(jobs);
+  ls_release_program(program);
+  return 0;
+}
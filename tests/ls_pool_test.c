@@ -0,0 +1,178 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "ls_pool.h"
+#include "ls_program.h"
+#include "ls_value.h"
+#include "ls_vm.h"
+
+// Compiles [source] to a program, which must succeed.
+static LsProgram *new_program(const char *source) {
+  LsProgram *program = ls_new_program(NULL, source, strlen(source));
+  ck_assert_ptr_nonnull(program);
+  return program;
+}
+
+// Fails at runtime unless the sum is right, so that jobs check themselves.
+static const char *sum = "fn sum(n) {\n"
+                         "  let total = 0\n"
+                         "  let i = 0\n"
+                         "  while (i < n) {\n"
+                         "    total = total + i\n"
+                         "    i = i + 1\n"
+                         "  }\n"
+                         "  return total\n"
+                         "}\n"
+                         "if (sum(1000) != 499500) {\n"
+                         "  let fail = null\n"
+                         "  fail()\n"
+                         "}";
+
+#define JOBS 200
+
+START_TEST(test_pool_run) {
+  LsPool *pool = ls_new_pool(NULL, 4);
+  ck_assert_ptr_nonnull(pool);
+  ck_assert_int_eq(pool->num_workers, 4);
+
+  LsProgram *program = new_program(sum);
+  const char *source = "let fail = null\nfail()";
+  LsProgram *failing = ls_new_program(NULL, source, strlen(source));
+
+  LsJob *jobs[JOBS];
+  for (int i = 0; i < JOBS; i++)
+    jobs[i] = ls_pool_submit(pool, i % 10 == 0 ? failing : program);
+
+  // The programs are held by the jobs.
+  ls_release_program(program);
+  ls_release_program(failing);
+
+  for (int i = 0; i < JOBS; i++) {
+    ck_assert_int_eq(ls_pool_await(pool, jobs[i]),
+                     i % 10 == 0 ? LS_RESULT_RUNTIME_ERROR
+                                 : LS_RESULT_SUCCESS);
+  }
+
+  // Workers free the objects of the jobs they ran.
+  for (int i = 0; i < pool->num_workers; i++)
+    ck_assert_ptr_null(pool->workers[i].vm->first_obj);
+
+  ls_free_pool(pool);
+}
+END_TEST
+
+START_TEST(test_pool_cancel) {
+  // The first job keeps the only worker busy, so the others stay queued.
+  LsPool *pool = ls_new_pool(NULL, 1);
+  const char *source = "let i = 0\nwhile (i < 5000000) { i = i + 1 }";
+  LsProgram *slow = new_program(source);
+  LsProgram *program = new_program(sum);
+
+  LsJob *running = ls_pool_submit(pool, slow);
+  LsJob *queued = ls_pool_submit(pool, program);
+  LsJob *kept = ls_pool_submit(pool, program);
+  ck_assert(ls_pool_cancel(pool, queued));
+  ck_assert(!ls_pool_cancel(pool, queued));
+  ck_assert_int_eq(ls_pool_await(pool, queued), LS_RESULT_CANCELED);
+
+  // The other jobs still run.
+  ck_assert_int_eq(ls_pool_await(pool, running), LS_RESULT_SUCCESS);
+  ck_assert_int_eq(ls_pool_await(pool, kept), LS_RESULT_SUCCESS);
+
+  ls_release_program(slow);
+  ls_release_program(program);
+  ls_free_pool(pool);
+}
+END_TEST
+
+START_TEST(test_pool_steal) {
+  // Jobs queued on a busy worker are stolen by idle ones.
+  LsPool *pool = ls_new_pool(NULL, 2);
+  const char *source = "let i = 0\nwhile (i < 5000000) { i = i + 1 }";
+  LsProgram *slow = new_program(source);
+  LsProgram *program = new_program(sum);
+
+  LsJob *busy = ls_pool_submit(pool, slow);
+  LsJob *jobs[JOBS];
+  for (int i = 0; i < JOBS; i++)
+    jobs[i] = ls_pool_submit(pool, program);
+  for (int i = 0; i < JOBS; i++)
+    ck_assert_int_eq(ls_pool_await(pool, jobs[i]), LS_RESULT_SUCCESS);
+
+  // Half of them were queued behind the slow job, which is still running.
+  pthread_mutex_lock(&busy->lock);
+  JobState state = busy->state;
+  pthread_mutex_unlock(&busy->lock);
+  ck_assert_int_eq(state, JOB_RUNNING);
+  ck_assert_int_eq(ls_pool_await(pool, busy), LS_RESULT_SUCCESS);
+
+  ls_release_program(slow);
+  ls_release_program(program);
+  ls_free_pool(pool);
+}
+END_TEST
+
+START_TEST(test_pool_budget) {
+  // Preempted jobs are resumed until they are done.
+  LsConfiguration config = {0};
+  config.budget = 1000;
+  LsPool *pool = ls_new_pool(&config, 2);
+  const char *source = "let i = 0\nwhile (i < 50000) { i = i + 1 }";
+  LsProgram *slow = new_program(source);
+
+  LsJob *jobs[4];
+  for (int i = 0; i < 4; i++)
+    jobs[i] = ls_pool_submit(pool, slow);
+  for (int i = 0; i < 4; i++)
+    ck_assert_int_eq(ls_pool_await(pool, jobs[i]), LS_RESULT_SUCCESS);
+  ls_free_pool(pool);
+
+  // A preempted job lets the jobs queued behind it run before it goes on, on
+  // the same worker.
+  pool = ls_new_pool(&config, 1);
+  LsProgram *spin =
+      new_program("let i = 0\nwhile (i < 5000000) { i = i + 1 }");
+  LsProgram *program = new_program(sum);
+  LsJob *busy = ls_pool_submit(pool, spin);
+  LsJob *quick = ls_pool_submit(pool, program);
+  ck_assert_int_eq(ls_pool_await(pool, quick), LS_RESULT_SUCCESS);
+  pthread_mutex_lock(&busy->lock);
+  JobState state = busy->state;
+  pthread_mutex_unlock(&busy->lock);
+  ck_assert_int_eq(state, JOB_RUNNING);
+  ck_assert_int_eq(ls_pool_await(pool, busy), LS_RESULT_SUCCESS);
+
+  ls_release_program(spin);
+  ls_release_program(program);
+  ls_release_program(slow);
+  ls_free_pool(pool);
+}
+END_TEST
+
+static Suite *alloc_suite(void) {
+  Suite *s = suite_create("ls_pool");
+  TCase *tc_core = tcase_create("Core");
+
+  tcase_add_test(tc_core, test_pool_run);
+  tcase_add_test(tc_core, test_pool_cancel);
+  tcase_add_test(tc_core, test_pool_steal);
+  tcase_add_test(tc_core, test_pool_budget);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void) {
+  Suite *suite = alloc_suite();
+  SRunner *sr = srunner_create(suite);
+
+  srunner_run_all(sr, CK_NORMAL);
+  int number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
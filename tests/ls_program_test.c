@@ -0,0 +1,188 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "ls_program.h"
+#include "ls_snapshot.h"
+#include "ls_value.h"
+#include "ls_vm.h"
+
+#include "ls_test.h"
+
+// Compiles [source] to a program, which must succeed.
+static LsProgram *new_program(const char *source) {
+  LsProgram *program = ls_new_program(NULL, source, strlen(source));
+  ck_assert_ptr_nonnull(program);
+  return program;
+}
+
+// Runs [program] in [vm] like ls_run_program(), which must succeed, and
+// returns the value the module returns.
+static LsValue run_program(LsVM *vm, LsProgram *program) {
+  LsObjFn *fn = ls_copy_module(program->vm, vm, program->fn);
+  LsValue result = LS_UNDEFINED;
+  ck_assert_int_eq(ls_call_fn(vm, fn, &result), LS_RESULT_SUCCESS);
+  return result;
+}
+
+static const char *counter = "let greeting = \"hello\"\n"
+                             "let count = 0\n"
+                             "fn next() {\n"
+                             "  count = count + 1\n"
+                             "  return count\n"
+                             "}\n"
+                             "fn sum(n) {\n"
+                             "  let total = 0\n"
+                             "  let i = 0\n"
+                             "  while (i < n) {\n"
+                             "    total = total + i\n"
+                             "    i = i + 1\n"
+                             "  }\n"
+                             "  return total\n"
+                             "}\n"
+                             "next()\n"
+                             "if (sum(100) != 4950 || greeting != \"hello\") {\n"
+                             "  let fail = null\n"
+                             "  fail()\n"
+                             "}\n"
+                             "return next";
+
+START_TEST(test_program_run) {
+  LsProgram *program = new_program(counter);
+  LsVM *a = ls_new_vm(NULL);
+  LsVM *b = ls_new_vm(NULL);
+
+  // The code, constants and strings are those of the program.
+  LsValue next_a = run_program(a, program);
+  LsObjFn *fn = (LsObjFn *)ls_val2obj(next_a);
+  ck_assert(fn->borrows_code);
+  ck_assert(fn->borrows_constants);
+  ck_assert_int_eq(count_objects(a, LS_OBJ_STRING), 0);
+
+  // The variables of the module are private to each VM.
+  LsValue next_b = run_program(b, program);
+  LsValue result;
+  ck_assert_int_eq(ls_call_fn(a, fn, &result), LS_RESULT_SUCCESS);
+  ck_assert(result == ls_num2val(2));
+  ck_assert_int_eq(ls_call_fn(a, fn, &result), LS_RESULT_SUCCESS);
+  ck_assert(result == ls_num2val(3));
+  ck_assert_int_eq(ls_call_fn(b, (LsObjFn *)ls_val2obj(next_b), &result),
+                   LS_RESULT_SUCCESS);
+  ck_assert(result == ls_num2val(2));
+
+  // Running it again starts over in a new module.
+  ck_assert_int_eq(ls_run_program(a, program), LS_RESULT_SUCCESS);
+  ck_assert_int_eq(ls_run_program(a, program), LS_RESULT_SUCCESS);
+  ck_assert_uint_eq(a->num_programs, 1);
+  ck_assert_int_eq(count_objects(a, LS_OBJ_MODULE), 3);
+
+  ls_free_vm(a);
+  ls_free_vm(b);
+  ls_release_program(program);
+}
+END_TEST
+
+START_TEST(test_program_references) {
+  LsProgram *program = new_program(counter);
+  LsVM *vm = ls_new_vm(NULL);
+  ck_assert_int_eq(ls_run_program(vm, program), LS_RESULT_SUCCESS);
+  ck_assert_int_eq(program->references, 2);
+
+  // The VM keeps the program alive once released.
+  ls_retain_program(program);
+  ck_assert_int_eq(program->references, 3);
+  ls_release_program(program);
+  ls_release_program(program);
+  ck_assert_int_eq(program->references, 1);
+  ck_assert_int_eq(ls_run_program(vm, program), LS_RESULT_SUCCESS);
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_program_compile_error) {
+  const char *source = "let x = ";
+  ck_assert_ptr_null(ls_new_program(NULL, source, strlen(source)));
+
+  LsConfiguration config;
+  LsVM *vm = ls_new_vm(NULL);
+  config = vm->config;
+  ls_free_vm(vm);
+
+  // Functions compiled lazily are compiled with the program.
+  config.lazy_compile = true;
+  source = "fn f() { return 1 + }";
+  ck_assert_ptr_null(ls_new_program(&config, source, strlen(source)));
+  LsProgram *program = ls_new_program(&config, counter, strlen(counter));
+  ck_assert_ptr_nonnull(program);
+  for (LsObj *obj = program->vm->first_obj; obj != NULL; obj = obj->next)
+    ck_assert(obj->type != LS_OBJ_FN || ((LsObjFn *)obj)->lazy == NULL);
+  ls_release_program(program);
+}
+END_TEST
+
+#define THREADS 4
+#define RUNS 50
+
+// Runs the program [data] RUNS times in a VM, then drops the reference to it
+// the thread was given. Returns NULL if every run succeeds.
+static void *run_on_thread(void *data) {
+  static int failed;
+  LsProgram *program = data;
+  LsVM *vm = ls_new_vm(NULL);
+  void *result = NULL;
+  for (int i = 0; i < RUNS && result == NULL; i++) {
+    if (ls_run_program(vm, program) != LS_RESULT_SUCCESS)
+      result = &failed;
+  }
+
+  ls_free_vm(vm);
+  ls_release_program(program);
+  return result;
+}
+
+START_TEST(test_program_threads) {
+  LsProgram *program = new_program(counter);
+  pthread_t threads[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    ls_retain_program(program);
+    ck_assert_int_eq(pthread_create(&threads[i], NULL, run_on_thread, program),
+                     0);
+  }
+
+  // Programs can be released while other threads run them.
+  ls_release_program(program);
+  for (int i = 0; i < THREADS; i++) {
+    void *result;
+    pthread_join(threads[i], &result);
+    ck_assert_ptr_null(result);
+  }
+}
+END_TEST
+
+static Suite *alloc_suite(void) {
+  Suite *s = suite_create("ls_program");
+  TCase *tc_core = tcase_create("Core");
+
+  tcase_add_test(tc_core, test_program_run);
+  tcase_add_test(tc_core, test_program_references);
+  tcase_add_test(tc_core, test_program_compile_error);
+  tcase_add_test(tc_core, test_program_threads);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void) {
+  Suite *suite = alloc_suite();
+  SRunner *sr = srunner_create(suite);
+
+  srunner_run_all(sr, CK_NORMAL);
+  int number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
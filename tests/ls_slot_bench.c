@@ -0,0 +1,47 @@
+#include "ls_bench.h"
+
+#include "ls_value.h"
+#include "ls_vm.h"
+
+// Returns its argument plus one.
+static void next(LsVM *vm) {
+  ls_set_slot_double(vm, 0, ls_get_slot_double(vm, 1) + 1);
+}
+
+int main(void) {
+  LsVM *vm = ls_new_vm(NULL);
+  ls_define_foreign(vm, "app", "next", 1, next);
+  ls_interpret_in_module(vm, "app",
+                         "fn score(x) { return x * 2 }\n"
+                         "fn handle(x) { return next(x) * 2 }");
+  ls_ensure_slots(vm, 2);
+  ls_set_slot_double(vm, 1, 1);
+
+  // Calling by name looks the variable up, and checks the function, each
+  // time.
+  BENCH("call a script by name", 10000000, 1, {
+    ls_get_variable(vm, "app", "score", 0);
+    ls_call(vm, 1);
+  });
+
+  // A handle does both once.
+  LsCallHandle *score = ls_make_call_handle(vm, "app", "score", 1);
+  BENCH("call a script through a handle", 10000000, 1,
+        ls_call_handle(vm, score));
+
+  // A round trip goes from the host to the script, back to the host through
+  // a foreign function, and returns.
+  BENCH("host to script to host by name", 10000000, 1, {
+    ls_get_variable(vm, "app", "handle", 0);
+    ls_call(vm, 1);
+  });
+
+  LsCallHandle *handle = ls_make_call_handle(vm, "app", "handle", 1);
+  BENCH("host to script to host through a handle", 10000000, 1,
+        ls_call_handle(vm, handle));
+
+  ls_release_call_handle(vm, score);
+  ls_release_call_handle(vm, handle);
+  ls_free_vm(vm);
+  return 0;
+}
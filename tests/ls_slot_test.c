@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "ls_value.h"
+#include "ls_vm.h"
+
+// Runs [source] in the module "app" of [vm], which must succeed.
+static void run(LsVM *vm, const char *source) {
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app", source),
+                   LS_RESULT_SUCCESS);
+}
+
+START_TEST(test_slot_values) {
+  LsVM *vm = ls_new_vm(NULL);
+  ck_assert_int_eq(ls_get_slot_count(vm), 0);
+  ls_ensure_slots(vm, 6);
+  ck_assert_int_eq(ls_get_slot_count(vm), 6);
+  ck_assert_int_eq(ls_get_slot_type(vm, 5), LS_TYPE_NULL);
+
+  // Primitives are stored as they are, without allocating.
+  size_t bytes = vm->bytes_allocated;
+  ls_set_slot_bool(vm, 0, true);
+  ls_set_slot_double(vm, 1, 1.5);
+  ls_set_slot_null(vm, 2);
+  ck_assert_uint_eq(vm->bytes_allocated, bytes);
+  ck_assert_int_eq(ls_get_slot_type(vm, 0), LS_TYPE_BOOL);
+  ck_assert(ls_get_slot_bool(vm, 0));
+  ck_assert_int_eq(ls_get_slot_type(vm, 1), LS_TYPE_NUMBER);
+  ck_assert(ls_get_slot_double(vm, 1) == 1.5);
+  ck_assert_int_eq(ls_get_slot_type(vm, 2), LS_TYPE_NULL);
+
+  // Strings and bytes are copied in, and borrowed out.
+  ls_set_slot_string(vm, 3, "text\0more", 9);
+  ls_set_slot_bytes(vm, 4, "\x01\x02\xff", 3);
+  bytes = vm->bytes_allocated;
+  size_t length;
+  const char *text = ls_get_slot_string(vm, 3, &length);
+  ck_assert_uint_eq(length, 9);
+  ck_assert(memcmp(text, "text\0more", 9) == 0);
+  ck_assert_int_eq(ls_get_slot_type(vm, 4), LS_TYPE_BYTES);
+  const char *data = ls_get_slot_bytes(vm, 4, &length);
+  ck_assert_uint_eq(length, 3);
+  ck_assert(memcmp(data, "\x01\x02\xff", 3) == 0);
+  ck_assert_ptr_eq(ls_get_slot_string(vm, 3, &length), text);
+  ck_assert_uint_eq(vm->bytes_allocated, bytes);
+
+  // Other values can't be read, and slots are only ever added.
+  run(vm, "fn f() { return 1 }");
+  ck_assert(ls_get_variable(vm, "app", "f", 5));
+  ck_assert_int_eq(ls_get_slot_type(vm, 5), LS_TYPE_UNKNOWN);
+  ck_assert(!ls_get_variable(vm, "app", "missing", 5));
+  ck_assert(!ls_get_variable(vm, "other", "f", 5));
+  ls_ensure_slots(vm, 2);
+  ck_assert_int_eq(ls_get_slot_count(vm), 6);
+  ck_assert(ls_get_slot_double(vm, 1) == 1.5);
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_slot_call) {
+  LsVM *vm = ls_new_vm(NULL);
+  run(vm, "fn add(a, b) { return a + b }\n"
+          "fn greet(name) { return \"hi \" + name }\n"
+          "fn fail(x) { return x + null }");
+  ls_ensure_slots(vm, 3);
+
+  // The result replaces the function in slot 0.
+  ck_assert(ls_get_variable(vm, "app", "add", 0));
+  ls_set_slot_double(vm, 1, 1);
+  ls_set_slot_double(vm, 2, 2);
+  ck_assert_int_eq(ls_call(vm, 2), LS_RESULT_SUCCESS);
+  ck_assert(ls_get_slot_double(vm, 0) == 3);
+
+  ck_assert(ls_get_variable(vm, "app", "greet", 0));
+  ls_set_slot_string(vm, 1, "you", 3);
+  ck_assert_int_eq(ls_call(vm, 1), LS_RESULT_SUCCESS);
+  size_t length;
+  const char *text = ls_get_slot_string(vm, 0, &length);
+  ck_assert_uint_eq(length, 6);
+  ck_assert(memcmp(text, "hi you", 6) == 0);
+
+  // Calls with numbers allocate nothing.
+  ck_assert(ls_get_variable(vm, "app", "add", 0));
+  size_t bytes = vm->bytes_allocated;
+  for (int i = 0; i < 100; i++) {
+    ls_set_slot_double(vm, 1, i);
+    ck_assert_int_eq(ls_call(vm, 2), LS_RESULT_SUCCESS);
+    ck_assert(ls_get_slot_double(vm, 0) == i + 2);
+    ck_assert(ls_get_variable(vm, "app", "add", 0));
+  }
+  ck_assert_uint_eq(vm->bytes_allocated, bytes);
+
+  // Failed calls leave the stack as it was.
+  ck_assert_int_eq(ls_call(vm, 1), LS_RESULT_RUNTIME_ERROR);
+  ck_assert(ls_get_variable(vm, "app", "fail", 0));
+  ck_assert_int_eq(ls_call(vm, 1), LS_RESULT_RUNTIME_ERROR);
+  ls_set_slot_double(vm, 0, 1);
+  ck_assert_int_eq(ls_call(vm, 0), LS_RESULT_RUNTIME_ERROR);
+  ck_assert_int_eq(vm->fiber->frame_count, 0);
+  ck_assert_ptr_eq(vm->fiber->stack_top, vm->fiber->stack);
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+// Returns the result of calling the variable "hook" of the module "app" with
+// its argument.
+static void call_hook(LsVM *vm) {
+  ls_ensure_slots(vm, 3);
+  ck_assert_int_eq(ls_get_slot_count(vm), 3);
+  ck_assert(ls_get_variable(vm, "app", "hook", 0));
+  if (ls_call(vm, 1) != LS_RESULT_SUCCESS)
+    ls_abort_fiber(vm, "Hook failed.");
+}
+
+START_TEST(test_slot_foreign) {
+  LsVM *vm = ls_new_vm(NULL);
+  ck_assert(ls_define_foreign(vm, "app", "hookof", 1, call_hook));
+  run(vm, "fn hook(x) { return x * 2 }\n"
+          "fn twice(x) { return hookof(x) + hookof(x) }");
+
+  // Foreign functions have slots of their own, and can call back.
+  ls_ensure_slots(vm, 2);
+  ck_assert(ls_get_variable(vm, "app", "twice", 0));
+  ls_set_slot_double(vm, 1, 5);
+  ck_assert_int_eq(ls_call(vm, 1), LS_RESULT_SUCCESS);
+  ck_assert(ls_get_slot_double(vm, 0) == 20);
+  ck_assert_int_eq(ls_get_slot_count(vm), 2);
+
+  // The host calls them like the other functions.
+  ck_assert(ls_get_variable(vm, "app", "hookof", 0));
+  ls_set_slot_double(vm, 1, 4);
+  ck_assert_int_eq(ls_call(vm, 1), LS_RESULT_SUCCESS);
+  ck_assert(ls_get_slot_double(vm, 0) == 8);
+  ck_assert_ptr_eq(vm->fiber->stack_top, vm->fiber->stack);
+
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_slot_handle) {
+  LsVM *vm = ls_new_vm(NULL);
+  ck_assert(ls_define_foreign(vm, "app", "hookof", 1, call_hook));
+  run(vm, "let score = null\n"
+          "fn hook(x) { return x + 1 }\n"
+          "fn make(n) { return fn(x) { return x * n } }\n"
+          "fn fail(x) { return x + null }\n"
+          "let scale = make(3)");
+
+  // Only functions taking the given arguments can be resolved.
+  ck_assert_ptr_null(ls_make_call_handle(vm, "app", "missing", 1));
+  ck_assert_ptr_null(ls_make_call_handle(vm, "app", "score", 1));
+  ck_assert_ptr_null(ls_make_call_handle(vm, "app", "hook", 2));
+  ck_assert_ptr_null(ls_make_call_handle(vm, "app", "hookof", 0));
+
+  // Script functions, closures and foreign functions are called the same way,
+  // without allocating.
+  LsCallHandle *hook = ls_make_call_handle(vm, "app", "hook", 1);
+  LsCallHandle *scale = ls_make_call_handle(vm, "app", "scale", 1);
+  LsCallHandle *hookof = ls_make_call_handle(vm, "app", "hookof", 1);
+  ck_assert_ptr_nonnull(hook);
+  ck_assert_ptr_nonnull(scale);
+  ck_assert_ptr_nonnull(hookof);
+  ls_ensure_slots(vm, 2);
+  size_t bytes = vm->bytes_allocated;
+  for (int i = 0; i < 100; i++) {
+    ls_set_slot_double(vm, 1, i);
+    ck_assert_int_eq(ls_call_handle(vm, hook), LS_RESULT_SUCCESS);
+    ck_assert(ls_get_slot_double(vm, 0) == i + 1);
+    ck_assert_int_eq(ls_call_handle(vm, scale), LS_RESULT_SUCCESS);
+    ck_assert(ls_get_slot_double(vm, 0) == i * 3);
+    ck_assert_int_eq(ls_call_handle(vm, hookof), LS_RESULT_SUCCESS);
+    ck_assert(ls_get_slot_double(vm, 0) == i + 1);
+  }
+  ck_assert_uint_eq(vm->bytes_allocated, bytes);
+
+  // Handles keep the function they were made with.
+  run(vm, "hook = fn(x) { return x }");
+  ls_set_slot_double(vm, 1, 1);
+  ck_assert_int_eq(ls_call_handle(vm, hook), LS_RESULT_SUCCESS);
+  ck_assert(ls_get_slot_double(vm, 0) == 2);
+
+  // Failed calls leave the stack as it was.
+  LsCallHandle *fail = ls_make_call_handle(vm, "app", "fail", 1);
+  ck_assert_ptr_nonnull(fail);
+  ck_assert_int_eq(ls_call_handle(vm, fail), LS_RESULT_RUNTIME_ERROR);
+  ck_assert_int_eq(vm->fiber->frame_count, 0);
+  ck_assert_ptr_eq(vm->fiber->stack_top, vm->fiber->stack);
+
+  ls_release_call_handle(vm, hook);
+  ls_release_call_handle(vm, scale);
+  ls_release_call_handle(vm, hookof);
+  ls_release_call_handle(vm, fail);
+  ls_free_vm(vm);
+}
+END_TEST
+
+static Suite *alloc_suite(void) {
+  Suite *s = suite_create("ls_slot");
+  TCase *tc_core = tcase_create("Core");
+
+  tcase_add_test(tc_core, test_slot_values);
+  tcase_add_test(tc_core, test_slot_call);
+  tcase_add_test(tc_core, test_slot_foreign);
+  tcase_add_test(tc_core, test_slot_handle);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void) {
+  Suite *suite = alloc_suite();
+  SRunner *sr = srunner_create(suite);
+
+  srunner_run_all(sr, CK_NORMAL);
+  int number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
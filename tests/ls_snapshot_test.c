@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "ls_snapshot.h"
+#include "ls_value.h"
+#include "ls_vm.h"
+
+#include "ls_test.h"
+
+// Returns the value of the variable [name] of [module] in [vm].
+static LsValue variable(LsVM *vm, const char *module, const char *name) {
+  LsValue found = ls_map_get(vm->modules, ls_new_string(vm, module));
+  ck_assert(ls_is_obj(found));
+  LsObjModule *mod = (LsObjModule *)ls_val2obj(found);
+  LsValue index = ls_map_get(mod->variable_names, ls_new_string(vm, name));
+  ck_assert(ls_is_num(index));
+  return mod->variables.data[(size_t)ls_val2num(index)];
+}
+
+static const char *init = "let greeting = \"hello\"\n"
+                          "fn counter(step) {\n"
+                          "  let n = 0\n"
+                          "  return fn() {\n"
+                          "    n = n + step\n"
+                          "    return n\n"
+                          "  }\n"
+                          "}\n"
+                          "let c = counter(2)\n"
+                          "let first = c()\n";
+
+START_TEST(test_snapshot_restore) {
+  LsVM *vm = ls_new_vm(NULL);
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app", init), LS_RESULT_SUCCESS);
+
+  Image image = {NULL, 0};
+  ck_assert(ls_save_image(vm, save_image, &image));
+  ls_free_vm(vm);
+
+  // The restored VM continues where the saved one was, with the state of
+  // the closure it holds.
+  LsVM *restored = ls_new_vm_from_image(NULL, image.data, image.length);
+  free(image.data);
+  ck_assert_ptr_nonnull(restored);
+  ck_assert(variable(restored, "app", "first") == ls_num2val(2));
+  ck_assert_int_eq(ls_interpret_in_module(restored, "app",
+                                          "let second = c()\n"
+                                          "let same = greeting == \"hello\"\n"
+                                          "let d = counter(10)\n"
+                                          "let third = c() + d()"),
+                   LS_RESULT_SUCCESS);
+  ck_assert(variable(restored, "app", "second") == ls_num2val(4));
+  ck_assert(variable(restored, "app", "same") == LS_TRUE);
+  ck_assert(variable(restored, "app", "third") == ls_num2val(6 + 10));
+
+  // Strings stay interned.
+  ck_assert(ls_val2obj(variable(restored, "app", "greeting")) ==
+            ls_val2obj(ls_intern_string(restored, "hello", 5)));
+
+  ls_free_vm(restored);
+}
+END_TEST
+
+START_TEST(test_snapshot_lazy) {
+  LsConfiguration config;
+  LsVM *vm = ls_new_vm(NULL);
+  config = vm->config;
+  ls_free_vm(vm);
+
+  // Functions which weren't compiled yet are saved compiled.
+  config.lazy_compile = true;
+  vm = ls_new_vm(&config);
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app",
+                                          "fn twice(x) { return 2 * x }\n"),
+                   LS_RESULT_SUCCESS);
+
+  Image image = {NULL, 0};
+  ck_assert(ls_save_image(vm, save_image, &image));
+  ls_free_vm(vm);
+
+  LsVM *restored = ls_new_vm_from_image(&config, image.data, image.length);
+  free(image.data);
+  ck_assert_ptr_nonnull(restored);
+  for (LsObj *obj = restored->first_obj; obj != NULL; obj = obj->next)
+    ck_assert(obj->type != LS_OBJ_FN || ((LsObjFn *)obj)->lazy == NULL);
+
+  ck_assert_int_eq(ls_interpret_in_module(restored, "app",
+                                          "let result = twice(21)"),
+                   LS_RESULT_SUCCESS);
+  ck_assert(variable(restored, "app", "result") == ls_num2val(42));
+
+  ls_free_vm(restored);
+}
+END_TEST
+
+// Returns the offset in [image] of the code of the function [name] of [vm],
+// which must be saved in it once.
+static size_t find_code(LsVM *vm, Image image, const char *name) {
+  LsObjFn *fn = NULL;
+  for (LsObj *obj = vm->first_obj; obj != NULL; obj = obj->next) {
+    LsObjFn *current = (LsObjFn *)obj;
+    if (obj->type == LS_OBJ_FN && current->name != NULL &&
+        strcmp(current->name->value, name) == 0)
+      fn = current;
+  }
+  ck_assert_ptr_nonnull(fn);
+
+  size_t found = 0;
+  int count = 0;
+  for (size_t i = 0; i + fn->code.length <= image.length; i++) {
+    if (memcmp(image.data + i, fn->code.data, fn->code.length) == 0) {
+      found = i;
+      count++;
+    }
+  }
+  ck_assert_int_eq(count, 1);
+  return found;
+}
+
+START_TEST(test_snapshot_invalid) {
+  LsVM *vm = ls_new_vm(NULL);
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app", init), LS_RESULT_SUCCESS);
+  Image image = {NULL, 0};
+  ck_assert(ls_save_image(vm, save_image, &image));
+  int num_objects = 0;
+  for (LsObj *obj = vm->first_obj; obj != NULL; obj = obj->next)
+    num_objects++;
+  size_t code = find_code(vm, image, "counter");
+  ls_free_vm(vm);
+
+  // Every object is saved, except the variable names of modules, which are
+  // saved with them.
+  const SnapshotHeader *header = (const SnapshotHeader *)image.data;
+  ck_assert_uint_eq(header->num_objects, (uint64_t)num_objects - 1);
+
+  // Truncated images are rejected.
+  for (size_t length = 0; length < image.length; length++)
+    ck_assert_ptr_null(ls_new_vm_from_image(NULL, image.data, length));
+
+  // So are images of other versions, and images with too many objects.
+  Image copy = {malloc(image.length), image.length};
+  SnapshotHeader *copy_header = (SnapshotHeader *)copy.data;
+  memcpy(copy.data, image.data, image.length);
+  copy_header->version++;
+  ck_assert_ptr_null(ls_new_vm_from_image(NULL, copy.data, copy.length));
+
+  memcpy(copy.data, image.data, image.length);
+  copy_header->num_objects = UINT64_MAX;
+  ck_assert_ptr_null(ls_new_vm_from_image(NULL, copy.data, copy.length));
+
+  // And images whose module table isn't a map.
+  memcpy(copy.data, image.data, image.length);
+  copy_header->modules = 1;
+  ck_assert_ptr_null(ls_new_vm_from_image(NULL, copy.data, copy.length));
+
+  // And functions that use more slots than compiled ones can, or don't
+  // describe each of their upvalues. The record of a function starts with
+  // its slots, arity, upvalues and code length, right before its code.
+  memcpy(copy.data, image.data, image.length);
+  uint32_t field = UINT32_MAX;
+  memcpy(copy.data + code - 20, &field, sizeof(field));
+  ck_assert_ptr_null(ls_new_vm_from_image(NULL, copy.data, copy.length));
+
+  memcpy(copy.data, image.data, image.length);
+  memcpy(&field, copy.data + code - 12, sizeof(field));
+  field++;
+  memcpy(copy.data + code - 12, &field, sizeof(field));
+  ck_assert_ptr_null(ls_new_vm_from_image(NULL, copy.data, copy.length));
+
+  // And functions with code the interpreter can't run safely, checked like
+  // the code of images. The function "counter" starts by loading a constant.
+  memcpy(copy.data, image.data, image.length);
+  ck_assert_int_eq(copy.data[code], CODE_CONSTANT);
+  copy.data[code + 1] = 0x7f;
+  copy.data[code + 2] = (char)0xff;
+  ck_assert_ptr_null(ls_new_vm_from_image(NULL, copy.data, copy.length));
+
+  memcpy(copy.data, image.data, image.length);
+  copy.data[code] = CODE_CLASS;
+  ck_assert_ptr_null(ls_new_vm_from_image(NULL, copy.data, copy.length));
+
+  free(copy.data);
+  free(image.data);
+}
+END_TEST
+
+START_TEST(test_snapshot_running) {
+  LsVM *vm = ls_new_vm(NULL);
+  ck_assert_int_eq(ls_interpret_in_module(vm, "app", "let x = 1"),
+                   LS_RESULT_SUCCESS);
+
+  // Nothing can be saved while code runs.
+  vm->fiber->frame_count = 1;
+  Image image = {NULL, 0};
+  ck_assert(!ls_save_image(vm, save_image, &image));
+  ck_assert_ptr_null(image.data);
+  vm->fiber->frame_count = 0;
+
+  ck_assert(ls_save_image(vm, save_image, &image));
+  LsVM *restored = ls_new_vm_from_image(NULL, image.data, image.length);
+  ck_assert_ptr_nonnull(restored);
+  ck_assert_int_eq(count_objects(restored, LS_OBJ_MODULE),
+                   count_objects(vm, LS_OBJ_MODULE));
+  ck_assert_int_eq(count_objects(restored, LS_OBJ_STRING),
+                   count_objects(vm, LS_OBJ_STRING));
+
+  ls_free_vm(restored);
+  ls_free_vm(vm);
+  free(image.data);
+}
+END_TEST
+
+START_TEST(test_clone) {
+  LsConfiguration config;
+  LsVM *vm = ls_new_vm(NULL);
+  config = vm->config;
+  ls_free_vm(vm);
+
+  config.lazy_compile = true;
+  LsVM *parent = ls_new_vm(&config);
+  ck_assert_int_eq(ls_interpret_in_module(parent, "app", init),
+                   LS_RESULT_SUCCESS);
+
+  LsVM *clone = ls_clone_vm(parent);
+  ck_assert_ptr_nonnull(clone);
+  ck_assert_ptr_eq(clone->parent, parent);
+
+  // Strings and code are shared with the parent.
+  ck_assert_int_eq(count_objects(clone, LS_OBJ_STRING), 0);
+  LsObjFn *counter = (LsObjFn *)ls_val2obj(variable(clone, "app", "counter"));
+  ck_assert(counter->borrows_code);
+  ck_assert_ptr_eq(
+      counter->code.data,
+      ((LsObjFn *)ls_val2obj(variable(parent, "app", "counter")))->code.data);
+
+  // Everything else is copied, so the clone and its parent change apart.
+  const char *next = "let next = c()";
+  ck_assert_int_eq(ls_interpret_in_module(clone, "app", next),
+                   LS_RESULT_SUCCESS);
+  ck_assert_int_eq(ls_interpret_in_module(clone, "app", "next = c()"),
+                   LS_RESULT_SUCCESS);
+  ck_assert(variable(clone, "app", "next") == ls_num2val(6));
+  ck_assert_int_eq(ls_interpret_in_module(parent, "app", next),
+                   LS_RESULT_SUCCESS);
+  ck_assert(variable(parent, "app", "next") == ls_num2val(4));
+
+  // New strings are interned by the clone, with the shared ones.
+  ck_assert_int_eq(ls_interpret_in_module(clone, "app",
+                                          "let same = greeting == \"hello\"\n"
+                                          "let other = \"bye\""),
+                   LS_RESULT_SUCCESS);
+  ck_assert(variable(clone, "app", "same") == LS_TRUE);
+  LsValue bye = ls_new_string(parent, "bye");
+  ck_assert(ls_map_get(clone->strings, bye) != LS_UNDEFINED);
+  ck_assert(ls_map_get(parent->strings, bye) == LS_UNDEFINED);
+
+  // A clone can be saved, with the strings of its parent.
+  Image image = {NULL, 0};
+  ck_assert(ls_save_image(clone, save_image, &image));
+  ls_free_vm(clone);
+  LsVM *restored = ls_new_vm_from_image(NULL, image.data, image.length);
+  free(image.data);
+  ck_assert_ptr_nonnull(restored);
+  ck_assert_int_eq(ls_interpret_in_module(restored, "app", "next = c()"),
+                   LS_RESULT_SUCCESS);
+  ck_assert(variable(restored, "app", "next") == ls_num2val(8));
+  ck_assert(ls_val_eq(variable(restored, "app", "other"),
+                      ls_new_string(restored, "bye")));
+
+  ls_free_vm(restored);
+  ls_free_vm(parent);
+}
+END_TEST
+
+static Suite *alloc_suite(void) {
+  Suite *s = suite_create("ls_snapshot");
+  TCase *tc_core = tcase_create("Core");
+
+  tcase_add_test(tc_core, test_snapshot_restore);
+  tcase_add_test(tc_core, test_snapshot_lazy);
+  tcase_add_test(tc_core, test_snapshot_invalid);
+  tcase_add_test(tc_core, test_snapshot_running);
+  tcase_add_test(tc_core, test_clone);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void) {
+  Suite *suite = alloc_suite();
+  SRunner *sr = srunner_create(suite);
+
+  srunner_run_all(sr, CK_NORMAL);
+  int number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
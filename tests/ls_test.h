@@ -0,0 +1,35 @@
+#ifndef LS_TEST_H_INCLUDE
+#define LS_TEST_H_INCLUDE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ls_value.h"
+
+// Returns the number of objects of [type] allocated by [vm].
+static inline int count_objects(LsVM *vm, LsObjType type) {
+  int count = 0;
+  for (LsObj *obj = vm->first_obj; obj != NULL; obj = obj->next) {
+    if (obj->type == type)
+      count++;
+  }
+
+  return count;
+}
+
+// An image saved by save_image().
+typedef struct {
+  char *data;
+  size_t length;
+} Image;
+
+// Copies the [length] bytes of [image] into the Image [data], which must be
+// freed.
+static inline void save_image(void *data, const char *image, size_t length) {
+  Image *saved = data;
+  saved->data = malloc(length);
+  memcpy(saved->data, image, length);
+  saved->length = length;
+}
+
+#endif
@@ -0,0 +1,92 @@
+#include "ls_bench.h"
+
+#include <stdlib.h>
+
+#include "ls_value.h"
+#include "ls_vm.h"
+
+// The number of elements of the benchmarked arrays.
+#define LENGTH 4096
+
+// The number of times each operation is repeated.
+#define ITERATIONS 20000
+
+// Defeats dead code elimination of benchmarked results.
+static volatile size_t sink;
+
+static void bench_fill(LsVM *vm, LsObjArray *values, LsObjArray *bytes) {
+  BENCH("fill (values, element by element)", ITERATIONS, LENGTH, {
+    for (size_t i = 0; i < LENGTH; i++)
+      ls_array_set(vm, values, i, LS_TRUE);
+  });
+  BENCH("fill (values, ls_array_fill)", ITERATIONS, LENGTH,
+        ls_array_fill(vm, values, LS_TRUE, 0, LENGTH));
+  BENCH("fill (bytes, ls_array_fill)", ITERATIONS, LENGTH,
+        ls_array_fill(vm, bytes, ls_num2val(42), 0, LENGTH));
+}
+
+static void bench_copy_within(LsVM *vm, LsObjArray *values) {
+  BENCH("copy within (values, element by element)", ITERATIONS, LENGTH / 2, {
+    for (size_t i = 0; i < LENGTH / 2; i++)
+      ls_array_set(vm, values, i, ls_array_get(values, i + LENGTH / 2));
+  });
+  BENCH("copy within (values, ls_array_copy_within)", ITERATIONS, LENGTH / 2,
+        ls_array_copy_within(values, 0, LENGTH / 2, LENGTH));
+}
+
+static void bench_slice_concat(LsVM *vm, LsObjArray *values) {
+  BENCH("slice (values)", ITERATIONS, LENGTH, {
+    LsValue slice = ls_array_slice(vm, values, 0, LENGTH);
+    ls_free_obj(vm, ls_val2obj(slice));
+  });
+  BENCH("concat (values)", ITERATIONS, 2 * LENGTH, {
+    LsValue cat = ls_array_concat(vm, values, values);
+    ls_free_obj(vm, ls_val2obj(cat));
+  });
+}
+
+static void bench_reverse(LsObjArray *values, LsObjArray *bytes) {
+  BENCH("reverse (values)", ITERATIONS, LENGTH, ls_array_reverse(values));
+  BENCH("reverse (bytes)", ITERATIONS, LENGTH, ls_array_reverse(bytes));
+}
+
+static void bench_index_of(LsObjArray *values, LsObjArray *bytes) {
+  BENCH("index of (values, element by element)", ITERATIONS, LENGTH, {
+    size_t found = LS_ARRAY_NOT_FOUND;
+    for (size_t i = 0; i < LENGTH; i++) {
+      if (ls_val_eq(ls_array_get(values, i), LS_FALSE)) {
+        found = i;
+        break;
+      }
+    }
+    sink = found;
+  });
+  BENCH("index of (values, ls_array_index_of)", ITERATIONS, LENGTH,
+        sink = ls_array_index_of(values, LS_FALSE, 0));
+  BENCH("index of (bytes, ls_array_index_of)", ITERATIONS, LENGTH,
+        sink = ls_array_index_of(bytes, ls_num2val(255), 0));
+}
+
+int main(void) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  LsValue valuesval = ls_new_array(vm, LENGTH);
+  LsValue bytesval = ls_new_byte_array(vm, NULL, LENGTH);
+  LsObjArray *values = (LsObjArray *)ls_val2obj(valuesval);
+  LsObjArray *bytes = (LsObjArray *)ls_val2obj(bytesval);
+
+  bench_fill(vm, values, bytes);
+  bench_copy_within(vm, values);
+  bench_slice_concat(vm, values);
+  bench_reverse(values, bytes);
+  bench_index_of(values, bytes);
+
+  // Free pointers.
+  ls_free_obj(vm, &values->obj);
+  ls_free_obj(vm, &bytes->obj);
+
+  // Free VM.
+  ls_free_vm(vm);
+
+  return EXIT_SUCCESS;
+}
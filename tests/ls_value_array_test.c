@@ -21,9 +21,10 @@ START_TEST(test_new_array) {
   LsObjArray *arr = (LsObjArray *)arrobj;
   // Check array specific fields.
   ck_assert_ptr_eq(&arr->obj, arrobj);
-  ck_assert_int_eq(arr->elements.length, 0);
-  ck_assert_int_eq(arr->elements.capacity, 0);
-  ck_assert_ptr_null(arr->elements.data);
+  ck_assert_int_eq(arr->kind, LS_ARRAY_INT32);
+  ck_assert_int_eq(ls_array_length(arr), 0);
+  ck_assert_int_eq(arr->elements.ints.capacity, 0);
+  ck_assert_ptr_null(arr->elements.ints.data);
 
   // VM Internal state is ok.
   // +1 for null terminated byte.
@@ -32,7 +33,7 @@ START_TEST(test_new_array) {
   ck_assert_ptr_eq(vm->first_obj, arrobj);
 
   // Free pointer.
-  ls_free(vm, arrobj);
+  ls_free_obj(vm, arrobj);
 
   // Free VM.
   ls_free_vm(vm);
@@ -58,9 +59,308 @@ START_TEST(test_array_eq) {
   ck_assert(!ls_val_same(arrval, LS_TRUE));
   ck_assert(!ls_val_eq(arrval, LS_TRUE));
 
+  // Same elements but not same so not equal.
+  LsValue arrval3 = ls_new_array(vm, 100);
+  ck_assert(!ls_val_same(arrval, arrval3));
+  ck_assert(!ls_val_eq(arrval, arrval3));
+
   // Free pointers.
   ls_free_obj(vm, ls_val2obj(arrval));
   ls_free_obj(vm, ls_val2obj(arrval2));
+  ls_free_obj(vm, ls_val2obj(arrval3));
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_array_kinds) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  LsValue arrval = ls_new_array(vm, 0);
+  LsObjArray *arr = (LsObjArray *)ls_val2obj(arrval);
+
+  // Small integers stay packed as int32.
+  for (int i = 0; i < 10; i++)
+    ls_array_push(vm, arr, ls_num2val(i * 1000));
+  ck_assert_int_eq(arr->kind, LS_ARRAY_INT32);
+  ck_assert_int_eq(ls_array_length(arr), 10);
+  ck_assert_int_eq(arr->elements.ints.data[3], 3000);
+
+  // A fractional number moves to doubles.
+  ls_array_set(vm, arr, 1, ls_num2val(0.5));
+  ck_assert_int_eq(arr->kind, LS_ARRAY_DOUBLE);
+  ck_assert_double_eq(arr->elements.doubles.data[1], 0.5);
+  ck_assert(ls_array_get(arr, 3) == ls_num2val(3000));
+
+  // Numbers that don't fit in int32 need doubles too.
+  LsValue intsval = ls_new_array(vm, 0);
+  LsObjArray *ints = (LsObjArray *)ls_val2obj(intsval);
+  ls_array_push(vm, ints, ls_num2val(-0.0));
+  ck_assert_int_eq(ints->kind, LS_ARRAY_DOUBLE);
+  ck_assert(ls_array_get(ints, 0) == ls_num2val(-0.0));
+
+  // Anything else moves to generic values.
+  LsValue str = ls_new_string(vm, "str");
+  ls_array_push(vm, arr, str);
+  ck_assert_int_eq(arr->kind, LS_ARRAY_VALUE);
+  ck_assert_int_eq(ls_array_length(arr), 11);
+  ck_assert(ls_array_get(arr, 0) == ls_num2val(0));
+  ck_assert(ls_array_get(arr, 1) == ls_num2val(0.5));
+  ck_assert(ls_array_get(arr, 10) == str);
+
+  // Kinds never go back.
+  ls_array_set(vm, arr, 10, ls_num2val(1));
+  ck_assert_int_eq(arr->kind, LS_ARRAY_VALUE);
+
+  // Arrays of nulls are generic from the start.
+  LsValue nullsval = ls_new_array(vm, 3);
+  LsObjArray *nulls = (LsObjArray *)ls_val2obj(nullsval);
+  ck_assert_int_eq(nulls->kind, LS_ARRAY_VALUE);
+  ck_assert(ls_array_get(nulls, 2) == LS_NULL);
+
+  // Free pointers.
+  ls_free_obj(vm, ls_val2obj(arrval));
+  ls_free_obj(vm, ls_val2obj(intsval));
+  ls_free_obj(vm, ls_val2obj(nullsval));
+  ls_free_obj(vm, ls_val2obj(str));
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_typed_arrays) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  // Byte arrays copy their data and take one byte per element.
+  const uint8_t data[] = {0, 1, 254, 255};
+  LsValue bytesval = ls_new_byte_array(vm, data, sizeof(data));
+  LsObjArray *bytes = (LsObjArray *)ls_val2obj(bytesval);
+  ck_assert_int_eq(bytes->kind, LS_ARRAY_BYTE);
+  ck_assert_int_eq(ls_array_length(bytes), 4);
+  ck_assert_int_ge(bytes->elements.bytes.capacity, 4);
+  ck_assert_mem_eq(bytes->elements.bytes.data, data, sizeof(data));
+  ck_assert(ls_array_get(bytes, 2) == ls_num2val(254));
+
+  // Storing a byte keeps the kind, a larger integer widens to int32.
+  ls_array_set(vm, bytes, 0, ls_num2val(42));
+  ck_assert_int_eq(bytes->kind, LS_ARRAY_BYTE);
+  ls_array_set(vm, bytes, 1, ls_num2val(256));
+  ck_assert_int_eq(bytes->kind, LS_ARRAY_INT32);
+  ck_assert_int_eq(bytes->elements.ints.data[0], 42);
+  ck_assert_int_eq(bytes->elements.ints.data[1], 256);
+  ck_assert_int_eq(bytes->elements.ints.data[3], 255);
+
+  // Zero-initialized int32 and double arrays.
+  LsValue intsval = ls_new_int32_array(vm, NULL, 8);
+  LsObjArray *ints = (LsObjArray *)ls_val2obj(intsval);
+  ck_assert_int_eq(ints->kind, LS_ARRAY_INT32);
+  ck_assert_int_eq(ls_array_length(ints), 8);
+  ck_assert(ls_array_get(ints, 7) == ls_num2val(0));
+
+  const double doubles_data[] = {0.25, -1e300};
+  LsValue doublesval = ls_new_double_array(vm, doubles_data, 2);
+  LsObjArray *doubles = (LsObjArray *)ls_val2obj(doublesval);
+  ck_assert_int_eq(doubles->kind, LS_ARRAY_DOUBLE);
+  ck_assert(ls_array_get(doubles, 1) == ls_num2val(-1e300));
+
+  // Integers fit in a double array without changing its kind.
+  ls_array_push(vm, doubles, ls_num2val(3));
+  ck_assert_int_eq(doubles->kind, LS_ARRAY_DOUBLE);
+  ck_assert_double_eq(doubles->elements.doubles.data[2], 3);
+
+  // Free pointers.
+  ls_free_obj(vm, ls_val2obj(bytesval));
+  ls_free_obj(vm, ls_val2obj(intsval));
+  ls_free_obj(vm, ls_val2obj(doublesval));
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_array_fill) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  // Bytes are filled in place.
+  LsValue bytesval = ls_new_byte_array(vm, NULL, 100);
+  LsObjArray *bytes = (LsObjArray *)ls_val2obj(bytesval);
+  ls_array_fill(vm, bytes, ls_num2val(7), 10, 90);
+  ck_assert_int_eq(bytes->kind, LS_ARRAY_BYTE);
+  ck_assert(ls_array_get(bytes, 9) == ls_num2val(0));
+  ck_assert(ls_array_get(bytes, 10) == ls_num2val(7));
+  ck_assert(ls_array_get(bytes, 89) == ls_num2val(7));
+  ck_assert(ls_array_get(bytes, 90) == ls_num2val(0));
+
+  // Filling with a value the kind can't hold converts the array first.
+  LsValue str = ls_new_string(vm, "str");
+  ls_array_fill(vm, bytes, str, 1, 100);
+  ck_assert_int_eq(bytes->kind, LS_ARRAY_VALUE);
+  ck_assert(ls_array_get(bytes, 0) == ls_num2val(0));
+  for (size_t i = 1; i < 100; i++)
+    ck_assert(ls_array_get(bytes, i) == str);
+
+  // Empty ranges are fine.
+  ls_array_fill(vm, bytes, LS_TRUE, 50, 50);
+  ck_assert(ls_array_get(bytes, 50) == str);
+
+  // Free pointers.
+  ls_free_obj(vm, ls_val2obj(bytesval));
+  ls_free_obj(vm, ls_val2obj(str));
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_array_copy_within) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  const int32_t data[] = {0, 1, 2, 3, 4, 5, 6, 7};
+  LsValue arrval = ls_new_int32_array(vm, data, 8);
+  LsObjArray *arr = (LsObjArray *)ls_val2obj(arrval);
+
+  // Overlapping forward copy.
+  ls_array_copy_within(arr, 2, 0, 4);
+  const int32_t forward[] = {0, 1, 0, 1, 2, 3, 6, 7};
+  ck_assert_mem_eq(arr->elements.ints.data, forward, sizeof(forward));
+
+  // Overlapping backward copy.
+  ls_array_copy_within(arr, 0, 4, 8);
+  const int32_t backward[] = {2, 3, 6, 7, 2, 3, 6, 7};
+  ck_assert_mem_eq(arr->elements.ints.data, backward, sizeof(backward));
+
+  // Empty ranges copy nothing, even out of empty arrays.
+  ls_array_copy_within(arr, 8, 3, 3);
+  ck_assert_mem_eq(arr->elements.ints.data, backward, sizeof(backward));
+  LsValue emptyval = ls_new_int32_array(vm, NULL, 0);
+  ls_array_copy_within((LsObjArray *)ls_val2obj(emptyval), 0, 0, 0);
+
+  // Free pointers.
+  ls_free_obj(vm, ls_val2obj(arrval));
+  ls_free_obj(vm, ls_val2obj(emptyval));
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_array_slice_concat) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  const uint8_t data[] = {1, 2, 3, 4, 5};
+  LsValue bytesval = ls_new_byte_array(vm, data, 5);
+  LsObjArray *bytes = (LsObjArray *)ls_val2obj(bytesval);
+
+  // Slices keep the kind.
+  LsValue sliceval = ls_array_slice(vm, bytes, 1, 4);
+  LsObjArray *slice = (LsObjArray *)ls_val2obj(sliceval);
+  ck_assert_int_eq(slice->kind, LS_ARRAY_BYTE);
+  ck_assert_int_eq(ls_array_length(slice), 3);
+  ck_assert_mem_eq(slice->elements.bytes.data, data + 1, 3);
+
+  LsValue emptyval = ls_array_slice(vm, bytes, 2, 2);
+  ck_assert_int_eq(ls_array_length((LsObjArray *)ls_val2obj(emptyval)), 0);
+
+  // Concatenating packed arrays of the same kind keeps the kind.
+  LsValue catval = ls_array_concat(vm, bytes, slice);
+  LsObjArray *cat = (LsObjArray *)ls_val2obj(catval);
+  ck_assert_int_eq(cat->kind, LS_ARRAY_BYTE);
+  ck_assert_int_eq(ls_array_length(cat), 8);
+  ck_assert(ls_array_get(cat, 4) == ls_num2val(5));
+  ck_assert(ls_array_get(cat, 5) == ls_num2val(2));
+
+  // Concatenating different kinds gives the most general one.
+  LsValue nullsval = ls_new_array(vm, 2);
+  LsObjArray *nulls = (LsObjArray *)ls_val2obj(nullsval);
+  LsValue mixedval = ls_array_concat(vm, nulls, bytes);
+  LsObjArray *mixed = (LsObjArray *)ls_val2obj(mixedval);
+  ck_assert_int_eq(mixed->kind, LS_ARRAY_VALUE);
+  ck_assert_int_eq(ls_array_length(mixed), 7);
+  ck_assert(ls_array_get(mixed, 1) == LS_NULL);
+  ck_assert(ls_array_get(mixed, 2) == ls_num2val(1));
+  ck_assert(ls_array_get(mixed, 6) == ls_num2val(5));
+
+  // Empty arrays have no elements to copy.
+  LsValue twiceval = ls_array_concat(vm, (LsObjArray *)ls_val2obj(emptyval),
+                                     (LsObjArray *)ls_val2obj(emptyval));
+  ck_assert_int_eq(ls_array_length((LsObjArray *)ls_val2obj(twiceval)), 0);
+
+  // Free pointers.
+  ls_free_obj(vm, ls_val2obj(bytesval));
+  ls_free_obj(vm, ls_val2obj(sliceval));
+  ls_free_obj(vm, ls_val2obj(emptyval));
+  ls_free_obj(vm, ls_val2obj(catval));
+  ls_free_obj(vm, ls_val2obj(nullsval));
+  ls_free_obj(vm, ls_val2obj(mixedval));
+  ls_free_obj(vm, ls_val2obj(twiceval));
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_array_reverse) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  const double data[] = {0.5, 1.5, 2.5, 3.5, 4.5};
+  LsValue arrval = ls_new_double_array(vm, data, 5);
+  LsObjArray *arr = (LsObjArray *)ls_val2obj(arrval);
+
+  ls_array_reverse(arr);
+  for (size_t i = 0; i < 5; i++)
+    ck_assert_double_eq(arr->elements.doubles.data[i], data[4 - i]);
+
+  // Even lengths too.
+  ls_array_push(vm, arr, LS_TRUE);
+  ls_array_reverse(arr);
+  ck_assert(ls_array_get(arr, 0) == LS_TRUE);
+  for (size_t i = 0; i < 5; i++)
+    ck_assert(ls_array_get(arr, i + 1) == ls_num2val(data[i]));
+
+  // Free pointer.
+  ls_free_obj(vm, ls_val2obj(arrval));
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_array_index_of) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  const uint8_t data[] = {1, 2, 3, 2, 1};
+  LsValue bytesval = ls_new_byte_array(vm, data, 5);
+  LsObjArray *bytes = (LsObjArray *)ls_val2obj(bytesval);
+
+  ck_assert_uint_eq(ls_array_index_of(bytes, ls_num2val(2), 0), 1);
+  ck_assert_uint_eq(ls_array_index_of(bytes, ls_num2val(2), 2), 3);
+  ck_assert_uint_eq(ls_array_index_of(bytes, ls_num2val(4), 0),
+                    LS_ARRAY_NOT_FOUND);
+  ck_assert_uint_eq(ls_array_index_of(bytes, ls_num2val(2.5), 0),
+                    LS_ARRAY_NOT_FOUND);
+  ck_assert_uint_eq(ls_array_index_of(bytes, LS_NULL, 0), LS_ARRAY_NOT_FOUND);
+  ck_assert_uint_eq(ls_array_index_of(bytes, ls_num2val(1), 10),
+                    LS_ARRAY_NOT_FOUND);
+
+  // Strings are found by value, other objects by identity.
+  LsValue arrval = ls_new_array(vm, 3);
+  LsObjArray *arr = (LsObjArray *)ls_val2obj(arrval);
+  LsValue str = ls_new_string(vm, "str");
+  LsValue same_str = ls_new_string(vm, "str");
+  ls_array_set(vm, arr, 1, str);
+  ls_array_set(vm, arr, 2, bytesval);
+  ck_assert_uint_eq(ls_array_index_of(arr, same_str, 0), 1);
+  ck_assert_uint_eq(ls_array_index_of(arr, bytesval, 0), 2);
+  ck_assert_uint_eq(ls_array_index_of(arr, LS_NULL, 0), 0);
+  ck_assert_uint_eq(ls_array_index_of(arr, arrval, 0), LS_ARRAY_NOT_FOUND);
+
+  // Free pointers.
+  ls_free_obj(vm, ls_val2obj(bytesval));
+  ls_free_obj(vm, ls_val2obj(arrval));
+  ls_free_obj(vm, ls_val2obj(str));
+  ls_free_obj(vm, ls_val2obj(same_str));
 
   // Free VM.
   ls_free_vm(vm);
@@ -73,6 +373,13 @@ static Suite *alloc_suite(void) {
 
   tcase_add_test(tc_core, test_new_array);
   tcase_add_test(tc_core, test_array_eq);
+  tcase_add_test(tc_core, test_array_kinds);
+  tcase_add_test(tc_core, test_typed_arrays);
+  tcase_add_test(tc_core, test_array_fill);
+  tcase_add_test(tc_core, test_array_copy_within);
+  tcase_add_test(tc_core, test_array_slice_concat);
+  tcase_add_test(tc_core, test_array_reverse);
+  tcase_add_test(tc_core, test_array_index_of);
   suite_add_tcase(s, tc_core);
 
   return s;
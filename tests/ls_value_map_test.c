@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <check.h>
+
+#include "ls_value.h"
+#include "ls_vm.h"
+
+START_TEST(test_new_map) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  // Allocate a map.
+  LsValue mapval = ls_new_map(vm);
+  LsObj *mapobj = ls_val2obj(mapval);
+
+  // Object is well initialized.
+  ck_assert_int_eq(mapobj->type, LS_OBJ_MAP);
+  ck_assert(!mapobj->is_dark);
+  ck_assert_ptr_null(mapobj->next);
+
+  LsObjMap *map = (LsObjMap *)mapobj;
+  // Check map specific fields.
+  ck_assert_ptr_eq(&map->obj, mapobj);
+  ck_assert_int_eq(map->count, 0);
+  ck_assert_int_eq(map->capacity, 0);
+  ck_assert_ptr_null(map->entries);
+
+  // Lookups in an empty map don't allocate.
+  ck_assert(ls_map_get(map, LS_NULL) == LS_UNDEFINED);
+  ck_assert(ls_map_remove(vm, map, LS_NULL) == LS_UNDEFINED);
+  ck_assert_int_eq(vm->bytes_allocated, sizeof(LsObjMap));
+
+  // Free pointer.
+  ls_free_obj(vm, mapobj);
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_map_set_get) {
+  LsVM *vm = ls_new_vm(NULL);
+  LsValue mapval = ls_new_map(vm);
+  LsObjMap *map = (LsObjMap *)ls_val2obj(mapval);
+
+  // Number, singleton and object keys.
+  ls_map_set(vm, map, ls_num2val(1), LS_TRUE);
+  ls_map_set(vm, map, LS_FALSE, ls_num2val(2));
+  ls_map_set(vm, map, mapval, LS_NULL);
+  ck_assert_int_eq(map->count, 3);
+
+  ck_assert(ls_map_get(map, ls_num2val(1)) == LS_TRUE);
+  ck_assert(ls_map_get(map, LS_FALSE) == ls_num2val(2));
+  ck_assert(ls_map_get(map, mapval) == LS_NULL);
+  ck_assert(ls_map_get(map, ls_num2val(2)) == LS_UNDEFINED);
+  ck_assert(ls_map_get(map, LS_TRUE) == LS_UNDEFINED);
+
+  // Overwriting keeps the count.
+  ls_map_set(vm, map, ls_num2val(1), LS_FALSE);
+  ck_assert_int_eq(map->count, 3);
+  ck_assert(ls_map_get(map, ls_num2val(1)) == LS_FALSE);
+
+  // Free pointer.
+  ls_free_obj(vm, &map->obj);
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_map_string_keys) {
+  LsVM *vm = ls_new_vm(NULL);
+  LsValue mapval = ls_new_map(vm);
+  LsObjMap *map = (LsObjMap *)ls_val2obj(mapval);
+
+  LsValue key = ls_new_string(vm, "key");
+  LsValue same_key = ls_new_string(vm, "key");
+  LsValue other_key = ls_new_string(vm, "other");
+
+  // Strings are keys by value, not identity.
+  ls_map_set(vm, map, key, ls_num2val(1));
+  ck_assert(ls_map_get(map, same_key) == ls_num2val(1));
+  ck_assert(ls_map_get(map, other_key) == LS_UNDEFINED);
+
+  ls_map_set(vm, map, same_key, ls_num2val(2));
+  ck_assert_int_eq(map->count, 1);
+  ck_assert(ls_map_get(map, key) == ls_num2val(2));
+
+  ck_assert(ls_map_remove(vm, map, same_key) == ls_num2val(2));
+  ck_assert_int_eq(map->count, 0);
+  ck_assert(ls_map_get(map, key) == LS_UNDEFINED);
+
+  // Free pointers.
+  ls_free_obj(vm, &map->obj);
+  ls_free_obj(vm, ls_val2obj(key));
+  ls_free_obj(vm, ls_val2obj(same_key));
+  ls_free_obj(vm, ls_val2obj(other_key));
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_map_grow_and_remove) {
+  LsVM *vm = ls_new_vm(NULL);
+  LsValue mapval = ls_new_map(vm);
+  LsObjMap *map = (LsObjMap *)ls_val2obj(mapval);
+
+  // Grow through many rehashes. Fractional keys always go to the hash part.
+  for (int i = 0; i < 10000; i++)
+    ls_map_set(vm, map, ls_num2val(i + 0.5), ls_num2val(i * 2));
+
+  ck_assert_int_eq(map->count, 10000);
+  ck_assert_uint_ge(map->capacity, 10000);
+  ck_assert_int_eq(map->array_capacity, 0);
+  for (int i = 0; i < 10000; i++)
+    ck_assert(ls_map_get(map, ls_num2val(i + 0.5)) == ls_num2val(i * 2));
+
+  // Remove every odd key.
+  for (int i = 1; i < 10000; i += 2)
+    ck_assert(ls_map_remove(vm, map, ls_num2val(i + 0.5)) ==
+              ls_num2val(i * 2));
+
+  ck_assert_int_eq(map->count, 5000);
+  for (int i = 0; i < 10000; i++) {
+    LsValue expected = i % 2 == 0 ? ls_num2val(i * 2) : LS_UNDEFINED;
+    ck_assert(ls_map_get(map, ls_num2val(i + 0.5)) == expected);
+  }
+
+  // Churn through insertions and removals without growing forever.
+  size_t capacity = map->capacity;
+  for (int i = 10000; i < 100000; i++) {
+    ls_map_set(vm, map, ls_num2val(i + 0.5), LS_TRUE);
+    ck_assert(ls_map_remove(vm, map, ls_num2val(i + 0.5)) == LS_TRUE);
+  }
+  ck_assert_int_eq(map->count, 5000);
+  ck_assert_uint_eq(map->capacity, capacity);
+
+  // Removing the last entry releases the storage.
+  for (int i = 0; i < 10000; i += 2)
+    ls_map_remove(vm, map, ls_num2val(i + 0.5));
+  ck_assert_int_eq(map->count, 0);
+  ck_assert_int_eq(map->capacity, 0);
+  ck_assert_ptr_null(map->entries);
+
+  // Free pointer.
+  ls_free_obj(vm, &map->obj);
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_map_array_part) {
+  LsVM *vm = ls_new_vm(NULL);
+  LsValue mapval = ls_new_map(vm);
+  LsObjMap *map = (LsObjMap *)ls_val2obj(mapval);
+  LsValue name = ls_new_string(vm, "name");
+
+  // Dense integer keys, plus a named field.
+  ls_map_set(vm, map, name, LS_TRUE);
+  for (int i = 0; i < 1000; i++)
+    ls_map_set(vm, map, ls_num2val(i), ls_num2val(-i));
+
+  ck_assert_int_eq(map->count, 1001);
+  ck_assert_uint_ge(map->array_capacity, 1000);
+  ck_assert_int_eq(map->array_count, 1000);
+  ck_assert_uint_lt(map->capacity, 100);
+  for (int i = 0; i < 1000; i++)
+    ck_assert(ls_map_get(map, ls_num2val(i)) == ls_num2val(-i));
+  ck_assert(ls_map_get(map, name) == LS_TRUE);
+
+  // Negative zero, fractional and negative keys are distinct hash keys.
+  ck_assert(ls_map_get(map, ls_num2val(-0.0)) == LS_UNDEFINED);
+  ls_map_set(vm, map, ls_num2val(-0.0), LS_FALSE);
+  ls_map_set(vm, map, ls_num2val(1.5), LS_FALSE);
+  ls_map_set(vm, map, ls_num2val(-1), LS_FALSE);
+  ck_assert(ls_map_get(map, ls_num2val(0)) == ls_num2val(0));
+  ck_assert(ls_map_get(map, ls_num2val(-0.0)) == LS_FALSE);
+  ck_assert_int_eq(map->count, 1004);
+  ck_assert_int_eq(map->array_count, 1000);
+
+  // Holes in the array part.
+  ck_assert(ls_map_remove(vm, map, ls_num2val(10)) == ls_num2val(-10));
+  ck_assert(ls_map_remove(vm, map, ls_num2val(10)) == LS_UNDEFINED);
+  ck_assert(ls_map_get(map, ls_num2val(10)) == LS_UNDEFINED);
+  ck_assert_int_eq(map->count, 1003);
+
+  // A sparse integer key doesn't grow the array part.
+  size_t array_capacity = map->array_capacity;
+  ls_map_set(vm, map, ls_num2val(1e9), LS_TRUE);
+  ck_assert_uint_eq(map->array_capacity, array_capacity);
+  ck_assert(ls_map_get(map, ls_num2val(1e9)) == LS_TRUE);
+
+  // Free pointers.
+  ls_free_obj(vm, &map->obj);
+  ls_free_obj(vm, ls_val2obj(name));
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_map_rebalance) {
+  LsVM *vm = ls_new_vm(NULL);
+  LsValue mapval = ls_new_map(vm);
+  LsObjMap *map = (LsObjMap *)ls_val2obj(mapval);
+
+  // Integer keys inserted in reverse first land in the hash part, then move
+  // to the array part once it's dense enough.
+  for (int i = 499; i >= 0; i--)
+    ls_map_set(vm, map, ls_num2val(i), ls_num2val(i));
+
+  ck_assert_int_eq(map->count, 500);
+  ck_assert_uint_ge(map->array_capacity, 256);
+  ck_assert_uint_ge(map->array_count, 256);
+  for (int i = 0; i < 500; i++)
+    ck_assert(ls_map_get(map, ls_num2val(i)) == ls_num2val(i));
+
+  // Free pointer.
+  ls_free_obj(vm, &map->obj);
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_map_next) {
+  LsVM *vm = ls_new_vm(NULL);
+  LsValue mapval = ls_new_map(vm);
+  LsObjMap *map = (LsObjMap *)ls_val2obj(mapval);
+
+  for (int i = 0; i < 100; i++)
+    ls_map_set(vm, map, ls_num2val(i), ls_num2val(-i));
+
+  // Every entry is visited exactly once.
+  bool seen[100] = {false};
+  size_t iterator = 0;
+  size_t visited = 0;
+  LsValue key, value;
+  while (ls_map_next(map, &iterator, &key, &value)) {
+    int i = (int)ls_val2num(key);
+    ck_assert(i >= 0 && i < 100);
+    ck_assert(!seen[i]);
+    ck_assert(value == ls_num2val(-i));
+    seen[i] = true;
+    visited++;
+  }
+  ck_assert_int_eq(visited, 100);
+
+  // The array part is visited in key order.
+  LsValue name = ls_new_string(vm, "name");
+  ls_map_set(vm, map, name, LS_TRUE);
+  iterator = 0;
+  for (int i = 0; i < 100; i++) {
+    ck_assert(ls_map_next(map, &iterator, &key, &value));
+    ck_assert(key == ls_num2val(i));
+  }
+  ck_assert(ls_map_next(map, &iterator, &key, &value));
+  ck_assert(ls_val_same(key, name));
+  ck_assert(!ls_map_next(map, &iterator, &key, &value));
+  ls_free_obj(vm, ls_val2obj(name));
+
+  // Free pointer.
+  ls_free_obj(vm, &map->obj);
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+static Suite *alloc_suite(void) {
+  Suite *s = suite_create("ls_map");
+  TCase *tc_core = tcase_create("Core");
+
+  tcase_add_test(tc_core, test_new_map);
+  tcase_add_test(tc_core, test_map_set_get);
+  tcase_add_test(tc_core, test_map_string_keys);
+  tcase_add_test(tc_core, test_map_grow_and_remove);
+  tcase_add_test(tc_core, test_map_array_part);
+  tcase_add_test(tc_core, test_map_rebalance);
+  tcase_add_test(tc_core, test_map_next);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void) {
+  Suite *suite = alloc_suite();
+  SRunner *sr = srunner_create(suite);
+
+  srunner_run_all(sr, CK_NORMAL);
+  int number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,5 +1,7 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <check.h>
 
@@ -30,7 +32,7 @@ START_TEST(test_new_string) {
   ck_assert_ptr_eq(vm->first_obj, strobj);
 
   // Free pointer.
-  ls_free(vm, strobj);
+  ls_free_obj(vm, strobj);
 
   // Free VM.
   ls_free_vm(vm);
@@ -65,12 +67,251 @@ START_TEST(test_string_eq) {
 }
 END_TEST
 
+START_TEST(test_string_index_of) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  LsValue hayval = ls_new_string(vm, "Hello world! Hello again!");
+  LsValue helloval = ls_new_string(vm, "Hello");
+  LsValue bangval = ls_new_string(vm, "!");
+  LsValue missingval = ls_new_string(vm, "bye");
+  LsValue emptyval = ls_new_string(vm, "");
+  LsObjString *hay = (LsObjString *)ls_val2obj(hayval);
+  LsObjString *hello = (LsObjString *)ls_val2obj(helloval);
+  LsObjString *bang = (LsObjString *)ls_val2obj(bangval);
+  LsObjString *missing = (LsObjString *)ls_val2obj(missingval);
+  LsObjString *empty = (LsObjString *)ls_val2obj(emptyval);
+
+  // Multi-byte needle.
+  ck_assert_uint_eq(ls_string_index_of(hay, hello, 0), 0);
+  ck_assert_uint_eq(ls_string_index_of(hay, hello, 1), 13);
+
+  // Single byte needle.
+  ck_assert_uint_eq(ls_string_index_of(hay, bang, 0), 11);
+  ck_assert_uint_eq(ls_string_index_of(hay, bang, 12), 24);
+
+  // Misses.
+  ck_assert_uint_eq(ls_string_index_of(hay, missing, 0), LS_STRING_NOT_FOUND);
+  ck_assert_uint_eq(ls_string_index_of(hay, hello, 100), LS_STRING_NOT_FOUND);
+  ck_assert(!ls_string_contains(hay, missing));
+  ck_assert(ls_string_contains(hay, bang));
+
+  // Empty needle matches at start.
+  ck_assert_uint_eq(ls_string_index_of(hay, empty, 5), 5);
+
+  // Prefix.
+  ck_assert(ls_string_starts_with(hay, hello));
+  ck_assert(!ls_string_starts_with(hay, bang));
+  ck_assert(ls_string_starts_with(hay, empty));
+
+  // Free pointers.
+  ls_free_obj(vm, &hay->obj);
+  ls_free_obj(vm, &hello->obj);
+  ls_free_obj(vm, &bang->obj);
+  ls_free_obj(vm, &missing->obj);
+  ls_free_obj(vm, &empty->obj);
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_string_index_of_long_needle) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  // Build a periodic haystack that defeats naive first-byte scanning, with
+  // a single match near the end.
+  char hay[4096];
+  char needle[64];
+  memset(hay, 'a', sizeof(hay));
+  memset(needle, 'a', sizeof(needle));
+  needle[sizeof(needle) - 1] = 'b';
+  memcpy(hay + 4000, needle, sizeof(needle));
+
+  LsValue hayval = ls_new_string_length(vm, hay, sizeof(hay));
+  LsValue needleval = ls_new_string_length(vm, needle, sizeof(needle));
+  LsValue tailval = ls_new_string_length(vm, needle + 1, sizeof(needle) - 1);
+  LsObjString *haystr = (LsObjString *)ls_val2obj(hayval);
+
+  ck_assert_uint_eq(
+      ls_string_index_of(haystr, (LsObjString *)ls_val2obj(needleval), 0),
+      4000);
+  ck_assert_uint_eq(
+      ls_string_index_of(haystr, (LsObjString *)ls_val2obj(tailval), 0), 4001);
+  ck_assert_uint_eq(
+      ls_string_index_of(haystr, (LsObjString *)ls_val2obj(needleval), 4001),
+      LS_STRING_NOT_FOUND);
+
+  // Free pointers.
+  ls_free_obj(vm, ls_val2obj(hayval));
+  ls_free_obj(vm, ls_val2obj(needleval));
+  ls_free_obj(vm, ls_val2obj(tailval));
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_string_split) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  LsValue strval = ls_new_string(vm, "a, b,, c");
+  LsValue sepval = ls_new_string(vm, ",");
+  LsValue missing = ls_new_string(vm, ";");
+  LsObjString *str = (LsObjString *)ls_val2obj(strval);
+
+  // Split around every separator, keeping empty pieces.
+  LsValue arrval =
+      ls_string_split(vm, str, (LsObjString *)ls_val2obj(sepval));
+  LsObjArray *arr = (LsObjArray *)ls_val2obj(arrval);
+  ck_assert_int_eq(ls_array_length(arr), 4);
+
+  const char *expected[] = {"a", " b", "", " c"};
+  for (size_t i = 0; i < ls_array_length(arr); i++) {
+    LsObjString *piece = (LsObjString *)ls_val2obj(ls_array_get(arr, i));
+    ck_assert_str_eq(piece->value, expected[i]);
+    ls_free_obj(vm, &piece->obj);
+  }
+  ls_free_obj(vm, &arr->obj);
+
+  // No separator: the string itself is the only element.
+  arrval = ls_string_split(vm, str, (LsObjString *)ls_val2obj(missing));
+  arr = (LsObjArray *)ls_val2obj(arrval);
+  ck_assert_int_eq(ls_array_length(arr), 1);
+  ck_assert(ls_val_same(ls_array_get(arr, 0), strval));
+  ls_free_obj(vm, &arr->obj);
+
+  // Free pointers.
+  ls_free_obj(vm, ls_val2obj(strval));
+  ls_free_obj(vm, ls_val2obj(sepval));
+  ls_free_obj(vm, ls_val2obj(missing));
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_string_replace) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  LsValue strval = ls_new_string(vm, "one two two three");
+  LsValue two = ls_new_string(vm, "two");
+  LsValue two2 = ls_new_string(vm, "two");
+  LsValue four = ls_new_string(vm, "four");
+  LsValue empty = ls_new_string(vm, "");
+  LsObjString *str = (LsObjString *)ls_val2obj(strval);
+
+  // Every occurrence is replaced.
+  LsValue result = ls_string_replace(vm, str, (LsObjString *)ls_val2obj(two),
+                                     (LsObjString *)ls_val2obj(four));
+  ck_assert(!ls_val_same(result, strval));
+  ck_assert_str_eq(((LsObjString *)ls_val2obj(result))->value,
+                   "one four four three");
+  ls_free_obj(vm, ls_val2obj(result));
+
+  // Replacement may be empty.
+  result = ls_string_replace(vm, str, (LsObjString *)ls_val2obj(two),
+                             (LsObjString *)ls_val2obj(empty));
+  ck_assert_str_eq(((LsObjString *)ls_val2obj(result))->value, "one   three");
+  ls_free_obj(vm, ls_val2obj(result));
+
+  // Nothing changes so nothing is allocated.
+  size_t bytes_allocated = vm->bytes_allocated;
+  result = ls_string_replace(vm, str, (LsObjString *)ls_val2obj(four),
+                             (LsObjString *)ls_val2obj(two));
+  ck_assert(ls_val_same(result, strval));
+  result = ls_string_replace(vm, str, (LsObjString *)ls_val2obj(two),
+                             (LsObjString *)ls_val2obj(two2));
+  ck_assert(ls_val_same(result, strval));
+  ck_assert_int_eq(vm->bytes_allocated, bytes_allocated);
+
+  // Free pointers.
+  ls_free_obj(vm, ls_val2obj(strval));
+  ls_free_obj(vm, ls_val2obj(two));
+  ls_free_obj(vm, ls_val2obj(two2));
+  ls_free_obj(vm, ls_val2obj(four));
+  ls_free_obj(vm, ls_val2obj(empty));
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_string_intern) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  // Interning creates the string once.
+  LsValue hello = ls_intern_string(vm, "hello world", 5);
+  ck_assert(ls_is_str(hello));
+  ck_assert_str_eq(((LsObjString *)ls_val2obj(hello))->value, "hello");
+
+  // Looking it up again returns the same string without allocating.
+  size_t bytes_allocated = vm->bytes_allocated;
+  ck_assert(ls_val_same(ls_intern_string(vm, "hello", 5), hello));
+  ck_assert_int_eq(vm->bytes_allocated, bytes_allocated);
+
+  // Different contents are different strings.
+  LsValue help = ls_intern_string(vm, "help", 4);
+  LsValue empty = ls_intern_string(vm, NULL, 0);
+  ck_assert(!ls_val_same(help, hello));
+  ck_assert(!ls_val_same(empty, hello));
+  ck_assert(ls_val_same(ls_intern_string(vm, "", 0), empty));
+
+  // Strings that aren't interned are never returned.
+  LsValue other = ls_new_string(vm, "other");
+  ck_assert(!ls_val_same(ls_intern_string(vm, "other", 5), other));
+  ls_free_obj(vm, ls_val2obj(other));
+
+  // Free pointers.
+  LsObjMap *strings = vm->strings;
+  size_t iterator = 0;
+  LsValue key, value;
+  while (ls_map_next(strings, &iterator, &key, &value))
+    ls_free_obj(vm, ls_val2obj(key));
+  ls_free_obj(vm, &strings->obj);
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
+START_TEST(test_string_to_number) {
+  LsVM *vm = ls_new_vm(NULL);
+
+  const char *texts[] = {"42", " -1.5e3\n", "+0x10", "\t.5 ", "1e400"};
+  double nums[] = {42, -1500, 16, 0.5, HUGE_VAL};
+  for (size_t i = 0; i < sizeof(nums) / sizeof(nums[0]); i++) {
+    LsValue str = ls_new_string(vm, texts[i]);
+    LsValue num = ls_string_to_number((LsObjString *)ls_val2obj(str));
+    ck_assert(ls_is_num(num));
+    ck_assert(ls_val2num(num) == nums[i]);
+    ls_free_obj(vm, ls_val2obj(str));
+  }
+
+  // Anything else than a single number isn't one.
+  const char *invalid[] = {"", " ", "-", "1 2", "--1", "0x", "one"};
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+    LsValue str = ls_new_string(vm, invalid[i]);
+    ck_assert(ls_string_to_number((LsObjString *)ls_val2obj(str)) == LS_NULL);
+    ls_free_obj(vm, ls_val2obj(str));
+  }
+
+  // Free VM.
+  ls_free_vm(vm);
+}
+END_TEST
+
 static Suite *alloc_suite(void) {
   Suite *s = suite_create("ls_string");
   TCase *tc_core = tcase_create("Core");
 
   tcase_add_test(tc_core, test_new_string);
   tcase_add_test(tc_core, test_string_eq);
+  tcase_add_test(tc_core, test_string_index_of);
+  tcase_add_test(tc_core, test_string_index_of_long_needle);
+  tcase_add_test(tc_core, test_string_split);
+  tcase_add_test(tc_core, test_string_replace);
+  tcase_add_test(tc_core, test_string_intern);
+  tcase_add_test(tc_core, test_string_to_number);
   suite_add_tcase(s, tc_core);
 
   return s;